@@ -0,0 +1,35 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+#include <lewis/ir.hpp>
+
+namespace lewis {
+
+// Binary serialization of generic IR, e.g., to hand Functions from a front end process
+// to the compiler. All fields are little endian 32-bit words:
+//
+//   File header: magic ("LWIR"), version, number of Functions, size of the string table.
+//   String table: NUL-terminated strings (padded to a multiple of 4 bytes).
+//   Per Function: a header with the name (i.e., its offset into the string table) and the
+//   number of blocks, phis, instructions, values, operands and edges, followed by flat
+//   arrays of fixed-size records (in that order).
+//
+// PhiNodes and instructions are stored in block order; Values are numbered in order of
+// their definition and are referred to by index (index + 1 for operands, zero for null).
+// Thus, readers do not need to parse anything and only allocate the IR nodes themselves.
+constexpr uint32_t binaryIrVersion = 1;
+
+// Appends the Functions (which must be in generic IR) to out.
+void writeBinaryIr(std::vector<uint8_t> &out, const std::vector<Function *> &fns);
+
+// Builds the IR of all Functions in data (e.g., an mmap()ed file). The Functions do not
+// refer to data after this returns. Throws std::runtime_error if data is malformed.
+std::vector<std::unique_ptr<Function>> readBinaryIr(std::span<const uint8_t> data);
+
+} // namespace lewis
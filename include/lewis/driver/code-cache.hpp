@@ -0,0 +1,77 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <lewis/elf/object.hpp>
+#include <lewis/function-hash.hpp>
+
+namespace lewis::driver {
+
+// Machine code of a single Function, independent of any elf::Object.
+// All offsets are relative to the Function's entry point.
+struct CachedCode {
+    struct Relocation {
+        // One of the R_X86_64_* constants.
+        uint32_t type = 0;
+        size_t offset = 0;
+        std::string symbol;
+        int64_t addend = 0;
+    };
+
+    // Local symbols (e.g., of BasicBlocks). Their names are appended to the Function's name.
+    struct Symbol {
+        std::string suffix;
+        size_t offset = 0;
+        size_t size = 0;
+    };
+
+    std::vector<uint8_t> text;
+    std::vector<Relocation> relocations;
+    std::vector<Symbol> symbols;
+
+    // Extracts the code of the Function called name that was emitted to textSection.
+    // relocationsBefore and symbolsBefore are the numbers of internal relocations and
+    // symbols of elf before the Function was emitted.
+    static CachedCode capture(elf::Object *elf, elf::ByteSection *textSection,
+            const std::string &name, size_t relocationsBefore, size_t symbolsBefore);
+
+    // Appends the code to textSection (aligned to the section's alignment) and defines
+    // the Function's symbol, the local symbols and the internal relocations.
+    void emit(elf::Object *elf, elf::ByteSection *textSection,
+            const std::string &name) const;
+};
+
+struct CodeCacheStats {
+    int64_t hits = 0;
+    // Hits that had to load the entry from the directory.
+    int64_t diskHits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+};
+
+// Maps FunctionHashes to CachedCode. Entries are kept in memory (evicting the least
+// recently used ones once their total size exceeds capacity bytes) and, if a directory
+// is given, also written to one file per entry. Files that cannot be read
+// (e.g., as they are truncated or from a different version) are treated as misses.
+// All member functions are thread-safe.
+struct CodeCache {
+    // This class is implemented using Pimpl.
+    static std::unique_ptr<CodeCache> create(size_t capacity, std::string directory = {});
+
+    virtual ~CodeCache() = default;
+
+    // Returns null on misses.
+    virtual std::shared_ptr<const CachedCode> lookup(const FunctionHash &hash) = 0;
+
+    virtual void insert(const FunctionHash &hash, CachedCode code) = 0;
+
+    virtual CodeCacheStats stats() = 0;
+};
+
+} // namespace lewis::driver
@@ -0,0 +1,113 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <lewis/driver/code-cache.hpp>
+#include <lewis/driver/thread-pool.hpp>
+#include <lewis/elf/file-emitter.hpp>
+#include <lewis/elf/object.hpp>
+#include <lewis/elf/passes.hpp>
+#include <lewis/ir.hpp>
+#include <lewis/profile.hpp>
+#include <lewis/target-x86_64/arch-passes.hpp>
+
+namespace lewis::driver {
+
+// Describes a single execution of a pass.
+struct PassReport {
+    // Name of the pass, e.g., "allocate-registers".
+    std::string pass;
+    // Name of the Function that the pass ran on. Empty for passes on the elf::Object.
+    std::string function;
+
+    std::chrono::nanoseconds wallTime{0};
+
+    // Size of the pass' input and output. Passes on IR count instructions,
+    // passes on the elf::Object count fragments.
+    size_t sizeBefore = 0;
+    size_t sizeAfter = 0;
+
+    // Pass-specific counters (e.g., the allocation cost), in a fixed order per pass.
+    std::vector<std::pair<std::string, int64_t>> counters;
+};
+
+// Invoked after each pass.
+using PassCallback = std::function<void(const PassReport &report)>;
+
+// Runs the standard pipeline and records a PassReport for each pass:
+// InsertDataFlowPhisPass -> FoldConstantsPass -> NumberLocalValuesPass
+// -> EliminateDeadCodePass (unless disabled)
+// -> LowerCodePass -> AllocateRegistersPass -> MachineCodeEmitter for each Function,
+// and CreatePltPass -> CreateHeadersPass -> LayoutPass -> InternalLinkPass -> FileEmitter
+// once for the elf::Object. All Functions are emitted into a shared .text section.
+struct PassManager {
+    // This class is implemented using Pimpl.
+    static std::unique_ptr<PassManager> create(elf::Object *elf,
+            elf::HashStyle hashStyle = elf::HashStyle::both);
+
+    virtual ~PassManager() = default;
+
+    virtual void setCallback(PassCallback callback) = 0;
+
+    // Enables or disables the optimization passes on generic IR (default: enabled).
+    virtual void setOptimization(bool enable) = 0;
+
+    // Enables the cache (default: null, i.e., disabled). Functions whose hash is found
+    // in the cache skip all passes; their cached code is emitted directly. Other Functions
+    // are added to the cache once their machine code is emitted.
+    virtual void setCodeCache(CodeCache *cache) = 0;
+
+    // Instruments all Functions that are compiled afterwards with block counters
+    // (default: disabled). The counters can be read by jit::readBlockProfile().
+    virtual void setInstrumentation(bool enable) = 0;
+
+    // Uses the profile (default: null) for block placement and register allocation
+    // of all Functions that are compiled afterwards. The profile must outlive the compilation.
+    // Instrumented Functions and Functions that are compiled with a profile
+    // bypass the code cache.
+    virtual void setProfile(const BlockProfile *profile) = 0;
+
+    // Selects the register allocator tier of all Functions that are compiled afterwards
+    // (default: optimizing).
+    virtual void setAllocationTier(targets::x86_64::AllocationTier tier) = 0;
+
+    // Lowers the Function, allocates registers and emits its machine code.
+    virtual void compileFunction(Function *fn) = 0;
+
+    // Compiles a batch of Functions. Lowering and register allocation run on the pool
+    // (or on the calling thread if pool is null); machine code is emitted afterwards,
+    // on the calling thread, in the order of fns. Thus, the resulting Object does not
+    // depend on the number of threads. Reports and callbacks are also delivered
+    // in the order of fns.
+    virtual void compileFunctions(const std::vector<Function *> &fns, ThreadPool *pool) = 0;
+
+    // Runs the passes on the elf::Object, up to (and including) InternalLinkPass.
+    // Afterwards, the Object can be loaded by jit::LoadedObject.
+    // No more Functions can be compiled once the Object is linked.
+    virtual void linkObject() = 0;
+
+    // Links the Object (if that did not happen yet) and emits the file to buffer.
+    virtual void emitFile() = 0;
+
+    // Same as emitFile() but streams the file to sink; buffer stays empty.
+    virtual void emitFile(elf::FileSink *sink) = 0;
+
+    // Reports of all passes that ran so far, in execution order.
+    virtual const std::vector<PassReport> &reports() = 0;
+
+    // Serializes reports() to JSON.
+    virtual std::string reportsToJson() = 0;
+
+    // Only valid after emitFile() was called.
+    std::vector<uint8_t> buffer;
+};
+
+} // namespace lewis::driver
@@ -0,0 +1,30 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace lewis::driver {
+
+// Fixed set of worker threads that execute batches of independent tasks.
+// Each worker owns a queue of tasks; idle workers steal tasks from other queues.
+struct ThreadPool {
+    // This class is implemented using Pimpl.
+    // If numThreads is zero, one thread per hardware thread is started.
+    static std::unique_ptr<ThreadPool> create(unsigned int numThreads = 0);
+
+    virtual ~ThreadPool() = default;
+
+    virtual unsigned int numThreads() = 0;
+
+    // Calls task(i) for all i < numTasks and blocks until all calls returned.
+    // Tasks run concurrently and in no particular order. If tasks throw, the exception
+    // of the task with the lowest index is rethrown (after all tasks finished).
+    // Only one batch can run at a time, i.e., run() must not be called concurrently.
+    virtual void run(size_t numTasks, const std::function<void(size_t)> &task) = 0;
+};
+
+} // namespace lewis::driver
@@ -0,0 +1,62 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <lewis/ir.hpp>
+#include <lewis/jit/loader.hpp>
+
+namespace lewis::driver {
+
+struct TieringOptions {
+    // A Function is recompiled once its most frequently executed block
+    // was executed this many times.
+    uint64_t hotThreshold = 1000;
+    // Interval in which the block counters are read.
+    std::chrono::milliseconds pollInterval{10};
+};
+
+// JIT compiler that runs code at two tiers. Functions are first compiled quickly,
+// using the baseline register allocator and no optimizations on generic IR, and
+// instrumented with block counters. A background thread polls the counters and recompiles
+// hot Functions with all optimizations and the collected profile.
+// Each Function is entered through a stub that jumps through a GOT slot; once the
+// optimized code is loaded, the slot is updated atomically (such that concurrently running
+// threads either take the old or the new code). Calls to Functions of earlier batches
+// go through their stubs, while calls inside a batch are direct and keep using
+// the baseline code until the caller is recompiled as well.
+// All code stays mapped until the TieredCompiler is destructed. All member functions
+// except for addFunctions() are thread-safe.
+struct TieredCompiler {
+    // This class is implemented using Pimpl.
+    // The resolver is used for all symbols that are not defined by added Functions.
+    static std::unique_ptr<TieredCompiler> create(jit::SymbolResolver resolver,
+            TieringOptions options = {});
+
+    virtual ~TieredCompiler() = default;
+
+    // Compiles a batch of Functions at the baseline tier and makes them available
+    // through lookup(). The Functions must be in generic IR; they are modified by
+    // the compilation (as by PassManager). Functions can only call Functions of the same
+    // or of earlier batches. Throws if a Function of the same name was already added.
+    virtual void addFunctions(const std::vector<Function *> &fns) = 0;
+
+    // Returns the entry point of an added Function (or nullptr). The entry point does not
+    // change when the Function is recompiled.
+    virtual void *lookup(const std::string &name) = 0;
+
+    // Whether the optimized code of the Function was installed.
+    virtual bool isOptimized(const std::string &name) = 0;
+
+    template<typename F>
+    F *lookupFunction(const std::string &name) {
+        return reinterpret_cast<F *>(lookup(name));
+    }
+};
+
+} // namespace lewis::driver
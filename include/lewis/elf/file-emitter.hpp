@@ -7,9 +7,52 @@
 
 namespace lewis::elf {
 
+// Destination of the bytes that FileEmitter produces. FileEmitter calls begin() once,
+// then writes the whole file sequentially (in file order) and finally calls finish().
+struct FileSink {
+    // The following sinks are implemented using Pimpl.
+
+    // Appends the file to buffer.
+    static std::unique_ptr<FileSink> createForBuffer(std::vector<uint8_t> *buffer);
+
+    // Writes the file to fd (at its current position) using writev().
+    // Data is gathered into few system calls; fd is not closed.
+    static std::unique_ptr<FileSink> createForFd(int fd);
+
+    // Writes the file to a caller-provided region (e.g., an mmap()ed file)
+    // of at least FileEmitter::computeFileSize() bytes.
+    static std::unique_ptr<FileSink> createForRegion(void *region, size_t size);
+
+    virtual ~FileSink() = default;
+
+    virtual void begin(size_t fileSize) = 0;
+
+    // Writes a copy of data. data only needs to stay valid during the call.
+    virtual void write(const void *data, size_t size) = 0;
+
+    // Writes data that stays valid (and unchanged) until finish() returns.
+    // Sinks can reference such data instead of copying it.
+    virtual void writeReferenced(const void *data, size_t size) {
+        write(data, size);
+    }
+
+    virtual void writeZeros(size_t size) = 0;
+
+    virtual void finish() = 0;
+};
+
 struct FileEmitter {
+    // Emits the file to buffer.
     static std::unique_ptr<FileEmitter> create(Object *elf);
 
+    // Emits the file to sink. Headers and tables are encoded one at a time while
+    // the contents of ByteSections are passed to the sink in place.
+    // buffer is not used.
+    static std::unique_ptr<FileEmitter> create(Object *elf, FileSink *sink);
+
+    // Size of the emitted file. The layout of the Object must be fixed.
+    static size_t computeFileSize(Object *elf);
+
     virtual ~FileEmitter() = default;
 
     virtual void run() = 0;
@@ -17,4 +60,4 @@ struct FileEmitter {
     std::vector<uint8_t> buffer;
 };
 
-} // namespace lewis::elf
\ No newline at end of file
+} // namespace lewis::elf
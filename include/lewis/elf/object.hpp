@@ -6,6 +6,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <frg/list.hpp>
 #include <lewis/hierarchy.hpp>
@@ -25,7 +26,8 @@ namespace fragment_kinds {
         stringTableSection,
         symbolTableSection,
         relocationSection,
-        hashSection
+        hashSection,
+        gnuHashSection
     };
 }
 
@@ -97,6 +99,8 @@ public:
     String *name = nullptr;
     uint32_t type = 0;
     uint32_t flags = 0;
+    // Required alignment of the Fragment, both in the file and in virtual memory.
+    size_t alignment = 8;
     std::optional<size_t> designatedIndex;
     std::optional<uintptr_t> fileOffset;
     std::optional<uintptr_t> virtualAddress;
@@ -177,6 +181,7 @@ struct Symbol {
     String *name = nullptr;
     FragmentUse section;
     size_t value = 0;
+    size_t size = 0;
 
     std::optional<size_t> designatedIndex;
 };
@@ -188,6 +193,8 @@ struct RelocationSection : Fragment,
 };
 
 struct Relocation {
+    // One of the R_X86_64_* constants.
+    uint32_t type = 0;
     FragmentUse section;
     ptrdiff_t offset = -1;
     Symbol *symbol = nullptr;
@@ -205,6 +212,35 @@ struct HashSection : Fragment,
     std::vector<Symbol *> chains;
 };
 
+// GNU-style hash table (DT_GNU_HASH). In contrast to the SysV HashSection, this requires
+// the symbol table to be sorted by bucket; the LayoutPass takes care of that.
+// Only defined symbols are part of the table.
+struct GnuHashSection : Fragment,
+        CastableIfFragmentKind<GnuHashSection, fragment_kinds::gnuHashSection> {
+    GnuHashSection()
+    : Fragment{fragment_kinds::gnuHashSection} { }
+
+    // Index of the first symbol that is part of the table.
+    uint32_t symbolOffset = 0;
+    uint32_t bloomShift = 0;
+    std::vector<uint64_t> bloom;
+    // Index of the first symbol in each bucket (or zero for empty buckets).
+    std::vector<uint32_t> buckets;
+    // Hash of each symbol starting at symbolOffset; the lowest bit terminates chains.
+    std::vector<uint32_t> chains;
+};
+
+// A loadable segment (i.e., a PT_LOAD). Segments are planned by the LayoutPass;
+// Fragments with the same permissions are packed into the same Segment.
+struct Segment {
+    // Combination of PF_* flags.
+    uint32_t flags = 0;
+    std::vector<Fragment *> fragments;
+    std::optional<uintptr_t> fileOffset;
+    std::optional<uintptr_t> virtualAddress;
+    std::optional<uintptr_t> computedSize;
+};
+
 struct Object {
     // -------------------------------------------------------------------------------------
     // Fragment management.
@@ -279,6 +315,10 @@ struct Object {
     FragmentUse symbolTableFragment;
     FragmentUse pltRelocationFragment;
     FragmentUse hashFragment;
+    FragmentUse gnuHashFragment;
+
+    // Populated by the LayoutPass.
+    std::vector<Segment> segments;
 
     // -------------------------------------------------------------------------------------
     // String management.
@@ -335,6 +375,10 @@ struct Object {
         return StringRange{this};
     }
 
+    // Returns the String with the given contents; creates the String if it does not exist yet.
+    // Note that Strings created by addString() are not considered here.
+    String *internString(const std::string &buffer);
+
     // -------------------------------------------------------------------------------------
     // Symbol management.
     // -------------------------------------------------------------------------------------
@@ -394,6 +438,11 @@ struct Object {
         return SymbolRange{this};
     }
 
+    // Returns the Symbol with the given name; creates an undefined Symbol (i.e., a Symbol
+    // without section) if it does not exist yet. Note that Symbols created by addSymbol()
+    // are not considered here.
+    Symbol *internSymbol(const std::string &name);
+
     // -------------------------------------------------------------------------------------
     // Relocation management.
     // -------------------------------------------------------------------------------------
@@ -433,6 +482,10 @@ struct Object {
             return RelocationIterator{_elf->_relocations.end()};
         }
 
+        size_t size() {
+            return _elf->_relocations.size();
+        }
+
     private:
         Object *_elf;
     };
@@ -460,6 +513,10 @@ struct Object {
             return RelocationIterator{_elf->_internalRelocations.end()};
         }
 
+        size_t size() {
+            return _elf->_internalRelocations.size();
+        }
+
     private:
         Object *_elf;
     };
@@ -482,6 +539,8 @@ private:
     std::vector<std::unique_ptr<Symbol>> _symbols;
     std::vector<std::unique_ptr<Relocation>> _relocations;
     std::vector<std::unique_ptr<Relocation>> _internalRelocations;
+    std::unordered_map<std::string, String *> _internedStrings;
+    std::unordered_map<String *, Symbol *> _internedSymbols;
     size_t _numSections = 0;
 };
 
@@ -16,9 +16,24 @@ struct ObjectPass {
 
 // The following passes are implemented using Pimpl.
 
+// Selects the hash tables that are emitted for dynamic symbol lookup.
+// DT_GNU_HASH is much faster to search but not understood by all loaders.
+enum class HashStyle {
+    sysv,
+    gnu,
+    both
+};
+
 // Creates header fragments required for the desired file type.
 struct CreateHeadersPass : ObjectPass {
-    static std::unique_ptr<CreateHeadersPass> create(Object *elf);
+    static std::unique_ptr<CreateHeadersPass> create(Object *elf,
+            HashStyle hashStyle = HashStyle::both);
+};
+
+// Creates a single GOT entry and PLT stub for each undefined symbol that is called
+// through an R_X86_64_PLT32 internal relocation. Needs to run before LayoutPass.
+struct CreatePltPass : ObjectPass {
+    static std::unique_ptr<CreatePltPass> create(Object *elf);
 };
 
 // Layouts fragments in the file and in virtual memory.
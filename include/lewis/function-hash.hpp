@@ -0,0 +1,37 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <lewis/ir.hpp>
+
+namespace lewis {
+
+// 128-bit structural hash of a Function (in generic IR).
+struct FunctionHash {
+    uint64_t words[2] = {0, 0};
+
+    bool operator== (const FunctionHash &other) const {
+        return words[0] == other.words[0] && words[1] == other.words[1];
+    }
+
+    // 32 lower-case hex digits.
+    std::string toString() const;
+};
+
+// Hashes the structure of the Function: its BasicBlocks (in order), their PhiNodes,
+// instructions (kinds, opcodes, constants, offsets, callee names and result types),
+// branches and DataFlowEdges. Values are identified by their position, hence the hash
+// does not depend on addresses. The name of the Function is not part of the hash.
+// seed allows callers to distinguish code that is compiled with different settings.
+FunctionHash hashFunction(Function *fn, uint64_t seed = 0);
+
+struct HashFunctionHash {
+    size_t operator() (const FunctionHash &hash) const {
+        return hash.words[0];
+    }
+};
+
+} // namespace lewis
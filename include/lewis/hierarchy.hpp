@@ -3,8 +3,38 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+
 namespace lewis {
 
+// Compile-time set of kinds (e.g., InstructionKindType values).
+// If the kinds are close to each other, membership is tested by a single range check and a
+// bitmask lookup; otherwise, this falls back to comparing against each kind in turn.
+template<typename K, K... S>
+struct KindSet {
+    static_assert(sizeof...(S) > 0);
+
+    static constexpr K minKind = std::min({S...});
+    static constexpr K maxKind = std::max({S...});
+    static constexpr bool isDense = maxKind - minKind < 64;
+
+    static constexpr uint64_t mask = isDense
+            ? ((uint64_t{1} << ((S - minKind) & 63)) | ...) : 0;
+
+    static constexpr bool contains(K kind) {
+        if constexpr (sizeof...(S) == 1) {
+            return ((kind == S) || ...);
+        } else if constexpr (isDense) {
+            // Unsigned wrap-around turns kinds below minKind into large offsets.
+            auto offset = static_cast<uint64_t>(kind) - static_cast<uint64_t>(minKind);
+            return offset < 64 && ((mask >> offset) & 1);
+        } else {
+            return ((kind == S) || ...);
+        }
+    }
+};
+
 // Helper to encode types in values.
 template<typename D>
 struct HierarchyTag { };
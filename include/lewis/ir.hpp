@@ -12,6 +12,7 @@
 #include <frg/list.hpp>
 #include <frg/rbtree.hpp>
 #include <lewis/hierarchy.hpp>
+#include <lewis/util/arena.hpp>
 
 namespace lewis {
 
@@ -21,6 +22,7 @@ struct DataFlowSource;
 struct DataFlowSink;
 struct PhiNode;
 struct BasicBlock;
+struct Function;
 
 //---------------------------------------------------------------------------------------
 // Type class and related functionality.
@@ -48,6 +50,14 @@ Type *globalPointerType();
 Type *globalInt32Type();
 Type *globalInt64Type();
 
+// Returns a pointer to the storage that directly follows an object (at the given offset).
+// Only valid for objects that are created with trailing storage (see Function::create()).
+template<typename E, typename T>
+E *trailingStorage(T *object, size_t offset = 0) {
+    static_assert(alignof(E) <= alignof(T));
+    return reinterpret_cast<E *>(reinterpret_cast<char *>(object + 1) + offset);
+}
+
 //---------------------------------------------------------------------------------------
 // ValueUse class to represent "uses" of a Value.
 //---------------------------------------------------------------------------------------
@@ -66,21 +76,17 @@ struct ValueOrigin {
         return _value;
     }
 
-    void doSet(std::unique_ptr<Value> value);
+    void doSet(Value *value);
 
     template<typename T>
-    T *set(std::unique_ptr<T> value) {
-        auto ptr = value.get();
-        doSet(std::move(value));
-        return ptr;
+    T *set(T *value) {
+        doSet(value);
+        return value;
     }
 
-    template<typename T, typename... Args>
-    T *setNew(Args &&... args) {
-        return set(std::make_unique<T>(std::forward<Args>(args)...));
-    }
-
-    std::unique_ptr<Value> reset();
+    // Detaches the Value from this ValueOrigin.
+    // The Value itself stays alive until its Function is destructed.
+    Value *reset();
 
 private:
     Instruction *_inst;
@@ -207,16 +213,16 @@ private:
 };
 
 // Template magic to enable hierarchy_cast<>.
-template<ValueKindType K>
+template<ValueKindType... S>
 struct IsValueKind {
     bool operator() (Value *p) {
-        return p->valueKind == K;
+        return KindSet<ValueKindType, S...>::contains(p->valueKind);
     }
 };
 
 // Template magic to enable hierarchy_cast<>.
-template<typename T, ValueKindType K>
-struct CastableIfValueKind : Castable<T, IsValueKind<K>> { };
+template<typename T, ValueKindType... S>
+struct CastableIfValueKind : Castable<T, IsValueKind<S...>> { };
 
 //---------------------------------------------------------------------------------------
 // Instruction base class.
@@ -252,28 +258,26 @@ struct Instruction {
         return _bb;
     }
 
+    // Position of the instruction inside its BasicBlock.
+    // Only valid while the BasicBlock is in numbering mode (see numberInstructions()).
+    uint64_t sequenceNumber() {
+        return _seqNum;
+    }
+
     const InstructionKindType kind;
 
 private:
     BasicBlock *_bb = nullptr;
     frg::rbtree_hook _instTreeHook;
     size_t _numSubtreeInstr = 1;
+    uint64_t _seqNum = 0;
 };
 
 // Template magic to enable hierarchy_cast<>.
 template<InstructionKindType... S>
 struct IsInstructionKind {
     bool operator() (Instruction *p) {
-        std::array<InstructionKindType, sizeof...(S)> kinds{S...};
-        return std::find(kinds.begin(), kinds.end(), p->kind) != kinds.end();
-    }
-};
-
-// Specialization for the simple case.
-template<InstructionKindType K>
-struct IsInstructionKind<K> {
-    bool operator() (Instruction *p) {
-        return p->kind == K;
+        return KindSet<InstructionKindType, S...>::contains(p->kind);
     }
 };
 
@@ -310,10 +314,10 @@ struct Branch {
     const BranchKindType kind;
 };
 
-template<BranchKindType K>
+template<BranchKindType... S>
 struct IsBranchKind {
     bool operator() (Branch *p) {
-        return p->kind == K;
+        return KindSet<BranchKindType, S...>::contains(p->kind);
     }
 };
 
@@ -324,18 +328,33 @@ struct CastableIfBranchKind : Castable<T, IsBranchKind<S...>> { };
 struct FunctionReturnBranch
 : Branch,
         CastableIfBranchKind<FunctionReturnBranch, branch_kinds::functionReturn> {
+    friend struct util::Arena;
+
+    // Operands are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(size_t numOperands_) {
+        return numOperands_ * sizeof(ValueUse);
+    }
+
+private:
     FunctionReturnBranch(size_t numOperands_)
-    : Branch{branch_kinds::functionReturn} {
-        for (size_t i = 0; i < numOperands_; i++)
-            _operands.push_back(std::make_unique<ValueUse>(nullptr));
+    : Branch{branch_kinds::functionReturn}, _numOperands{numOperands_} {
+        for (size_t i = 0; i < _numOperands; i++)
+            new (_operands() + i) ValueUse{nullptr};
+    }
+
+public:
+    ~FunctionReturnBranch() {
+        for (size_t i = 0; i < _numOperands; i++)
+            _operands()[i].~ValueUse();
     }
 
-    size_t numOperands() { return _operands.size(); }
-    ValueUse &operand(size_t i) { return *_operands[i]; }
+    size_t numOperands() { return _numOperands; }
+    ValueUse &operand(size_t i) { return _operands()[i]; }
 
 private:
-    // TODO: This can be done without another indirection.
-    std::vector<std::unique_ptr<ValueUse>> _operands;
+    ValueUse *_operands() { return trailingStorage<ValueUse>(this); }
+
+    size_t _numOperands;
 };
 
 struct UnconditionalBranch
@@ -369,14 +388,12 @@ struct DataFlowEdge {
     friend struct DataFlowSource;
     friend struct DataFlowSink;
 
-    static void doAttach(std::unique_ptr<DataFlowEdge> edge,
-            DataFlowSource &source, DataFlowSink &sink);
+    static void doAttach(DataFlowEdge *edge, DataFlowSource &source, DataFlowSink &sink);
 
-    static DataFlowEdge *attach(std::unique_ptr<DataFlowEdge> edge,
+    static DataFlowEdge *attach(DataFlowEdge *edge,
             DataFlowSource &source, DataFlowSink &sink) {
-        auto ptr = edge.get();
-        doAttach(std::move(edge), source, sink);
-        return ptr;
+        doAttach(edge, source, sink);
+        return edge;
     }
 
     // TODO: Do not pass nullptr as an Instruction to the ValueUse.
@@ -517,10 +534,10 @@ private:
 };
 
 // Template magic to enable hierarchy_cast<>.
-template<PhiKindType K>
+template<PhiKindType... S>
 struct IsPhiKind {
     bool operator() (PhiNode *p) {
-        return p->phiKind == K;
+        return KindSet<PhiKindType, S...>::contains(p->phiKind);
     }
 };
 
@@ -643,16 +660,27 @@ struct BasicBlock {
         return PhiRange{this};
     }
 
+    Function *function() {
+        return _fn;
+    }
+
+    // Position of the BasicBlock inside its Function.
+    size_t ordinal() {
+        return _ordinal;
+    }
+
     template<typename T>
-    T *attachPhi(std::unique_ptr<T> phi) {
-        auto ptr = phi.get();
-        _phis.push_back(phi.release());
-        return ptr;
+    T *attachPhi(T *phi) {
+        _phis.push_back(phi);
+        return phi;
     }
 
-    PhiIterator replacePhi(PhiIterator from, std::unique_ptr<PhiNode> to) {
+    template<typename T, typename... Args>
+    T *attachNewPhi(Args &&... args);
+
+    PhiIterator replacePhi(PhiIterator from, PhiNode *to) {
         auto it = from;
-        auto nit = _phis.insert(it, to.release());
+        auto nit = _phis.insert(it, to);
         _phis.erase(it);
         return nit;
     }
@@ -700,83 +728,106 @@ struct BasicBlock {
         return index;
     }
 
-    void doInsertInstruction(std::unique_ptr<Instruction> inst) {
+    // Enables numbering mode: assigns increasing sequence numbers to all instructions.
+    // While numbering mode is enabled, instruction positions can be compared in O(1) through
+    // Instruction::sequenceNumber(). Numbers are spaced out such that inserting instructions
+    // only rarely requires renumbering; renumbering always preserves the relative order.
+    void numberInstructions();
+
+    void stopNumbering() {
+        _numbered = false;
+    }
+
+    void doInsertInstruction(Instruction *inst) {
         assert(!inst->_bb);
         inst->_bb = this;
-        _insts.insert(nullptr, inst.release());
+        _insts.insert(nullptr, inst);
+        if (_numbered)
+            _numberInserted(inst);
     }
 
-    void doInsertInstruction(InstructionIterator before, std::unique_ptr<Instruction> inst) {
+    void doInsertInstruction(InstructionIterator before, Instruction *inst) {
         assert(!inst->_bb);
         inst->_bb = this;
-        _insts.insert(before._inst, inst.release());
+        _insts.insert(before._inst, inst);
+        if (_numbered)
+            _numberInserted(inst);
     }
 
     template<typename T>
-    T *insertInstruction(std::unique_ptr<T> inst) {
-        auto ptr = inst.get();
-        doInsertInstruction(std::move(inst));
-        return ptr;
+    T *insertInstruction(T *inst) {
+        doInsertInstruction(inst);
+        return inst;
     }
 
     template<typename T>
-    T *insertInstruction(InstructionIterator it, std::unique_ptr<T> inst) {
-        auto ptr = inst.get();
-        doInsertInstruction(it, std::move(inst));
-        return ptr;
+    T *insertInstruction(InstructionIterator it, T *inst) {
+        doInsertInstruction(it, inst);
+        return inst;
     }
 
     template<typename T, typename... Args>
-    T *insertNewInstruction(Args &&... args) {
-        return insertInstruction(std::make_unique<T>(std::forward<Args>(args)...));
-    }
+    T *insertNewInstruction(Args &&... args);
 
     void eraseInstruction(InstructionIterator it) {
+        assert(it._inst);
+        assert(it._inst->_bb == this);
+        it._inst->_bb = nullptr;
         _insts.remove(it._inst);
     }
 
-    InstructionIterator replaceInstruction(InstructionIterator from,
-            std::unique_ptr<Instruction> to) {
+    InstructionIterator replaceInstruction(InstructionIterator from, Instruction *to) {
         assert(from._inst);
         assert(from._inst->_bb == this);
         assert(!to->_bb);
-        auto ptr = to.get();
         to->_bb = this;
-        _insts.insert(from._inst, to.release());
+        _insts.insert(from._inst, to);
         from._inst->_bb = nullptr;
         _insts.remove(from._inst);
-        return InstructionIterator{ptr};
+        if (_numbered)
+            to->_seqNum = from._inst->_seqNum;
+        return InstructionIterator{to};
     }
 
-    void doSetBranch(std::unique_ptr<Branch> branch) {
-        _branch = std::move(branch);
+    void doSetBranch(Branch *branch) {
+        _branch = branch;
     }
 
     template<typename T>
-    T *setBranch(std::unique_ptr<T> branch) {
-        auto ptr = branch.get();
-        doSetBranch(std::move(branch));
-        return ptr;
+    T *setBranch(T *branch) {
+        doSetBranch(branch);
+        return branch;
     }
 
+    template<typename T, typename... Args>
+    T *setNewBranch(Args &&... args);
+
     Branch *branch() {
-        return _branch.get();
+        return _branch;
     }
 
     DataFlowSource source;
 
 private:
+    void _numberInserted(Instruction *inst);
+
+    Function *_fn = nullptr;
+    size_t _ordinal = 0;
     frg::default_list_hook<BasicBlock> _blockListHook;
 
     PhiList _phis;
     InstructionTree _insts;
-    std::unique_ptr<Branch> _branch;
+    Branch *_branch = nullptr;
+    bool _numbered = false;
 };
 
 //---------------------------------------------------------------------------------------
 // Function class.
 //---------------------------------------------------------------------------------------
 
+// Owns all IR nodes (BasicBlocks, PhiNodes, Instructions, Branches, Values and DataFlowEdges)
+// that belong to it. IR nodes are allocated from a per-Function arena and all of them are
+// freed at once when the Function is destructed.
 struct Function {
     using BlockList = frg::intrusive_list<
         BasicBlock,
@@ -808,18 +859,57 @@ struct Function {
         return BlockRange{this};
     }
 
-    BasicBlock *addBlock(std::unique_ptr<BasicBlock> block) {
-        auto ptr = block.get();
-        _blocks.push_back(block.release());
-        return ptr;
+    BasicBlock *addBlock(BasicBlock *block) {
+        assert(!block->_fn);
+        block->_fn = this;
+        block->_ordinal = _numBlocks++;
+        _blocks.push_back(block);
+        return block;
+    }
+
+    BasicBlock *addNewBlock() {
+        return addBlock(create<BasicBlock>());
+    }
+
+    // Allocates an IR node from the arena of this Function.
+    // Classes that store variable-length arrays inline define a static trailingSize()
+    // function that computes the size of those arrays from the constructor arguments.
+    template<typename T, typename... Args>
+    T *create(Args &&... args) {
+        if constexpr (requires { T::trailingSize(args...); }) {
+            auto trailingSize = T::trailingSize(args...);
+            return _arena.createWithTrailing<T>(trailingSize, std::forward<Args>(args)...);
+        } else {
+            return _arena.create<T>(std::forward<Args>(args)...);
+        }
     }
 
     std::string name;
 
 private:
+    util::Arena _arena;
     BlockList _blocks;
+    size_t _numBlocks = 0;
 };
 
+template<typename T, typename... Args>
+T *BasicBlock::attachNewPhi(Args &&... args) {
+    assert(_fn && "BasicBlock must be added to a Function first");
+    return attachPhi(_fn->create<T>(std::forward<Args>(args)...));
+}
+
+template<typename T, typename... Args>
+T *BasicBlock::insertNewInstruction(Args &&... args) {
+    assert(_fn && "BasicBlock must be added to a Function first");
+    return insertInstruction(_fn->create<T>(std::forward<Args>(args)...));
+}
+
+template<typename T, typename... Args>
+T *BasicBlock::setNewBranch(Args &&... args) {
+    assert(_fn && "BasicBlock must be added to a Function first");
+    return setBranch(_fn->create<T>(std::forward<Args>(args)...));
+}
+
 //---------------------------------------------------------------------------------------
 // Helper class to define instructions with a single result.
 //---------------------------------------------------------------------------------------
@@ -903,26 +993,49 @@ struct BinaryMathInstruction
 struct InvokeInstruction
 : Instruction,
         CastableIfInstructionKind<InvokeInstruction, instruction_kinds::invoke> {
+    friend struct util::Arena;
+
+    // Operands and results are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(const std::string &, size_t numOperands_, size_t numResults_) {
+        return numOperands_ * sizeof(ValueUse) + numResults_ * sizeof(ValueOrigin);
+    }
+
+private:
     InvokeInstruction(std::string function, size_t numOperands_, size_t numResults_)
-    : Instruction{instruction_kinds::invoke}, function{std::move(function)} {
-        for (size_t i = 0; i < numOperands_; i++)
-            _operands.push_back(std::make_unique<ValueUse>(this));
-        for (size_t i = 0; i < numResults_; i++)
-            _results.push_back(std::make_unique<ValueOrigin>(this));
+    : Instruction{instruction_kinds::invoke}, function{std::move(function)},
+            _numOperands{numOperands_}, _numResults{numResults_} {
+        for (size_t i = 0; i < _numOperands; i++)
+            new (_operands() + i) ValueUse{this};
+        for (size_t i = 0; i < _numResults; i++)
+            new (_results() + i) ValueOrigin{this};
+    }
+
+public:
+    ~InvokeInstruction() {
+        for (size_t i = 0; i < _numOperands; i++)
+            _operands()[i].~ValueUse();
+        for (size_t i = 0; i < _numResults; i++)
+            _results()[i].~ValueOrigin();
     }
 
     std::string function;
 
-    size_t numOperands() { return _operands.size(); }
-    ValueUse &operand(size_t i) { return *_operands[i]; }
+    size_t numOperands() { return _numOperands; }
+    ValueUse &operand(size_t i) { return _operands()[i]; }
 
-    size_t numResults() { return _results.size(); }
-    ValueOrigin &result(size_t i) { return *_results[i]; }
+    size_t numResults() { return _numResults; }
+    ValueOrigin &result(size_t i) { return _results()[i]; }
 
 private:
-    // TODO: This can be done without another indirection.
-    std::vector<std::unique_ptr<ValueUse>> _operands;
-    std::vector<std::unique_ptr<ValueOrigin>> _results;
+    ValueUse *_operands() {
+        return trailingStorage<ValueUse>(this);
+    }
+    ValueOrigin *_results() {
+        return trailingStorage<ValueOrigin>(this, _numOperands * sizeof(ValueUse));
+    }
+
+    size_t _numOperands;
+    size_t _numResults;
 };
 
 } // namespace lewis
@@ -0,0 +1,23 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstdint>
+#include <lewis/elf/object.hpp>
+#include <lewis/jit/loader.hpp>
+#include <lewis/profile.hpp>
+
+namespace lewis::jit {
+
+// Reads the block counters of code that was instrumented by MachineCodeEmitter
+// (see MachineCodeEmitter::setCounterSection()). If reset is true, the counters are
+// zeroed afterwards. Counters are read without synchronization; concurrently running
+// code may thus be profiled slightly inaccurately.
+BlockProfile readBlockProfile(LoadedObject *object, bool reset = false);
+
+// Same as above, for an Object that was laid out by LayoutPass and is loaded
+// at base (e.g., a file emitted by FileEmitter and opened by dlopen()).
+BlockProfile readBlockProfile(elf::Object *elf, uintptr_t base, bool reset = false);
+
+} // namespace lewis::jit
@@ -0,0 +1,51 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <lewis/elf/object.hpp>
+
+namespace lewis::jit {
+
+// Returns the address of an undefined symbol (e.g., a function that is called through the PLT)
+// or nullptr if the symbol cannot be resolved.
+using SymbolResolver = std::function<void *(const std::string &name)>;
+
+// A symbol that is defined by a LoadedObject, at its final address.
+struct LoadedSymbol {
+    std::string name;
+    void *address;
+    size_t size;
+    // Whether the symbol refers to code (rather than data).
+    bool executable;
+};
+
+// Maps the segments of an elf::Object directly into executable memory, without going
+// through FileEmitter, the file system or the dynamic loader.
+// The Object needs to be laid out by LayoutPass and linked by InternalLinkPass first.
+// Code is never mapped writable and executable at the same time: the contents are written
+// through a separate writable view of the same memory that is discarded after loading.
+// The mapping is released once the LoadedObject is destructed.
+struct LoadedObject {
+    // This class is implemented using Pimpl.
+    static std::unique_ptr<LoadedObject> create(elf::Object *elf, SymbolResolver resolver);
+
+    virtual ~LoadedObject() = default;
+
+    // Returns the address of a symbol that is defined by the Object (or nullptr).
+    virtual void *lookup(const std::string &name) = 0;
+
+    // All symbols that are defined by the Object, in the order of the Object's symbols.
+    virtual const std::vector<LoadedSymbol> &symbols() = 0;
+
+    template<typename F>
+    F *lookupFunction(const std::string &name) {
+        return reinterpret_cast<F *>(lookup(name));
+    }
+};
+
+} // namespace lewis::jit
@@ -0,0 +1,66 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <lewis/elf/object.hpp>
+#include <lewis/jit/loader.hpp>
+
+namespace lewis::jit {
+
+struct ExportedBlock {
+    std::string name;
+    uintptr_t address;
+};
+
+// A Function at its final address, together with the .bbN symbols of its blocks.
+struct ExportedFunction {
+    std::string name;
+    uintptr_t address;
+    size_t size;
+    // Machine code of the Function (size bytes).
+    const uint8_t *code;
+    // Sorted by address.
+    std::vector<ExportedBlock> blocks;
+};
+
+// Collects the Functions of a LoadedObject.
+std::vector<ExportedFunction> collectFunctions(LoadedObject *object);
+
+// Collects the Functions of an Object that was laid out by LayoutPass and is loaded
+// at base (e.g., a file emitted by FileEmitter and opened by dlopen()).
+std::vector<ExportedFunction> collectFunctions(elf::Object *elf, uintptr_t base);
+
+// Describes generated code to profilers such as perf, which otherwise only see
+// anonymous addresses. Supports two formats:
+// perf maps (<directory>/perf-<pid>.map) that perf reads to symbolize samples and
+// jitdump files (<directory>/jit-<pid>.dump) that contain the code itself (and the
+// addresses of blocks as debug info), such that "perf inject --jit" can produce ELF images
+// for annotation. For jitdump, perf must record with a monotonic clock (perf record -k 1).
+// All member functions are thread-safe.
+struct ProfilerExport {
+    enum Formats : unsigned {
+        perfMap = 1,
+        jitDump = 2
+    };
+
+    // This class is implemented using Pimpl.
+    static std::unique_ptr<ProfilerExport> create(unsigned formats,
+            std::string directory = "/tmp");
+
+    virtual ~ProfilerExport() = default;
+
+    // The code must stay valid until the profiling session ends.
+    virtual void exportFunctions(const std::vector<ExportedFunction> &fns) = 0;
+
+    void exportObject(LoadedObject *object) {
+        exportFunctions(collectFunctions(object));
+    }
+};
+
+} // namespace lewis::jit
@@ -0,0 +1,43 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <lewis/ir.hpp>
+#include <lewis/util/bitset.hpp>
+
+namespace lewis {
+
+// Computes which Values are live at the boundaries of the BasicBlocks of a Function
+// (in generic IR). Values are numbered densely in order of their definition.
+// A Value is live-in at a BasicBlock if it is used in the block (or in a successor)
+// without being defined there. Uses by branches and by DataFlowEdges count as uses
+// in the edge's source block; PhiNodes define their Value at the beginning of their block.
+// The sets are found by a worklist algorithm over live-in/live-out bitsets.
+struct Liveness {
+    // This class is implemented using Pimpl.
+    static std::unique_ptr<Liveness> compute(Function *fn);
+
+    virtual ~Liveness() = default;
+
+    virtual size_t numValues() = 0;
+    virtual Value *valueAt(size_t index) = 0;
+    virtual size_t indexOf(Value *value) = 0;
+
+    // BasicBlock that defines the Value.
+    virtual BasicBlock *definingBlock(Value *value) = 0;
+
+    // BasicBlock of the instruction, branch or DataFlowEdge that contains the ValueUse.
+    virtual BasicBlock *usingBlock(ValueUse *use) = 0;
+
+    // Successors and predecessors do not contain duplicates.
+    virtual const std::vector<BasicBlock *> &successors(BasicBlock *bb) = 0;
+    virtual const std::vector<BasicBlock *> &predecessors(BasicBlock *bb) = 0;
+
+    virtual const util::BitSet &liveIn(BasicBlock *bb) = 0;
+    virtual const util::BitSet &liveOut(BasicBlock *bb) = 0;
+};
+
+} // namespace lewis
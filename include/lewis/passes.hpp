@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <memory>
 #include <lewis/ir.hpp>
 
 namespace lewis {
@@ -19,4 +20,34 @@ struct FunctionPass {
     virtual void run() = 0;
 };
 
+// Makes data flow between BasicBlocks explicit: each Value that is used outside of the
+// BasicBlock that defines it is passed to the using blocks through DataFlowPhis and
+// DataFlowEdges (based on Liveness). Afterwards, all Values are local to their BasicBlock,
+// as the backends require. Implemented using Pimpl.
+struct InsertDataFlowPhisPass : FunctionPass {
+    static std::unique_ptr<InsertDataFlowPhisPass> create(Function *fn);
+};
+
+// The following passes optimize generic IR. They are implemented using Pimpl.
+
+// Replaces math instructions on constants by LoadConstInstructions and simplifies
+// math instructions with neutral or absorbing constants (e.g., x + 0).
+// DataFlowPhis that receive the same constant on all edges are replaced by that constant.
+struct FoldConstantsPass : FunctionPass {
+    static std::unique_ptr<FoldConstantsPass> create(Function *fn);
+};
+
+// Replaces the results of instructions that compute the same value as an earlier
+// instruction of the same BasicBlock by that instruction's result. The redundant
+// instructions are left in place for EliminateDeadCodePass. LoadOffsetInstructions
+// are only reused up to the next InvokeInstruction (as the callee might write memory).
+struct NumberLocalValuesPass : FunctionPass {
+    static std::unique_ptr<NumberLocalValuesPass> create(Function *fn);
+};
+
+// Removes instructions without side effects whose results are not used.
+struct EliminateDeadCodePass : FunctionPass {
+    static std::unique_ptr<EliminateDeadCodePass> create(Function *fn);
+};
+
 } // namespace lewis::elf
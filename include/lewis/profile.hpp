@@ -0,0 +1,48 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <lewis/ir.hpp>
+
+namespace lewis {
+
+// Name of the symbol that MachineCodeEmitter generates for the BasicBlock
+// at position index of Function fnName.
+inline std::string blockSymbolName(const std::string &fnName, size_t index) {
+    return fnName + ".bb" + std::to_string(index);
+}
+
+// Execution counts of BasicBlocks, keyed by the names of their block symbols.
+// Since blocks are keyed by position, a profile applies to any Function that is
+// constructed in the same way as the instrumented one (e.g., on a later run).
+struct BlockProfile {
+    void add(const std::string &blockSymbol, uint64_t count) {
+        counts[blockSymbol] += count;
+    }
+
+    // Sums up the counts of both profiles (e.g., of multiple runs).
+    void merge(const BlockProfile &other) {
+        for (auto &[blockSymbol, count] : other.counts)
+            add(blockSymbol, count);
+    }
+
+    // Returns the counts of all blocks of fn (indexed by BasicBlock::ordinal()),
+    // or an empty vector if the profile does not contain any block of fn.
+    std::vector<uint64_t> countsOf(Function *fn) const;
+
+    std::unordered_map<std::string, uint64_t> counts;
+};
+
+// Returns a weight in [1, maxWeight] for each block of fn (indexed by BasicBlock::ordinal())
+// that is proportional to its execution count (except that cold blocks keep a weight of one).
+// Used to scale costs that depend on the execution frequency. All weights are one
+// if profile is null or does not contain fn.
+std::vector<int> weighBlocks(Function *fn, const BlockProfile *profile, int maxWeight);
+
+} // namespace lewis
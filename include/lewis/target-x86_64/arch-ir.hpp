@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <optional>
 #include <lewis/ir.hpp>
 
 namespace lewis::targets::x86_64 {
@@ -41,6 +42,12 @@ namespace arch_instruction_kinds {
         addMR,
         andMR,
         call,
+        pushM,
+        popM,
+        addMC,
+        andMC,
+        addRM,
+        andRM,
     };
 }
 
@@ -50,6 +57,7 @@ namespace arch_branch_kinds {
         ret,
         jmp,
         jnz,
+        tailCall,
     };
 }
 
@@ -157,7 +165,10 @@ struct UnaryMOverwriteInstruction
 // Instruction that takes a single mode M operand and replaces it by the result.
 struct UnaryMInPlaceInstruction
 : Instruction,
-        CastableIfInstructionKind<UnaryMInPlaceInstruction, arch_instruction_kinds::negM> {
+        CastableIfInstructionKind<UnaryMInPlaceInstruction,
+                arch_instruction_kinds::negM,
+                arch_instruction_kinds::addMC,
+                arch_instruction_kinds::andMC> {
     UnaryMInPlaceInstruction(InstructionKindType kind, Value *primary_ = nullptr)
     : Instruction{kind}, result{this}, primary{this, primary_} { }
 
@@ -179,6 +190,36 @@ struct BinaryMRInPlaceInstruction
     ValueUse secondary;
 };
 
+// Like UnaryMInPlaceInstruction, but also takes an immediate constant as second operand.
+// The immediate is sign-extended to the operand size. From the point of view of register
+// allocation, there is no difference to UnaryMInPlaceInstruction.
+struct BinaryMCInPlaceInstruction
+: UnaryMInPlaceInstruction, CastableIfInstructionKind<BinaryMCInPlaceInstruction,
+        arch_instruction_kinds::addMC,
+        arch_instruction_kinds::andMC> {
+    BinaryMCInPlaceInstruction(InstructionKindType kind,
+            Value *primary_ = nullptr, int32_t value_ = 0)
+    : UnaryMInPlaceInstruction{kind, primary_}, value{value_} { }
+
+    int32_t value;
+};
+
+// Takes a register primary operand and a memory secondary operand
+// (a BaseDispMemoryMode produced by DefineOffsetInstruction).
+struct BinaryRMInPlaceInstruction
+: Instruction, CastableIfInstructionKind<BinaryRMInPlaceInstruction,
+        arch_instruction_kinds::addRM,
+        arch_instruction_kinds::andRM> {
+    BinaryRMInPlaceInstruction(InstructionKindType kind,
+            Value *primary_ = nullptr, Value *secondary_ = nullptr)
+    : Instruction{kind}, result{this},
+            primary{this, primary_}, secondary{this, secondary_} { }
+
+    ValueOrigin result;
+    ValueUse primary;
+    ValueUse secondary;
+};
+
 struct PseudoMoveSingleInstruction
 : UnaryMOverwriteInstruction,
         CastableIfInstructionKind<PseudoMoveSingleInstruction,
@@ -200,26 +241,41 @@ private:
     };
 
 public:
+    friend struct util::Arena;
+
+    // Pairs are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(size_t arity) {
+        return arity * sizeof(MovePair);
+    }
+
+private:
     PseudoMoveMultipleInstruction(size_t arity)
-    : Instruction{arch_instruction_kinds::pseudoMoveMultiple} {
-        for(size_t i = 0; i < arity; i++)
-            _pairs.push_back(std::make_unique<MovePair>(this));
+    : Instruction{arch_instruction_kinds::pseudoMoveMultiple}, _arity{arity} {
+        for(size_t i = 0; i < _arity; i++)
+            new (_pairs() + i) MovePair{this};
+    }
+
+public:
+    ~PseudoMoveMultipleInstruction() {
+        for(size_t i = 0; i < _arity; i++)
+            _pairs()[i].~MovePair();
     }
 
     size_t arity() {
-        return _pairs.size();
+        return _arity;
     }
 
     ValueOrigin &result(size_t i) {
-        return _pairs[i]->result;
+        return _pairs()[i].result;
     }
     ValueUse &operand(size_t i) {
-        return _pairs[i]->operand;
+        return _pairs()[i].operand;
     }
 
 private:
-    // TODO: This can be done without another indirection.
-    std::vector<std::unique_ptr<MovePair>> _pairs;
+    MovePair *_pairs() { return trailingStorage<MovePair>(this); }
+
+    size_t _arity;
 };
 
 // TODO: Turn this into a UnaryMOverwriteInstruction.
@@ -282,46 +338,169 @@ struct AndMRInstruction
     : BinaryMRInPlaceInstruction{arch_instruction_kinds::andMR, primary_, secondary_} { }
 };
 
+struct AddMCInstruction
+: BinaryMCInPlaceInstruction,
+        CastableIfInstructionKind<AddMCInstruction, arch_instruction_kinds::addMC> {
+    AddMCInstruction(Value *primary_ = nullptr, int32_t value_ = 0)
+    : BinaryMCInPlaceInstruction{arch_instruction_kinds::addMC, primary_, value_} { }
+};
+
+struct AndMCInstruction
+: BinaryMCInPlaceInstruction,
+        CastableIfInstructionKind<AndMCInstruction, arch_instruction_kinds::andMC> {
+    AndMCInstruction(Value *primary_ = nullptr, int32_t value_ = 0)
+    : BinaryMCInPlaceInstruction{arch_instruction_kinds::andMC, primary_, value_} { }
+};
+
+struct AddRMInstruction
+: BinaryRMInPlaceInstruction,
+        CastableIfInstructionKind<AddRMInstruction, arch_instruction_kinds::addRM> {
+    AddRMInstruction(Value *primary_ = nullptr, Value *secondary_ = nullptr)
+    : BinaryRMInPlaceInstruction{arch_instruction_kinds::addRM, primary_, secondary_} { }
+};
+
+struct AndRMInstruction
+: BinaryRMInPlaceInstruction,
+        CastableIfInstructionKind<AndRMInstruction, arch_instruction_kinds::andRM> {
+    AndRMInstruction(Value *primary_ = nullptr, Value *secondary_ = nullptr)
+    : BinaryRMInPlaceInstruction{arch_instruction_kinds::andRM, primary_, secondary_} { }
+};
+
+// Pushes a qword from memory to the stack. Together with PopMInstruction, this is used for
+// memory-to-memory moves.
+struct PushMInstruction
+: Instruction,
+        CastableIfInstructionKind<PushMInstruction, arch_instruction_kinds::pushM> {
+    PushMInstruction(Value *operand_ = nullptr)
+    : Instruction{arch_instruction_kinds::pushM}, operand{this, operand_} { }
+
+    ValueUse operand;
+};
+
+// Pops a qword from the stack to memory.
+struct PopMInstruction
+: Instruction,
+        CastableIfInstructionKind<PopMInstruction, arch_instruction_kinds::popM> {
+    PopMInstruction()
+    : Instruction{arch_instruction_kinds::popM}, result{this} { }
+
+    ValueOrigin result;
+};
+
 struct CallInstruction
 : Instruction,
         CastableIfInstructionKind<CallInstruction, arch_instruction_kinds::call> {
+    friend struct util::Arena;
+
+    // Operands and results are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(size_t numOperands_, size_t numResults_) {
+        return numOperands_ * sizeof(ValueUse) + numResults_ * sizeof(ValueOrigin);
+    }
+
+private:
     CallInstruction(size_t numOperands_, size_t numResults_)
-    : Instruction{arch_instruction_kinds::call} {
-        for (size_t i = 0; i < numOperands_; i++)
-            _operands.push_back(std::make_unique<ValueUse>(this));
-        for (size_t i = 0; i < numResults_; i++)
-            _results.push_back(std::make_unique<ValueOrigin>(this));
+    : Instruction{arch_instruction_kinds::call},
+            _numOperands{numOperands_}, _numResults{numResults_} {
+        for (size_t i = 0; i < _numOperands; i++)
+            new (_operands() + i) ValueUse{this};
+        for (size_t i = 0; i < _numResults; i++)
+            new (_results() + i) ValueOrigin{this};
+    }
+
+public:
+    ~CallInstruction() {
+        for (size_t i = 0; i < _numOperands; i++)
+            _operands()[i].~ValueUse();
+        for (size_t i = 0; i < _numResults; i++)
+            _results()[i].~ValueOrigin();
     }
 
     std::string function;
 
-    size_t numOperands() { return _operands.size(); }
-    ValueUse &operand(size_t i) { return *_operands[i]; }
+    size_t numOperands() { return _numOperands; }
+    ValueUse &operand(size_t i) { return _operands()[i]; }
 
-    size_t numResults() { return _results.size(); }
-    ValueOrigin &result(size_t i) { return *_results[i]; }
+    size_t numResults() { return _numResults; }
+    ValueOrigin &result(size_t i) { return _results()[i]; }
 
 private:
-    // TODO: This can be done without another indirection.
-    std::vector<std::unique_ptr<ValueUse>> _operands;
-    std::vector<std::unique_ptr<ValueOrigin>> _results;
+    ValueUse *_operands() {
+        return trailingStorage<ValueUse>(this);
+    }
+    ValueOrigin *_results() {
+        return trailingStorage<ValueOrigin>(this, _numOperands * sizeof(ValueUse));
+    }
+
+    size_t _numOperands;
+    size_t _numResults;
 };
 
 struct RetBranch
 : Branch,
         CastableIfBranchKind<RetBranch, arch_branch_kinds::ret> {
+    friend struct util::Arena;
+
+    // Operands are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(size_t numOperands_) {
+        return numOperands_ * sizeof(ValueUse);
+    }
+
+private:
     RetBranch(size_t numOperands_)
-    : Branch{arch_branch_kinds::ret} {
-        for (size_t i = 0; i < numOperands_; i++)
-            _operands.push_back(std::make_unique<ValueUse>(nullptr));
+    : Branch{arch_branch_kinds::ret}, _numOperands{numOperands_} {
+        for (size_t i = 0; i < _numOperands; i++)
+            new (_operands() + i) ValueUse{nullptr};
+    }
+
+public:
+    ~RetBranch() {
+        for (size_t i = 0; i < _numOperands; i++)
+            _operands()[i].~ValueUse();
     }
 
-    size_t numOperands() { return _operands.size(); }
-    ValueUse &operand(size_t i) { return *_operands[i]; }
+    size_t numOperands() { return _numOperands; }
+    ValueUse &operand(size_t i) { return _operands()[i]; }
 
 private:
-    // TODO: This can be done without another indirection.
-    std::vector<std::unique_ptr<ValueUse>> _operands;
+    ValueUse *_operands() { return trailingStorage<ValueUse>(this); }
+
+    size_t _numOperands;
+};
+
+// Calls a function that returns directly to our caller, i.e., the results of the call
+// are the results of this function. Lowered to the function epilogue followed by a JMP.
+struct TailCallBranch
+: Branch,
+        CastableIfBranchKind<TailCallBranch, arch_branch_kinds::tailCall> {
+    friend struct util::Arena;
+
+    // Operands are stored in trailing storage (see Function::create()).
+    static size_t trailingSize(size_t numOperands_) {
+        return numOperands_ * sizeof(ValueUse);
+    }
+
+private:
+    TailCallBranch(size_t numOperands_)
+    : Branch{arch_branch_kinds::tailCall}, _numOperands{numOperands_} {
+        for (size_t i = 0; i < _numOperands; i++)
+            new (_operands() + i) ValueUse{nullptr};
+    }
+
+public:
+    ~TailCallBranch() {
+        for (size_t i = 0; i < _numOperands; i++)
+            _operands()[i].~ValueUse();
+    }
+
+    std::string function;
+
+    size_t numOperands() { return _numOperands; }
+    ValueUse &operand(size_t i) { return _operands()[i]; }
+
+private:
+    ValueUse *_operands() { return trailingStorage<ValueUse>(this); }
+
+    size_t _numOperands;
 };
 
 struct JmpBranch
@@ -345,6 +524,8 @@ struct JnzBranch
     BasicBlock *ifTarget;
     BasicBlock *elseTarget;
     ValueUse operand;
+    // If set, the branch tests operand & testMask instead of operand itself.
+    std::optional<int32_t> testMask;
 };
 
 } // namespace lewis::targets::x86_64
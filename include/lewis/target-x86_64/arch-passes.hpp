@@ -5,6 +5,7 @@
 
 #include <memory>
 #include <lewis/passes.hpp>
+#include <lewis/profile.hpp>
 
 namespace lewis::targets::x86_64 {
 
@@ -15,9 +16,45 @@ struct LowerCodePass : BasicBlockPass {
     static std::unique_ptr<LowerCodePass> create(BasicBlock *bb);
 };
 
+// Statistics that quantify the quality of a register allocation.
+struct AllocationStats {
+    // Sum of the weights of all penalties that could not be avoided.
+    int achievedCost = 0;
+    // Number of register-to-register moves that were emitted.
+    int numRegisterMoves = 0;
+    // Number of pseudo moves that did not require an instruction
+    // (as source and target were allocated to the same register).
+    int numFusedMoves = 0;
+    // Number of LiveCompounds that were spilled to the stack.
+    int numSpilledCompounds = 0;
+    // Number of loads and stores that were emitted to access spill slots.
+    int numSpillMoves = 0;
+};
+
+enum class AllocationTier {
+    // Allocates compounds in program order in a single pass, without tracking penalties
+    // (i.e., no attempt is made to avoid moves). Intended for code that is compiled
+    // quickly first and recompiled once it turns out to be hot.
+    baseline,
+    // Allocates compounds in order of their spill weights and avoids moves where possible.
+    optimizing
+};
+
+struct AllocationOptions {
+    AllocationTier tier = AllocationTier::optimizing;
+    // If a profile is given, penalties and spill weights are scaled by the execution counts
+    // of the blocks, such that moves and spills are pushed into cold code.
+    // Ignored by the baseline tier.
+    const BlockProfile *profile = nullptr;
+};
+
 // Allocate registers in x86 IR.
 struct AllocateRegistersPass : FunctionPass {
-    static std::unique_ptr<AllocateRegistersPass> create(Function *fn);
+    static std::unique_ptr<AllocateRegistersPass> create(Function *fn,
+            AllocationOptions options = {});
+
+    // Only valid after run() was called.
+    virtual AllocationStats stats() = 0;
 };
 
 } // namespace lewis::targets::x86_64
@@ -7,25 +7,103 @@
 #include <unordered_map>
 #include <vector>
 #include <lewis/elf/object.hpp>
+#include <lewis/profile.hpp>
 #include <lewis/target-x86_64/arch-ir.hpp>
 #include <lewis/util/byte-encode.hpp>
 
 namespace lewis::targets::x86_64 {
 
+// Identifies the code that the backend (lowering, register allocation and emission)
+// generates for a given Function. Must be bumped whenever the generated code changes;
+// it is part of the hash of the code cache, such that stale cache entries are not used.
+constexpr uint32_t codegenVersion = 3;
+
 // TODO: This should probably also use pimpl.
 struct MachineCodeEmitter {
+    // Creates an empty .text section that multiple MachineCodeEmitters can append to.
+    static elf::ByteSection *createTextSection(elf::Object *elf);
+
+    // Creates an empty (writable) section for block counters, see setCounterSection().
+    static elf::ByteSection *createCounterSection(elf::Object *elf);
+
+    // Emits the Function into its own .text section.
     MachineCodeEmitter(Function *fn, elf::Object *elf);
 
+    // Appends the Function to an existing .text section.
+    MachineCodeEmitter(Function *fn, elf::Object *elf, elf::ByteSection *textSection);
+
+    // Instruments the Function: each BasicBlock increments a 64-bit counter when it is entered.
+    // The counters are appended to counterSection; their symbols are named after the block
+    // symbols (<block symbol>.count). Note that the increment clobbers the flags.
+    void setCounterSection(elf::ByteSection *counterSection) {
+        _counterSection = counterSection;
+    }
+
+    // Places blocks according to their execution counts: hot successors become fall-through
+    // blocks and blocks that never executed are moved to the end of the Function.
+    void setProfile(const BlockProfile *profile) {
+        _profile = profile;
+    }
+
     void run();
 
 private:
-    void _emitBlock(BasicBlock *bb, elf::ByteSection *textSection);
+    static constexpr size_t noBlock = static_cast<size_t>(-1);
+
+    // Machine code of a single BasicBlock before its branch is resolved.
+    struct EmittedBlock {
+        explicit EmittedBlock(BasicBlock *bb)
+        : bb{bb} { }
+
+        BasicBlock *bb;
+        std::vector<uint8_t> code;
+        // Relocations within code. Their offsets are relative to the start of the block.
+        std::vector<elf::Relocation *> relocations;
+
+        // The branch is lowered to: an optional Jcc to condTarget, followed by an optional
+        // JMP to jumpTarget (or a RET, or a JMP to the function tailCall).
+        // Targets are indices into _blocks.
+        bool ret = false;
+        TailCallBranch *tailCall = nullptr;
+        int conditionCode = -1;
+        size_t condTarget = noBlock;
+        size_t jumpTarget = noBlock;
+        // Whether the jumps need rel32 encodings; determined by branch relaxation.
+        bool longCond = false;
+        bool longJump = false;
+
+        // Offset relative to the function's entry point.
+        size_t offset = 0;
+    };
+
+    void _placeBlocks();
+    void _emitCounter(EmittedBlock &block);
+    void _lowerBranch(size_t index);
+    void _emitBody(EmittedBlock &block);
+    void _relaxBranches();
+    size_t _branchSize(EmittedBlock &block);
 
     Function *_fn;
     elf::Object *_elf;
-    elf::ByteSection *_gotSection = nullptr;
-    elf::ByteSection *_pltSection = nullptr;
+    elf::ByteSection *_textSection;
+    elf::ByteSection *_counterSection = nullptr;
+    const BlockProfile *_profile = nullptr;
     std::unordered_map<BasicBlock *, elf::Symbol *> _bbSymbols;
+    std::unordered_map<BasicBlock *, elf::Symbol *> _counterSymbols;
+    std::vector<EmittedBlock> _blocks;
+    std::unordered_map<BasicBlock *, size_t> _blockIndices;
+};
+
+// Emits many Functions into a single elf::Object. All Functions share the same .text section
+// (and hence the same segment); the passes on elf::Object only need to run once per module.
+struct ModuleEmitter {
+    ModuleEmitter(elf::Object *elf);
+
+    void emit(Function *fn);
+
+private:
+    elf::Object *_elf;
+    elf::ByteSection *_textSection = nullptr;
 };
 
 } // namespace lewis::targets::x86_64
@@ -0,0 +1,105 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace lewis::util {
+
+// Bump allocator that owns all objects created through it.
+// All objects are destructed (in reverse order of creation) and their memory is freed
+// in one shot when the Arena is destructed. Individual objects are never freed.
+struct Arena {
+    Arena() = default;
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator= (const Arena &) = delete;
+
+    ~Arena() {
+        while (_finalizers) {
+            _finalizers->destroy(_finalizers->object);
+            _finalizers = _finalizers->next;
+        }
+
+        while (_chunks) {
+            auto next = _chunks->next;
+            ::operator delete(_chunks);
+            _chunks = next;
+        }
+    }
+
+    void *allocate(size_t size, size_t align) {
+        assert(align && !(align & (align - 1)) && align <= alignof(std::max_align_t));
+        auto p = (_current + align - 1) & ~uintptr_t(align - 1);
+        if (!_current || p + size > _limit) {
+            _refill(size + align);
+            p = (_current + align - 1) & ~uintptr_t(align - 1);
+        }
+        _current = p + size;
+        return reinterpret_cast<void *>(p);
+    }
+
+    // Creates an object of type T.
+    template<typename T, typename... Args>
+    T *create(Args &&... args) {
+        return createWithTrailing<T>(0, std::forward<Args>(args)...);
+    }
+
+    // Creates an object of type T that is immediately followed by trailingSize bytes.
+    // Classes use this to store variable-length arrays without another indirection.
+    template<typename T, typename... Args>
+    T *createWithTrailing(size_t trailingSize, Args &&... args) {
+        auto storage = allocate(sizeof(T) + trailingSize, alignof(T));
+        auto object = new (storage) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            auto finalizer = new (allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer;
+            finalizer->destroy = [] (void *p) { static_cast<T *>(p)->~T(); };
+            finalizer->object = object;
+            finalizer->next = _finalizers;
+            _finalizers = finalizer;
+        }
+        return object;
+    }
+
+private:
+    struct Chunk {
+        Chunk *next;
+    };
+
+    struct Finalizer {
+        void (*destroy)(void *);
+        void *object;
+        Finalizer *next;
+    };
+
+    void _refill(size_t minSize) {
+        // Grow chunks geometrically such that large Functions need few chunks
+        // while small Functions stay cheap.
+        if (_chunkSize < 64 * 1024)
+            _chunkSize *= 2;
+        auto size = _chunkSize;
+        if (size < minSize + sizeof(Chunk))
+            size = minSize + sizeof(Chunk);
+
+        auto chunk = static_cast<Chunk *>(::operator new(size));
+        chunk->next = _chunks;
+        _chunks = chunk;
+        _current = reinterpret_cast<uintptr_t>(chunk + 1);
+        _limit = reinterpret_cast<uintptr_t>(chunk) + size;
+    }
+
+    Chunk *_chunks = nullptr;
+    Finalizer *_finalizers = nullptr;
+    uintptr_t _current = 0;
+    uintptr_t _limit = 0;
+    size_t _chunkSize = 1024;
+};
+
+} // namespace lewis::util
@@ -0,0 +1,89 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lewis::util {
+
+// Dense set of indices in [0, size()). Used by dataflow analyses that number
+// their elements densely; all binary operations require sets of the same size.
+struct BitSet {
+    BitSet() = default;
+
+    explicit BitSet(size_t size)
+    : _size{size}, _words((size + 63) / 64, 0) { }
+
+    size_t size() const {
+        return _size;
+    }
+
+    bool test(size_t i) const {
+        assert(i < _size);
+        return _words[i / 64] & (uint64_t{1} << (i % 64));
+    }
+
+    void set(size_t i) {
+        assert(i < _size);
+        _words[i / 64] |= uint64_t{1} << (i % 64);
+    }
+
+    void reset(size_t i) {
+        assert(i < _size);
+        _words[i / 64] &= ~(uint64_t{1} << (i % 64));
+    }
+
+    bool empty() const {
+        for (auto word : _words) {
+            if (word)
+                return false;
+        }
+        return true;
+    }
+
+    // Adds all elements of other. Returns true if this set changed.
+    bool merge(const BitSet &other) {
+        assert(_size == other._size);
+        uint64_t changed = 0;
+        for (size_t k = 0; k < _words.size(); ++k) {
+            auto word = _words[k] | other._words[k];
+            changed |= word ^ _words[k];
+            _words[k] = word;
+        }
+        return changed;
+    }
+
+    // Adds all elements of other that are not in mask. Returns true if this set changed.
+    bool mergeExcept(const BitSet &other, const BitSet &mask) {
+        assert(_size == other._size && _size == mask._size);
+        uint64_t changed = 0;
+        for (size_t k = 0; k < _words.size(); ++k) {
+            auto word = _words[k] | (other._words[k] & ~mask._words[k]);
+            changed |= word ^ _words[k];
+            _words[k] = word;
+        }
+        return changed;
+    }
+
+    // Calls f(i) for all elements i in increasing order.
+    template<typename F>
+    void forEach(F f) const {
+        for (size_t k = 0; k < _words.size(); ++k) {
+            auto word = _words[k];
+            while (word) {
+                f(k * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+private:
+    size_t _size = 0;
+    std::vector<uint64_t> _words;
+};
+
+} // namespace lewis::util
@@ -3,30 +3,81 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <cstring>
+#include <span>
+#include <vector>
 
 namespace lewis::util {
 
+// Appends binary data to a std::vector.
+// To avoid resizing the vector for each byte, the encoder writes through a raw cursor into
+// storage that it allocated ahead of time. The vector's size() is only accurate again
+// after the encoder is destructed; while the encoder is alive, offset() must be used instead
+// and the vector must not be modified by other means.
 struct ByteEncoder {
     ByteEncoder(std::vector<uint8_t> *out)
-    : _out{out} { }
+    : _out{out}, _cursor{out->data() + out->size()}, _limit{_cursor} { }
+
+    ByteEncoder(const ByteEncoder &) = delete;
+
+    ByteEncoder &operator= (const ByteEncoder &) = delete;
+
+    ~ByteEncoder() {
+        // Drop the storage that was allocated but not written.
+        _out->resize(offset());
+    }
+
+    size_t offset() {
+        return _cursor - _out->data();
+    }
+
+    // Capacity hint: makes sure that the next n bytes can be written without growing the vector.
+    // Emitters call this once per instruction (or per table) with an upper bound of its size.
+    // Writes within that bound can then go through an UncheckedEncoder.
+    void ensure(size_t n) {
+        if (static_cast<size_t>(_limit - _cursor) < n)
+            _grow(n);
+    }
 
 private:
+    friend struct UncheckedEncoder;
+
+    void _grow(size_t n) {
+        // Make all capacity that the vector already has (e.g., due to reserve() or
+        // a previous encoder) available to the cursor. Beyond that, grow geometrically
+        // such that repeated small writes stay cheap.
+        auto size = offset();
+        if (size + n <= _out->capacity()) {
+            _out->resize(_out->capacity());
+        } else {
+            _out->resize(std::max(size + n, 2 * _out->capacity()));
+        }
+        _cursor = _out->data() + size;
+        _limit = _out->data() + _out->size();
+    }
+
+    void _pokeBytes(const void *p, size_t n) {
+        if (!n)
+            return;
+        ensure(n);
+        memcpy(_cursor, p, n);
+        _cursor += n;
+    }
+
     template<typename T>
     void _poke(T v) {
-        auto n = _out->size();
-        _out->resize(n + sizeof(T));
-        memcpy(_out->data() + n, &v, sizeof(T));
+        _pokeBytes(&v, sizeof(T));
     }
 
 public:
-    size_t offset() {
-        return _out->size();
-    }
-
     friend void encodeChars(ByteEncoder &e, const char *v) {
-        while (*v)
-            e._poke<uint8_t>(*(v++));
+        e._pokeBytes(v, strlen(v));
+    }
+    friend void encodeBytes(ByteEncoder &e, std::span<const uint8_t> v) {
+        e._pokeBytes(v.data(), v.size());
     }
     friend void encode8(ByteEncoder &e, uint8_t v) { e._poke<uint8_t>(v); }
     friend void encode16(ByteEncoder &e, uint16_t v) { e._poke<uint16_t>(v); }
@@ -35,6 +86,54 @@ public:
 
 private:
     std::vector<uint8_t> *_out;
+    uint8_t *_cursor;
+    uint8_t *_limit;
+};
+
+// Writes the next n bytes of a ByteEncoder (which are reserved on construction) without
+// checking bounds on each write, such that a short sequence of writes of bounded size
+// (e.g., the REX prefix, opcode, ModRM, SIB and displacement of an instruction) only
+// performs a single check. Exceeding n bytes is only caught by assertions.
+struct UncheckedEncoder {
+    UncheckedEncoder(ByteEncoder &encoder, size_t n)
+    : _encoder{&encoder} {
+        encoder.ensure(n);
+        _end = encoder._cursor + n;
+    }
+
+    UncheckedEncoder(const UncheckedEncoder &) = delete;
+
+    UncheckedEncoder &operator= (const UncheckedEncoder &) = delete;
+
+    size_t offset() {
+        return _encoder->offset();
+    }
+
+private:
+    void _pokeBytes(const void *p, size_t n) {
+        assert(n <= static_cast<size_t>(_end - _encoder->_cursor)
+                && "Write exceeds the bytes reserved by UncheckedEncoder");
+        memcpy(_encoder->_cursor, p, n);
+        _encoder->_cursor += n;
+    }
+
+    template<typename T>
+    void _poke(T v) {
+        _pokeBytes(&v, sizeof(T));
+    }
+
+public:
+    friend void encodeBytes(UncheckedEncoder &e, std::span<const uint8_t> v) {
+        e._pokeBytes(v.data(), v.size());
+    }
+    friend void encode8(UncheckedEncoder &e, uint8_t v) { e._poke<uint8_t>(v); }
+    friend void encode16(UncheckedEncoder &e, uint16_t v) { e._poke<uint16_t>(v); }
+    friend void encode32(UncheckedEncoder &e, uint32_t v) { e._poke<uint32_t>(v); }
+    friend void encode64(UncheckedEncoder &e, uint64_t v) { e._poke<uint64_t>(v); }
+
+private:
+    ByteEncoder *_encoder;
+    uint8_t *_end;
 };
 
 } // namespace lewis::util
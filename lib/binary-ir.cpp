@@ -0,0 +1,580 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <lewis/binary-ir.hpp>
+#include <lewis/util/byte-encode.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr uint32_t fileMagic = 0x5249574C; // "LWIR"
+
+    // The records of the format. All of them consist of 32-bit words only, such that
+    // they can be copied from (and to) the buffer directly.
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numFunctions;
+        uint32_t stringTableSize;
+    };
+
+    struct FunctionHeader {
+        uint32_t name;
+        uint32_t numBlocks;
+        uint32_t numPhis;
+        uint32_t numInstructions;
+        uint32_t numValues;
+        uint32_t numOperands;
+        uint32_t numEdges;
+    };
+
+    struct BlockRecord {
+        uint32_t numPhis;
+        uint32_t numInstructions;
+        uint32_t branchKind;
+        // Indices of the target blocks; unused targets are zero.
+        uint32_t targets[2];
+        // Operands into the operand array.
+        uint32_t firstOperand;
+        uint32_t numOperands;
+    };
+
+    struct PhiRecord {
+        uint32_t phiKind;
+    };
+
+    struct InstructionRecord {
+        uint32_t kind;
+        // Opcode of math instructions, callee name of InvokeInstructions.
+        uint32_t aux;
+        uint32_t firstOperand;
+        uint32_t numOperands;
+        uint32_t numResults;
+        uint32_t reserved;
+        // Value of LoadConstInstructions, offset of LoadOffsetInstructions.
+        uint32_t immediate[2];
+    };
+
+    struct ValueRecord {
+        uint32_t typeKind;
+    };
+
+    struct OperandRecord {
+        uint32_t value;
+    };
+
+    struct EdgeRecord {
+        uint32_t sourceBlock;
+        uint32_t sinkPhi;
+        uint32_t alias;
+    };
+
+    template<typename R>
+    void encodeRecord(util::ByteEncoder &e, const R &record) {
+        static_assert(sizeof(R) % 4 == 0);
+        encodeBytes(e, {reinterpret_cast<const uint8_t *>(&record), sizeof(R)});
+    }
+
+    [[noreturn]] void malformed(const char *what) {
+        throw std::runtime_error(std::string{"Malformed binary IR: "} + what);
+    }
+};
+
+//---------------------------------------------------------------------------------------
+// Writer.
+//---------------------------------------------------------------------------------------
+
+struct BinaryIrWriter {
+    BinaryIrWriter(std::vector<uint8_t> &out)
+    : _out{out} { }
+
+    void run(const std::vector<Function *> &fns);
+
+private:
+    uint32_t _internString(const std::string &s) {
+        auto [it, inserted] = _stringOffsets.insert({s, _strings.size()});
+        if (inserted) {
+            _strings.insert(_strings.end(), s.begin(), s.end());
+            _strings.push_back(0);
+        }
+        return it->second;
+    }
+
+    void _define(Value *value) {
+        assert(value && "Definitions must have a Value for writeBinaryIr()");
+        _values.insert({value, _valueRecords.size()});
+        _valueRecords.push_back({value->getType() ? value->getType()->typeKind
+                : type_kinds::null});
+    }
+
+    void _use(ValueUse &use) {
+        _operandRecords.push_back({_refOf(use.get())});
+    }
+
+    uint32_t _refOf(Value *value) {
+        if (!value)
+            return 0;
+        auto it = _values.find(value);
+        assert(it != _values.end() && "Value is not defined in this Function");
+        return it->second + 1;
+    }
+
+    void _writeFunction(Function *fn);
+
+    std::vector<uint8_t> &_out;
+    std::vector<uint8_t> _functions;
+    std::vector<char> _strings;
+    std::unordered_map<std::string, uint32_t> _stringOffsets;
+
+    // State of the current Function.
+    std::unordered_map<Value *, uint32_t> _values;
+    std::vector<BlockRecord> _blockRecords;
+    std::vector<PhiRecord> _phiRecords;
+    std::vector<InstructionRecord> _instructionRecords;
+    std::vector<ValueRecord> _valueRecords;
+    std::vector<OperandRecord> _operandRecords;
+    std::vector<EdgeRecord> _edgeRecords;
+};
+
+void BinaryIrWriter::run(const std::vector<Function *> &fns) {
+    for (auto fn : fns)
+        _writeFunction(fn);
+    while (_strings.size() % 4)
+        _strings.push_back(0);
+
+    util::ByteEncoder e{&_out};
+    encodeRecord(e, FileHeader{fileMagic, binaryIrVersion,
+            static_cast<uint32_t>(fns.size()), static_cast<uint32_t>(_strings.size())});
+    encodeBytes(e, {reinterpret_cast<const uint8_t *>(_strings.data()), _strings.size()});
+    encodeBytes(e, _functions);
+}
+
+void BinaryIrWriter::_writeFunction(Function *fn) {
+    _values.clear();
+    _blockRecords.clear();
+    _phiRecords.clear();
+    _instructionRecords.clear();
+    _valueRecords.clear();
+    _operandRecords.clear();
+    _edgeRecords.clear();
+
+    // Number blocks, phis and Values first; uses can precede definitions in loops.
+    std::unordered_map<BasicBlock *, uint32_t> blocks;
+    std::unordered_map<DataFlowSink *, uint32_t> sinks;
+    uint32_t numPhis = 0;
+    for (auto bb : fn->blocks()) {
+        blocks.insert({bb, blocks.size()});
+        for (auto phi : bb->phis()) {
+            _define(phi->value.get());
+            if (auto dataFlowPhi = hierarchy_cast<DataFlowPhi *>(phi); dataFlowPhi)
+                sinks.insert({&dataFlowPhi->sink, numPhis});
+            numPhis++;
+        }
+        for (auto inst : bb->instructions()) {
+            switch (inst->kind) {
+            case instruction_kinds::loadConst:
+                _define(static_cast<LoadConstInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::loadOffset:
+                _define(static_cast<LoadOffsetInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::unaryMath:
+                _define(static_cast<UnaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::binaryMath:
+                _define(static_cast<BinaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::invoke: {
+                auto invoke = static_cast<InvokeInstruction *>(inst);
+                for (size_t i = 0; i < invoke->numResults(); i++)
+                    _define(invoke->result(i).get());
+                break;
+            }
+            default:
+                assert(!"writeBinaryIr() only supports generic IR");
+            }
+        }
+    }
+
+    for (auto bb : fn->blocks()) {
+        BlockRecord block{};
+        for (auto phi : bb->phis()) {
+            _phiRecords.push_back({phi->phiKind});
+            block.numPhis++;
+        }
+
+        for (auto inst : bb->instructions()) {
+            InstructionRecord record{};
+            record.kind = inst->kind;
+            record.firstOperand = _operandRecords.size();
+            record.numResults = 1;
+            uint64_t immediate = 0;
+            switch (inst->kind) {
+            case instruction_kinds::loadConst: {
+                immediate = static_cast<LoadConstInstruction *>(inst)->value;
+                break;
+            }
+            case instruction_kinds::loadOffset: {
+                auto loadOffset = static_cast<LoadOffsetInstruction *>(inst);
+                immediate = loadOffset->offset;
+                _use(loadOffset->operand);
+                break;
+            }
+            case instruction_kinds::unaryMath: {
+                auto unaryMath = static_cast<UnaryMathInstruction *>(inst);
+                record.aux = static_cast<uint32_t>(unaryMath->opcode);
+                _use(unaryMath->operand);
+                break;
+            }
+            case instruction_kinds::binaryMath: {
+                auto binaryMath = static_cast<BinaryMathInstruction *>(inst);
+                record.aux = static_cast<uint32_t>(binaryMath->opcode);
+                _use(binaryMath->left);
+                _use(binaryMath->right);
+                break;
+            }
+            case instruction_kinds::invoke: {
+                auto invoke = static_cast<InvokeInstruction *>(inst);
+                record.aux = _internString(invoke->function);
+                for (size_t i = 0; i < invoke->numOperands(); i++)
+                    _use(invoke->operand(i));
+                record.numResults = invoke->numResults();
+                break;
+            }
+            default:
+                assert(!"writeBinaryIr() only supports generic IR");
+            }
+            record.numOperands = _operandRecords.size() - record.firstOperand;
+            record.immediate[0] = static_cast<uint32_t>(immediate);
+            record.immediate[1] = static_cast<uint32_t>(immediate >> 32);
+            _instructionRecords.push_back(record);
+            block.numInstructions++;
+        }
+
+        auto branch = bb->branch();
+        assert(branch && "writeBinaryIr() requires all blocks to have a branch");
+        block.branchKind = branch->kind;
+        block.firstOperand = _operandRecords.size();
+        switch (branch->kind) {
+        case branch_kinds::functionReturn: {
+            auto functionReturn = static_cast<FunctionReturnBranch *>(branch);
+            for (size_t i = 0; i < functionReturn->numOperands(); i++)
+                _use(functionReturn->operand(i));
+            break;
+        }
+        case branch_kinds::unconditional: {
+            auto unconditional = static_cast<UnconditionalBranch *>(branch);
+            block.targets[0] = blocks.at(unconditional->target);
+            break;
+        }
+        case branch_kinds::conditional: {
+            auto conditional = static_cast<ConditionalBranch *>(branch);
+            block.targets[0] = blocks.at(conditional->ifTarget);
+            block.targets[1] = blocks.at(conditional->elseTarget);
+            _use(conditional->operand);
+            break;
+        }
+        default:
+            assert(!"writeBinaryIr() only supports generic IR");
+        }
+        block.numOperands = _operandRecords.size() - block.firstOperand;
+        _blockRecords.push_back(block);
+
+        for (auto edge : bb->source.edges())
+            _edgeRecords.push_back({blocks.at(bb), sinks.at(edge->sink()),
+                    _refOf(edge->alias.get())});
+    }
+
+    util::ByteEncoder e{&_functions};
+    encodeRecord(e, FunctionHeader{_internString(fn->name),
+            static_cast<uint32_t>(_blockRecords.size()),
+            static_cast<uint32_t>(_phiRecords.size()),
+            static_cast<uint32_t>(_instructionRecords.size()),
+            static_cast<uint32_t>(_valueRecords.size()),
+            static_cast<uint32_t>(_operandRecords.size()),
+            static_cast<uint32_t>(_edgeRecords.size())});
+    for (auto &record : _blockRecords)
+        encodeRecord(e, record);
+    for (auto &record : _phiRecords)
+        encodeRecord(e, record);
+    for (auto &record : _instructionRecords)
+        encodeRecord(e, record);
+    for (auto &record : _valueRecords)
+        encodeRecord(e, record);
+    for (auto &record : _operandRecords)
+        encodeRecord(e, record);
+    for (auto &record : _edgeRecords)
+        encodeRecord(e, record);
+}
+
+void writeBinaryIr(std::vector<uint8_t> &out, const std::vector<Function *> &fns) {
+    BinaryIrWriter{out}.run(fns);
+}
+
+//---------------------------------------------------------------------------------------
+// Reader.
+//---------------------------------------------------------------------------------------
+
+struct BinaryIrReader {
+    BinaryIrReader(std::span<const uint8_t> data)
+    : _data{data} { }
+
+    std::vector<std::unique_ptr<Function>> run();
+
+private:
+    // Returns a pointer to n records of type R and advances the cursor.
+    // The buffer need not be aligned, hence records are always accessed through memcpy().
+    template<typename R>
+    const uint8_t *_consume(size_t n) {
+        if (n > (_data.size() - _offset) / sizeof(R))
+            malformed("unexpected end of data");
+        auto p = _data.data() + _offset;
+        _offset += n * sizeof(R);
+        return p;
+    }
+
+    template<typename R>
+    static R _recordAt(const uint8_t *array, size_t index) {
+        R record;
+        memcpy(&record, array + index * sizeof(R), sizeof(R));
+        return record;
+    }
+
+    std::string _stringAt(uint32_t offset) {
+        if (offset >= _strings.size())
+            malformed("string offset out of range");
+        return std::string{_strings.data() + offset};
+    }
+
+    Value *_valueAt(uint32_t ref) {
+        if (!ref)
+            return nullptr;
+        if (ref > _values.size())
+            malformed("value index out of range");
+        return _values[ref - 1];
+    }
+
+    std::unique_ptr<Function> _readFunction();
+
+    std::span<const uint8_t> _data;
+    size_t _offset = 0;
+    std::span<const char> _strings;
+    std::vector<Value *> _values;
+};
+
+std::vector<std::unique_ptr<Function>> BinaryIrReader::run() {
+    auto header = _recordAt<FileHeader>(_consume<FileHeader>(1), 0);
+    if (header.magic != fileMagic)
+        malformed("bad magic");
+    if (header.version != binaryIrVersion)
+        malformed("unsupported version");
+
+    auto strings = _consume<char>(header.stringTableSize);
+    _strings = {reinterpret_cast<const char *>(strings), header.stringTableSize};
+    // Makes sure that all strings are terminated.
+    if (!_strings.empty() && _strings.back())
+        malformed("string table is not terminated");
+
+    std::vector<std::unique_ptr<Function>> fns;
+    for (uint32_t i = 0; i < header.numFunctions; i++)
+        fns.push_back(_readFunction());
+    if (_offset != _data.size())
+        malformed("trailing data");
+    return fns;
+}
+
+std::unique_ptr<Function> BinaryIrReader::_readFunction() {
+    auto header = _recordAt<FunctionHeader>(_consume<FunctionHeader>(1), 0);
+    auto blockRecords = _consume<BlockRecord>(header.numBlocks);
+    auto phiRecords = _consume<PhiRecord>(header.numPhis);
+    auto instructionRecords = _consume<InstructionRecord>(header.numInstructions);
+    auto valueRecords = _consume<ValueRecord>(header.numValues);
+    auto operandRecords = _consume<OperandRecord>(header.numOperands);
+    auto edgeRecords = _consume<EdgeRecord>(header.numEdges);
+
+    auto fn = std::make_unique<Function>();
+    fn->name = _stringAt(header.name);
+
+    auto operandAt = [&] (uint32_t index) {
+        return _valueAt(_recordAt<OperandRecord>(operandRecords, index).value);
+    };
+    auto checkOperands = [&] (uint32_t first, uint32_t count) {
+        if (first > header.numOperands || count > header.numOperands - first)
+            malformed("operand range out of bounds");
+    };
+
+    // All Values are created up front as uses can precede definitions.
+    _values.clear();
+    _values.reserve(header.numValues);
+    for (uint32_t k = 0; k < header.numValues; k++) {
+        Type *type;
+        switch (_recordAt<ValueRecord>(valueRecords, k).typeKind) {
+        case type_kinds::pointer: type = globalPointerType(); break;
+        case type_kinds::int32: type = globalInt32Type(); break;
+        case type_kinds::int64: type = globalInt64Type(); break;
+        default:
+            malformed("unknown type");
+        }
+        auto value = fn->create<LocalValue>();
+        value->setType(type);
+        _values.push_back(value);
+    }
+    uint32_t nextValue = 0;
+    auto defineNext = [&] (ValueOrigin &origin) {
+        if (nextValue >= header.numValues)
+            malformed("too few values");
+        origin.set(_values[nextValue++]);
+    };
+
+    std::vector<BasicBlock *> blocks;
+    blocks.reserve(header.numBlocks);
+    for (uint32_t b = 0; b < header.numBlocks; b++)
+        blocks.push_back(fn->addNewBlock());
+    auto blockAt = [&] (uint32_t index) {
+        if (index >= header.numBlocks)
+            malformed("block index out of range");
+        return blocks[index];
+    };
+
+    std::vector<DataFlowPhi *> sinks(header.numPhis, nullptr);
+    uint32_t nextPhi = 0;
+    uint32_t nextInstruction = 0;
+    for (uint32_t b = 0; b < header.numBlocks; b++) {
+        auto record = _recordAt<BlockRecord>(blockRecords, b);
+        auto bb = blocks[b];
+
+        if (record.numPhis > header.numPhis - nextPhi)
+            malformed("too few phis");
+        for (uint32_t i = 0; i < record.numPhis; i++, nextPhi++) {
+            PhiNode *phi;
+            switch (_recordAt<PhiRecord>(phiRecords, nextPhi).phiKind) {
+            case phi_kinds::argument:
+                phi = bb->attachNewPhi<ArgumentPhi>();
+                break;
+            case phi_kinds::dataFlow: {
+                auto dataFlowPhi = bb->attachNewPhi<DataFlowPhi>();
+                sinks[nextPhi] = dataFlowPhi;
+                phi = dataFlowPhi;
+                break;
+            }
+            default:
+                malformed("unknown phi kind");
+            }
+            defineNext(phi->value);
+        }
+
+        if (record.numInstructions > header.numInstructions - nextInstruction)
+            malformed("too few instructions");
+        for (uint32_t i = 0; i < record.numInstructions; i++, nextInstruction++) {
+            auto inst = _recordAt<InstructionRecord>(instructionRecords, nextInstruction);
+            checkOperands(inst.firstOperand, inst.numOperands);
+            auto immediate = uint64_t{inst.immediate[0]}
+                    | (uint64_t{inst.immediate[1]} << 32);
+            auto expect = [&] (uint32_t numOperands) {
+                if (inst.numOperands != numOperands || inst.numResults != 1)
+                    malformed("wrong number of operands or results");
+            };
+
+            switch (inst.kind) {
+            case instruction_kinds::loadConst: {
+                expect(0);
+                auto loadConst = bb->insertNewInstruction<LoadConstInstruction>(immediate);
+                defineNext(loadConst->result);
+                break;
+            }
+            case instruction_kinds::loadOffset: {
+                expect(1);
+                auto loadOffset = bb->insertNewInstruction<LoadOffsetInstruction>(
+                        operandAt(inst.firstOperand), static_cast<int64_t>(immediate));
+                defineNext(loadOffset->result);
+                break;
+            }
+            case instruction_kinds::unaryMath: {
+                expect(1);
+                if (inst.aux != static_cast<uint32_t>(UnaryMathOpcode::negate))
+                    malformed("unknown opcode");
+                auto unaryMath = bb->insertNewInstruction<UnaryMathInstruction>(
+                        UnaryMathOpcode::negate, operandAt(inst.firstOperand));
+                defineNext(unaryMath->result);
+                break;
+            }
+            case instruction_kinds::binaryMath: {
+                expect(2);
+                auto opcode = static_cast<BinaryMathOpcode>(inst.aux);
+                if (opcode != BinaryMathOpcode::add && opcode != BinaryMathOpcode::bitwiseAnd)
+                    malformed("unknown opcode");
+                auto binaryMath = bb->insertNewInstruction<BinaryMathInstruction>(opcode,
+                        operandAt(inst.firstOperand), operandAt(inst.firstOperand + 1));
+                defineNext(binaryMath->result);
+                break;
+            }
+            case instruction_kinds::invoke: {
+                if (inst.numResults > header.numValues - nextValue)
+                    malformed("too few values");
+                auto invoke = bb->insertNewInstruction<InvokeInstruction>(
+                        _stringAt(inst.aux), inst.numOperands, inst.numResults);
+                for (uint32_t k = 0; k < inst.numOperands; k++)
+                    invoke->operand(k) = operandAt(inst.firstOperand + k);
+                for (uint32_t k = 0; k < inst.numResults; k++)
+                    defineNext(invoke->result(k));
+                break;
+            }
+            default:
+                malformed("unknown instruction kind");
+            }
+        }
+
+        checkOperands(record.firstOperand, record.numOperands);
+        switch (record.branchKind) {
+        case branch_kinds::functionReturn: {
+            auto functionReturn = bb->setNewBranch<FunctionReturnBranch>(record.numOperands);
+            for (uint32_t k = 0; k < record.numOperands; k++)
+                functionReturn->operand(k) = operandAt(record.firstOperand + k);
+            break;
+        }
+        case branch_kinds::unconditional: {
+            if (record.numOperands)
+                malformed("wrong number of branch operands");
+            bb->setNewBranch<UnconditionalBranch>(blockAt(record.targets[0]));
+            break;
+        }
+        case branch_kinds::conditional: {
+            if (record.numOperands != 1)
+                malformed("wrong number of branch operands");
+            auto conditional = bb->setNewBranch<ConditionalBranch>(
+                    blockAt(record.targets[0]), blockAt(record.targets[1]));
+            conditional->operand = operandAt(record.firstOperand);
+            break;
+        }
+        default:
+            malformed("unknown branch kind");
+        }
+    }
+    if (nextPhi != header.numPhis || nextInstruction != header.numInstructions
+            || nextValue != header.numValues)
+        malformed("unused records");
+
+    for (uint32_t i = 0; i < header.numEdges; i++) {
+        auto record = _recordAt<EdgeRecord>(edgeRecords, i);
+        auto source = blockAt(record.sourceBlock);
+        if (record.sinkPhi >= header.numPhis || !sinks[record.sinkPhi])
+            malformed("edge does not point to a DataFlowPhi");
+        auto edge = DataFlowEdge::attach(fn->create<DataFlowEdge>(),
+                source->source, sinks[record.sinkPhi]->sink);
+        edge->alias = _valueAt(record.alias);
+    }
+
+    return fn;
+}
+
+std::vector<std::unique_ptr<Function>> readBinaryIr(std::span<const uint8_t> data) {
+    return BinaryIrReader{data}.run();
+}
+
+} // namespace lewis
@@ -0,0 +1,373 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <unistd.h>
+#include <lewis/driver/code-cache.hpp>
+#include <lewis/util/byte-encode.hpp>
+
+namespace lewis::driver {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Identifies files of the on-disk cache. The version must be bumped whenever
+    // the encoding changes. Changes of the generated code are covered by the hashes,
+    // which include targets::x86_64::codegenVersion (see PassManager).
+    constexpr uint32_t fileMagic = 0x4343574C; // "LWCC"
+    constexpr uint32_t fileVersion = 1;
+
+    // Makes the names of temporary files unique within the process.
+    std::atomic<uint64_t> tempCounter{0};
+
+    // Approximate memory footprint of an entry; used to enforce the capacity.
+    size_t chargeOf(const CachedCode &code) {
+        size_t charge = sizeof(CachedCode) + code.text.size();
+        for (auto &relocation : code.relocations)
+            charge += sizeof(CachedCode::Relocation) + relocation.symbol.size();
+        for (auto &symbol : code.symbols)
+            charge += sizeof(CachedCode::Symbol) + symbol.suffix.size();
+        return charge;
+    }
+
+    void encodeString(util::ByteEncoder &e, const std::string &s) {
+        encode32(e, s.size());
+        encodeBytes(e, {reinterpret_cast<const uint8_t *>(s.data()), s.size()});
+    }
+
+    std::vector<uint8_t> encodeFile(const CachedCode &code) {
+        std::vector<uint8_t> out;
+        {
+            util::ByteEncoder e{&out};
+            encode32(e, fileMagic);
+            encode32(e, fileVersion);
+            encode64(e, code.text.size());
+            encodeBytes(e, code.text);
+            encode32(e, code.relocations.size());
+            for (auto &relocation : code.relocations) {
+                encode32(e, relocation.type);
+                encode64(e, relocation.offset);
+                encode64(e, relocation.addend);
+                encodeString(e, relocation.symbol);
+            }
+            encode32(e, code.symbols.size());
+            for (auto &symbol : code.symbols) {
+                encode64(e, symbol.offset);
+                encode64(e, symbol.size);
+                encodeString(e, symbol.suffix);
+            }
+        }
+        return out;
+    }
+
+    // Bounds-checked reader for the format of encodeFile().
+    struct FileDecoder {
+        FileDecoder(const std::vector<uint8_t> &in)
+        : _p{in.data()}, _limit{in.data() + in.size()} { }
+
+        bool ok() {
+            return _ok;
+        }
+
+        bool atEnd() {
+            return _p == _limit;
+        }
+
+        uint64_t read(size_t n) {
+            if (static_cast<size_t>(_limit - _p) < n) {
+                _ok = false;
+                return 0;
+            }
+            uint64_t v = 0;
+            memcpy(&v, _p, n); // The format is little endian, as is x86_64.
+            _p += n;
+            return v;
+        }
+
+        void readBytes(void *out, size_t n) {
+            if (static_cast<size_t>(_limit - _p) < n) {
+                _ok = false;
+                return;
+            }
+            memcpy(out, _p, n);
+            _p += n;
+        }
+
+        std::string readString() {
+            std::string s(read(4), '\0');
+            readBytes(s.data(), s.size());
+            return s;
+        }
+
+        // Checks that count elements of at least n bytes each can follow.
+        bool canRead(uint64_t count, size_t n) {
+            if (count > static_cast<size_t>(_limit - _p) / n)
+                _ok = false;
+            return _ok;
+        }
+
+    private:
+        const uint8_t *_p;
+        const uint8_t *_limit;
+        bool _ok = true;
+    };
+
+    std::optional<CachedCode> decodeFile(const std::vector<uint8_t> &in) {
+        FileDecoder d{in};
+        if (d.read(4) != fileMagic || d.read(4) != fileVersion)
+            return std::nullopt;
+
+        CachedCode code;
+        auto textSize = d.read(8);
+        if (!d.canRead(textSize, 1))
+            return std::nullopt;
+        code.text.resize(textSize);
+        d.readBytes(code.text.data(), textSize);
+
+        auto numRelocations = d.read(4);
+        if (!d.canRead(numRelocations, 24))
+            return std::nullopt;
+        for (uint64_t i = 0; i < numRelocations && d.ok(); i++) {
+            CachedCode::Relocation relocation;
+            relocation.type = d.read(4);
+            relocation.offset = d.read(8);
+            relocation.addend = d.read(8);
+            relocation.symbol = d.readString();
+            code.relocations.push_back(std::move(relocation));
+        }
+
+        auto numSymbols = d.read(4);
+        if (!d.canRead(numSymbols, 20))
+            return std::nullopt;
+        for (uint64_t i = 0; i < numSymbols && d.ok(); i++) {
+            CachedCode::Symbol symbol;
+            symbol.offset = d.read(8);
+            symbol.size = d.read(8);
+            symbol.suffix = d.readString();
+            code.symbols.push_back(std::move(symbol));
+        }
+
+        if (!d.ok() || !d.atEnd())
+            return std::nullopt;
+        for (auto &relocation : code.relocations) {
+            if (relocation.offset + 4 > code.text.size())
+                return std::nullopt;
+        }
+        return code;
+    }
+};
+
+CachedCode CachedCode::capture(elf::Object *elf, elf::ByteSection *textSection,
+        const std::string &name, size_t relocationsBefore, size_t symbolsBefore) {
+    auto fnSymbol = elf->internSymbol(name);
+    assert(fnSymbol->section == textSection);
+    auto entry = fnSymbol->value;
+
+    CachedCode code;
+    auto begin = textSection->buffer.begin() + entry;
+    code.text.assign(begin, begin + fnSymbol->size);
+
+    size_t k = 0;
+    for (auto relocation : elf->internalRelocations()) {
+        if (k++ < relocationsBefore)
+            continue;
+        assert(relocation->section == textSection);
+        assert(relocation->symbol && relocation->symbol->name);
+        assert(relocation->addend.has_value());
+        code.relocations.push_back({relocation->type, relocation->offset - entry,
+                relocation->symbol->name->buffer, relocation->addend.value()});
+    }
+
+    k = 0;
+    for (auto symbol : elf->symbols()) {
+        if (k++ < symbolsBefore)
+            continue;
+        if (symbol == fnSymbol || symbol->section != textSection)
+            continue;
+        assert(symbol->name && symbol->name->buffer.starts_with(name));
+        code.symbols.push_back({symbol->name->buffer.substr(name.size()),
+                symbol->value - entry, symbol->size});
+    }
+    return code;
+}
+
+void CachedCode::emit(elf::Object *elf, elf::ByteSection *textSection,
+        const std::string &name) const {
+    util::ByteEncoder out{&textSection->buffer};
+    // Pad with INT3, in the same way as MachineCodeEmitter.
+    while (out.offset() & (textSection->alignment - 1))
+        encode8(out, 0xCC);
+    auto entry = out.offset();
+    encodeBytes(out, text);
+
+    auto fnSymbol = elf->internSymbol(name);
+    assert(!fnSymbol->section && "Function is already defined in this object");
+    fnSymbol->section = textSection;
+    fnSymbol->value = entry;
+    fnSymbol->size = text.size();
+
+    for (auto &cached : symbols) {
+        auto symbol = elf->addSymbol(std::make_unique<elf::Symbol>());
+        symbol->name = elf->addString(std::make_unique<elf::String>(name + cached.suffix));
+        symbol->section = textSection;
+        symbol->value = entry + cached.offset;
+        symbol->size = cached.size;
+    }
+
+    for (auto &cached : relocations) {
+        auto relocation = elf->addInternalRelocation(std::make_unique<elf::Relocation>());
+        relocation->type = cached.type;
+        relocation->section = textSection;
+        relocation->offset = entry + cached.offset;
+        relocation->symbol = elf->internSymbol(cached.symbol);
+        relocation->addend = cached.addend;
+    }
+}
+
+struct CodeCacheImpl : CodeCache {
+    CodeCacheImpl(size_t capacity, std::string directory)
+    : _capacity{capacity}, _directory{std::move(directory)} { }
+
+    std::shared_ptr<const CachedCode> lookup(const FunctionHash &hash) override;
+
+    void insert(const FunctionHash &hash, CachedCode code) override;
+
+    CodeCacheStats stats() override {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _stats;
+    }
+
+private:
+    struct Entry {
+        FunctionHash hash;
+        std::shared_ptr<const CachedCode> code;
+        size_t charge;
+    };
+
+    std::string _pathOf(const FunctionHash &hash) {
+        return _directory + "/" + hash.toString() + ".lcc";
+    }
+
+    std::shared_ptr<const CachedCode> _loadFile(const FunctionHash &hash);
+    void _storeFile(const FunctionHash &hash, const CachedCode &code);
+
+    // Inserts a new entry at the front of the LRU list and evicts old entries.
+    void _insertEntry(const FunctionHash &hash, std::shared_ptr<const CachedCode> code);
+
+    size_t _capacity;
+    std::string _directory;
+
+    std::mutex _mutex;
+    // Most recently used entries come first.
+    std::list<Entry> _lru;
+    std::unordered_map<FunctionHash, std::list<Entry>::iterator, HashFunctionHash> _map;
+    size_t _totalCharge = 0;
+    CodeCacheStats _stats;
+};
+
+std::shared_ptr<const CachedCode> CodeCacheImpl::lookup(const FunctionHash &hash) {
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto it = _map.find(hash);
+    if (it != _map.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        _stats.hits++;
+        return it->second->code;
+    }
+
+    if (!_directory.empty()) {
+        if (auto code = _loadFile(hash); code) {
+            _stats.hits++;
+            _stats.diskHits++;
+            _insertEntry(hash, code);
+            return code;
+        }
+    }
+
+    _stats.misses++;
+    return nullptr;
+}
+
+void CodeCacheImpl::insert(const FunctionHash &hash, CachedCode code) {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!_directory.empty())
+        _storeFile(hash, code);
+
+    if (auto it = _map.find(hash); it != _map.end()) {
+        _totalCharge -= it->second->charge;
+        _lru.erase(it->second);
+        _map.erase(it);
+    }
+    _insertEntry(hash, std::make_shared<const CachedCode>(std::move(code)));
+}
+
+void CodeCacheImpl::_insertEntry(const FunctionHash &hash,
+        std::shared_ptr<const CachedCode> code) {
+    auto charge = chargeOf(*code);
+    _lru.push_front({hash, std::move(code), charge});
+    _map.insert({hash, _lru.begin()});
+    _totalCharge += charge;
+
+    // Always keep the new entry, even if it exceeds the capacity on its own.
+    while (_totalCharge > _capacity && _lru.size() > 1) {
+        auto &victim = _lru.back();
+        _totalCharge -= victim.charge;
+        _map.erase(victim.hash);
+        _lru.pop_back();
+        _stats.evictions++;
+    }
+}
+
+std::shared_ptr<const CachedCode> CodeCacheImpl::_loadFile(const FunctionHash &hash) {
+    auto stream = fopen(_pathOf(hash).c_str(), "rb");
+    if (!stream)
+        return nullptr;
+
+    std::vector<uint8_t> in;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), stream)))
+        in.insert(in.end(), chunk, chunk + n);
+    fclose(stream);
+
+    auto code = decodeFile(in);
+    if (!code) {
+        if (verbose)
+            std::cout << "lewis: Ignoring malformed cache file " << _pathOf(hash) << std::endl;
+        return nullptr;
+    }
+    return std::make_shared<const CachedCode>(std::move(*code));
+}
+
+void CodeCacheImpl::_storeFile(const FunctionHash &hash, const CachedCode &code) {
+    // Write to a temporary file first such that concurrent readers (possibly in other
+    // processes) never observe partial files. The on-disk cache is best-effort:
+    // failures only cause later misses.
+    auto path = _pathOf(hash);
+    auto tempPath = path + ".tmp" + std::to_string(getpid())
+            + "." + std::to_string(tempCounter++);
+    auto stream = fopen(tempPath.c_str(), "wb");
+    if (!stream)
+        return;
+    auto out = encodeFile(code);
+    auto written = fwrite(out.data(), 1, out.size(), stream);
+    if (fclose(stream) || written != out.size()) {
+        remove(tempPath.c_str());
+        return;
+    }
+    if (rename(tempPath.c_str(), path.c_str()))
+        remove(tempPath.c_str());
+}
+
+std::unique_ptr<CodeCache> CodeCache::create(size_t capacity, std::string directory) {
+    return std::make_unique<CodeCacheImpl>(capacity, std::move(directory));
+}
+
+} // namespace lewis::driver
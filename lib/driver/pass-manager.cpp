@@ -0,0 +1,382 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <lewis/driver/pass-manager.hpp>
+#include <lewis/elf/file-emitter.hpp>
+#include <lewis/function-hash.hpp>
+#include <lewis/passes.hpp>
+#include <lewis/target-x86_64/arch-passes.hpp>
+#include <lewis/target-x86_64/mc-emitter.hpp>
+
+namespace lewis::driver {
+
+namespace {
+    constexpr bool verbose = false;
+
+    size_t countInstructions(Function *fn) {
+        size_t n = 0;
+        for (auto bb : fn->blocks())
+            n += bb->indexOfInstruction(nullptr);
+        return n;
+    }
+
+    void appendJsonString(std::string &out, const std::string &s) {
+        out += '"';
+        for (auto c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+};
+
+struct PassManagerImpl : PassManager {
+    PassManagerImpl(elf::Object *elf, elf::HashStyle hashStyle)
+    : _elf{elf}, _hashStyle{hashStyle} { }
+
+    void setCallback(PassCallback callback) override {
+        _callback = std::move(callback);
+    }
+
+    void setOptimization(bool enable) override {
+        _optimize = enable;
+    }
+
+    void setCodeCache(CodeCache *cache) override {
+        _cache = cache;
+    }
+
+    void setInstrumentation(bool enable) override {
+        _instrument = enable;
+    }
+
+    void setProfile(const BlockProfile *profile) override {
+        _profile = profile;
+    }
+
+    void setAllocationTier(targets::x86_64::AllocationTier tier) override {
+        _allocationTier = tier;
+    }
+
+    void compileFunction(Function *fn) override;
+    void compileFunctions(const std::vector<Function *> &fns, ThreadPool *pool) override;
+    void linkObject() override;
+    void emitFile() override;
+    void emitFile(elf::FileSink *sink) override;
+
+    const std::vector<PassReport> &reports() override {
+        return _reports;
+    }
+
+    std::string reportsToJson() override;
+
+private:
+    // Runs f() and records its wall time. Returns the new report; its sizes and counters
+    // are filled in by the caller before the report is finished by _finish().
+    template<typename F>
+    PassReport _time(std::string pass, std::string function, size_t sizeBefore, F f) {
+        PassReport report;
+        report.pass = std::move(pass);
+        report.function = std::move(function);
+        report.sizeBefore = sizeBefore;
+        auto start = std::chrono::steady_clock::now();
+        f();
+        report.wallTime = std::chrono::steady_clock::now() - start;
+        return report;
+    }
+
+    // Runs the passes that only touch the Function itself. This is safe to call
+    // concurrently on different Functions; reports are returned instead of being finished.
+    std::vector<PassReport> _lowerAndAllocate(Function *fn);
+    // Also adds the code to the cache if hash is given.
+    void _emitMachineCode(Function *fn, const std::optional<FunctionHash> &hash);
+
+    // Distinguishes cached code that was compiled with different settings
+    // or by a different version of the backend.
+    uint64_t _cacheSeed() {
+        uint64_t seed = static_cast<uint64_t>(targets::x86_64::codegenVersion) << 32;
+        if (_optimize)
+            seed |= 1;
+        if (_allocationTier == targets::x86_64::AllocationTier::baseline)
+            seed |= 2;
+        return seed;
+    }
+
+    void _finish(PassReport report);
+
+    elf::Object *_elf;
+    elf::HashStyle _hashStyle;
+    PassCallback _callback;
+    bool _optimize = true;
+    CodeCache *_cache = nullptr;
+    bool _instrument = false;
+    const BlockProfile *_profile = nullptr;
+    targets::x86_64::AllocationTier _allocationTier = targets::x86_64::AllocationTier::optimizing;
+    elf::ByteSection *_textSection = nullptr;
+    elf::ByteSection *_counterSection = nullptr;
+    bool _linked = false;
+    std::vector<PassReport> _reports;
+};
+
+void PassManagerImpl::compileFunction(Function *fn) {
+    compileFunctions({fn}, nullptr);
+}
+
+void PassManagerImpl::compileFunctions(const std::vector<Function *> &fns, ThreadPool *pool) {
+    if (_linked)
+        throw std::logic_error("Functions cannot be compiled after the Object is linked");
+
+    // Look up all Functions first (the IR is modified by the passes).
+    // The cache does not know about counters and profiles, hence it is bypassed if either is used.
+    bool useCache = _cache && !_instrument && !_profile;
+    std::vector<std::optional<FunctionHash>> hashes(fns.size());
+    std::vector<std::shared_ptr<const CachedCode>> cached(fns.size());
+    std::vector<PassReport> cacheReports(fns.size());
+    if (useCache) {
+        for (size_t i = 0; i < fns.size(); ++i) {
+            cacheReports[i] = _time("code-cache", fns[i]->name, countInstructions(fns[i]), [&] {
+                hashes[i] = hashFunction(fns[i], _cacheSeed());
+                cached[i] = _cache->lookup(*hashes[i]);
+            });
+        }
+    }
+
+    std::vector<std::vector<PassReport>> reports(fns.size());
+    auto task = [&] (size_t i) {
+        if (!cached[i])
+            reports[i] = _lowerAndAllocate(fns[i]);
+    };
+    if (pool) {
+        pool->run(fns.size(), task);
+    } else {
+        for (size_t i = 0; i < fns.size(); ++i)
+            task(i);
+    }
+
+    for (size_t i = 0; i < fns.size(); ++i) {
+        if (useCache) {
+            auto &report = cacheReports[i];
+            report.sizeAfter = report.sizeBefore;
+            report.counters = {
+                {"hits", cached[i] ? 1 : 0},
+                {"bytes", cached[i] ? static_cast<int64_t>(cached[i]->text.size()) : 0}
+            };
+            _finish(std::move(report));
+        }
+
+        if (cached[i]) {
+            if (!_textSection)
+                _textSection = targets::x86_64::MachineCodeEmitter::createTextSection(_elf);
+            cached[i]->emit(_elf, _textSection, fns[i]->name);
+            continue;
+        }
+
+        for (auto &report : reports[i])
+            _finish(std::move(report));
+        _emitMachineCode(fns[i], hashes[i]);
+    }
+}
+
+std::vector<PassReport> PassManagerImpl::_lowerAndAllocate(Function *fn) {
+    std::vector<PassReport> reports;
+
+    auto runFunctionPass = [&] (std::string pass, auto create) {
+        auto report = _time(std::move(pass), fn->name, countInstructions(fn), [&] {
+            create(fn)->run();
+        });
+        report.sizeAfter = countInstructions(fn);
+        reports.push_back(std::move(report));
+    };
+
+    runFunctionPass("insert-data-flow-phis", InsertDataFlowPhisPass::create);
+    if (_optimize) {
+        runFunctionPass("fold-constants", FoldConstantsPass::create);
+        runFunctionPass("number-local-values", NumberLocalValuesPass::create);
+        runFunctionPass("eliminate-dead-code", EliminateDeadCodePass::create);
+    }
+
+    auto lowerReport = _time("lower-code", fn->name, countInstructions(fn), [&] {
+        for (auto bb : fn->blocks())
+            targets::x86_64::LowerCodePass::create(bb)->run();
+    });
+    lowerReport.sizeAfter = countInstructions(fn);
+    reports.push_back(std::move(lowerReport));
+
+    std::unique_ptr<targets::x86_64::AllocateRegistersPass> ra;
+    auto raReport = _time("allocate-registers", fn->name, countInstructions(fn), [&] {
+        ra = targets::x86_64::AllocateRegistersPass::create(fn, {_allocationTier, _profile});
+        ra->run();
+    });
+    auto stats = ra->stats();
+    raReport.sizeAfter = countInstructions(fn);
+    raReport.counters = {
+        {"cost", stats.achievedCost},
+        {"register-moves", stats.numRegisterMoves},
+        {"fused-moves", stats.numFusedMoves},
+        {"spilled-compounds", stats.numSpilledCompounds},
+        {"spill-moves", stats.numSpillMoves}
+    };
+    reports.push_back(std::move(raReport));
+    return reports;
+}
+
+void PassManagerImpl::_emitMachineCode(Function *fn, const std::optional<FunctionHash> &hash) {
+    if (!_textSection)
+        _textSection = targets::x86_64::MachineCodeEmitter::createTextSection(_elf);
+    auto bytesBefore = _textSection->buffer.size();
+    auto relocationsBefore = _elf->internalRelocations().size();
+    auto symbolsBefore = _elf->symbols().size();
+    if (_instrument && !_counterSection)
+        _counterSection = targets::x86_64::MachineCodeEmitter::createCounterSection(_elf);
+    auto emitReport = _time("emit-machine-code", fn->name, countInstructions(fn), [&] {
+        targets::x86_64::MachineCodeEmitter mce{fn, _elf, _textSection};
+        if (_instrument)
+            mce.setCounterSection(_counterSection);
+        mce.setProfile(_profile);
+        mce.run();
+    });
+    emitReport.sizeAfter = emitReport.sizeBefore;
+    emitReport.counters = {
+        {"bytes", static_cast<int64_t>(_textSection->buffer.size() - bytesBefore)},
+        {"relocations", static_cast<int64_t>(_elf->internalRelocations().size()
+                - relocationsBefore)}
+    };
+    _finish(std::move(emitReport));
+
+    if (_cache && hash)
+        _cache->insert(*hash, CachedCode::capture(_elf, _textSection, fn->name,
+                relocationsBefore, symbolsBefore));
+}
+
+void PassManagerImpl::linkObject() {
+    if (_linked)
+        return;
+    _linked = true;
+
+    auto relocationsBefore = _elf->relocations().size();
+    auto pltReport = _time("create-plt", {}, _elf->numberOfFragments(), [&] {
+        elf::CreatePltPass::create(_elf)->run();
+    });
+    pltReport.sizeAfter = _elf->numberOfFragments();
+    pltReport.counters = {
+        {"plt-entries", static_cast<int64_t>(_elf->relocations().size() - relocationsBefore)}
+    };
+    _finish(std::move(pltReport));
+
+    auto headersReport = _time("create-headers", {}, _elf->numberOfFragments(), [&] {
+        elf::CreateHeadersPass::create(_elf, _hashStyle)->run();
+    });
+    headersReport.sizeAfter = _elf->numberOfFragments();
+    headersReport.counters = {
+        {"symbols", static_cast<int64_t>(_elf->symbols().size())}
+    };
+    _finish(std::move(headersReport));
+
+    auto layoutReport = _time("layout", {}, _elf->numberOfFragments(), [&] {
+        elf::LayoutPass::create(_elf)->run();
+    });
+    size_t fileSize = 0;
+    for (auto fragment : _elf->fragments())
+        fileSize = std::max(fileSize,
+                fragment->fileOffset.value() + fragment->computedSize.value());
+    layoutReport.sizeAfter = _elf->numberOfFragments();
+    layoutReport.counters = {
+        {"segments", static_cast<int64_t>(_elf->segments.size())},
+        {"file-bytes", static_cast<int64_t>(fileSize)}
+    };
+    _finish(std::move(layoutReport));
+
+    auto linkReport = _time("internal-link", {}, _elf->numberOfFragments(), [&] {
+        elf::InternalLinkPass::create(_elf)->run();
+    });
+    linkReport.sizeAfter = _elf->numberOfFragments();
+    linkReport.counters = {
+        {"relocations", static_cast<int64_t>(_elf->internalRelocations().size())}
+    };
+    _finish(std::move(linkReport));
+}
+
+void PassManagerImpl::emitFile() {
+    linkObject();
+
+    auto emitReport = _time("emit-file", {}, _elf->numberOfFragments(), [&] {
+        auto fe = elf::FileEmitter::create(_elf);
+        fe->run();
+        buffer = std::move(fe->buffer);
+    });
+    emitReport.sizeAfter = emitReport.sizeBefore;
+    emitReport.counters = {
+        {"bytes", static_cast<int64_t>(buffer.size())}
+    };
+    _finish(std::move(emitReport));
+}
+
+void PassManagerImpl::emitFile(elf::FileSink *sink) {
+    linkObject();
+
+    auto emitReport = _time("emit-file", {}, _elf->numberOfFragments(), [&] {
+        elf::FileEmitter::create(_elf, sink)->run();
+    });
+    emitReport.sizeAfter = emitReport.sizeBefore;
+    emitReport.counters = {
+        {"bytes", static_cast<int64_t>(elf::FileEmitter::computeFileSize(_elf))}
+    };
+    _finish(std::move(emitReport));
+}
+
+void PassManagerImpl::_finish(PassReport report) {
+    if (verbose)
+        std::cout << "lewis: Pass " << report.pass << " took "
+                << report.wallTime.count() << " ns" << std::endl;
+    _reports.push_back(std::move(report));
+    if (_callback)
+        _callback(_reports.back());
+}
+
+std::string PassManagerImpl::reportsToJson() {
+    std::string out = "{\"passes\":[";
+    for (size_t i = 0; i < _reports.size(); ++i) {
+        auto &report = _reports[i];
+        if (i)
+            out += ',';
+        out += "{\"pass\":";
+        appendJsonString(out, report.pass);
+        if (!report.function.empty()) {
+            out += ",\"function\":";
+            appendJsonString(out, report.function);
+        }
+        out += ",\"wallNs\":" + std::to_string(report.wallTime.count());
+        out += ",\"sizeBefore\":" + std::to_string(report.sizeBefore);
+        out += ",\"sizeAfter\":" + std::to_string(report.sizeAfter);
+        out += ",\"counters\":{";
+        for (size_t j = 0; j < report.counters.size(); ++j) {
+            if (j)
+                out += ',';
+            appendJsonString(out, report.counters[j].first);
+            out += ':' + std::to_string(report.counters[j].second);
+        }
+        out += "}}";
+    }
+    out += "]}";
+    return out;
+}
+
+std::unique_ptr<PassManager> PassManager::create(elf::Object *elf, elf::HashStyle hashStyle) {
+    return std::make_unique<PassManagerImpl>(elf, hashStyle);
+}
+
+} // namespace lewis::driver
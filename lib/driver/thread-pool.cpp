@@ -0,0 +1,167 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <lewis/driver/thread-pool.hpp>
+
+namespace lewis::driver {
+
+struct ThreadPoolImpl : ThreadPool {
+    ThreadPoolImpl(unsigned int numThreads);
+
+    ThreadPoolImpl(const ThreadPoolImpl &) = delete;
+
+    ~ThreadPoolImpl() override;
+
+    ThreadPoolImpl &operator= (const ThreadPoolImpl &) = delete;
+
+    unsigned int numThreads() override {
+        return _workers.size();
+    }
+
+    void run(size_t numTasks, const std::function<void(size_t)> &task) override;
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        // Indices of tasks. The owner pops from the back, thieves steal from the front.
+        std::deque<size_t> queue;
+    };
+
+    void _work(size_t self);
+    bool _popTask(size_t self, size_t &index);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    // Protects all of the following members.
+    std::mutex _mutex;
+    // Signaled when a new batch starts or when the pool shuts down.
+    std::condition_variable _batchStarted;
+    // Signaled when the last worker finishes the current batch.
+    std::condition_variable _batchFinished;
+    const std::function<void(size_t)> *_task = nullptr;
+    std::vector<std::exception_ptr> *_exceptions = nullptr;
+    uint64_t _generation = 0;
+    // Number of workers that are still executing tasks of the current batch.
+    size_t _activeWorkers = 0;
+    bool _shutdown = false;
+};
+
+ThreadPoolImpl::ThreadPoolImpl(unsigned int numThreads) {
+    if (!numThreads)
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned int i = 0; i < numThreads; ++i)
+        _workers.push_back(std::make_unique<Worker>());
+    for (unsigned int i = 0; i < numThreads; ++i)
+        _workers[i]->thread = std::thread{[this, i] { _work(i); }};
+}
+
+ThreadPoolImpl::~ThreadPoolImpl() {
+    {
+        std::lock_guard lock{_mutex};
+        _shutdown = true;
+    }
+    _batchStarted.notify_all();
+    for (auto &worker : _workers)
+        worker->thread.join();
+}
+
+void ThreadPoolImpl::run(size_t numTasks, const std::function<void(size_t)> &task) {
+    if (!numTasks)
+        return;
+
+    // Distribute the tasks round-robin; work stealing balances the load later on.
+    // No worker touches the queues while no batch is active.
+    for (size_t i = 0; i < numTasks; ++i)
+        _workers[i % _workers.size()]->queue.push_back(i);
+
+    std::vector<std::exception_ptr> exceptions(numTasks);
+    {
+        std::unique_lock lock{_mutex};
+        _task = &task;
+        _exceptions = &exceptions;
+        _activeWorkers = _workers.size();
+        _generation++;
+        _batchStarted.notify_all();
+        _batchFinished.wait(lock, [&] { return !_activeWorkers; });
+        _task = nullptr;
+        _exceptions = nullptr;
+    }
+
+    for (auto &exception : exceptions) {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+}
+
+void ThreadPoolImpl::_work(size_t self) {
+    uint64_t seenGeneration = 0;
+    while (true) {
+        const std::function<void(size_t)> *task;
+        std::vector<std::exception_ptr> *exceptions;
+        {
+            std::unique_lock lock{_mutex};
+            _batchStarted.wait(lock, [&] {
+                return _shutdown || _generation != seenGeneration;
+            });
+            if (_shutdown)
+                return;
+            seenGeneration = _generation;
+            task = _task;
+            exceptions = _exceptions;
+        }
+
+        // Every task writes to a different slot of exceptions; no locking is required.
+        size_t index;
+        while (_popTask(self, index)) {
+            try {
+                (*task)(index);
+            } catch (...) {
+                (*exceptions)[index] = std::current_exception();
+            }
+        }
+
+        // All queues are empty; as tasks do not spawn new tasks, the batch is over for us.
+        std::lock_guard lock{_mutex};
+        assert(_activeWorkers);
+        if (!--_activeWorkers)
+            _batchFinished.notify_all();
+    }
+}
+
+bool ThreadPoolImpl::_popTask(size_t self, size_t &index) {
+    {
+        auto &own = *_workers[self];
+        std::lock_guard lock{own.mutex};
+        if (!own.queue.empty()) {
+            index = own.queue.back();
+            own.queue.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < _workers.size(); ++i) {
+        auto &victim = *_workers[(self + i) % _workers.size()];
+        std::lock_guard lock{victim.mutex};
+        if (!victim.queue.empty()) {
+            index = victim.queue.front();
+            victim.queue.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+std::unique_ptr<ThreadPool> ThreadPool::create(unsigned int numThreads) {
+    return std::make_unique<ThreadPoolImpl>(numThreads);
+}
+
+} // namespace lewis::driver
@@ -0,0 +1,330 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <elf.h>
+#include <lewis/binary-ir.hpp>
+#include <lewis/driver/pass-manager.hpp>
+#include <lewis/driver/tiered-compiler.hpp>
+#include <lewis/elf/passes.hpp>
+#include <lewis/jit/block-profile.hpp>
+#include <lewis/target-x86_64/mc-emitter.hpp>
+#include <lewis/util/byte-encode.hpp>
+
+namespace lewis::driver {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Suffix of the undefined symbols that the stubs jump to (through the PLT).
+    const std::string implSuffix = "@impl";
+
+    // Same as the alignment of Functions, such that stubs do not straddle cache lines.
+    constexpr size_t stubAlignment = 16;
+};
+
+struct TieredCompilerImpl : TieredCompiler {
+    TieredCompilerImpl(jit::SymbolResolver resolver, TieringOptions options)
+    : _resolver{std::move(resolver)}, _options{options} { }
+
+    TieredCompilerImpl(const TieredCompilerImpl &) = delete;
+
+    ~TieredCompilerImpl() override;
+
+    TieredCompilerImpl &operator= (const TieredCompilerImpl &) = delete;
+
+    // Separate from the constructor such that the thread only sees fully constructed members.
+    void initialize();
+
+    void addFunctions(const std::vector<Function *> &fns) override;
+    void *lookup(const std::string &name) override;
+    bool isOptimized(const std::string &name) override;
+
+private:
+    struct TieredFunction {
+        std::string name;
+        // Serialized generic IR, as the IR that was passed to addFunctions() is lowered.
+        std::vector<uint8_t> ir;
+        size_t numBlocks = 0;
+        // Entry point of the stub.
+        void *entry = nullptr;
+        // GOT slot that the stub jumps through.
+        uintptr_t *slot = nullptr;
+        bool optimized = false;
+        // Set once the Function was optimized or once the optimization failed.
+        bool done = false;
+    };
+
+    struct LoadedCode {
+        std::unique_ptr<elf::Object> elf;
+        std::unique_ptr<jit::LoadedObject> object;
+    };
+
+    void _work();
+    void _optimize(TieredFunction *fn, const BlockProfile &profile);
+    // Resolves symbols of the generated code: added Functions are called through their stubs.
+    void *_resolve(const std::string &name);
+    LoadedCode _createStubs(const std::vector<TieredFunction *> &fns,
+            jit::LoadedObject *baseline);
+
+    jit::SymbolResolver _resolver;
+    TieringOptions _options;
+    std::thread _thread;
+
+    // Protects all of the following members.
+    std::mutex _mutex;
+    // Signaled when the compiler shuts down.
+    std::condition_variable _wakeup;
+    bool _shutdown = false;
+    std::vector<std::unique_ptr<TieredFunction>> _functions;
+    std::unordered_map<std::string, TieredFunction *> _functionMap;
+    // Objects that contain instrumented baseline code (i.e., block counters).
+    std::vector<jit::LoadedObject *> _baselineObjects;
+    std::vector<LoadedCode> _code;
+};
+
+void TieredCompilerImpl::initialize() {
+    _thread = std::thread{[this] { _work(); }};
+}
+
+TieredCompilerImpl::~TieredCompilerImpl() {
+    {
+        std::lock_guard lock{_mutex};
+        _shutdown = true;
+    }
+    _wakeup.notify_all();
+    if (_thread.joinable())
+        _thread.join();
+}
+
+void TieredCompilerImpl::addFunctions(const std::vector<Function *> &fns) {
+    std::vector<std::unique_ptr<TieredFunction>> batch;
+    {
+        std::lock_guard lock{_mutex};
+        for (auto fn : fns) {
+            bool duplicate = _functionMap.count(fn->name)
+                    || std::any_of(batch.begin(), batch.end(), [&] (const auto &other) {
+                return other->name == fn->name;
+            });
+            if (duplicate)
+                throw std::runtime_error("Function " + fn->name + " was already added");
+
+            auto tiered = std::make_unique<TieredFunction>();
+            tiered->name = fn->name;
+            writeBinaryIr(tiered->ir, {fn});
+            for (auto bb : fn->blocks()) {
+                (void)bb;
+                tiered->numBlocks++;
+            }
+            batch.push_back(std::move(tiered));
+        }
+    }
+
+    // The resolver takes the lock itself, hence the batch is compiled without holding it.
+    LoadedCode baseline;
+    baseline.elf = std::make_unique<elf::Object>();
+    auto pm = PassManager::create(baseline.elf.get());
+    pm->setOptimization(false);
+    pm->setAllocationTier(targets::x86_64::AllocationTier::baseline);
+    pm->setInstrumentation(true);
+    pm->compileFunctions(fns, nullptr);
+    pm->linkObject();
+    baseline.object = jit::LoadedObject::create(baseline.elf.get(),
+            [this] (const std::string &name) { return _resolve(name); });
+
+    std::vector<TieredFunction *> batchPointers;
+    for (auto &tiered : batch)
+        batchPointers.push_back(tiered.get());
+    auto stubs = _createStubs(batchPointers, baseline.object.get());
+
+    std::lock_guard lock{_mutex};
+    for (auto &tiered : batch) {
+        tiered->entry = stubs.object->lookup(tiered->name);
+        tiered->slot = static_cast<uintptr_t *>(
+                stubs.object->lookup(tiered->name + implSuffix + "@got"));
+        assert(tiered->entry && tiered->slot);
+        _functionMap.insert({tiered->name, tiered.get()});
+        _functions.push_back(std::move(tiered));
+    }
+    _baselineObjects.push_back(baseline.object.get());
+    _code.push_back(std::move(baseline));
+    _code.push_back(std::move(stubs));
+
+    if (verbose)
+        std::cout << "lewis: Compiled " << fns.size() << " functions at the baseline tier"
+                << std::endl;
+}
+
+void *TieredCompilerImpl::lookup(const std::string &name) {
+    std::lock_guard lock{_mutex};
+    auto it = _functionMap.find(name);
+    if (it == _functionMap.end())
+        return nullptr;
+    return it->second->entry;
+}
+
+bool TieredCompilerImpl::isOptimized(const std::string &name) {
+    std::lock_guard lock{_mutex};
+    auto it = _functionMap.find(name);
+    if (it == _functionMap.end())
+        return false;
+    return it->second->optimized;
+}
+
+TieredCompilerImpl::LoadedCode TieredCompilerImpl::_createStubs(
+        const std::vector<TieredFunction *> &fns, jit::LoadedObject *baseline) {
+    // Each stub is a single JMP to the PLT entry of <name>@impl, which jumps through the GOT.
+    // CreatePltPass generates the PLT and GOT entries, as <name>@impl is undefined.
+    LoadedCode stubs;
+    stubs.elf = std::make_unique<elf::Object>();
+    auto elf = stubs.elf.get();
+    auto textSection = targets::x86_64::MachineCodeEmitter::createTextSection(elf);
+    for (auto fn : fns) {
+        util::ByteEncoder text{&textSection->buffer};
+        while (text.offset() & (stubAlignment - 1))
+            encode8(text, 0xCC);
+
+        auto symbol = elf->internSymbol(fn->name);
+        symbol->section = textSection;
+        symbol->value = text.offset();
+        symbol->size = 5;
+
+        auto jumpToPlt = elf->addInternalRelocation(std::make_unique<elf::Relocation>());
+        jumpToPlt->type = R_X86_64_PLT32;
+        jumpToPlt->section = textSection;
+        jumpToPlt->offset = text.offset() + 1;
+        jumpToPlt->symbol = elf->internSymbol(fn->name + implSuffix);
+        jumpToPlt->addend = -4;
+
+        encode8(text, 0xE9);
+        encode32(text, 0); // Relocation points here.
+    }
+
+    elf::CreatePltPass::create(elf)->run();
+    elf::CreateHeadersPass::create(elf)->run();
+    elf::LayoutPass::create(elf)->run();
+    elf::InternalLinkPass::create(elf)->run();
+
+    // Initially, the GOT slots point to the baseline code.
+    stubs.object = jit::LoadedObject::create(elf, [&] (const std::string &name) -> void * {
+        if (name.size() <= implSuffix.size()
+                || name.compare(name.size() - implSuffix.size(), implSuffix.size(), implSuffix))
+            return nullptr;
+        return baseline->lookup(name.substr(0, name.size() - implSuffix.size()));
+    });
+    return stubs;
+}
+
+void *TieredCompilerImpl::_resolve(const std::string &name) {
+    {
+        std::lock_guard lock{_mutex};
+        auto it = _functionMap.find(name);
+        if (it != _functionMap.end())
+            return it->second->entry;
+    }
+    return _resolver ? _resolver(name) : nullptr;
+}
+
+void TieredCompilerImpl::_work() {
+    std::unique_lock lock{_mutex};
+    while (true) {
+        _wakeup.wait_for(lock, _options.pollInterval, [&] { return _shutdown; });
+        if (_shutdown)
+            return;
+
+        bool pending = std::any_of(_functions.begin(), _functions.end(),
+                [] (const auto &fn) { return !fn->done; });
+        if (!pending)
+            continue;
+
+        // Block symbols are unique across objects, as they contain the Function's name.
+        BlockProfile profile;
+        for (auto object : _baselineObjects)
+            profile.merge(jit::readBlockProfile(object));
+
+        std::vector<TieredFunction *> hot;
+        for (auto &fn : _functions) {
+            if (fn->done)
+                continue;
+            uint64_t maxCount = 0;
+            for (size_t i = 0; i < fn->numBlocks; i++) {
+                auto it = profile.counts.find(blockSymbolName(fn->name, i));
+                if (it != profile.counts.end())
+                    maxCount = std::max(maxCount, it->second);
+            }
+            if (maxCount >= _options.hotThreshold)
+                hot.push_back(fn.get());
+        }
+
+        // Functions are never removed and their IR is immutable, hence it can be
+        // accessed without holding the lock.
+        lock.unlock();
+        for (auto fn : hot)
+            _optimize(fn, profile);
+        lock.lock();
+    }
+}
+
+void TieredCompilerImpl::_optimize(TieredFunction *fn, const BlockProfile &profile) {
+    // This runs on the background thread, hence no exception may escape. If the optimization
+    // fails for any reason, the baseline code stays in place.
+    try {
+        auto fns = readBinaryIr(fn->ir);
+        assert(fns.size() == 1);
+
+        LoadedCode optimized;
+        optimized.elf = std::make_unique<elf::Object>();
+        auto pm = PassManager::create(optimized.elf.get());
+        pm->setProfile(&profile);
+        pm->compileFunction(fns[0].get());
+        pm->linkObject();
+        optimized.object = jit::LoadedObject::create(optimized.elf.get(),
+                [this] (const std::string &name) { return _resolve(name); });
+
+        auto code = reinterpret_cast<uintptr_t>(optimized.object->lookup(fn->name));
+        assert(code);
+
+        // Keep the code alive before it becomes reachable.
+        std::lock_guard lock{_mutex};
+        _code.push_back(std::move(optimized));
+        // Threads that jump through the slot read it without synchronization;
+        // the store itself must thus be atomic.
+        std::atomic_ref<uintptr_t>{*fn->slot}.store(code, std::memory_order_release);
+        fn->optimized = true;
+        fn->done = true;
+    } catch (const std::exception &e) {
+        if (verbose)
+            std::cout << "lewis: Could not optimize " << fn->name << ": " << e.what()
+                    << std::endl;
+        std::lock_guard lock{_mutex};
+        fn->done = true;
+        return;
+    } catch (...) {
+        if (verbose)
+            std::cout << "lewis: Could not optimize " << fn->name << std::endl;
+        std::lock_guard lock{_mutex};
+        fn->done = true;
+        return;
+    }
+
+    if (verbose)
+        std::cout << "lewis: Installed optimized code of " << fn->name << std::endl;
+}
+
+std::unique_ptr<TieredCompiler> TieredCompiler::create(jit::SymbolResolver resolver,
+        TieringOptions options) {
+    auto compiler = std::make_unique<TieredCompilerImpl>(std::move(resolver), options);
+    compiler->initialize();
+    return compiler;
+}
+
+} // namespace lewis::driver
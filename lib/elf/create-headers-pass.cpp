@@ -8,13 +8,14 @@
 namespace lewis::elf {
 
 struct CreateHeadersPassImpl : CreateHeadersPass {
-    CreateHeadersPassImpl(Object *elf)
-    : _elf{elf} { }
+    CreateHeadersPassImpl(Object *elf, HashStyle hashStyle)
+    : _elf{elf}, _hashStyle{hashStyle} { }
 
     void run() override;
 
 private:
     Object *_elf;
+    HashStyle _hashStyle;
 };
 
 void CreateHeadersPassImpl::run() {
@@ -29,12 +30,13 @@ void CreateHeadersPassImpl::run() {
     auto dynamic = _elf->insertFragment(std::make_unique<DynamicSection>());
     dynamic->name = dynamicString;
     dynamic->type = SHT_DYNAMIC;
-    dynamic->flags = SHF_ALLOC;
+    dynamic->flags = SHF_ALLOC | SHF_WRITE;
     _elf->dynamicFragment = dynamic;
 
     auto strtab = _elf->insertFragment(std::make_unique<StringTableSection>());
     strtab->type = SHT_STRTAB;
     strtab->flags = SHF_ALLOC;
+    strtab->alignment = 1;
     _elf->stringTableFragment = strtab;
 
     auto symtab = _elf->insertFragment(std::make_unique<SymbolTableSection>());
@@ -53,15 +55,26 @@ void CreateHeadersPassImpl::run() {
     pltrel->entrySize = sizeof(Elf64_Rela);
     _elf->pltRelocationFragment = pltrel;
 
-    auto hashtab = _elf->insertFragment(std::make_unique<HashSection>());
-    hashtab->type = SHT_HASH;
-    hashtab->flags = SHF_ALLOC;
-    hashtab->sectionLink = symtab;
-    _elf->hashFragment = hashtab;
+    if (_hashStyle == HashStyle::sysv || _hashStyle == HashStyle::both) {
+        auto hashtab = _elf->insertFragment(std::make_unique<HashSection>());
+        hashtab->type = SHT_HASH;
+        hashtab->flags = SHF_ALLOC;
+        hashtab->sectionLink = symtab;
+        _elf->hashFragment = hashtab;
+    }
+
+    if (_hashStyle == HashStyle::gnu || _hashStyle == HashStyle::both) {
+        auto gnuHashtab = _elf->insertFragment(std::make_unique<GnuHashSection>());
+        gnuHashtab->type = SHT_GNU_HASH;
+        gnuHashtab->flags = SHF_ALLOC;
+        gnuHashtab->sectionLink = symtab;
+        _elf->gnuHashFragment = gnuHashtab;
+    }
 }
 
-std::unique_ptr<CreateHeadersPass> CreateHeadersPass::create(Object *elf) {
-    return std::make_unique<CreateHeadersPassImpl>(elf);
+std::unique_ptr<CreateHeadersPass> CreateHeadersPass::create(Object *elf,
+        HashStyle hashStyle) {
+    return std::make_unique<CreateHeadersPassImpl>(elf, hashStyle);
 }
 
 } // namespace lewis::elf
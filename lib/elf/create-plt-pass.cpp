@@ -0,0 +1,115 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <iostream>
+#include <unordered_map>
+#include <elf.h>
+#include <lewis/elf/passes.hpp>
+#include <lewis/elf/utils.hpp>
+
+namespace lewis::elf {
+
+namespace {
+    constexpr bool verbose = false;
+};
+
+struct CreatePltPassImpl : CreatePltPass {
+    CreatePltPassImpl(Object *elf)
+    : _elf{elf} { }
+
+    void run() override;
+
+private:
+    Object *_elf;
+};
+
+void CreatePltPassImpl::run() {
+    if(verbose)
+        std::cout << "Running CreatePltPass" << std::endl;
+
+    // Collect all calls to undefined symbols. We add internal relocations below,
+    // hence we cannot do this while creating the PLT entries.
+    std::vector<Relocation *> calls;
+    for (auto relocation : _elf->internalRelocations()) {
+        if (relocation->type != R_X86_64_PLT32)
+            continue;
+        assert(relocation->symbol);
+        if (relocation->symbol->section)
+            continue;
+        calls.push_back(relocation);
+    }
+    if (calls.empty())
+        return;
+
+    auto gotSection = _elf->insertFragment(std::make_unique<ByteSection>());
+    gotSection->name = _elf->internString(".got");
+    gotSection->type = SHT_PROGBITS;
+    gotSection->flags = SHF_ALLOC | SHF_WRITE;
+
+    auto pltSection = _elf->insertFragment(std::make_unique<ByteSection>());
+    pltSection->name = _elf->internString(".plt");
+    pltSection->type = SHT_PROGBITS;
+    pltSection->flags = SHF_ALLOC | SHF_EXECINSTR;
+    pltSection->alignment = 16;
+
+    util::ByteEncoder got{&gotSection->buffer};
+    util::ByteEncoder plt{&pltSection->buffer};
+
+    // Maps each undefined symbol to its PLT entry.
+    std::unordered_map<Symbol *, Symbol *> pltSymbols;
+
+    for (auto call : calls) {
+        auto symbol = call->symbol;
+        if (auto it = pltSymbols.find(symbol); it != pltSymbols.end()) {
+            call->symbol = it->second;
+            continue;
+        }
+
+        // Add a GOT entry for the function.
+        // TODO: Create the "special" GOT entries.
+        auto gotSymbol = _elf->addSymbol(std::make_unique<Symbol>());
+        gotSymbol->name = _elf->internString(symbol->name->buffer + "@got");
+        gotSymbol->section = gotSection;
+        gotSymbol->value = got.offset();
+
+        auto jumpSlot = _elf->addRelocation(std::make_unique<Relocation>());
+        jumpSlot->type = R_X86_64_JUMP_SLOT;
+        jumpSlot->section = gotSection;
+        jumpSlot->offset = got.offset();
+        jumpSlot->symbol = symbol;
+        encode64(got, 0);
+
+        // Add a PLT stub for the entry.
+        // TODO: Create the PLT header (and correct entries) for dynamic binding.
+        // TODO: Properly align PLT entries as in the ABI supplement.
+        auto pltSymbol = _elf->addSymbol(std::make_unique<Symbol>());
+        pltSymbol->name = _elf->internString(symbol->name->buffer + "@plt");
+        pltSymbol->section = pltSection;
+        pltSymbol->value = plt.offset();
+
+        auto jumpThroughGot = _elf->addInternalRelocation(std::make_unique<Relocation>());
+        jumpThroughGot->type = R_X86_64_PC32;
+        jumpThroughGot->section = pltSection;
+        jumpThroughGot->offset = plt.offset() + 2;
+        jumpThroughGot->symbol = gotSymbol;
+        jumpThroughGot->addend = -4;
+
+        encode8(plt, 0xFF); // JMP with ModRM: [RIP + disp32].
+        encode8(plt, 0x25);
+        encode32(plt, 0);
+
+        pltSymbols.insert({symbol, pltSymbol});
+        call->symbol = pltSymbol;
+    }
+
+    if(verbose)
+        std::cout << "Created " << pltSymbols.size() << " PLT entries for "
+                << calls.size() << " calls" << std::endl;
+}
+
+std::unique_ptr<CreatePltPass> CreatePltPass::create(Object *elf) {
+    return std::make_unique<CreatePltPassImpl>(elf);
+}
+
+} // namespace lewis::elf
@@ -1,8 +1,10 @@
 // Copyright the lewis authors (AUTHORS.md) 2018
 // SPDX-License-Identifier: MIT
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <vector>
 #include <elf.h>
 #include <lewis/elf/file-emitter.hpp>
 #include <lewis/elf/passes.hpp>
@@ -11,12 +13,19 @@
 namespace lewis::elf {
 
 struct FileEmitterImpl : FileEmitter {
+    FileEmitterImpl(Object *elf, FileSink *sink)
+    : _elf{elf}, _sink{sink} { }
+
     FileEmitterImpl(Object *elf)
-    : _elf{elf} { }
+    : _elf{elf}, _ownSink{FileSink::createForBuffer(&buffer)}, _sink{_ownSink.get()} { }
 
     void run() override;
 
 private:
+    // Passes the data that was encoded to _scratch to the sink.
+    void _flushScratch();
+
+    void _emitEhdr();
     void _emitPhdrs(PhdrsFragment *phdrs);
     void _emitShdrs(ShdrsFragment *shdrs);
     void _emitDynamic(DynamicSection *dynamic);
@@ -24,12 +33,79 @@ private:
     void _emitSymbolTable(SymbolTableSection *symtab);
     void _emitRela(RelocationSection *rel);
     void _emitHash(HashSection *hash);
+    void _emitGnuHash(GnuHashSection *gnuHash);
 
     Object *_elf;
+    std::unique_ptr<FileSink> _ownSink;
+    FileSink *_sink;
+    // Headers and tables are encoded here before they are passed to the sink.
+    // The buffer is reused, hence it only needs to fit the largest table.
+    std::vector<uint8_t> _scratch;
+    // Number of bytes that were passed to the sink so far.
+    size_t _offset = 0;
 };
 
 void FileEmitterImpl::run() {
-    util::ByteEncoder ehdr{&buffer};
+    // The layout is fixed at this point, hence we know the final size of the file.
+    _sink->begin(computeFileSize(_elf));
+
+    _emitEhdr();
+    _flushScratch();
+
+    // The LayoutPass groups fragments into segments, hence the file order of fragments
+    // can differ from the order in which they were inserted.
+    std::vector<Fragment *> fileOrder;
+    for (auto fragment : _elf->fragments())
+        fileOrder.push_back(fragment);
+    std::sort(fileOrder.begin(), fileOrder.end(), [] (Fragment *a, Fragment *b) {
+        return a->fileOffset.value() < b->fileOffset.value();
+    });
+
+    for (auto fragment : fileOrder) {
+        // Pad the file up to the fragment's (aligned) offset.
+        assert(fragment->fileOffset.value() >= _offset);
+        _sink->writeZeros(fragment->fileOffset.value() - _offset);
+        _offset = fragment->fileOffset.value();
+
+        if (auto phdrs = hierarchy_cast<PhdrsFragment *>(fragment); phdrs) {
+            _emitPhdrs(phdrs);
+        } else if (auto shdrs = hierarchy_cast<ShdrsFragment *>(fragment); shdrs) {
+            _emitShdrs(shdrs);
+        } else if (auto dynamic = hierarchy_cast<DynamicSection *>(fragment); dynamic) {
+            _emitDynamic(dynamic);
+        } else if (auto strtab = hierarchy_cast<StringTableSection *>(fragment); strtab) {
+            _emitStringTable(strtab);
+        } else if (auto symtab = hierarchy_cast<SymbolTableSection *>(fragment); symtab) {
+            _emitSymbolTable(symtab);
+        } else if (auto rel = hierarchy_cast<RelocationSection *>(fragment); rel) {
+            _emitRela(rel);
+        } else if (auto hash = hierarchy_cast<HashSection *>(fragment); hash) {
+            _emitHash(hash);
+        } else if (auto gnuHash = hierarchy_cast<GnuHashSection *>(fragment); gnuHash) {
+            _emitGnuHash(gnuHash);
+        } else {
+            auto section = hierarchy_cast<ByteSection *>(fragment);
+            assert(section && "Unexpected Fragment for FileEmitter");
+            // The Object outlives the FileEmitter, hence the sink can reference the buffer.
+            _sink->writeReferenced(section->buffer.data(), section->buffer.size());
+            _offset += section->buffer.size();
+            continue;
+        }
+        _flushScratch();
+    }
+
+    _sink->finish();
+}
+
+void FileEmitterImpl::_flushScratch() {
+    _sink->write(_scratch.data(), _scratch.size());
+    _offset += _scratch.size();
+    _scratch.clear();
+}
+
+void FileEmitterImpl::_emitEhdr() {
+    util::ByteEncoder ehdr{&_scratch};
+    ehdr.ensure(64);
 
     // Write the EHDR.e_ident field.
     encode8(ehdr, 0x7F);
@@ -56,72 +132,42 @@ void FileEmitterImpl::run() {
     // TODO: Do not hardcode this size.
     encodeHalf(ehdr, 64); // e_ehsize
     encodeHalf(ehdr, sizeof(Elf64_Phdr)); // e_phentsize
-    // TODO: # of PHDRs should be independent of # of sections.
-    encodeHalf(ehdr, _elf->numberOfFragments() + 1); // e_phnum
+    encodeHalf(ehdr, _elf->segments.size() + 1); // e_phnum
     encodeHalf(ehdr, sizeof(Elf64_Shdr)); // e_shentsize
     encodeHalf(ehdr, 1 + _elf->numberOfSections()); // e_shnum
     encodeHalf(ehdr, _elf->stringTableFragment->designatedIndex.value()); // e_shstrndx
-
-    for (auto fragment : _elf->fragments()) {
-        // Make sure that sections are at least 8-byte aligned.
-        // TODO: Support arbitrary alignment.
-        while(buffer.size() & size_t(7))
-            buffer.push_back(0);
-
-        // Make sure that the fragment ends up at the correct address.
-        assert(fragment->fileOffset.value() == buffer.size());
-
-        if (auto phdrs = hierarchy_cast<PhdrsFragment *>(fragment); phdrs) {
-            _emitPhdrs(phdrs);
-        } else if (auto shdrs = hierarchy_cast<ShdrsFragment *>(fragment); shdrs) {
-            _emitShdrs(shdrs);
-        } else if (auto dynamic = hierarchy_cast<DynamicSection *>(fragment); dynamic) {
-            _emitDynamic(dynamic);
-        } else if (auto strtab = hierarchy_cast<StringTableSection *>(fragment); strtab) {
-            _emitStringTable(strtab);
-        } else if (auto symtab = hierarchy_cast<SymbolTableSection *>(fragment); symtab) {
-            _emitSymbolTable(symtab);
-        } else if (auto rel = hierarchy_cast<RelocationSection *>(fragment); rel) {
-            _emitRela(rel);
-        } else if (auto hash = hierarchy_cast<HashSection *>(fragment); hash) {
-            _emitHash(hash);
-        } else {
-            auto section = hierarchy_cast<ByteSection *>(fragment);
-            assert(section && "Unexpected Fragment for FileEmitter");
-            buffer.insert(buffer.end(), section->buffer.begin(), section->buffer.end());
-        }
-    }
 }
 
 void FileEmitterImpl::_emitPhdrs(PhdrsFragment *phdrs) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(phdrs->computedSize.value());
 
-    for (auto fragment : _elf->fragments()) {
-        // TODO: p_type and p_flags are only fillers.
+    for (auto &segment : _elf->segments) {
         encodeWord(section, PT_LOAD); // p_type
-        encodeWord(section, PF_R | PF_X); // p_flags
-        encodeOff(section, fragment->fileOffset.value()); // p_offset
-        encodeAddr(section, fragment->virtualAddress.value()); // p_vaddr
-        encodeAddr(section, fragment->virtualAddress.value()); // p_paddr
+        encodeWord(section, segment.flags); // p_flags
+        encodeOff(section, segment.fileOffset.value()); // p_offset
+        encodeAddr(section, segment.virtualAddress.value()); // p_vaddr
+        encodeAddr(section, segment.virtualAddress.value()); // p_paddr
         // TODO: p_filesz and p_memsz need not match.
-        encodeXword(section, fragment->computedSize.value()); // p_filesz
-        encodeXword(section, fragment->computedSize.value()); // p_memsz
-        encodeXword(section, 0); // p_align
+        encodeXword(section, segment.computedSize.value()); // p_filesz
+        encodeXword(section, segment.computedSize.value()); // p_memsz
+        encodeXword(section, 0x1000); // p_align
     }
 
     // Emit the PT_DYNAMIC segment.
     encodeWord(section, PT_DYNAMIC); // p_type
-    encodeWord(section, PF_R); // p_flags
+    encodeWord(section, PF_R | PF_W); // p_flags
     encodeOff(section, _elf->dynamicFragment->fileOffset.value()); // p_offset
     encodeAddr(section, _elf->dynamicFragment->virtualAddress.value()); // p_vaddr
     encodeAddr(section, _elf->dynamicFragment->virtualAddress.value()); // p_paddr
     encodeXword(section, _elf->dynamicFragment->computedSize.value()); // p_filesz
     encodeXword(section, _elf->dynamicFragment->computedSize.value()); // p_memsz
-    encodeXword(section, 0); // p_align
+    encodeXword(section, _elf->dynamicFragment->alignment); // p_align
 }
 
 void FileEmitterImpl::_emitShdrs(ShdrsFragment *shdrs) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(shdrs->computedSize.value());
 
     // Emit the SHN_UNDEF section. Specified in the ELF base specification.
     encodeWord(section, 0); // sh_name
@@ -162,20 +208,27 @@ void FileEmitterImpl::_emitShdrs(ShdrsFragment *shdrs) {
         encodeXword(section, fragment->computedSize.value()); // sh_size
         encodeWord(section, linkIndex); // sh_link
         encodeWord(section, fragment->sectionInfo.value_or(0)); // sh_info
-        encodeXword(section, 0); // sh_addralign
+        encodeXword(section, fragment->alignment); // sh_addralign
         encodeXword(section, fragment->entrySize.value_or(0)); // sh_entsize
     }
 }
 
 void FileEmitterImpl::_emitDynamic(DynamicSection *dynamic) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(dynamic->computedSize.value());
 
     encodeSxword(section, DT_STRTAB);
     encodeXword(section, _elf->stringTableFragment->virtualAddress.value());
     encodeSxword(section, DT_SYMTAB);
     encodeXword(section, _elf->symbolTableFragment->virtualAddress.value());
-    encodeSxword(section, DT_HASH);
-    encodeXword(section, _elf->hashFragment->virtualAddress.value());
+    if (_elf->hashFragment) {
+        encodeSxword(section, DT_HASH);
+        encodeXword(section, _elf->hashFragment->virtualAddress.value());
+    }
+    if (_elf->gnuHashFragment) {
+        encodeSxword(section, DT_GNU_HASH);
+        encodeXword(section, _elf->gnuHashFragment->virtualAddress.value());
+    }
     encodeSxword(section, DT_JMPREL);
     encodeXword(section, _elf->pltRelocationFragment->virtualAddress.value());
     encodeSxword(section, DT_PLTRELSZ);
@@ -185,17 +238,24 @@ void FileEmitterImpl::_emitDynamic(DynamicSection *dynamic) {
 }
 
 void FileEmitterImpl::_emitStringTable(StringTableSection *strtab) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(strtab->computedSize.value());
 
-    encode8(section, 0); // ELF uses index zero for non-existent strings.
+    // Strings can overlap (see LayoutPass); each one is copied to its designatedOffset.
+    // Index zero (i.e., the empty string) and all terminators remain zero.
+    std::vector<uint8_t> table(strtab->computedSize.value(), 0);
     for (auto string : _elf->strings()) {
-        encodeChars(section, string->buffer.c_str());
-        encode8(section, 0);
+        assert(string->designatedOffset.has_value()
+                && "String table layout must be fixed for FileEmitter");
+        std::copy(string->buffer.begin(), string->buffer.end(),
+                table.begin() + string->designatedOffset.value());
     }
+    encodeBytes(section, {table.data(), table.size()});
 }
 
 void FileEmitterImpl::_emitSymbolTable(SymbolTableSection *symtab) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(symtab->computedSize.value());
 
     // Encode the null symbol.
     encodeWord(section, 0); // st_name
@@ -205,8 +265,15 @@ void FileEmitterImpl::_emitSymbolTable(SymbolTableSection *symtab) {
     encodeAddr(section, 0); // st_value
     encodeXword(section, 0); // st_size
 
-    // Encode all "real" symbols.
-    for (auto symbol : _elf->symbols()) {
+    // Encode all "real" symbols. The LayoutPass may have reordered them.
+    std::vector<Symbol *> order;
+    for (auto symbol : _elf->symbols())
+        order.push_back(symbol);
+    std::sort(order.begin(), order.end(), [] (Symbol *a, Symbol *b) {
+        return a->designatedIndex.value() < b->designatedIndex.value();
+    });
+
+    for (auto symbol : order) {
         size_t nameIndex = 0;
         if (symbol->name) {
             assert(symbol->name->designatedOffset.has_value()
@@ -231,12 +298,13 @@ void FileEmitterImpl::_emitSymbolTable(SymbolTableSection *symtab) {
         encodeHalf(section, sectionIndex); // st_shndx
         // TODO: Use symbol->value in object files.
         encodeAddr(section, virtualAddress); // st_value
-        encodeXword(section, 0); // st_size
+        encodeXword(section, symbol->size); // st_size
     }
 }
 
 void FileEmitterImpl::_emitRela(RelocationSection *rel) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(rel->computedSize.value());
 
     for (auto relocation : _elf->relocations()) {
         assert(relocation->offset >= 0);
@@ -254,13 +322,14 @@ void FileEmitterImpl::_emitRela(RelocationSection *rel) {
         }
 
         encodeAddr(section, sectionAddress + relocation->offset);
-        encodeXword(section, (symbolIndex << 32) | R_X86_64_JUMP_SLOT);
+        encodeXword(section, (symbolIndex << 32) | relocation->type);
         encodeSxword(section, 0);
     }
 }
 
 void FileEmitterImpl::_emitHash(HashSection *hash) {
-    util::ByteEncoder section{&buffer};
+    util::ByteEncoder section{&_scratch};
+    section.ensure(hash->computedSize.value());
 
     encodeWord(section, hash->buckets.size());
     encodeWord(section, hash->chains.size());
@@ -282,8 +351,37 @@ void FileEmitterImpl::_emitHash(HashSection *hash) {
     }
 }
 
+void FileEmitterImpl::_emitGnuHash(GnuHashSection *gnuHash) {
+    util::ByteEncoder section{&_scratch};
+    section.ensure(gnuHash->computedSize.value());
+
+    encodeWord(section, gnuHash->buckets.size());
+    encodeWord(section, gnuHash->symbolOffset);
+    encodeWord(section, gnuHash->bloom.size());
+    encodeWord(section, gnuHash->bloomShift);
+
+    for (auto word : gnuHash->bloom)
+        encodeXword(section, word);
+    for (auto index : gnuHash->buckets)
+        encodeWord(section, index);
+    for (auto hash : gnuHash->chains)
+        encodeWord(section, hash);
+}
+
 std::unique_ptr<FileEmitter> FileEmitter::create(Object *elf) {
     return std::make_unique<FileEmitterImpl>(elf);
 }
 
+std::unique_ptr<FileEmitter> FileEmitter::create(Object *elf, FileSink *sink) {
+    return std::make_unique<FileEmitterImpl>(elf, sink);
+}
+
+size_t FileEmitter::computeFileSize(Object *elf) {
+    size_t fileSize = 64;
+    for (auto fragment : elf->fragments())
+        fileSize = std::max(fileSize,
+                fragment->fileOffset.value() + fragment->computedSize.value());
+    return fileSize;
+}
+
 } // namespace lewis::elf
@@ -0,0 +1,184 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/uio.h>
+#include <lewis/elf/file-emitter.hpp>
+
+namespace lewis::elf {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Maximal number of bytes that are copied into the staging buffer before
+    // FdSink issues a system call.
+    constexpr size_t stagingLimit = size_t(1) << 20;
+};
+
+struct BufferSink : FileSink {
+    BufferSink(std::vector<uint8_t> *buffer)
+    : _buffer{buffer} { }
+
+    void begin(size_t fileSize) override {
+        _buffer->reserve(_buffer->size() + fileSize);
+    }
+
+    void write(const void *data, size_t size) override {
+        auto p = static_cast<const uint8_t *>(data);
+        _buffer->insert(_buffer->end(), p, p + size);
+    }
+
+    void writeZeros(size_t size) override {
+        _buffer->resize(_buffer->size() + size, 0);
+    }
+
+    void finish() override { }
+
+private:
+    std::vector<uint8_t> *_buffer;
+};
+
+struct FdSink : FileSink {
+    FdSink(int fd)
+    : _fd{fd} { }
+
+    void begin(size_t) override { }
+
+    void write(const void *data, size_t size) override {
+        if (!size)
+            return;
+        auto p = static_cast<const uint8_t *>(data);
+        _pieces.push_back({nullptr, _staging.size(), size});
+        _staging.insert(_staging.end(), p, p + size);
+        _checkLimits();
+    }
+
+    void writeReferenced(const void *data, size_t size) override {
+        if (!size)
+            return;
+        _pieces.push_back({static_cast<const uint8_t *>(data), 0, size});
+        _checkLimits();
+    }
+
+    void writeZeros(size_t size) override {
+        if (!size)
+            return;
+        _pieces.push_back({nullptr, _staging.size(), size});
+        _staging.resize(_staging.size() + size, 0);
+        _checkLimits();
+    }
+
+    void finish() override {
+        _flush();
+        if (verbose)
+            std::cout << "lewis: FdSink issued " << _numSyscalls << " system calls"
+                    << std::endl;
+    }
+
+private:
+    // Either refers to data outside of the sink or to a range of _staging.
+    // Offsets are used for the latter as _staging can be reallocated.
+    struct Piece {
+        const uint8_t *data;
+        size_t stagingOffset;
+        size_t size;
+    };
+
+    void _checkLimits() {
+        if (_staging.size() >= stagingLimit || _pieces.size() >= IOV_MAX)
+            _flush();
+    }
+
+    void _flush() {
+        std::vector<iovec> iovs;
+        iovs.reserve(_pieces.size());
+        for (auto &piece : _pieces) {
+            auto base = piece.data ? piece.data : _staging.data() + piece.stagingOffset;
+            iovs.push_back({const_cast<uint8_t *>(base), piece.size});
+        }
+
+        // writev() may write fewer bytes than requested; continue after the last byte.
+        size_t k = 0;
+        while (k < iovs.size()) {
+            auto n = std::min(iovs.size() - k, size_t(IOV_MAX));
+            auto written = ::writev(_fd, iovs.data() + k, n);
+            _numSyscalls++;
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string{"Could not write file: "}
+                        + strerror(errno));
+            }
+            if (!written)
+                throw std::runtime_error("Could not write file: writev() made no progress");
+
+            size_t remaining = written;
+            while (k < iovs.size() && remaining >= iovs[k].iov_len) {
+                remaining -= iovs[k].iov_len;
+                k++;
+            }
+            if (remaining) {
+                iovs[k].iov_base = static_cast<uint8_t *>(iovs[k].iov_base) + remaining;
+                iovs[k].iov_len -= remaining;
+            }
+        }
+
+        _pieces.clear();
+        _staging.clear();
+    }
+
+    int _fd;
+    std::vector<Piece> _pieces;
+    std::vector<uint8_t> _staging;
+    int _numSyscalls = 0;
+};
+
+struct RegionSink : FileSink {
+    RegionSink(void *region, size_t size)
+    : _region{static_cast<uint8_t *>(region)}, _size{size} { }
+
+    void begin(size_t fileSize) override {
+        if (fileSize > _size)
+            throw std::runtime_error("File does not fit into the region of the FileSink");
+    }
+
+    void write(const void *data, size_t size) override {
+        assert(_offset + size <= _size);
+        memcpy(_region + _offset, data, size);
+        _offset += size;
+    }
+
+    void writeZeros(size_t size) override {
+        assert(_offset + size <= _size);
+        memset(_region + _offset, 0, size);
+        _offset += size;
+    }
+
+    void finish() override { }
+
+private:
+    uint8_t *_region;
+    size_t _size;
+    size_t _offset = 0;
+};
+
+std::unique_ptr<FileSink> FileSink::createForBuffer(std::vector<uint8_t> *buffer) {
+    return std::make_unique<BufferSink>(buffer);
+}
+
+std::unique_ptr<FileSink> FileSink::createForFd(int fd) {
+    return std::make_unique<FdSink>(fd);
+}
+
+std::unique_ptr<FileSink> FileSink::createForRegion(void *region, size_t size) {
+    return std::make_unique<RegionSink>(region, size);
+}
+
+} // namespace lewis::elf
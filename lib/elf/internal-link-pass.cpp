@@ -39,12 +39,16 @@ void InternalLinkPassImpl::run() {
         auto relocationAddress = relocation->section->virtualAddress.value() + relocation->offset;
 
         auto symbol = relocation->symbol;
-        assert(symbol->section);
+        assert(symbol->section && "Undefined symbols need to be resolved before InternalLinkPass");
         assert(symbol->section->virtualAddress.has_value()
                 && "Section layout must be fixed for InternalLinkPass");
         auto symbolAddress = symbol->section->virtualAddress.value() + symbol->value;
 
-        // Here, we emit a R_X86_64_PC32 relocation. TODO: Support other types of relocations.
+        // For R_X86_64_PLT32, CreatePltPass already retargeted calls to undefined symbols
+        // to their PLT entries; the computation is the same as for R_X86_64_PC32.
+        // TODO: Support other types of relocations.
+        assert((relocation->type == R_X86_64_PC32 || relocation->type == R_X86_64_PLT32)
+                && "Unexpected relocation type for InternalLinkPass");
         auto byteSection = hierarchy_cast<ByteSection *>(relocation->section.get());
         auto value = symbolAddress - relocationAddress + relocation->addend.value_or(0);
         put32(byteSection->buffer.data() + relocation->offset, value);
@@ -1,9 +1,12 @@
 // Copyright the lewis authors (AUTHORS.md) 2018
 // SPDX-License-Identifier: MIT
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <iostream>
+#include <unordered_map>
+#include <unordered_set>
 #include <elf.h>
 #include <lewis/elf/passes.hpp>
 #include <lewis/elf/utils.hpp>
@@ -11,6 +14,13 @@
 namespace {
     constexpr bool verbose = false;
 
+    constexpr size_t pageSize = 0x1000;
+
+    size_t alignUp(size_t v, size_t alignment) {
+        assert(alignment && !(alignment & (alignment - 1)));
+        return (v + alignment - 1) & ~(alignment - 1);
+    }
+
     // Adapted from Bit Twiddling Hacks.
     template <typename T>
     T ceil2Power(T v) {
@@ -32,6 +42,13 @@ namespace {
         }
         return h;
     }
+
+    uint32_t gnuHash(const std::string &s) {
+        uint32_t h = 5381;
+        for(size_t i = 0; i < s.size(); ++i)
+            h = (h << 5) + h + (uint8_t)s[i];
+        return h;
+    }
 }
 
 namespace lewis::elf {
@@ -43,105 +60,290 @@ struct LayoutPassImpl : LayoutPass {
     void run() override;
 
 private:
+    void _planSegments();
+    size_t _layoutStrings();
+    size_t _computeSize(Fragment *fragment);
+
     Object *_elf;
 };
 
 void LayoutPassImpl::run() {
-    size_t sectionIndex = 1;
-    size_t offset = 64; // Size of EHDR.
-    size_t address = 0x1000;
     if(verbose)
         std::cout << "Running LayoutPass" << std::endl;
-    for (auto fragment : _elf->fragments()) {
-        size_t size;
-        if (auto phdrs = hierarchy_cast<PhdrsFragment *>(fragment); phdrs) {
-            // TODO: # of PHDRs should be independent of # of sections.
-            size = (_elf->numberOfFragments() + 1) * sizeof(Elf64_Phdr);
-        } else if (auto shdrs = hierarchy_cast<ShdrsFragment *>(fragment); shdrs) {
-            size = (1 + _elf->numberOfSections()) * sizeof(Elf64_Shdr);
-        } else if (auto dynamic = hierarchy_cast<DynamicSection *>(fragment); dynamic) {
-            size = 6 * 16;
-        } else if (auto strtab = hierarchy_cast<StringTableSection *>(fragment); strtab) {
-            size = 1; // ELF uses index zero for non-existent strings.
-            for (auto string : _elf->strings()) {
-                string->designatedOffset = size;
-                size += string->buffer.size() + 1;
-            }
-        } else if (auto symtab = hierarchy_cast<SymbolTableSection *>(fragment); symtab) {
-            size_t numEntries = 1; // ELF uses index zero for non-existent symbols.
-            for (auto symbol : _elf->symbols()) {
-                symbol->designatedIndex = numEntries;
-                numEntries++;
-            }
-            size = sizeof(Elf64_Sym) * numEntries;
-        } else if (auto rel = hierarchy_cast<RelocationSection *>(fragment); rel) {
-            size_t numEntries = 0;
-            for (auto relocation : _elf->relocations()) {
-                relocation->designatedIndex = numEntries;
-                numEntries++;
-            }
-            size = sizeof(Elf64_Rela) * numEntries;
-        } else if (auto hash = hierarchy_cast<HashSection *>(fragment); hash) {
-            size_t tableSize = ceil2Power(_elf->symbols().size());
-            hash->buckets.resize(tableSize, 0);
-            hash->chains.resize(_elf->symbols().size() + 1);
-
-            struct BucketData {
-                size_t tail;
-                size_t collisions;
-            };
-
-            std::vector<BucketData> bucketData;
-            bucketData.resize(tableSize, BucketData{0, 0});
-
-            size_t maxCollisions = 0;
-            for (auto symbol : _elf->symbols()) {
-                assert(symbol->designatedIndex.has_value() && "Symbol layout needs to be fixed"
-                        " before hash table is realized.");
-
-                auto b = elf64Hash(symbol->name->buffer) & (tableSize - 1);
-                if (auto t = bucketData[b].tail; !t) {
-                    hash->buckets[b] = symbol;
-                    bucketData[b].tail = symbol->designatedIndex.value();
-                }else{
-                    hash->chains[t] = symbol;
-                    bucketData[b].tail = symbol->designatedIndex.value();
-                    bucketData[b].collisions++;
-                    maxCollisions = std::max(maxCollisions, bucketData[b].collisions);
-                }
-            }
 
-            if(verbose)
-                std::cout << "ELF hash table of size " << tableSize
-                        << " contains " << _elf->symbols().size()
-                        << " symbols; there are at most " << maxCollisions
-                        << " collisions" << std::endl;
-        } else {
-            auto section = hierarchy_cast<ByteSection *>(fragment);
-            assert(section && "Unexpected ELF fragment");
-            size = section->buffer.size();
-        }
+    // The number of PHDRs depends on the segments, so we need to plan them first.
+    _planSegments();
 
-        if(verbose)
-            std::cout << "Laying out fragment " << fragment << " at " << (void *)offset
-                    << ", size: " << (void *)size << std::endl;
+    size_t sectionIndex = 1;
+    for (auto fragment : _elf->fragments()) {
         if (fragment->isSection())
             fragment->designatedIndex = sectionIndex++;
+        fragment->computedSize = _computeSize(fragment);
+    }
 
-        // Make sure that sections are at least 8-byte aligned.
-        // TODO: Support arbitrary alignment.
-        offset = (offset + 7) & ~size_t(7);
+    size_t offset = 64; // Size of EHDR.
+    size_t address = pageSize;
 
-        // TODO: Perform virtualAddress allocation per segment and not per section.
-        // Make sure each segment starts on it's own page.
-        address = (address + 0xFFF) & ~size_t{0xFFF};
-        // Make sure virtualAddress and fileOffset match modulo page size.
-        address += offset & 0xFFF;
+    auto placeFragment = [&] (Fragment *fragment) {
+        auto padding = alignUp(offset, fragment->alignment) - offset;
+        offset += padding;
+        address += padding;
 
+        if(verbose)
+            std::cout << "Laying out fragment " << fragment << " at " << (void *)offset
+                    << ", size: " << (void *)fragment->computedSize.value() << std::endl;
         fragment->fileOffset = offset;
         fragment->virtualAddress = address;
-        fragment->computedSize = size;
-        offset += size;
+        offset += fragment->computedSize.value();
+        address += fragment->computedSize.value();
+    };
+
+    std::unordered_set<Fragment *> loaded;
+    for (auto &segment : _elf->segments) {
+        // Make sure each segment starts on it's own page. The segment's virtualAddress and
+        // fileOffset need to match modulo page size; the segment's first page may
+        // still share a file page with the previous segment.
+        offset = alignUp(offset, segment.fragments.front()->alignment);
+        address = alignUp(address, pageSize) + (offset & (pageSize - 1));
+
+        segment.fileOffset = offset;
+        segment.virtualAddress = address;
+        for (auto fragment : segment.fragments) {
+            placeFragment(fragment);
+            loaded.insert(fragment);
+        }
+        segment.computedSize = offset - segment.fileOffset.value();
+    }
+
+    // Fragments that are not loaded (e.g., the SHDRs) are placed behind all segments.
+    for (auto fragment : _elf->fragments()) {
+        if (loaded.count(fragment))
+            continue;
+        placeFragment(fragment);
+        fragment->virtualAddress = 0;
+    }
+}
+
+void LayoutPassImpl::_planSegments() {
+    Segment readOnly;
+    readOnly.flags = PF_R;
+    Segment executable;
+    executable.flags = PF_R | PF_X;
+    Segment writable;
+    writable.flags = PF_R | PF_W;
+
+    for (auto fragment : _elf->fragments()) {
+        if (hierarchy_cast<PhdrsFragment *>(fragment)) {
+            readOnly.fragments.push_back(fragment);
+        } else if (!fragment->isSection() || !(fragment->flags & SHF_ALLOC)) {
+            // Do not load the SHDRs and non-allocated sections.
+        } else if (fragment->flags & SHF_EXECINSTR) {
+            assert(!(fragment->flags & SHF_WRITE) && "W^X violation in ELF section");
+            executable.fragments.push_back(fragment);
+        } else if (fragment->flags & SHF_WRITE) {
+            writable.fragments.push_back(fragment);
+        } else {
+            readOnly.fragments.push_back(fragment);
+        }
+    }
+
+    _elf->segments.clear();
+    for (auto segment : {&readOnly, &executable, &writable})
+        if (!segment->fragments.empty())
+            _elf->segments.push_back(std::move(*segment));
+
+    if(verbose)
+        std::cout << "Planned " << _elf->segments.size() << " segments for "
+                << _elf->numberOfFragments() << " fragments" << std::endl;
+}
+
+// Assigns the offsets of all Strings and returns the size of the string table.
+// Identical Strings share their offset and Strings that are suffixes of other Strings
+// (e.g., "bar" of "foobar") point into them. Sorting by reversed contents places each
+// String directly after the Strings that it is a suffix of.
+size_t LayoutPassImpl::_layoutStrings() {
+    std::vector<String *> order;
+    for (auto string : _elf->strings())
+        order.push_back(string);
+    std::stable_sort(order.begin(), order.end(), [] (String *a, String *b) {
+        return std::lexicographical_compare(b->buffer.rbegin(), b->buffer.rend(),
+                a->buffer.rbegin(), a->buffer.rend());
+    });
+
+    // Maps each String to the String that contains it; this is either a String that is
+    // placed in the table or the String itself.
+    std::unordered_map<String *, String *> hosts;
+    String *previous = nullptr;
+    for (auto string : order) {
+        auto &buffer = string->buffer;
+        if (previous && buffer.size() <= previous->buffer.size()
+                && std::equal(buffer.rbegin(), buffer.rend(), previous->buffer.rbegin())) {
+            hosts.insert({string, hosts.at(previous)});
+        } else {
+            hosts.insert({string, string});
+        }
+        previous = string;
+    }
+
+    // Place the Strings in their original order to keep the table deterministic and readable.
+    size_t size = 1; // ELF uses index zero for non-existent strings.
+    size_t numMerged = 0;
+    for (auto string : _elf->strings()) {
+        if (hosts.at(string) != string) {
+            numMerged++;
+            continue;
+        }
+        string->designatedOffset = size;
+        size += string->buffer.size() + 1;
+    }
+    for (auto string : _elf->strings()) {
+        auto host = hosts.at(string);
+        if (host == string)
+            continue;
+        string->designatedOffset = host->designatedOffset.value()
+                + host->buffer.size() - string->buffer.size();
+    }
+
+    if(verbose)
+        std::cout << "String table of size " << size << " merges " << numMerged
+                << " strings" << std::endl;
+    return size;
+}
+
+size_t LayoutPassImpl::_computeSize(Fragment *fragment) {
+    if (auto phdrs = hierarchy_cast<PhdrsFragment *>(fragment); phdrs) {
+        // One PHDR per segment, plus the PT_DYNAMIC.
+        return (_elf->segments.size() + 1) * sizeof(Elf64_Phdr);
+    } else if (auto shdrs = hierarchy_cast<ShdrsFragment *>(fragment); shdrs) {
+        return (1 + _elf->numberOfSections()) * sizeof(Elf64_Shdr);
+    } else if (auto dynamic = hierarchy_cast<DynamicSection *>(fragment); dynamic) {
+        // DT_STRTAB, DT_SYMTAB, DT_JMPREL, DT_PLTRELSZ, DT_NULL and the hash tables.
+        size_t numEntries = 5;
+        if (_elf->hashFragment)
+            numEntries++;
+        if (_elf->gnuHashFragment)
+            numEntries++;
+        return 16 * numEntries;
+    } else if (auto strtab = hierarchy_cast<StringTableSection *>(fragment); strtab) {
+        return _layoutStrings();
+    } else if (auto symtab = hierarchy_cast<SymbolTableSection *>(fragment); symtab) {
+        std::vector<Symbol *> order;
+        for (auto symbol : _elf->symbols())
+            order.push_back(symbol);
+
+        // DT_GNU_HASH requires all undefined symbols to come first,
+        // followed by the defined symbols sorted by bucket.
+        if (_elf->gnuHashFragment) {
+            auto gnuHash = hierarchy_cast<GnuHashSection *>(_elf->gnuHashFragment.get());
+            auto definedBegin = std::stable_partition(order.begin(), order.end(),
+                    [] (Symbol *symbol) { return !symbol->section; });
+
+            // Aim for two symbols per bucket on average.
+            size_t numBuckets = std::max(size_t(1), size_t(order.end() - definedBegin) / 2);
+            gnuHash->buckets.assign(numBuckets, 0);
+            std::stable_sort(definedBegin, order.end(), [&] (Symbol *a, Symbol *b) {
+                return ::gnuHash(a->name->buffer) % numBuckets
+                        < ::gnuHash(b->name->buffer) % numBuckets;
+            });
+        }
+
+        size_t numEntries = 1; // ELF uses index zero for non-existent symbols.
+        for (auto symbol : order) {
+            symbol->designatedIndex = numEntries;
+            numEntries++;
+        }
+        return sizeof(Elf64_Sym) * numEntries;
+    } else if (auto rel = hierarchy_cast<RelocationSection *>(fragment); rel) {
+        size_t numEntries = 0;
+        for (auto relocation : _elf->relocations()) {
+            relocation->designatedIndex = numEntries;
+            numEntries++;
+        }
+        return sizeof(Elf64_Rela) * numEntries;
+    } else if (auto hash = hierarchy_cast<HashSection *>(fragment); hash) {
+        size_t tableSize = ceil2Power(_elf->symbols().size());
+        hash->buckets.resize(tableSize, 0);
+        hash->chains.resize(_elf->symbols().size() + 1);
+
+        struct BucketData {
+            size_t tail;
+            size_t collisions;
+        };
+
+        std::vector<BucketData> bucketData;
+        bucketData.resize(tableSize, BucketData{0, 0});
+
+        size_t maxCollisions = 0;
+        for (auto symbol : _elf->symbols()) {
+            assert(symbol->designatedIndex.has_value() && "Symbol layout needs to be fixed"
+                    " before hash table is realized.");
+
+            auto b = elf64Hash(symbol->name->buffer) & (tableSize - 1);
+            if (auto t = bucketData[b].tail; !t) {
+                hash->buckets[b] = symbol;
+                bucketData[b].tail = symbol->designatedIndex.value();
+            }else{
+                hash->chains[t] = symbol;
+                bucketData[b].tail = symbol->designatedIndex.value();
+                bucketData[b].collisions++;
+                maxCollisions = std::max(maxCollisions, bucketData[b].collisions);
+            }
+        }
+
+        if(verbose)
+            std::cout << "ELF hash table of size " << tableSize
+                    << " contains " << _elf->symbols().size()
+                    << " symbols; there are at most " << maxCollisions
+                    << " collisions" << std::endl;
+
+        // The hash table consists of nbucket, nchain followed by the buckets and chains.
+        return sizeof(uint32_t) * (2 + hash->buckets.size() + hash->chains.size());
+    } else if (auto gnuHash = hierarchy_cast<GnuHashSection *>(fragment); gnuHash) {
+        // The symbol table determined the number of buckets and the order of symbols.
+        auto numBuckets = gnuHash->buckets.size();
+        assert(numBuckets && "Symbol layout needs to be fixed"
+                " before hash table is realized.");
+
+        std::vector<Symbol *> hashed;
+        for (auto symbol : _elf->symbols())
+            if (symbol->section)
+                hashed.push_back(symbol);
+        std::sort(hashed.begin(), hashed.end(), [] (Symbol *a, Symbol *b) {
+            return a->designatedIndex.value() < b->designatedIndex.value();
+        });
+
+        // Use ~8 bits of the bloom filter per symbol; the filter size needs to be a power of 2.
+        size_t bloomSize = ceil2Power(std::max(size_t(1), hashed.size() / 8));
+        gnuHash->symbolOffset = hashed.empty() ? _elf->symbols().size() + 1
+                : hashed.front()->designatedIndex.value();
+        gnuHash->bloomShift = 26;
+        gnuHash->bloom.assign(bloomSize, 0);
+        gnuHash->chains.resize(hashed.size());
+
+        for (size_t i = 0; i < hashed.size(); i++) {
+            auto symbol = hashed[i];
+            assert(symbol->designatedIndex.value() == gnuHash->symbolOffset + i
+                    && "Defined symbols must be contiguous for DT_GNU_HASH");
+            auto h = ::gnuHash(symbol->name->buffer);
+            gnuHash->bloom[(h / 64) % bloomSize] |= (uint64_t(1) << (h % 64))
+                    | (uint64_t(1) << ((h >> gnuHash->bloomShift) % 64));
+
+            auto b = h % numBuckets;
+            if (!gnuHash->buckets[b])
+                gnuHash->buckets[b] = symbol->designatedIndex.value();
+
+            // The lowest bit marks the last symbol of each chain.
+            bool last = i + 1 == hashed.size()
+                    || ::gnuHash(hashed[i + 1]->name->buffer) % numBuckets != b;
+            gnuHash->chains[i] = last ? (h | 1) : (h & ~uint32_t(1));
+        }
+
+        return 4 * sizeof(uint32_t) + bloomSize * sizeof(uint64_t)
+                + (numBuckets + hashed.size()) * sizeof(uint32_t);
+    } else {
+        auto section = hierarchy_cast<ByteSection *>(fragment);
+        assert(section && "Unexpected ELF fragment");
+        return section->buffer.size();
     }
 }
 
@@ -50,10 +50,30 @@ void Object::doAddString(std::unique_ptr<String> string) {
     _strings.push_back(std::move(string));
 }
 
+String *Object::internString(const std::string &buffer) {
+    auto it = _internedStrings.find(buffer);
+    if (it != _internedStrings.end())
+        return it->second;
+    auto string = addString(std::make_unique<String>(buffer));
+    _internedStrings.insert({buffer, string});
+    return string;
+}
+
 void Object::doAddSymbol(std::unique_ptr<Symbol> symbol) {
     _symbols.push_back(std::move(symbol));
 }
 
+Symbol *Object::internSymbol(const std::string &name) {
+    auto string = internString(name);
+    auto it = _internedSymbols.find(string);
+    if (it != _internedSymbols.end())
+        return it->second;
+    auto symbol = addSymbol(std::make_unique<Symbol>());
+    symbol->name = string;
+    _internedSymbols.insert({string, symbol});
+    return symbol;
+}
+
 void Object::doAddRelocation(std::unique_ptr<Relocation> relocation) {
     _relocations.push_back(std::move(relocation));
 }
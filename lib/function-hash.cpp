@@ -0,0 +1,272 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <unordered_map>
+#include <lewis/function-hash.hpp>
+
+namespace lewis {
+
+namespace {
+    uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    // Finalizer of splitmix64.
+    uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EB;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Feeds a stream of words into two independent lanes.
+    struct Hasher {
+        Hasher(uint64_t seed)
+        : _a{mix(seed ^ 0x243F6A8885A308D3)}, _b{mix(seed ^ 0x13198A2E03707344)} { }
+
+        void add(uint64_t w) {
+            _a = rotl(_a ^ mix(w), 27) * 0x9E3779B97F4A7C15 + 0x52DCE729;
+            _b = rotl(_b + mix(w ^ 0xC2B2AE3D27D4EB4F), 31) * 0xFF51AFD7ED558CCD + _a;
+        }
+
+        void addString(const std::string &s) {
+            add(s.size());
+            uint64_t w = 0;
+            for (size_t i = 0; i < s.size(); i++) {
+                w |= uint64_t{static_cast<uint8_t>(s[i])} << (8 * (i % 8));
+                if (i % 8 == 7) {
+                    add(w);
+                    w = 0;
+                }
+            }
+            add(w);
+        }
+
+        FunctionHash finish() {
+            FunctionHash hash;
+            hash.words[0] = mix(_a ^ rotl(_b, 17));
+            hash.words[1] = mix(_b + _a);
+            return hash;
+        }
+
+    private:
+        uint64_t _a;
+        uint64_t _b;
+    };
+
+    // Marks the start of each IR node such that different structures cannot produce
+    // the same stream of words.
+    enum : uint64_t {
+        blockTag = 0x100,
+        phiTag,
+        instructionTag,
+        branchTag,
+        edgeTag
+    };
+};
+
+struct FunctionHasher {
+    FunctionHasher(Function *fn, uint64_t seed)
+    : _fn{fn}, _h{seed} { }
+
+    FunctionHash run();
+
+private:
+    void _number(Value *value) {
+        if (value)
+            _values.insert({value, _values.size() + 1});
+    }
+
+    void _addValue(Value *value) {
+        if (!value) {
+            _h.add(0);
+            return;
+        }
+        auto it = _values.find(value);
+        assert(it != _values.end() && "Value is not defined in this Function");
+        _h.add(it->second);
+    }
+
+    void _addType(Value *value) {
+        _h.add(value && value->getType() ? value->getType()->typeKind : type_kinds::null);
+    }
+
+    void _addDefinition(ValueOrigin &origin) {
+        _addValue(origin.get());
+        _addType(origin.get());
+    }
+
+    size_t _indexOf(BasicBlock *bb) {
+        auto it = _blocks.find(bb);
+        assert(it != _blocks.end());
+        return it->second;
+    }
+
+    Function *_fn;
+    Hasher _h;
+    // Values and BasicBlocks are numbered in definition (resp. list) order.
+    // Zero is reserved for null.
+    std::unordered_map<Value *, uint64_t> _values;
+    std::unordered_map<BasicBlock *, uint64_t> _blocks;
+    // Maps DataFlowSinks to (index of the block, index of the PhiNode in the block).
+    std::unordered_map<DataFlowSink *, std::pair<uint64_t, uint64_t>> _sinks;
+};
+
+FunctionHash FunctionHasher::run() {
+    // Number all definitions first, as uses can precede definitions
+    // (in BasicBlock order) once there are loops.
+    for (auto bb : _fn->blocks()) {
+        _blocks.insert({bb, _blocks.size() + 1});
+        uint64_t phiIndex = 0;
+        for (auto phi : bb->phis()) {
+            _number(phi->value.get());
+            if (auto dataFlowPhi = hierarchy_cast<DataFlowPhi *>(phi); dataFlowPhi)
+                _sinks.insert({&dataFlowPhi->sink, {_blocks.size(), phiIndex}});
+            phiIndex++;
+        }
+        for (auto inst : bb->instructions()) {
+            switch (inst->kind) {
+            case instruction_kinds::loadConst:
+                _number(static_cast<LoadConstInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::loadOffset:
+                _number(static_cast<LoadOffsetInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::unaryMath:
+                _number(static_cast<UnaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::binaryMath:
+                _number(static_cast<BinaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::invoke: {
+                auto invoke = static_cast<InvokeInstruction *>(inst);
+                for (size_t i = 0; i < invoke->numResults(); i++)
+                    _number(invoke->result(i).get());
+                break;
+            }
+            default:
+                assert(!"hashFunction() only supports generic IR");
+            }
+        }
+    }
+
+    for (auto bb : _fn->blocks()) {
+        _h.add(blockTag);
+
+        for (auto phi : bb->phis()) {
+            _h.add(phiTag);
+            _h.add(phi->phiKind);
+            _addDefinition(phi->value);
+        }
+
+        for (auto inst : bb->instructions()) {
+            _h.add(instructionTag);
+            _h.add(inst->kind);
+            switch (inst->kind) {
+            case instruction_kinds::loadConst: {
+                auto loadConst = static_cast<LoadConstInstruction *>(inst);
+                _h.add(loadConst->value);
+                _addDefinition(loadConst->result);
+                break;
+            }
+            case instruction_kinds::loadOffset: {
+                auto loadOffset = static_cast<LoadOffsetInstruction *>(inst);
+                _addValue(loadOffset->operand.get());
+                _h.add(loadOffset->offset);
+                _addDefinition(loadOffset->result);
+                break;
+            }
+            case instruction_kinds::unaryMath: {
+                auto unaryMath = static_cast<UnaryMathInstruction *>(inst);
+                _h.add(static_cast<uint64_t>(unaryMath->opcode));
+                _addValue(unaryMath->operand.get());
+                _addDefinition(unaryMath->result);
+                break;
+            }
+            case instruction_kinds::binaryMath: {
+                auto binaryMath = static_cast<BinaryMathInstruction *>(inst);
+                _h.add(static_cast<uint64_t>(binaryMath->opcode));
+                _addValue(binaryMath->left.get());
+                _addValue(binaryMath->right.get());
+                _addDefinition(binaryMath->result);
+                break;
+            }
+            case instruction_kinds::invoke: {
+                auto invoke = static_cast<InvokeInstruction *>(inst);
+                _h.addString(invoke->function);
+                _h.add(invoke->numOperands());
+                for (size_t i = 0; i < invoke->numOperands(); i++)
+                    _addValue(invoke->operand(i).get());
+                _h.add(invoke->numResults());
+                for (size_t i = 0; i < invoke->numResults(); i++)
+                    _addDefinition(invoke->result(i));
+                break;
+            }
+            default:
+                assert(!"hashFunction() only supports generic IR");
+            }
+        }
+
+        auto branch = bb->branch();
+        _h.add(branchTag);
+        if (!branch) {
+            _h.add(branch_kinds::null);
+        } else {
+            _h.add(branch->kind);
+            switch (branch->kind) {
+            case branch_kinds::functionReturn: {
+                auto functionReturn = static_cast<FunctionReturnBranch *>(branch);
+                _h.add(functionReturn->numOperands());
+                for (size_t i = 0; i < functionReturn->numOperands(); i++)
+                    _addValue(functionReturn->operand(i).get());
+                break;
+            }
+            case branch_kinds::unconditional: {
+                auto unconditional = static_cast<UnconditionalBranch *>(branch);
+                _h.add(_indexOf(unconditional->target));
+                break;
+            }
+            case branch_kinds::conditional: {
+                auto conditional = static_cast<ConditionalBranch *>(branch);
+                _h.add(_indexOf(conditional->ifTarget));
+                _h.add(_indexOf(conditional->elseTarget));
+                _addValue(conditional->operand.get());
+                break;
+            }
+            default:
+                assert(!"hashFunction() only supports generic IR");
+            }
+        }
+
+        // The order of edges matters: the backend processes them in list order.
+        for (auto edge : bb->source.edges()) {
+            auto it = _sinks.find(edge->sink());
+            assert(it != _sinks.end());
+            _h.add(edgeTag);
+            _h.add(it->second.first);
+            _h.add(it->second.second);
+            _addValue(edge->alias.get());
+        }
+    }
+
+    return _h.finish();
+}
+
+std::string FunctionHash::toString() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string s;
+    for (auto word : words) {
+        for (int i = 60; i >= 0; i -= 4)
+            s += digits[(word >> i) & 0xF];
+    }
+    return s;
+}
+
+FunctionHash hashFunction(Function *fn, uint64_t seed) {
+    return FunctionHasher{fn, seed}.run();
+}
+
+} // namespace lewis
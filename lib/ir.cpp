@@ -21,19 +21,18 @@ Type *globalInt64Type() {
     return &singleton;
 }
 
-void ValueOrigin::doSet(std::unique_ptr<Value> v) {
+void ValueOrigin::doSet(Value *v) {
     assert(!v->_origin);
     v->_origin = this;
-    _value = v.get();
-    v.release();
+    _value = v;
 }
 
-std::unique_ptr<Value> ValueOrigin::reset() {
+Value *ValueOrigin::reset() {
     assert(_value->_origin == this);
     auto v = _value;
     v->_origin = nullptr;
     _value = nullptr;
-    return std::unique_ptr<Value>{v};
+    return v;
 }
 
 void ValueUse::assign(Value *v) {
@@ -57,14 +56,42 @@ void Value::replaceAllUses(Value *other) {
     }
 }
 
-void DataFlowEdge::doAttach(std::unique_ptr<DataFlowEdge> edge,
-        DataFlowSource &source, DataFlowSink &sink) {
+// Distance between sequence numbers of adjacent instructions after (re-)numbering.
+// Allows ~20 insertions at the same position before we need to renumber.
+static constexpr uint64_t sequenceGap = uint64_t(1) << 20;
+
+void BasicBlock::numberInstructions() {
+    uint64_t seqNum = 0;
+    for (auto inst : instructions()) {
+        seqNum += sequenceGap;
+        inst->_seqNum = seqNum;
+    }
+    _numbered = true;
+}
+
+void BasicBlock::_numberInserted(Instruction *inst) {
+    auto pred = InstructionTree::predecessor(inst);
+    auto succ = InstructionTree::successor(inst);
+    auto lower = pred ? pred->_seqNum : 0;
+    if (!succ) {
+        inst->_seqNum = lower + sequenceGap;
+        return;
+    }
+
+    auto upper = succ->_seqNum;
+    if (upper - lower >= 2) {
+        inst->_seqNum = lower + (upper - lower) / 2;
+        return;
+    }
+    numberInstructions();
+}
+
+void DataFlowEdge::doAttach(DataFlowEdge *edge, DataFlowSource &source, DataFlowSink &sink) {
     assert(!edge->_source && !edge->_sink);
     edge->_source = &source;
     edge->_sink = &sink;
-    source._edges.push_back(edge.get());
-    sink._edges.push_back(edge.get());
-    edge.release();
+    source._edges.push_back(edge);
+    sink._edges.push_back(edge);
 }
 
 } // namespace lewis
@@ -0,0 +1,50 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <string_view>
+#include <elf.h>
+#include <lewis/jit/block-profile.hpp>
+
+namespace lewis::jit {
+
+namespace {
+    // MachineCodeEmitter names counters after their block symbols.
+    constexpr std::string_view counterSuffix = ".count";
+
+    void readCounter(BlockProfile &profile, const std::string &name, void *address,
+            bool reset) {
+        auto counter = static_cast<uint64_t *>(address);
+        profile.add(name.substr(0, name.size() - counterSuffix.size()), *counter);
+        if (reset)
+            *counter = 0;
+    }
+};
+
+BlockProfile readBlockProfile(LoadedObject *object, bool reset) {
+    BlockProfile profile;
+    for (auto &symbol : object->symbols()) {
+        if (symbol.executable || symbol.size != 8 || !symbol.name.ends_with(counterSuffix))
+            continue;
+        readCounter(profile, symbol.name, symbol.address, reset);
+    }
+    return profile;
+}
+
+BlockProfile readBlockProfile(elf::Object *elf, uintptr_t base, bool reset) {
+    BlockProfile profile;
+    for (auto symbol : elf->symbols()) {
+        if (!symbol->section || !symbol->name || symbol->size != 8)
+            continue;
+        if ((symbol->section->flags & SHF_EXECINSTR)
+                || !symbol->name->buffer.ends_with(counterSuffix))
+            continue;
+        assert(symbol->section->virtualAddress.has_value()
+                && "Object must be laid out before its counters can be read");
+        auto address = base + symbol->section->virtualAddress.value() + symbol->value;
+        readCounter(profile, symbol->name->buffer, reinterpret_cast<void *>(address), reset);
+    }
+    return profile;
+}
+
+} // namespace lewis::jit
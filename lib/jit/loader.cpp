@@ -0,0 +1,215 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <elf.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <lewis/jit/loader.hpp>
+
+namespace lewis::jit {
+
+namespace {
+    constexpr bool verbose = false;
+
+    constexpr uintptr_t pageSize = 0x1000;
+
+    int protectionOf(uint32_t flags) {
+        int prot = 0;
+        if (flags & PF_R)
+            prot |= PROT_READ;
+        if (flags & PF_W)
+            prot |= PROT_WRITE;
+        if (flags & PF_X)
+            prot |= PROT_EXEC;
+        return prot;
+    }
+};
+
+struct LoadedObjectImpl : LoadedObject {
+    LoadedObjectImpl(elf::Object *elf, SymbolResolver resolver);
+
+    LoadedObjectImpl(const LoadedObjectImpl &) = delete;
+
+    ~LoadedObjectImpl() override;
+
+    LoadedObjectImpl &operator= (const LoadedObjectImpl &) = delete;
+
+    // Separate from the constructor such that the destructor releases partial mappings.
+    void initialize();
+
+    void *lookup(const std::string &name) override;
+
+    const std::vector<LoadedSymbol> &symbols() override {
+        return _loadedSymbols;
+    }
+
+private:
+    void _load();
+    void _resolveRelocations();
+    void _collectSymbols();
+
+    elf::Object *_elf;
+    SymbolResolver _resolver;
+
+    // Lowest (page-aligned) virtual address that is mapped and size of the mapping.
+    uintptr_t _spanStart = 0;
+    size_t _spanSize = 0;
+    // Executable (final) and writable (temporary) views of the same memory.
+    uint8_t *_execView = nullptr;
+    uint8_t *_writeView = nullptr;
+
+    std::unordered_map<std::string, void *> _symbols;
+    std::vector<LoadedSymbol> _loadedSymbols;
+};
+
+LoadedObjectImpl::LoadedObjectImpl(elf::Object *elf, SymbolResolver resolver)
+: _elf{elf}, _resolver{std::move(resolver)} { }
+
+void LoadedObjectImpl::initialize() {
+    _load();
+    _resolveRelocations();
+    _collectSymbols();
+
+    // Drop the writable view; from now on, code is only reachable through the
+    // executable view (which is not writable).
+    munmap(_writeView, _spanSize);
+    _writeView = nullptr;
+
+    // We do not need the Object anymore.
+    _elf = nullptr;
+}
+
+LoadedObjectImpl::~LoadedObjectImpl() {
+    if (_writeView)
+        munmap(_writeView, _spanSize);
+    if (_execView)
+        munmap(_execView, _spanSize);
+}
+
+void LoadedObjectImpl::_load() {
+    if (_elf->segments.empty())
+        throw std::runtime_error("Object needs to be laid out before it can be loaded");
+
+    uintptr_t spanEnd = 0;
+    _spanStart = UINTPTR_MAX;
+    for (auto &segment : _elf->segments) {
+        auto address = segment.virtualAddress.value();
+        _spanStart = std::min(_spanStart, address & ~(pageSize - 1));
+        spanEnd = std::max(spanEnd, (address + segment.computedSize.value() + pageSize - 1)
+                & ~(pageSize - 1));
+    }
+    _spanSize = spanEnd - _spanStart;
+
+    // Map the same memory twice: the writable view is used to copy code and data,
+    // the executable view is exposed to callers.
+    int fd = memfd_create("lewis-jit", MFD_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Could not create memory file for JIT code");
+    if (ftruncate(fd, _spanSize)) {
+        close(fd);
+        throw std::runtime_error("Could not resize memory file for JIT code");
+    }
+
+    auto writeView = mmap(nullptr, _spanSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    auto execView = mmap(nullptr, _spanSize, PROT_NONE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (writeView == MAP_FAILED || execView == MAP_FAILED) {
+        if (writeView != MAP_FAILED)
+            munmap(writeView, _spanSize);
+        if (execView != MAP_FAILED)
+            munmap(execView, _spanSize);
+        throw std::runtime_error("Could not map memory for JIT code");
+    }
+    _writeView = static_cast<uint8_t *>(writeView);
+    _execView = static_cast<uint8_t *>(execView);
+
+    for (auto &segment : _elf->segments) {
+        auto address = segment.virtualAddress.value();
+        auto pageStart = address & ~(pageSize - 1);
+        auto pageEnd = (address + segment.computedSize.value() + pageSize - 1)
+                & ~(pageSize - 1);
+        if (mprotect(_execView + (pageStart - _spanStart), pageEnd - pageStart,
+                protectionOf(segment.flags)))
+            throw std::runtime_error("Could not change protection of JIT code");
+
+        // Only ByteSections carry code or data that is accessed at runtime;
+        // the remaining fragments are only consumed by the dynamic loader.
+        for (auto fragment : segment.fragments) {
+            auto section = hierarchy_cast<elf::ByteSection *>(fragment);
+            if (!section)
+                continue;
+            memcpy(_writeView + (section->virtualAddress.value() - _spanStart),
+                    section->buffer.data(), section->buffer.size());
+        }
+    }
+
+    if(verbose)
+        std::cout << "lewis: Loaded " << _elf->segments.size() << " segments at "
+                << (void *)_execView << std::endl;
+}
+
+void LoadedObjectImpl::_resolveRelocations() {
+    for (auto relocation : _elf->relocations()) {
+        assert(relocation->offset >= 0);
+        assert(relocation->section->virtualAddress.has_value()
+                && "Section layout must be fixed for LoadedObject");
+        auto symbol = relocation->symbol;
+        assert(symbol && symbol->name);
+
+        void *target;
+        if (symbol->section) {
+            target = _execView + (symbol->section->virtualAddress.value() + symbol->value
+                    - _spanStart);
+        } else {
+            target = _resolver ? _resolver(symbol->name->buffer) : nullptr;
+            if (!target)
+                throw std::runtime_error("Could not resolve symbol "
+                        + symbol->name->buffer);
+        }
+
+        auto slot = _writeView + (relocation->section->virtualAddress.value()
+                + relocation->offset - _spanStart);
+        uint64_t value;
+        if (relocation->type == R_X86_64_JUMP_SLOT || relocation->type == R_X86_64_GLOB_DAT) {
+            value = reinterpret_cast<uintptr_t>(target);
+        } else if (relocation->type == R_X86_64_64) {
+            value = reinterpret_cast<uintptr_t>(target) + relocation->addend.value_or(0);
+        } else {
+            throw std::runtime_error("Unexpected relocation type for LoadedObject");
+        }
+        memcpy(slot, &value, sizeof(uint64_t));
+    }
+}
+
+void LoadedObjectImpl::_collectSymbols() {
+    for (auto symbol : _elf->symbols()) {
+        if (!symbol->section || !symbol->name)
+            continue;
+        auto address = _execView
+                + (symbol->section->virtualAddress.value() + symbol->value - _spanStart);
+        _symbols.insert({symbol->name->buffer, address});
+        _loadedSymbols.push_back({symbol->name->buffer, address, symbol->size,
+                static_cast<bool>(symbol->section->flags & SHF_EXECINSTR)});
+    }
+}
+
+void *LoadedObjectImpl::lookup(const std::string &name) {
+    auto it = _symbols.find(name);
+    if (it == _symbols.end())
+        return nullptr;
+    return it->second;
+}
+
+std::unique_ptr<LoadedObject> LoadedObject::create(elf::Object *elf, SymbolResolver resolver) {
+    auto object = std::make_unique<LoadedObjectImpl>(elf, std::move(resolver));
+    object->initialize();
+    return object;
+}
+
+} // namespace lewis::jit
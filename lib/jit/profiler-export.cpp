@@ -0,0 +1,284 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <lewis/jit/profiler-export.hpp>
+#include <lewis/util/byte-encode.hpp>
+
+namespace lewis::jit {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Constants of the jitdump format; see tools/perf/Documentation/jitdump-specification.txt
+    // in the Linux source tree.
+    constexpr uint32_t jitDumpMagic = 0x4A695444; // "JiTD"
+    constexpr uint32_t jitDumpVersion = 1;
+    constexpr uint32_t jitCodeLoad = 0;
+    constexpr uint32_t jitCodeDebugInfo = 2;
+    constexpr uint32_t jitCodeClose = 3;
+
+    // perf correlates jitdump records with samples through CLOCK_MONOTONIC.
+    uint64_t timestamp() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // Block symbols are called <function>.bb<index>.
+    std::string functionOfBlock(const std::string &name) {
+        auto pos = name.rfind(".bb");
+        if (pos == std::string::npos)
+            return {};
+        return name.substr(0, pos);
+    }
+
+    // Symbols with a size are Functions, the remaining ones are blocks.
+    struct RawSymbol {
+        std::string name;
+        uintptr_t address;
+        size_t size;
+        const uint8_t *code;
+    };
+
+    std::vector<ExportedFunction> groupSymbols(std::vector<RawSymbol> symbols) {
+        std::vector<ExportedFunction> fns;
+        std::unordered_map<std::string, size_t> indices;
+        for (auto &symbol : symbols) {
+            if (!symbol.size)
+                continue;
+            indices.insert({symbol.name, fns.size()});
+            fns.push_back({symbol.name, symbol.address, symbol.size, symbol.code, {}});
+        }
+
+        for (auto &symbol : symbols) {
+            if (symbol.size)
+                continue;
+            auto it = indices.find(functionOfBlock(symbol.name));
+            if (it == indices.end())
+                continue;
+            auto &fn = fns[it->second];
+            assert(symbol.address >= fn.address && symbol.address <= fn.address + fn.size);
+            fn.blocks.push_back({symbol.name, symbol.address});
+        }
+
+        for (auto &fn : fns)
+            std::sort(fn.blocks.begin(), fn.blocks.end(),
+                    [] (const ExportedBlock &a, const ExportedBlock &b) {
+                return a.address < b.address;
+            });
+        return fns;
+    }
+};
+
+std::vector<ExportedFunction> collectFunctions(LoadedObject *object) {
+    std::vector<RawSymbol> symbols;
+    for (auto &symbol : object->symbols()) {
+        if (!symbol.executable)
+            continue;
+        auto address = reinterpret_cast<uintptr_t>(symbol.address);
+        symbols.push_back({symbol.name, address, symbol.size,
+                static_cast<const uint8_t *>(symbol.address)});
+    }
+    return groupSymbols(std::move(symbols));
+}
+
+std::vector<ExportedFunction> collectFunctions(elf::Object *elf, uintptr_t base) {
+    std::vector<RawSymbol> symbols;
+    for (auto symbol : elf->symbols()) {
+        if (!symbol->section || !symbol->name || !(symbol->section->flags & SHF_EXECINSTR))
+            continue;
+        auto section = hierarchy_cast<elf::ByteSection *>(symbol->section.get());
+        assert(section && section->virtualAddress.has_value()
+                && "Object must be laid out before its Functions can be collected");
+        symbols.push_back({symbol->name->buffer,
+                base + section->virtualAddress.value() + symbol->value, symbol->size,
+                section->buffer.data() + symbol->value});
+    }
+    return groupSymbols(std::move(symbols));
+}
+
+struct ProfilerExportImpl : ProfilerExport {
+    ProfilerExportImpl(unsigned formats, std::string directory)
+    : _formats{formats}, _directory{std::move(directory)} { }
+
+    ProfilerExportImpl(const ProfilerExportImpl &) = delete;
+
+    ~ProfilerExportImpl() override;
+
+    ProfilerExportImpl &operator= (const ProfilerExportImpl &) = delete;
+
+    // Separate from the constructor such that the destructor closes partially opened files.
+    void initialize();
+
+    void exportFunctions(const std::vector<ExportedFunction> &fns) override;
+
+private:
+    void _writeJitDump(const std::vector<uint8_t> &data);
+    void _encodeRecordHeader(util::ByteEncoder &e, uint32_t id, size_t size);
+
+    unsigned _formats;
+    std::string _directory;
+
+    std::mutex _mutex;
+    FILE *_perfMap = nullptr;
+    int _jitDumpFd = -1;
+    // perf detects jitdump files through an executable mapping of the file.
+    void *_jitDumpMarker = MAP_FAILED;
+    uint64_t _codeIndex = 0;
+};
+
+void ProfilerExportImpl::initialize() {
+    auto pid = std::to_string(getpid());
+
+    if (_formats & perfMap) {
+        auto path = _directory + "/perf-" + pid + ".map";
+        _perfMap = fopen(path.c_str(), "a");
+        if (!_perfMap)
+            throw std::runtime_error("Could not open perf map " + path);
+    }
+
+    if (_formats & jitDump) {
+        auto path = _directory + "/jit-" + pid + ".dump";
+        _jitDumpFd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+        if (_jitDumpFd < 0)
+            throw std::runtime_error("Could not open jitdump file " + path);
+        _jitDumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                MAP_PRIVATE, _jitDumpFd, 0);
+        if (_jitDumpMarker == MAP_FAILED)
+            throw std::runtime_error("Could not map jitdump file " + path);
+
+        std::vector<uint8_t> header;
+        {
+            util::ByteEncoder e{&header};
+            encode32(e, jitDumpMagic);
+            encode32(e, jitDumpVersion);
+            encode32(e, 40); // total_size of the header.
+            encode32(e, EM_X86_64);
+            encode32(e, 0); // pad1
+            encode32(e, getpid());
+            encode64(e, timestamp());
+            encode64(e, 0); // flags
+        }
+        _writeJitDump(header);
+    }
+}
+
+ProfilerExportImpl::~ProfilerExportImpl() {
+    if (_perfMap)
+        fclose(_perfMap);
+    if (_jitDumpFd >= 0) {
+        std::vector<uint8_t> record;
+        {
+            util::ByteEncoder e{&record};
+            _encodeRecordHeader(e, jitCodeClose, 16);
+        }
+        // Destructors cannot report errors; a missing close record is tolerated by perf.
+        try {
+            _writeJitDump(record);
+        } catch (const std::runtime_error &) { }
+        if (_jitDumpMarker != MAP_FAILED)
+            munmap(_jitDumpMarker, sysconf(_SC_PAGESIZE));
+        close(_jitDumpFd);
+    }
+}
+
+void ProfilerExportImpl::exportFunctions(const std::vector<ExportedFunction> &fns) {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    if (_perfMap) {
+        for (auto &fn : fns)
+            fprintf(_perfMap, "%lx %zx %s\n", static_cast<unsigned long>(fn.address),
+                    fn.size, fn.name.c_str());
+        fflush(_perfMap);
+    }
+
+    if (_jitDumpFd >= 0) {
+        auto pid = getpid();
+        auto tid = static_cast<uint32_t>(syscall(SYS_gettid));
+
+        // All records are written with a single write() to keep them intact
+        // even if other threads of the process write to the file.
+        std::vector<uint8_t> data;
+        for (auto &fn : fns) {
+            util::ByteEncoder e{&data};
+
+            // Debug info must precede the code load record that it belongs to.
+            // Each block is described as line <index> of a file that is named after it.
+            if (!fn.blocks.empty()) {
+                size_t size = 16 + 16;
+                for (auto &block : fn.blocks)
+                    size += 16 + block.name.size() + 1;
+                _encodeRecordHeader(e, jitCodeDebugInfo, size);
+                encode64(e, fn.address); // code_addr
+                encode64(e, fn.blocks.size()); // nr_entry
+                for (size_t i = 0; i < fn.blocks.size(); i++) {
+                    encode64(e, fn.blocks[i].address); // addr
+                    encode32(e, i + 1); // lineno
+                    encode32(e, 0); // discrim
+                    encodeChars(e, fn.blocks[i].name.c_str());
+                    encode8(e, 0);
+                }
+            }
+
+            _encodeRecordHeader(e, jitCodeLoad, 16 + 40 + fn.name.size() + 1 + fn.size);
+            encode32(e, pid);
+            encode32(e, tid);
+            encode64(e, fn.address); // vma
+            encode64(e, fn.address); // code_addr
+            encode64(e, fn.size); // code_size
+            encode64(e, _codeIndex++); // code_index
+            encodeChars(e, fn.name.c_str());
+            encode8(e, 0);
+            encodeBytes(e, {fn.code, fn.size});
+        }
+        _writeJitDump(data);
+    }
+
+    if (verbose)
+        std::cout << "lewis: Exported " << fns.size() << " functions to profilers"
+                << std::endl;
+}
+
+void ProfilerExportImpl::_writeJitDump(const std::vector<uint8_t> &data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        auto written = write(_jitDumpFd, data.data() + offset, data.size() - offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string{"Could not write jitdump file: "}
+                    + strerror(errno));
+        }
+        offset += written;
+    }
+}
+
+void ProfilerExportImpl::_encodeRecordHeader(util::ByteEncoder &e, uint32_t id,
+        size_t size) {
+    encode32(e, id);
+    encode32(e, size); // total_size (including this header).
+    encode64(e, timestamp());
+}
+
+std::unique_ptr<ProfilerExport> ProfilerExport::create(unsigned formats,
+        std::string directory) {
+    auto exporter = std::make_unique<ProfilerExportImpl>(formats, std::move(directory));
+    exporter->initialize();
+    return exporter;
+}
+
+} // namespace lewis::jit
@@ -0,0 +1,111 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <lewis/passes.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr bool verbose = false;
+
+    bool isUnused(Value *value) {
+        auto uses = value->uses();
+        return uses.begin() == uses.end();
+    }
+};
+
+struct EliminateDeadCodeImpl : EliminateDeadCodePass {
+    EliminateDeadCodeImpl(Function *fn)
+    : _fn{fn} { }
+
+    void run() override;
+
+private:
+    // Erases the instruction if it is dead. Operands that might have become dead
+    // are pushed to the worklist.
+    void _tryErase(BasicBlock *bb, Instruction *inst, std::vector<Instruction *> &worklist);
+
+    Function *_fn;
+    int _numErased = 0;
+};
+
+void EliminateDeadCodeImpl::run() {
+    std::vector<Instruction *> worklist;
+    for (auto bb : _fn->blocks()) {
+        for (auto inst : bb->instructions())
+            worklist.push_back(inst);
+
+        // Visit instructions in reverse order; in most cases, this erases chains of
+        // dead instructions in a single sweep. Operands of erased instructions are
+        // revisited, so the order does not matter for correctness.
+        while (!worklist.empty()) {
+            auto inst = worklist.back();
+            worklist.pop_back();
+            if (!inst->basicBlock())
+                continue; // Already erased.
+            _tryErase(bb, inst, worklist);
+        }
+    }
+
+    if (verbose)
+        std::cout << "lewis: Erased " << _numErased << " dead instructions" << std::endl;
+}
+
+void EliminateDeadCodeImpl::_tryErase(BasicBlock *bb, Instruction *inst,
+        std::vector<Instruction *> &worklist) {
+    assert(inst->basicBlock() == bb);
+
+    auto release = [&] (ValueUse &use) {
+        auto value = use.get();
+        use = nullptr;
+        // Values are local to their BasicBlock; only instructions of bb can become dead.
+        if (value->origin() && value->origin()->instruction())
+            worklist.push_back(value->origin()->instruction());
+    };
+
+    switch (inst->kind) {
+    case instruction_kinds::loadConst: {
+        auto loadConst = static_cast<LoadConstInstruction *>(inst);
+        if (!isUnused(loadConst->result.get()))
+            return;
+        break;
+    }
+    case instruction_kinds::loadOffset: {
+        auto loadOffset = static_cast<LoadOffsetInstruction *>(inst);
+        if (!isUnused(loadOffset->result.get()))
+            return;
+        release(loadOffset->operand);
+        break;
+    }
+    case instruction_kinds::unaryMath: {
+        auto unaryMath = static_cast<UnaryMathInstruction *>(inst);
+        if (!isUnused(unaryMath->result.get()))
+            return;
+        release(unaryMath->operand);
+        break;
+    }
+    case instruction_kinds::binaryMath: {
+        auto binaryMath = static_cast<BinaryMathInstruction *>(inst);
+        if (!isUnused(binaryMath->result.get()))
+            return;
+        release(binaryMath->left);
+        release(binaryMath->right);
+        break;
+    }
+    default:
+        // Calls have side effects; other instructions are not generic IR.
+        return;
+    }
+
+    bb->eraseInstruction(bb->iteratorTo(inst));
+    _numErased++;
+}
+
+std::unique_ptr<EliminateDeadCodePass> EliminateDeadCodePass::create(Function *fn) {
+    return std::make_unique<EliminateDeadCodeImpl>(fn);
+}
+
+} // namespace lewis
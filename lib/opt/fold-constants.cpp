@@ -0,0 +1,179 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <iostream>
+#include <optional>
+#include <lewis/passes.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Constants are stored zero-extended; int32 values only use the lower 32 bits
+    // (in the same way as LowerCodePass materializes them).
+    uint64_t truncateToType(Type *type, uint64_t value) {
+        if (type->typeKind == type_kinds::int32)
+            return static_cast<uint32_t>(value);
+        return value;
+    }
+
+    uint64_t allOnes(Type *type) {
+        return truncateToType(type, ~uint64_t{0});
+    }
+
+    std::optional<uint64_t> constantOf(Value *value) {
+        if (!value->origin() || !value->origin()->instruction())
+            return std::nullopt;
+        auto loadConst = hierarchy_cast<LoadConstInstruction *>(
+                value->origin()->instruction());
+        if (!loadConst)
+            return std::nullopt;
+        return truncateToType(value->getType(), loadConst->value);
+    }
+};
+
+struct FoldConstantsImpl : FoldConstantsPass {
+    FoldConstantsImpl(Function *fn)
+    : _fn{fn} { }
+
+    void run() override;
+
+private:
+    void _propagateThroughPhis(BasicBlock *bb);
+
+    // Replaces inst by a LoadConstInstruction that defines the same Value.
+    void _replaceByConstant(BasicBlock *bb, Instruction *inst, ValueOrigin &result,
+            uint64_t value);
+
+    Function *_fn;
+    int _numFolded = 0;
+};
+
+void FoldConstantsImpl::run() {
+    for (auto bb : _fn->blocks()) {
+        _propagateThroughPhis(bb);
+
+        auto it = bb->instructions().begin();
+        while (it != bb->instructions().end()) {
+            auto inst = *it;
+            ++it;
+
+            switch (inst->kind) {
+            case instruction_kinds::unaryMath: {
+                auto unaryMath = static_cast<UnaryMathInstruction *>(inst);
+                auto type = unaryMath->result.get()->getType();
+                auto operand = constantOf(unaryMath->operand.get());
+                if (!operand)
+                    break;
+                assert(unaryMath->opcode == UnaryMathOpcode::negate);
+                unaryMath->operand = nullptr;
+                _replaceByConstant(bb, unaryMath, unaryMath->result,
+                        truncateToType(type, -*operand));
+                break;
+            }
+            case instruction_kinds::binaryMath: {
+                auto binaryMath = static_cast<BinaryMathInstruction *>(inst);
+                auto type = binaryMath->result.get()->getType();
+                auto left = constantOf(binaryMath->left.get());
+                auto right = constantOf(binaryMath->right.get());
+
+                std::optional<uint64_t> folded;
+                Value *forwarded = nullptr;
+                if (left && right) {
+                    if (binaryMath->opcode == BinaryMathOpcode::add) {
+                        folded = truncateToType(type, *left + *right);
+                    } else {
+                        assert(binaryMath->opcode == BinaryMathOpcode::bitwiseAnd);
+                        folded = *left & *right;
+                    }
+                } else if (left || right) {
+                    // Exactly one of the operands is a constant.
+                    auto constant = left ? *left : *right;
+                    auto variable = left ? binaryMath->right.get() : binaryMath->left.get();
+                    if (binaryMath->opcode == BinaryMathOpcode::add) {
+                        if (!constant)
+                            forwarded = variable;
+                    } else {
+                        assert(binaryMath->opcode == BinaryMathOpcode::bitwiseAnd);
+                        if (!constant) {
+                            folded = 0;
+                        } else if (constant == allOnes(type)) {
+                            forwarded = variable;
+                        }
+                    }
+                }
+
+                if (folded) {
+                    binaryMath->left = nullptr;
+                    binaryMath->right = nullptr;
+                    _replaceByConstant(bb, binaryMath, binaryMath->result, *folded);
+                } else if (forwarded) {
+                    if (verbose)
+                        std::cout << "lewis: Forwarding operand of BinaryMathInstruction"
+                                << std::endl;
+                    binaryMath->result.get()->replaceAllUses(forwarded);
+                    binaryMath->left = nullptr;
+                    binaryMath->right = nullptr;
+                    bb->eraseInstruction(bb->iteratorTo(binaryMath));
+                    _numFolded++;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    if (verbose)
+        std::cout << "lewis: Folded " << _numFolded << " instructions" << std::endl;
+}
+
+void FoldConstantsImpl::_propagateThroughPhis(BasicBlock *bb) {
+    for (auto phi : bb->phis()) {
+        auto dataFlowPhi = hierarchy_cast<DataFlowPhi *>(phi);
+        if (!dataFlowPhi)
+            continue;
+
+        std::optional<uint64_t> common;
+        bool isConstant = true;
+        for (auto edge : dataFlowPhi->sink.edges()) {
+            auto constant = constantOf(edge->alias.get());
+            if (!constant || (common && *common != *constant)) {
+                isConstant = false;
+                break;
+            }
+            common = constant;
+        }
+        if (!isConstant || !common)
+            continue;
+
+        // The PhiNode stays in place (as its edges cannot be removed); it simply
+        // becomes unused.
+        auto phiValue = phi->value.get();
+        auto loadConst = bb->insertInstruction(bb->instructions().begin(),
+                _fn->create<LoadConstInstruction>(*common));
+        auto value = loadConst->result.set(_fn->create<LocalValue>());
+        value->setType(phiValue->getType());
+        phiValue->replaceAllUses(value);
+        _numFolded++;
+    }
+}
+
+void FoldConstantsImpl::_replaceByConstant(BasicBlock *bb, Instruction *inst,
+        ValueOrigin &result, uint64_t value) {
+    if (verbose)
+        std::cout << "lewis: Folding instruction to constant " << value << std::endl;
+    auto loadConst = _fn->create<LoadConstInstruction>(value);
+    loadConst->result.set(result.reset());
+    bb->replaceInstruction(bb->iteratorTo(inst), loadConst);
+    _numFolded++;
+}
+
+std::unique_ptr<FoldConstantsPass> FoldConstantsPass::create(Function *fn) {
+    return std::make_unique<FoldConstantsImpl>(fn);
+}
+
+} // namespace lewis
@@ -0,0 +1,106 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <lewis/liveness.hpp>
+#include <lewis/passes.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr bool verbose = false;
+};
+
+struct InsertDataFlowPhisImpl : InsertDataFlowPhisPass {
+    InsertDataFlowPhisImpl(Function *fn)
+    : _fn{fn} { }
+
+    void run() override;
+
+private:
+    // DataFlowPhi that defines the Value with the given index in the BasicBlock.
+    DataFlowPhi *_phiOf(BasicBlock *bb, size_t index) {
+        auto it = _phis[bb->ordinal()].find(index);
+        assert(it != _phis[bb->ordinal()].end());
+        return it->second;
+    }
+
+    Function *_fn;
+    std::unique_ptr<Liveness> _liveness;
+    // Indexed by BasicBlock::ordinal(). Maps Liveness indices to DataFlowPhis.
+    std::vector<std::unordered_map<size_t, DataFlowPhi *>> _phis;
+};
+
+void InsertDataFlowPhisImpl::run() {
+    _liveness = Liveness::compute(_fn);
+
+    size_t numBlocks = 0;
+    for (auto bb : _fn->blocks())
+        numBlocks = std::max(numBlocks, bb->ordinal() + 1);
+    _phis.resize(numBlocks);
+
+    // First, create a DataFlowPhi for each Value that is live-in.
+    size_t numPhis = 0;
+    for (auto bb : _fn->blocks()) {
+        _liveness->liveIn(bb).forEach([&] (size_t k) {
+            // The entry block has no predecessors that could provide the Value.
+            assert(bb != *_fn->blocks().begin() && "Value is used before its definition");
+
+            auto phi = bb->attachNewPhi<DataFlowPhi>();
+            auto value = phi->value.set(_fn->create<LocalValue>());
+            value->setType(_liveness->valueAt(k)->getType());
+            _phis[bb->ordinal()].insert({k, phi});
+            numPhis++;
+        });
+    }
+    if (!numPhis)
+        return;
+
+    // Rewrite all uses outside of the defining block to the DataFlowPhis.
+    // This has to happen before the DataFlowEdges are created: their aliases refer
+    // to the original Values when the source block is the defining block.
+    std::vector<ValueUse *> nonLocalUses;
+    for (size_t k = 0; k < _liveness->numValues(); k++) {
+        auto value = _liveness->valueAt(k);
+        auto definingBlock = _liveness->definingBlock(value);
+
+        nonLocalUses.clear();
+        for (auto use : value->uses()) {
+            if (_liveness->usingBlock(use) != definingBlock)
+                nonLocalUses.push_back(use);
+        }
+        for (auto use : nonLocalUses)
+            use->assign(_phiOf(_liveness->usingBlock(use), k)->value.get());
+    }
+
+    // Finally, connect each DataFlowPhi to all predecessors. A predecessor either defines
+    // the Value or the Value is live-in at the predecessor, too.
+    for (auto bb : _fn->blocks()) {
+        _liveness->liveIn(bb).forEach([&] (size_t k) {
+            auto value = _liveness->valueAt(k);
+            auto phi = _phiOf(bb, k);
+            for (auto predecessor : _liveness->predecessors(bb)) {
+                auto edge = DataFlowEdge::attach(_fn->create<DataFlowEdge>(),
+                        predecessor->source, phi->sink);
+                if (_liveness->definingBlock(value) == predecessor) {
+                    edge->alias = value;
+                } else {
+                    edge->alias = _phiOf(predecessor, k)->value.get();
+                }
+            }
+        });
+    }
+
+    if (verbose)
+        std::cout << "lewis: Inserted " << numPhis << " DataFlowPhis" << std::endl;
+}
+
+std::unique_ptr<InsertDataFlowPhisPass> InsertDataFlowPhisPass::create(Function *fn) {
+    return std::make_unique<InsertDataFlowPhisImpl>(fn);
+}
+
+} // namespace lewis
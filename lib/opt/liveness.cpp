@@ -0,0 +1,257 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <unordered_map>
+#include <lewis/liveness.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr bool verbose = false;
+};
+
+struct LivenessImpl : Liveness {
+    LivenessImpl(Function *fn)
+    : _fn{fn} { }
+
+    void compute();
+
+    size_t numValues() override {
+        return _values.size();
+    }
+
+    Value *valueAt(size_t index) override {
+        assert(index < _values.size());
+        return _values[index];
+    }
+
+    size_t indexOf(Value *value) override {
+        auto it = _indices.find(value);
+        assert(it != _indices.end());
+        return it->second;
+    }
+
+    BasicBlock *definingBlock(Value *value) override {
+        return _definingBlocks[indexOf(value)];
+    }
+
+    BasicBlock *usingBlock(ValueUse *use) override {
+        if (use->instruction())
+            return use->instruction()->basicBlock();
+        auto it = _nonInstructionUses.find(use);
+        assert(it != _nonInstructionUses.end());
+        return it->second;
+    }
+
+    const std::vector<BasicBlock *> &successors(BasicBlock *bb) override {
+        return _blocks[bb->ordinal()].successors;
+    }
+
+    const std::vector<BasicBlock *> &predecessors(BasicBlock *bb) override {
+        return _blocks[bb->ordinal()].predecessors;
+    }
+
+    const util::BitSet &liveIn(BasicBlock *bb) override {
+        return _blocks[bb->ordinal()].liveIn;
+    }
+
+    const util::BitSet &liveOut(BasicBlock *bb) override {
+        return _blocks[bb->ordinal()].liveOut;
+    }
+
+private:
+    struct BlockInfo {
+        BasicBlock *bb = nullptr;
+        std::vector<BasicBlock *> successors;
+        std::vector<BasicBlock *> predecessors;
+        // Values defined by the block.
+        util::BitSet defs;
+        util::BitSet liveIn;
+        util::BitSet liveOut;
+    };
+
+    void _numberValues();
+    void _collectEdges();
+    void _solve();
+
+    void _define(BasicBlock *bb, Value *value);
+    void _addSuccessor(BasicBlock *bb, BasicBlock *successor);
+
+    Function *_fn;
+    // Indexed by BasicBlock::ordinal().
+    std::vector<BlockInfo> _blocks;
+    std::vector<Value *> _values;
+    std::vector<BasicBlock *> _definingBlocks;
+    std::unordered_map<Value *, size_t> _indices;
+    // Maps uses by branches and DataFlowEdges to their BasicBlock.
+    std::unordered_map<ValueUse *, BasicBlock *> _nonInstructionUses;
+};
+
+void LivenessImpl::compute() {
+    size_t numBlocks = 0;
+    for (auto bb : _fn->blocks())
+        numBlocks = std::max(numBlocks, bb->ordinal() + 1);
+    _blocks.resize(numBlocks);
+    for (auto bb : _fn->blocks())
+        _blocks[bb->ordinal()].bb = bb;
+
+    _numberValues();
+    _collectEdges();
+    _solve();
+}
+
+void LivenessImpl::_numberValues() {
+    for (auto bb : _fn->blocks()) {
+        for (auto phi : bb->phis())
+            _define(bb, phi->value.get());
+
+        for (auto inst : bb->instructions()) {
+            switch (inst->kind) {
+            case instruction_kinds::loadConst:
+                _define(bb, static_cast<LoadConstInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::loadOffset:
+                _define(bb, static_cast<LoadOffsetInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::unaryMath:
+                _define(bb, static_cast<UnaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::binaryMath:
+                _define(bb, static_cast<BinaryMathInstruction *>(inst)->result.get());
+                break;
+            case instruction_kinds::invoke: {
+                auto invoke = static_cast<InvokeInstruction *>(inst);
+                for (size_t i = 0; i < invoke->numResults(); i++)
+                    _define(bb, invoke->result(i).get());
+                break;
+            }
+            default:
+                assert(!"Liveness only supports generic IR");
+            }
+        }
+    }
+}
+
+void LivenessImpl::_collectEdges() {
+    for (auto bb : _fn->blocks()) {
+        auto branch = bb->branch();
+        assert(branch);
+        switch (branch->kind) {
+        case branch_kinds::functionReturn: {
+            auto functionReturn = static_cast<FunctionReturnBranch *>(branch);
+            for (size_t i = 0; i < functionReturn->numOperands(); i++)
+                _nonInstructionUses.insert({&functionReturn->operand(i), bb});
+            break;
+        }
+        case branch_kinds::unconditional: {
+            auto unconditional = static_cast<UnconditionalBranch *>(branch);
+            _addSuccessor(bb, unconditional->target);
+            break;
+        }
+        case branch_kinds::conditional: {
+            auto conditional = static_cast<ConditionalBranch *>(branch);
+            _nonInstructionUses.insert({&conditional->operand, bb});
+            _addSuccessor(bb, conditional->ifTarget);
+            _addSuccessor(bb, conditional->elseTarget);
+            break;
+        }
+        default:
+            assert(!"Liveness only supports generic IR");
+        }
+
+        for (auto edge : bb->source.edges())
+            _nonInstructionUses.insert({&edge->alias, bb});
+    }
+}
+
+void LivenessImpl::_solve() {
+    auto n = _values.size();
+    for (auto &info : _blocks) {
+        info.defs = util::BitSet{n};
+        info.liveIn = util::BitSet{n};
+        info.liveOut = util::BitSet{n};
+    }
+    for (size_t k = 0; k < n; k++)
+        _blocks[_definingBlocks[k]->ordinal()].defs.set(k);
+
+    // Initialize liveIn to the upward-exposed uses. In SSA form, a use in the defining
+    // block always follows the definition, hence all other uses are upward-exposed.
+    bool anyLiveIn = false;
+    for (size_t k = 0; k < n; k++) {
+        for (auto use : _values[k]->uses()) {
+            auto bb = usingBlock(use);
+            if (bb == _definingBlocks[k])
+                continue;
+            _blocks[bb->ordinal()].liveIn.set(k);
+            anyLiveIn = true;
+        }
+    }
+    // Fast path: all data flow is already block-local.
+    if (!anyLiveIn)
+        return;
+
+    // Iterate liveOut = union of liveIn of successors, liveIn |= liveOut - defs.
+    // Data flows backwards; hence, visit the blocks in reverse order first.
+    std::vector<BasicBlock *> worklist;
+    std::vector<bool> onWorklist(_blocks.size(), false);
+    for (auto &info : _blocks) {
+        if (!info.bb)
+            continue;
+        worklist.push_back(info.bb);
+        onWorklist[info.bb->ordinal()] = true;
+    }
+
+    size_t numVisits = 0;
+    while (!worklist.empty()) {
+        auto bb = worklist.back();
+        worklist.pop_back();
+        onWorklist[bb->ordinal()] = false;
+        numVisits++;
+
+        auto &info = _blocks[bb->ordinal()];
+        for (auto successor : info.successors)
+            info.liveOut.merge(_blocks[successor->ordinal()].liveIn);
+        if (!info.liveIn.mergeExcept(info.liveOut, info.defs))
+            continue;
+
+        for (auto predecessor : info.predecessors) {
+            if (onWorklist[predecessor->ordinal()])
+                continue;
+            worklist.push_back(predecessor);
+            onWorklist[predecessor->ordinal()] = true;
+        }
+    }
+
+    if (verbose)
+        std::cout << "lewis: Liveness converged after " << numVisits
+                << " block visits" << std::endl;
+}
+
+void LivenessImpl::_define(BasicBlock *bb, Value *value) {
+    if (!value)
+        return;
+    auto [it, inserted] = _indices.insert({value, _values.size()});
+    assert(inserted && "Value is defined more than once");
+    _values.push_back(value);
+    _definingBlocks.push_back(bb);
+}
+
+void LivenessImpl::_addSuccessor(BasicBlock *bb, BasicBlock *successor) {
+    assert(successor);
+    auto &successors = _blocks[bb->ordinal()].successors;
+    if (std::find(successors.begin(), successors.end(), successor) != successors.end())
+        return;
+    successors.push_back(successor);
+    _blocks[successor->ordinal()].predecessors.push_back(bb);
+}
+
+std::unique_ptr<Liveness> Liveness::compute(Function *fn) {
+    auto liveness = std::make_unique<LivenessImpl>(fn);
+    liveness->compute();
+    return liveness;
+}
+
+} // namespace lewis
@@ -0,0 +1,143 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <cassert>
+#include <functional>
+#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <lewis/passes.hpp>
+
+namespace lewis {
+
+namespace {
+    constexpr bool verbose = false;
+
+    // Identifies the value that an instruction computes.
+    struct ValueKey {
+        InstructionKindType kind;
+        int opcode;
+        Value *left;
+        Value *right;
+        uint64_t immediate;
+        Type *type;
+
+        bool operator== (const ValueKey &other) const {
+            return kind == other.kind && opcode == other.opcode
+                    && left == other.left && right == other.right
+                    && immediate == other.immediate && type == other.type;
+        }
+    };
+
+    struct HashValueKey {
+        size_t operator() (const ValueKey &key) const {
+            size_t h = std::hash<uint64_t>{}(key.immediate);
+            auto combine = [&] (size_t x) {
+                h ^= x + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+            };
+            combine(key.kind);
+            combine(key.opcode);
+            combine(std::hash<Value *>{}(key.left));
+            combine(std::hash<Value *>{}(key.right));
+            combine(std::hash<Type *>{}(key.type));
+            return h;
+        }
+    };
+
+    using ValueTable = std::unordered_map<ValueKey, Value *, HashValueKey>;
+};
+
+struct NumberLocalValuesImpl : NumberLocalValuesPass {
+    NumberLocalValuesImpl(Function *fn)
+    : _fn{fn} { }
+
+    void run() override;
+
+private:
+    Function *_fn;
+    int _numReplaced = 0;
+};
+
+void NumberLocalValuesImpl::run() {
+    for (auto bb : _fn->blocks()) {
+        // Values that do not depend on memory.
+        ValueTable pureValues;
+        // Values that are loaded from memory. Invalidated by calls.
+        ValueTable loadedValues;
+
+        auto it = bb->instructions().begin();
+        while (it != bb->instructions().end()) {
+            auto inst = *it;
+            ++it;
+
+            ValueTable *table;
+            ValueKey key;
+            ValueOrigin *result;
+            switch (inst->kind) {
+            case instruction_kinds::loadConst: {
+                auto loadConst = static_cast<LoadConstInstruction *>(inst);
+                table = &pureValues;
+                key = {inst->kind, 0, nullptr, nullptr, loadConst->value,
+                        loadConst->result.get()->getType()};
+                result = &loadConst->result;
+                break;
+            }
+            case instruction_kinds::loadOffset: {
+                auto loadOffset = static_cast<LoadOffsetInstruction *>(inst);
+                table = &loadedValues;
+                key = {inst->kind, 0, loadOffset->operand.get(), nullptr,
+                        static_cast<uint64_t>(loadOffset->offset),
+                        loadOffset->result.get()->getType()};
+                result = &loadOffset->result;
+                break;
+            }
+            case instruction_kinds::unaryMath: {
+                auto unaryMath = static_cast<UnaryMathInstruction *>(inst);
+                table = &pureValues;
+                key = {inst->kind, static_cast<int>(unaryMath->opcode),
+                        unaryMath->operand.get(), nullptr, 0,
+                        unaryMath->result.get()->getType()};
+                result = &unaryMath->result;
+                break;
+            }
+            case instruction_kinds::binaryMath: {
+                auto binaryMath = static_cast<BinaryMathInstruction *>(inst);
+                // Both opcodes are commutative; canonicalize the order of the operands.
+                auto left = binaryMath->left.get();
+                auto right = binaryMath->right.get();
+                if (std::less<Value *>{}(right, left))
+                    std::swap(left, right);
+                table = &pureValues;
+                key = {inst->kind, static_cast<int>(binaryMath->opcode), left, right, 0,
+                        binaryMath->result.get()->getType()};
+                result = &binaryMath->result;
+                break;
+            }
+            case instruction_kinds::invoke:
+                loadedValues.clear();
+                continue;
+            default:
+                continue;
+            }
+
+            auto [entry, inserted] = table->insert({key, result->get()});
+            if (inserted)
+                continue;
+
+            if (verbose)
+                std::cout << "lewis: Reusing value of an earlier instruction" << std::endl;
+            result->get()->replaceAllUses(entry->second);
+            _numReplaced++;
+            // The instruction is dead now; EliminateDeadCodePass removes it.
+        }
+    }
+
+    if (verbose)
+        std::cout << "lewis: Replaced " << _numReplaced << " values" << std::endl;
+}
+
+std::unique_ptr<NumberLocalValuesPass> NumberLocalValuesPass::create(Function *fn) {
+    return std::make_unique<NumberLocalValuesImpl>(fn);
+}
+
+} // namespace lewis
@@ -0,0 +1,53 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <cassert>
+#include <lewis/profile.hpp>
+
+namespace lewis {
+
+std::vector<uint64_t> BlockProfile::countsOf(Function *fn) const {
+    std::vector<uint64_t> result;
+    bool found = false;
+    for (auto bb : fn->blocks()) {
+        assert(bb->ordinal() == result.size());
+        auto it = counts.find(blockSymbolName(fn->name, bb->ordinal()));
+        if (it != counts.end()) {
+            result.push_back(it->second);
+            found = true;
+        } else {
+            result.push_back(0);
+        }
+    }
+    if (!found)
+        return {};
+    return result;
+}
+
+std::vector<int> weighBlocks(Function *fn, const BlockProfile *profile, int maxWeight) {
+    assert(maxWeight >= 1);
+    std::vector<uint64_t> counts;
+    if (profile)
+        counts = profile->countsOf(fn);
+
+    std::vector<int> weights;
+    for (auto bb : fn->blocks()) {
+        (void)bb;
+        weights.push_back(1);
+    }
+    if (counts.empty())
+        return weights;
+
+    uint64_t maxCount = *std::max_element(counts.begin(), counts.end());
+    if (!maxCount)
+        return weights;
+    for (size_t i = 0; i < weights.size(); i++) {
+        // Computed in floating point to avoid overflows for large counts.
+        auto scaled = static_cast<double>(counts[i]) / maxCount * maxWeight;
+        weights[i] = std::max(1, static_cast<int>(scaled));
+    }
+    return weights;
+}
+
+} // namespace lewis
@@ -1,12 +1,18 @@
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <optional>
 #include <queue>
 #include <unordered_map>
-#include <frg/interval_tree.hpp>
+#include <vector>
+#include <frg/list.hpp>
 #include <lewis/target-x86_64/arch-ir.hpp>
 #include <lewis/target-x86_64/arch-passes.hpp>
+#include <lewis/util/arena.hpp>
 
 namespace lewis::targets::x86_64 {
 
@@ -17,10 +23,23 @@ namespace {
     // Every GPR except for RSP.
     constexpr uint64_t gprMask = 0xFFEF;
 
-    std::unique_ptr<Value> cloneModeValue(Value *value) {
+    // Spill slots are addressed relative to RSP.
+    constexpr int stackPointerRegister = 4;
+
+    // RBX, RBP and R12 - R15 are preserved across calls (i.e., owned by the caller).
+    constexpr uint64_t calleeSavedRegisters = 0xF028;
+
+    // Factor by which each crossed call raises the allocation priority of a compound.
+    constexpr int callCrossingPriority = 16;
+
+    // Upper bound of the block weights derived from profiles. Keeps the sum of all
+    // penalties well within the range of int.
+    constexpr int maxBlockWeight = 256;
+
+    Value *cloneModeValue(Function *fn, Value *value) {
         auto registerMode = hierarchy_cast<RegisterMode *>(value);
         assert(registerMode);
-        auto clone = std::make_unique<RegisterMode>();
+        auto clone = fn->create<RegisterMode>();
         clone->operandSize = registerMode->operandSize;
         return clone;
     }
@@ -84,16 +103,15 @@ struct ProgramCounter {
         return !(*this == other);
     }
 
+    // Requires the BasicBlocks to be in numbering mode (see BasicBlock::numberInstructions()).
     bool operator< (const ProgramCounter &other) const {
         if (block != other.block)
-            return block < other.block;
+            return block->ordinal() < other.block->ordinal();
         if (subBlock != other.subBlock)
             return subBlock < other.subBlock;
         if (instruction != other.instruction) {
-            auto index = block->indexOfInstruction(instruction);
-            auto otherIndex = block->indexOfInstruction(other.instruction);
-            if (index != otherIndex)
-                return index < otherIndex;
+            assert(instruction && other.instruction);
+            return instruction->sequenceNumber() < other.instruction->sequenceNumber();
         }
         return subInstruction < other.subInstruction;
     }
@@ -116,6 +134,14 @@ struct ProgramCounter {
 
 struct LiveCompound;
 
+// Penalty that is incurred if two LiveCompounds are not allocated to the same register
+// (i.e. if a move is required between them). Stored in the adjacency lists of both compounds.
+struct Penalty {
+    LiveCompound *other;
+    // Cost of the move. Can be scaled by the expected execution frequency of the move.
+    int weight;
+};
+
 struct LiveInterval {
     LiveInterval()
     : equivalencePointer{this} { }
@@ -138,12 +164,13 @@ struct LiveInterval {
     ProgramCounter originPc;
     ProgramCounter finalPc;
 
+    // Dense indices of originPc and finalPc (see AllocateRegistersImpl::_slotOf()).
+    // Only valid while the interval is allocated.
+    int originSlot = -1;
+    int finalSlot = -1;
+
     // List of intervals that share the same compound.
     frg::default_list_hook<LiveInterval> compoundHook;
-
-    // Intrusive tree that stores all intervals.
-    frg::rbtree_hook rbHook;
-    frg::interval_hook<ProgramCounter> intervalHook;
 };
 
 // Encapsulates multiple LiveIntervals that are always allocated to the same register.
@@ -166,10 +193,25 @@ struct LiveCompound {
     int allocatedRegister = -1;
 
     uint64_t possibleRegisters = 0;
-};
 
-struct Penalty {
-    std::array<LiveCompound *, 2> compounds;
+    std::vector<Penalty> penalties;
+
+    // Compounds that are not spillable must be allocated to a register.
+    bool spillable = false;
+
+    // Number of accesses (definitions and uses) per instruction covered by the compound.
+    // Compounds with high weight are allocated first and spilled last.
+    double spillWeight = 0;
+
+    // Contribution of this compound to _achievedCost.
+    int cost = 0;
+
+    // Index of the stack slot if the compound was spilled.
+    int spillSlot = -1;
+
+    // Number of calls that clobber registers while the compound is live.
+    // Compounds that cross calls can only be allocated to callee-saved registers.
+    int numCrossedCalls = 0;
 };
 
 // Represents a node of the move chain graph.
@@ -216,6 +258,10 @@ struct MoveChain {
     // Sanity check that we emit each move exactly once.
     bool didMoveToThisTarget = false;
 
+    // True if the source value was pushed to the stack to break a cycle.
+    // In this case, the move to this target is emitted as a pop.
+    bool throughStack = false;
+
     // ----------------------------------------------------------------------
     // Members defined for cycle representatives (pointed to by cyclePointer).
     // ----------------------------------------------------------------------
@@ -225,58 +271,173 @@ struct MoveChain {
 };
 
 struct AllocateRegistersImpl : AllocateRegistersPass {
-    AllocateRegistersImpl(Function *fn)
-    : _fn{fn} { }
+    AllocateRegistersImpl(Function *fn, AllocationOptions options)
+    : _fn{fn}, _options{options} { }
 
     void run() override;
 
+    AllocationStats stats() override {
+        return AllocationStats{_achievedCost, _numRegisterMoves, _numFusedMoves,
+                _numSpilledCompounds, _numSpillMoves};
+    }
+
 private:
+    void _addPenalty(LiveCompound *first, LiveCompound *second, int weight) {
+        // The baseline tier does not build the penalty graph.
+        if (_options.tier == AllocationTier::baseline)
+            return;
+        first->penalties.push_back(Penalty{second, weight});
+        second->penalties.push_back(Penalty{first, weight});
+    }
+
+    void _enqueueCompound(LiveCompound *compound, double weight) {
+        _unrestrictedQueue.push(QueueItem{weight, _numQueued++, compound});
+    }
+
+    void _computeSpillWeight(LiveCompound *compound);
+    void _countCrossedCalls(LiveCompound *compound);
     void _allocateCompound(LiveCompound *compound);
+    int _evictForCompound(LiveCompound *compound);
+    void _spillCompound(LiveCompound *compound);
+    void _assignSlots(BasicBlock *bb);
+    int _slotOf(const ProgramCounter &pc);
+    uint64_t _occupiedRegisters(LiveInterval *interval);
+    void _insertAllocation(LiveInterval *interval);
+    void _removeAllocation(LiveInterval *interval);
     void _collectBlockIntervals(BasicBlock *bb);
     std::optional<ProgramCounter> _determineFinalPc(BasicBlock *bb, Value *v);
+    void _placeFrame();
     void _establishAllocation(BasicBlock *bb);
 
     Function *_fn;
+    AllocationOptions _options;
+
+    // Owns all LiveCompounds and LiveIntervals; they are freed together with the pass.
+    util::Arena _arena;
+
+    // Expected execution frequency of each block (indexed by ordinal). Scales penalties
+    // and spill weights. All ones if there is no profile.
+    std::vector<int> _blockWeights;
+
+    // Calls of each block (indexed by ordinal), in program order.
+    std::vector<std::vector<Instruction *>> _callsOfBlock;
+
+    // The following vectors are indexed by ordinal and implement shrink-wrapping:
+    // the prologue is only executed on paths that reach blocks that need the frame.
+    // Blocks that need the frame as they contain calls (which require the stack to be
+    // aligned), access spill slots or callee-saved registers.
+    std::vector<bool> _needsFrame;
+    // Blocks that execute with the frame established; closed under successors.
+    std::vector<bool> _inFrame;
+    // Blocks that start with the prologue.
+    std::vector<bool> _savesFrame;
 
     std::unordered_map<PhiNode *, LiveCompound *> _phiCompounds;
 
+    struct QueueItem {
+        // Compounds with higher weight are allocated first. Ties are broken in FIFO order.
+        bool operator< (const QueueItem &other) const {
+            if (weight != other.weight)
+                return weight < other.weight;
+            return sequence > other.sequence;
+        }
+
+        double weight;
+        size_t sequence;
+        LiveCompound *compound;
+    };
+
     // Stores all intervals that still need to be allocated.
-    // TODO: Prioritize the intervals in some way, e.g. by use density.
-    std::queue<LiveCompound *> _restrictedQueue;
-    std::queue<LiveCompound *> _unrestrictedQueue;
+    std::vector<LiveCompound *> _restrictedCompounds;
+    std::priority_queue<QueueItem> _unrestrictedQueue;
+    size_t _numQueued = 0;
+
+    // Unrestricted compounds are only enqueued once all blocks are collected,
+    // as the spill weight of phi compounds depends on multiple blocks.
+    std::vector<LiveCompound *> _unrestrictedCompounds;
+
+    // Each ProgramCounter of a block is mapped to a dense index ("slot") within the block:
+    // slot 0 is beforeBlock, each instruction occupies three slots (before, at and after it)
+    // and the last slot is afterBlock. Instructions that are inserted by spilling have
+    // no slots of their own; all of their ProgramCounters map to the slot of their anchor.
+    struct InstructionSlot {
+        int base;
+        bool anchored;
+    };
+    std::unordered_map<Instruction *, InstructionSlot> _instructionSlots;
+    std::vector<int> _numSlots;
 
-    std::vector<Penalty> _penalties;
+    // Intervals that have already been allocated, for each block (indexed by ordinal).
+    std::vector<std::vector<LiveInterval *>> _allocatedIntervals;
 
-    // Stores all intervals that have already been allocated.
-    frg::interval_tree<
-        LiveInterval,
-        ProgramCounter,
-        &LiveInterval::originPc,
-        &LiveInterval::finalPc,
-        &LiveInterval::rbHook,
-        &LiveInterval::intervalHook
-    > _allocated;
+    // Bitmask of the registers that are occupied at each slot of each block
+    // (indexed by ordinal and slot). Allocated intervals of the same register only overlap
+    // if they are equivalent; hence, each bit is owned by a single equivalence class.
+    std::vector<std::vector<uint16_t>> _occupancy;
+
+    // Allocated intervals, grouped by their equivalencePointer.
+    std::unordered_map<LiveInterval *, std::vector<LiveInterval *>> _allocatedEquivalents;
 
     // Bitmask of all registers that are used.
     // The function prologue is constructed from this.
     uint64_t _usedRegisters = 0;
 
+    // Number of stack slots that are used for spilling.
+    int _numSpillSlots = 0;
+
     // Some statistics to quantify the quality of the allocation.
     int _achievedCost = 0;
     int _numRegisterMoves = 0;
+    int _numFusedMoves = 0;
+    int _numSpilledCompounds = 0;
+    int _numSpillMoves = 0;
 };
 
 void AllocateRegistersImpl::run() {
+    // ProgramCounter comparisons rely on instruction sequence numbers.
+    for (auto bb : _fn->blocks())
+        bb->numberInstructions();
+
+    bool baseline = _options.tier == AllocationTier::baseline;
+    _blockWeights = weighBlocks(_fn, baseline ? nullptr : _options.profile, maxBlockWeight);
+    _callsOfBlock.resize(_blockWeights.size());
+    _needsFrame.resize(_blockWeights.size(), false);
+    _numSlots.resize(_blockWeights.size());
+    _allocatedIntervals.resize(_blockWeights.size());
+    _occupancy.resize(_blockWeights.size());
+
     // LiveCompounds for phi nodes span multiple basic blocks.
     // Create them here and set them up in _collectBlockIntervals().
     for (auto bb : _fn->blocks()) {
         for (auto phi : bb->phis())
-            _phiCompounds.insert({phi, new LiveCompound});
+            _phiCompounds.insert({phi, _arena.create<LiveCompound>()});
     }
 
     for (auto bb : _fn->blocks())
         _collectBlockIntervals(bb);
 
+    // Slots are assigned after _collectBlockIntervals() inserted its pseudo moves.
+    for (auto bb : _fn->blocks())
+        _assignSlots(bb);
+
+    for (auto compound : _unrestrictedCompounds) {
+        // The baseline tier allocates in FIFO order, i.e., in the order in which
+        // _collectBlockIntervals() created the compounds (which roughly follows the program).
+        if (baseline) {
+            _enqueueCompound(compound, 0);
+            continue;
+        }
+
+        _countCrossedCalls(compound);
+        _computeSpillWeight(compound);
+        // Compounds that cross calls can only use the few callee-saved registers.
+        // Allocate them early, such that compounds that do not cross calls are
+        // allocated to caller-saved registers instead of taking callee-saved ones.
+        auto priority = compound->spillWeight
+                * (1 + callCrossingPriority * compound->numCrossedCalls);
+        _enqueueCompound(compound, priority);
+    }
+
     // The following loops performs the actual allocation.
     // Perform "restricted" allocations first. Restricted allocations are those that *must*
     // fulfill certain conditions in order to yield a feasible allocation, i.e.
@@ -285,28 +446,84 @@ void AllocateRegistersImpl::run() {
     // For x86 this is easy, as all restricted allocation always go into fixed registers.
     if (verbose)
         std::cout << "Perfoming restricted allocation" << std::endl;
-    while (!_restrictedQueue.empty()) {
-        auto compound = _restrictedQueue.front();
-        _restrictedQueue.pop();
+    for (auto compound : _restrictedCompounds)
         _allocateCompound(compound);
-    }
     // We perform unrestricted allocations afterwards. If those cannot be satisfied, we can
     // just split or spill the intervals. We *never* have to split or spill a restricted
     // allocation in this second loop, as those are all already fixed.
+    // Compounds are allocated in order of decreasing spill weight, i.e., the compounds
+    // that would be most expensive to spill are allocated first.
     if (verbose)
         std::cout << "Perfoming unrestricted allocation" << std::endl;
     while (!_unrestrictedQueue.empty()) {
-        auto compound = _unrestrictedQueue.front();
+        auto compound = _unrestrictedQueue.top().compound;
         _unrestrictedQueue.pop();
         _allocateCompound(compound);
     }
 
+    _placeFrame();
     for (auto bb : _fn->blocks())
         _establishAllocation(bb);
 
+    for (auto bb : _fn->blocks())
+        bb->stopNumbering();
+
     if (verbose) {
         std::cout << "Allocation cost is " << _achievedCost << " units" << std::endl;
-        std::cout << "Allocation requires " << _numRegisterMoves << " moves" << std::endl;
+        std::cout << "Allocation requires " << _numRegisterMoves << " moves ("
+                << _numFusedMoves << " moves were fused)" << std::endl;
+        std::cout << "Spilled " << _numSpilledCompounds << " compounds using "
+                << _numSpillMoves << " memory moves" << std::endl;
+    }
+}
+
+void AllocateRegistersImpl::_computeSpillWeight(LiveCompound *compound) {
+    // Position of a ProgramCounter inside its block, in units of instructions.
+    auto positionOf = [] (const ProgramCounter &pc) -> size_t {
+        if (pc.subBlock == beforeBlock)
+            return 0;
+        if (pc.subBlock == afterBlock)
+            return pc.block->indexOfInstruction(nullptr) + 1;
+        return pc.block->indexOfInstruction(pc.instruction) + 1;
+    };
+
+    size_t numAccesses = 0;
+    size_t span = 0;
+    for (auto interval : compound->intervals) {
+        assert(interval->originPc.block == interval->finalPc.block);
+        span += positionOf(interval->finalPc) - positionOf(interval->originPc) + 1;
+
+        if (!interval->associatedValue)
+            continue;
+        size_t n = 1;
+        for (auto use : interval->associatedValue->uses()) {
+            (void)use;
+            n++;
+        }
+        numAccesses += n * _blockWeights[interval->originPc.block->ordinal()];
+    }
+    assert(span);
+    compound->spillWeight = static_cast<double>(numAccesses) / span;
+}
+
+void AllocateRegistersImpl::_countCrossedCalls(LiveCompound *compound) {
+    for (auto interval : compound->intervals) {
+        auto bb = interval->originPc.block;
+        auto &calls = _callsOfBlock[bb->ordinal()];
+        auto clobberPc = [&] (Instruction *call) {
+            return ProgramCounter{bb, inBlock, call, atInstruction};
+        };
+
+        // Calls are sorted, hence the crossed calls form a contiguous range.
+        auto first = std::upper_bound(calls.begin(), calls.end(), interval->originPc,
+                [&] (const ProgramCounter &pc, Instruction *call) {
+            return pc < clobberPc(call);
+        });
+        auto last = std::lower_bound(first, calls.end(), interval->finalPc,
+                [&] (Instruction *call, const ProgramCounter &pc) {
+            return clobberPc(call) < pc;
+        });
+        compound->numCrossedCalls += last - first;
     }
 }
 
@@ -324,35 +541,23 @@ void AllocateRegistersImpl::_allocateCompound(LiveCompound *compound) {
 
     if (verbose)
         std::cout << "Allocating compound " << compound << ", possible registers: "
-                << compound->possibleRegisters << std::endl;
+                << compound->possibleRegisters << ", crossed calls: "
+                << compound->numCrossedCalls << std::endl;
+    uint64_t occupied = 0;
     for (auto interval : compound->intervals) {
         if (verbose)
             std::cout << "    Interval " << interval << " for value " << interval->associatedValue
                     << " at [" << interval->originPc << ", " << interval->finalPc << "]" << std::endl;
-
-        _allocated.for_overlaps([&] (LiveInterval *overlap) {
-            // The intervals might be able to share their registers.
-            // In this case no splitting/spilling is necessary.
-            if (interval->equivalencePointer == overlap->equivalencePointer)
-                return;
-
-            auto overlapRegister = overlap->compound->allocatedRegister;
-            assert(overlapRegister >= 0);
-            state[overlapRegister].allocationPossible = false;
-        }, interval->originPc, interval->finalPc);
+        occupied |= _occupiedRegisters(interval);
+    }
+    for (int i = 0; i < 16; i++) {
+        if (occupied & (1 << i))
+            state[i].allocationPossible = false;
     }
 
     // Compute allocation penalties.
-    for(auto penalty : _penalties) {
-        LiveCompound *other;
-        if (compound == penalty.compounds[0]) {
-            other = penalty.compounds[1];
-        } else if(compound == penalty.compounds[1]) {
-            other = penalty.compounds[0];
-        } else {
-            continue;
-        }
-
+    for(auto penalty : compound->penalties) {
+        auto other = penalty.other;
         if (other->allocatedRegister < 0)
             continue;
 
@@ -362,10 +567,18 @@ void AllocateRegistersImpl::_allocateCompound(LiveCompound *compound) {
 
         // Instead of increasing cost everywhere, we increment the base cost
         // and add a negative contribution of a single register.
-        baseCost += 1;
-        state[other->allocatedRegister].relativeCost -= 1;
+        baseCost += penalty.weight;
+        state[other->allocatedRegister].relativeCost -= penalty.weight;
     }
 
+    // Among registers of equal cost, compounds that cross calls prefer callee-saved registers
+    // that are already saved over those that would need to be saved.
+    auto preferenceOf = [&] (int i) {
+        if (!compound->numCrossedCalls)
+            return 0;
+        return (calleeSavedRegisters & ~_usedRegisters & (1 << i)) ? 1 : 0;
+    };
+
     // Chose the best free register according to its cost.
     int bestRegister = -1;
     for (int i = 0; i < 16; i++) {
@@ -381,15 +594,27 @@ void AllocateRegistersImpl::_allocateCompound(LiveCompound *compound) {
         if (bestRegister < 0) {
             bestRegister = i;
         } else if (!ignorePenalties && state[bestRegister].relativeCost
-                > state[i].relativeCost) {
+                != state[i].relativeCost) {
+            if (state[bestRegister].relativeCost > state[i].relativeCost)
+                bestRegister = i;
+        } else if (preferenceOf(bestRegister) > preferenceOf(i)) {
             bestRegister = i;
         }
     }
     if(bestRegister < 0) {
-        std::cerr << "Could not find possible register for allocation" << std::endl;
-        std::cerr << "    Possible register mask was: 0x"
-                << std::hex << compound->possibleRegisters << std::dec << std::endl;
-        throw std::runtime_error("TODO: Implement live range splitting");
+        if (compound->spillable) {
+            _spillCompound(compound);
+            return;
+        }
+
+        bestRegister = _evictForCompound(compound);
+        if (bestRegister < 0) {
+            std::cerr << "Could not find possible register for allocation" << std::endl;
+            std::cerr << "    Possible register mask was: 0x"
+                    << std::hex << compound->possibleRegisters << std::dec << std::endl;
+            throw std::runtime_error("Register allocation failed:"
+                    " too many unspillable values are live at the same time");
+        }
     }
 
     compound->allocatedRegister = bestRegister;
@@ -400,14 +625,302 @@ void AllocateRegistersImpl::_allocateCompound(LiveCompound *compound) {
     for (auto interval : compound->intervals) {
         if (interval->associatedValue)
             setRegister(interval->associatedValue, compound->allocatedRegister);
-        _allocated.insert(interval);
+        _insertAllocation(interval);
     }
     _usedRegisters |= 1 << bestRegister;
-    _achievedCost += baseCost + state[bestRegister].relativeCost;
+    compound->cost = baseCost + state[bestRegister].relativeCost;
+    _achievedCost += compound->cost;
+}
+
+// Called if an unspillable compound cannot be allocated. Determines the register that can
+// be freed up at the lowest cost, spills all compounds that occupy it and returns it.
+// Returns -1 if no register can be freed up.
+int AllocateRegistersImpl::_evictForCompound(LiveCompound *compound) {
+    struct EvictionState {
+        double cost = 0;
+        bool evictionPossible = true;
+        std::vector<LiveCompound *> victims;
+    };
+
+    EvictionState state[16];
+
+    for (auto interval : compound->intervals) {
+        auto originSlot = _slotOf(interval->originPc);
+        auto finalSlot = _slotOf(interval->finalPc);
+        for (auto overlap : _allocatedIntervals[interval->originPc.block->ordinal()]) {
+            if (overlap->finalSlot < originSlot || overlap->originSlot > finalSlot)
+                continue;
+            if (interval->equivalencePointer == overlap->equivalencePointer)
+                continue;
+
+            auto victim = overlap->compound;
+            auto &victimState = state[victim->allocatedRegister];
+            if (!victim->spillable) {
+                victimState.evictionPossible = false;
+                continue;
+            }
+            if (std::find(victimState.victims.begin(), victimState.victims.end(), victim)
+                    != victimState.victims.end())
+                continue;
+            victimState.victims.push_back(victim);
+            victimState.cost += victim->spillWeight;
+        }
+    }
+
+    int bestRegister = -1;
+    for (int i = 0; i < 16; i++) {
+        if (!(compound->possibleRegisters & (1 << i)))
+            continue;
+        if (!state[i].evictionPossible)
+            continue;
+        if (bestRegister < 0 || state[bestRegister].cost > state[i].cost)
+            bestRegister = i;
+    }
+    if (bestRegister < 0)
+        return -1;
+
+    for (auto victim : state[bestRegister].victims) {
+        if (verbose)
+            std::cout << "    Evicting compound " << victim << " from register "
+                    << bestRegister << std::endl;
+        for (auto interval : victim->intervals)
+            _removeAllocation(interval);
+        victim->allocatedRegister = -1;
+        _achievedCost -= victim->cost;
+        victim->cost = 0;
+        _spillCompound(victim);
+    }
+    return bestRegister;
+}
+
+// Spills a compound to a stack slot.
+// Pseudo moves access the stack slot directly; they are lowered to loads and stores later.
+// For other instructions, the compound's Values are replaced by short-lived Values that are
+// reloaded from the stack slot before each use and stored to it after each definition.
+// All such Values that are accessed by the same instruction form a new (unspillable)
+// compound; this preserves constraints of in-place instructions.
+void AllocateRegistersImpl::_spillCompound(LiveCompound *compound) {
+    assert(compound->spillable);
+    assert(compound->allocatedRegister < 0);
+    compound->spillSlot = _numSpillSlots++;
+    _numSpilledCompounds++;
+    if (verbose)
+        std::cout << "    Spilling compound " << compound << " to slot "
+                << compound->spillSlot << std::endl;
+
+    auto makeSlotValue = [&] (Value *value) {
+        auto registerMode = hierarchy_cast<RegisterMode *>(value);
+        assert(registerMode);
+        auto slotValue = _fn->create<BaseDispMemoryMode>();
+        slotValue->operandSize = registerMode->operandSize;
+        slotValue->baseRegister = stackPointerRegister;
+        slotValue->disp = 8 * compound->spillSlot;
+        return slotValue;
+    };
+
+    // Maps instructions to their access compounds; the vector keeps the order deterministic.
+    std::unordered_map<Instruction *, LiveCompound *> accessMap;
+    std::vector<LiveCompound *> accessCompounds;
+    auto addAccessInterval = [&] (Instruction *inst, Value *value,
+            ProgramCounter originPc, ProgramCounter finalPc) {
+        auto [it, inserted] = accessMap.insert({inst, nullptr});
+        if (inserted) {
+            it->second = _arena.create<LiveCompound>();
+            it->second->possibleRegisters = gprMask;
+            accessCompounds.push_back(it->second);
+        }
+
+        auto interval = _arena.create<LiveInterval>();
+        it->second->intervals.push_back(interval);
+        interval->associatedValue = value;
+        interval->compound = it->second;
+        interval->originPc = originPc;
+        interval->finalPc = finalPc;
+    };
+
+    auto isPseudoMove = [] (Instruction *inst) {
+        return hierarchy_cast<PseudoMoveSingleInstruction *>(inst)
+                || hierarchy_cast<PseudoMoveMultipleInstruction *>(inst);
+    };
+
+    for (auto interval : compound->intervals) {
+        auto value = interval->associatedValue;
+        assert(value);
+        auto bb = interval->originPc.block;
+        _needsFrame[bb->ordinal()] = true;
+
+        // Copy the uses as we modify them below.
+        std::vector<ValueUse *> uses;
+        for (auto use : value->uses())
+            uses.push_back(use);
+
+        // Reload the Value before each instruction that uses it.
+        std::unordered_map<Instruction *, Value *> reloads;
+        for (auto use : uses) {
+            auto useInst = use->instruction();
+            if (!useInst)
+                continue;
+            if (isPseudoMove(useInst)) {
+                *use = makeSlotValue(value);
+                continue;
+            }
+
+            auto [it, inserted] = reloads.insert({useInst, nullptr});
+            if (inserted) {
+                auto reload = bb->insertInstruction(bb->iteratorTo(useInst),
+                        _fn->create<MovRMInstruction>(makeSlotValue(value)));
+                _instructionSlots.insert({reload, InstructionSlot{
+                        _slotOf({bb, inBlock, useInst, beforeInstruction}), true}});
+                it->second = reload->result.set(cloneModeValue(_fn, value));
+                addAccessInterval(useInst, it->second,
+                        ProgramCounter{bb, inBlock, reload, afterInstruction},
+                        ProgramCounter{bb, inBlock, useInst, beforeInstruction});
+                _numSpillMoves++;
+            }
+            *use = it->second;
+        }
+
+        // Store the Value after the instruction that defines it.
+        // Values without defining instruction are PhiNode values; their predecessors
+        // store them to the stack slot.
+        auto origin = value->origin();
+        assert(origin);
+        if (auto defInst = origin->instruction(); defInst) {
+            Value *slotValue;
+            origin->reset();
+            if (isPseudoMove(defInst)) {
+                slotValue = origin->set(makeSlotValue(value));
+            } else {
+                auto defValue = origin->set(cloneModeValue(_fn, value));
+                auto store = _fn->create<MovMRInstruction>(defValue);
+                slotValue = store->result.set(makeSlotValue(value));
+                auto nit = bb->iteratorTo(defInst);
+                ++nit;
+                bb->insertInstruction(nit, store);
+                _instructionSlots.insert({store, InstructionSlot{
+                        _slotOf({bb, inBlock, defInst, afterInstruction}), true}});
+                addAccessInterval(defInst, defValue,
+                        ProgramCounter{bb, inBlock, defInst, afterInstruction},
+                        ProgramCounter{bb, inBlock, store, beforeInstruction});
+                _numSpillMoves++;
+            }
+
+            // Uses outside of instructions (i.e., by DataFlowEdges) refer to the stack slot.
+            for (auto use : uses) {
+                if (!use->instruction())
+                    *use = slotValue;
+            }
+        } else {
+            for (auto use : uses)
+                assert(use->instruction());
+        }
+    }
+
+    // Access compounds are tiny; allocate them before all other compounds.
+    for (auto accessCompound : accessCompounds)
+        _enqueueCompound(accessCompound, std::numeric_limits<double>::infinity());
+}
+
+void AllocateRegistersImpl::_assignSlots(BasicBlock *bb) {
+    int numSlots = 1;
+    for (auto inst : bb->instructions()) {
+        _instructionSlots.insert({inst, InstructionSlot{numSlots, false}});
+        numSlots += 3;
+    }
+    numSlots++;
+    _numSlots[bb->ordinal()] = numSlots;
+    _occupancy[bb->ordinal()].resize(numSlots, 0);
+}
+
+// Instructions that are inserted by spilling are anchored such that the dense order agrees
+// with the order of ProgramCounters for all intervals that can overlap: reloads are placed
+// immediately before their use and stores immediately after their definition.
+int AllocateRegistersImpl::_slotOf(const ProgramCounter &pc) {
+    if (pc.subBlock == beforeBlock)
+        return 0;
+    if (pc.subBlock == afterBlock)
+        return _numSlots[pc.block->ordinal()] - 1;
+    auto slot = _instructionSlots.at(pc.instruction);
+    if (slot.anchored)
+        return slot.base;
+    return slot.base + 1 + pc.subInstruction;
+}
+
+// Returns the registers that are occupied by non-equivalent intervals while interval is live.
+uint64_t AllocateRegistersImpl::_occupiedRegisters(LiveInterval *interval) {
+    auto &occupancy = _occupancy[interval->originPc.block->ordinal()];
+    auto originSlot = _slotOf(interval->originPc);
+    auto finalSlot = _slotOf(interval->finalPc);
+
+    auto it = _allocatedEquivalents.find(interval->equivalencePointer);
+    if (it == _allocatedEquivalents.end()) {
+        uint64_t occupied = 0;
+        for (auto slot = originSlot; slot <= finalSlot; slot++)
+            occupied |= occupancy[slot];
+        return occupied;
+    }
+
+    // Registers are shared with equivalent intervals (which always own their bits).
+    uint64_t occupied = 0;
+    for (auto slot = originSlot; slot <= finalSlot; slot++) {
+        uint64_t mask = occupancy[slot];
+        for (auto equivalent : it->second) {
+            if (equivalent->originPc.block != interval->originPc.block)
+                continue;
+            if (equivalent->originSlot <= slot && slot <= equivalent->finalSlot)
+                mask &= ~(uint64_t{1} << equivalent->compound->allocatedRegister);
+        }
+        occupied |= mask;
+    }
+    return occupied;
+}
+
+void AllocateRegistersImpl::_insertAllocation(LiveInterval *interval) {
+    auto bb = interval->originPc.block;
+    auto &occupancy = _occupancy[bb->ordinal()];
+    interval->originSlot = _slotOf(interval->originPc);
+    interval->finalSlot = _slotOf(interval->finalPc);
+    assert(interval->originSlot <= interval->finalSlot);
+
+    auto bit = uint16_t(1) << interval->compound->allocatedRegister;
+    for (auto slot = interval->originSlot; slot <= interval->finalSlot; slot++)
+        occupancy[slot] |= bit;
+    _allocatedIntervals[bb->ordinal()].push_back(interval);
+    _allocatedEquivalents[interval->equivalencePointer].push_back(interval);
+}
+
+void AllocateRegistersImpl::_removeAllocation(LiveInterval *interval) {
+    auto bb = interval->originPc.block;
+    auto &occupancy = _occupancy[bb->ordinal()];
+    auto &intervals = _allocatedIntervals[bb->ordinal()];
+    intervals.erase(std::find(intervals.begin(), intervals.end(), interval));
+
+    auto eit = _allocatedEquivalents.find(interval->equivalencePointer);
+    assert(eit != _allocatedEquivalents.end());
+    eit->second.erase(std::find(eit->second.begin(), eit->second.end(), interval));
+    if (eit->second.empty())
+        _allocatedEquivalents.erase(eit);
+
+    // Equivalent intervals might still occupy the register; recompute the affected slots.
+    auto reg = interval->compound->allocatedRegister;
+    auto bit = uint16_t(1) << reg;
+    for (auto slot = interval->originSlot; slot <= interval->finalSlot; slot++)
+        occupancy[slot] &= ~bit;
+    for (auto other : intervals) {
+        if (other->compound->allocatedRegister != reg)
+            continue;
+        auto first = std::max(other->originSlot, interval->originSlot);
+        auto last = std::min(other->finalSlot, interval->finalSlot);
+        for (auto slot = first; slot <= last; slot++)
+            occupancy[slot] |= bit;
+    }
 }
 
 // Called before allocation. Generates all LiveIntervals and adds them to the queue.
 void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
+    // Moves between the compounds of this block execute as often as the block.
+    auto blockWeight = _blockWeights[bb->ordinal()];
+
     std::vector<LiveCompound *> collected;
     std::unordered_map<Value *, LiveInterval *> intervalMap;
 
@@ -417,8 +930,8 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
     // Generate LiveIntervals for PhiNodes.
     for (auto phi : bb->phis()) {
         auto pseudoMove = bb->insertInstruction(instructionsBegin,
-                std::make_unique<PseudoMoveSingleInstruction>());
-        auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(phi->value.get()));
+                _fn->create<PseudoMoveSingleInstruction>());
+        auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, phi->value.get()));
         phi->value.get()->replaceAllUses(pseudoMoveResult);
         pseudoMove->operand = phi->value.get();
 
@@ -429,7 +942,7 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
         if (auto argument = hierarchy_cast<ArgumentPhi *>(phi); argument) {
             nodeCompound->possibleRegisters = 0x80;
 
-            auto nodeInterval = new LiveInterval;
+            auto nodeInterval = _arena.create<LiveInterval>();
             nodeCompound->intervals.push_back(nodeInterval);
             nodeInterval->associatedValue = phi->value.get();
             nodeInterval->compound = nodeCompound;
@@ -438,8 +951,9 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
             assert(nodeInterval->associatedValue);
         } else if (auto dataFlow = hierarchy_cast<DataFlowPhi *>(phi); dataFlow) {
             nodeCompound->possibleRegisters = gprMask;
+            nodeCompound->spillable = true;
 
-            auto nodeInterval = new LiveInterval;
+            auto nodeInterval = _arena.create<LiveInterval>();
             nodeCompound->intervals.push_back(nodeInterval);
             nodeInterval->associatedValue = phi->value.get();
             nodeInterval->compound = nodeCompound;
@@ -450,19 +964,20 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
             assert(!"Unexpected IR phi");
         }
 
-        auto copyCompound = new LiveCompound;
+        auto copyCompound = _arena.create<LiveCompound>();
         copyCompound->possibleRegisters = gprMask;
+        copyCompound->spillable = true;
 
-        auto copyInterval = new LiveInterval;
+        auto copyInterval = _arena.create<LiveInterval>();
         copyCompound->intervals.push_back(copyInterval);
         copyInterval->associatedValue = pseudoMoveResult;
         copyInterval->compound = copyCompound;
         copyInterval->originPc = {bb, inBlock, pseudoMove, afterInstruction};
 
         intervalMap.insert({pseudoMoveResult, copyInterval});
-        _unrestrictedQueue.push(nodeCompound);
+        _unrestrictedCompounds.push_back(nodeCompound);
         collected.push_back(copyCompound);
-        _penalties.push_back(Penalty{{nodeCompound, copyCompound}});
+        _addPenalty(nodeCompound, copyCompound, blockWeight);
     }
 
     // Generate LiveIntervals for instructions.
@@ -470,25 +985,29 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
         // Use cit to refer to the current instruction (we might need to increment it
         // when we generate new instructions here).
         auto cit = it;
-        if (auto defineOffset = hierarchy_cast<DefineOffsetInstruction *>(*cit); defineOffset) {
+        switch ((*cit)->kind) {
+        case arch_instruction_kinds::defineOffset: {
+            auto defineOffset = static_cast<DefineOffsetInstruction *>(*cit);
             auto originalOperand = defineOffset->operand.get();
             auto pseudoMove = bb->insertInstruction(cit,
-                    std::make_unique<PseudoMoveSingleInstruction>(originalOperand));
-            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(originalOperand));
+                    _fn->create<PseudoMoveSingleInstruction>(originalOperand));
+            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, originalOperand));
             defineOffset->operand = pseudoMoveResult;
 
-            auto compound = new LiveCompound;
+            // This compound is not spillable, as the result is a BaseDispMemoryMode that
+            // uses the compound's register as base register.
+            auto compound = _arena.create<LiveCompound>();
             compound->possibleRegisters = gprMask;
 
             // TODO: Do we really need copyInterval here?
-            auto copyInterval = new LiveInterval;
+            auto copyInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(copyInterval);
             copyInterval->equivalencePointer = intervalMap.at(originalOperand)->equivalencePointer;
             copyInterval->associatedValue = pseudoMoveResult;
             copyInterval->compound = compound;
             copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
 
-            auto resultInterval = new LiveInterval;
+            auto resultInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(resultInterval);
             resultInterval->equivalencePointer = intervalMap.at(originalOperand)->equivalencePointer;
             resultInterval->associatedValue = defineOffset->result.get();
@@ -498,12 +1017,16 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             intervalMap.insert({defineOffset->result.get(), resultInterval});
             collected.push_back(compound);
-            _penalties.push_back(Penalty{{intervalMap.at(originalOperand)->compound, compound}});
-        } else if (auto movMC = hierarchy_cast<MovMCInstruction *>(*cit); movMC) {
-            auto compound = new LiveCompound;
+            _addPenalty(intervalMap.at(originalOperand)->compound, compound, blockWeight);
+            break;
+        }
+        case arch_instruction_kinds::movMC: {
+            auto movMC = static_cast<MovMCInstruction *>(*cit);
+            auto compound = _arena.create<LiveCompound>();
             compound->possibleRegisters = gprMask;
+            compound->spillable = true;
 
-            auto interval = new LiveInterval;
+            auto interval = _arena.create<LiveInterval>();
             compound->intervals.push_back(interval);
             interval->associatedValue = movMC->result.get();
             interval->compound = compound;
@@ -512,12 +1035,17 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             intervalMap.insert({movMC->result.get(), interval});
             collected.push_back(compound);
-        } else if (auto unaryMOverwrite = hierarchy_cast<UnaryMOverwriteInstruction *>(*cit);
-                unaryMOverwrite) {
-            auto compound = new LiveCompound;
+            break;
+        }
+        case arch_instruction_kinds::pseudoMoveSingle:
+        case arch_instruction_kinds::movMR:
+        case arch_instruction_kinds::movRM: {
+            auto unaryMOverwrite = static_cast<UnaryMOverwriteInstruction *>(*cit);
+            auto compound = _arena.create<LiveCompound>();
             compound->possibleRegisters = gprMask;
+            compound->spillable = true;
 
-            auto resultInterval = new LiveInterval;
+            auto resultInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(resultInterval);
             resultInterval->associatedValue = unaryMOverwrite->result.get();
             resultInterval->compound = compound;
@@ -526,24 +1054,29 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             intervalMap.insert({unaryMOverwrite->result.get(), resultInterval});
             collected.push_back(compound);
-        } else if (auto unaryMInPlace = hierarchy_cast<UnaryMInPlaceInstruction *>(*cit);
-                unaryMInPlace) {
+            break;
+        }
+        case arch_instruction_kinds::negM:
+        case arch_instruction_kinds::addMC:
+        case arch_instruction_kinds::andMC: {
+            auto unaryMInPlace = static_cast<UnaryMInPlaceInstruction *>(*cit);
             auto originalPrimary = unaryMInPlace->primary.get();
             auto pseudoMove = bb->insertInstruction(cit,
-                    std::make_unique<PseudoMoveSingleInstruction>(originalPrimary));
-            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(originalPrimary));
+                    _fn->create<PseudoMoveSingleInstruction>(originalPrimary));
+            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, originalPrimary));
             unaryMInPlace->primary = pseudoMoveResult;
 
-            auto compound = new LiveCompound;
+            auto compound = _arena.create<LiveCompound>();
             compound->possibleRegisters = gprMask;
+            compound->spillable = true;
 
-            auto copyInterval = new LiveInterval;
+            auto copyInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(copyInterval);
             copyInterval->associatedValue = pseudoMoveResult;
             copyInterval->compound = compound;
             copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
 
-            auto resultInterval = new LiveInterval;
+            auto resultInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(resultInterval);
             resultInterval->associatedValue = unaryMInPlace->result.get();
             resultInterval->compound = compound;
@@ -552,25 +1085,29 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             intervalMap.insert({unaryMInPlace->result.get(), resultInterval});
             collected.push_back(compound);
-            _penalties.push_back(Penalty{{intervalMap.at(originalPrimary)->compound, compound}});
-        } else if (auto binaryMRInPlace = hierarchy_cast<BinaryMRInPlaceInstruction *>(*cit);
-                binaryMRInPlace) {
+            _addPenalty(intervalMap.at(originalPrimary)->compound, compound, blockWeight);
+            break;
+        }
+        case arch_instruction_kinds::addMR:
+        case arch_instruction_kinds::andMR: {
+            auto binaryMRInPlace = static_cast<BinaryMRInPlaceInstruction *>(*cit);
             auto originalPrimary = binaryMRInPlace->primary.get();
             auto pseudoMove = bb->insertInstruction(cit,
-                    std::make_unique<PseudoMoveSingleInstruction>(originalPrimary));
-            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(originalPrimary));
+                    _fn->create<PseudoMoveSingleInstruction>(originalPrimary));
+            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, originalPrimary));
             binaryMRInPlace->primary = pseudoMoveResult;
 
-            auto compound = new LiveCompound;
+            auto compound = _arena.create<LiveCompound>();
             compound->possibleRegisters = gprMask;
+            compound->spillable = true;
 
-            auto copyInterval = new LiveInterval;
+            auto copyInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(copyInterval);
             copyInterval->associatedValue = pseudoMoveResult;
             copyInterval->compound = compound;
             copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
 
-            auto resultInterval = new LiveInterval;
+            auto resultInterval = _arena.create<LiveInterval>();
             compound->intervals.push_back(resultInterval);
             resultInterval->associatedValue = binaryMRInPlace->result.get();
             resultInterval->compound = compound;
@@ -579,8 +1116,46 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             intervalMap.insert({binaryMRInPlace->result.get(), resultInterval});
             collected.push_back(compound);
-            _penalties.push_back(Penalty{{intervalMap.at(originalPrimary)->compound, compound}});
-        } else if (auto call = hierarchy_cast<CallInstruction *>(*cit); call) {
+            _addPenalty(intervalMap.at(originalPrimary)->compound, compound, blockWeight);
+            break;
+        }
+        case arch_instruction_kinds::addRM:
+        case arch_instruction_kinds::andRM: {
+            auto binaryRMInPlace = static_cast<BinaryRMInPlaceInstruction *>(*cit);
+            // The secondary operand is a BaseDispMemoryMode; its use extends the compound
+            // of the corresponding DefineOffsetInstruction.
+            auto originalPrimary = binaryRMInPlace->primary.get();
+            auto pseudoMove = bb->insertInstruction(cit,
+                    _fn->create<PseudoMoveSingleInstruction>(originalPrimary));
+            auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, originalPrimary));
+            binaryRMInPlace->primary = pseudoMoveResult;
+
+            auto compound = _arena.create<LiveCompound>();
+            compound->possibleRegisters = gprMask;
+            compound->spillable = true;
+
+            auto copyInterval = _arena.create<LiveInterval>();
+            compound->intervals.push_back(copyInterval);
+            copyInterval->associatedValue = pseudoMoveResult;
+            copyInterval->compound = compound;
+            copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
+
+            auto resultInterval = _arena.create<LiveInterval>();
+            compound->intervals.push_back(resultInterval);
+            resultInterval->associatedValue = binaryRMInPlace->result.get();
+            resultInterval->compound = compound;
+            resultInterval->originPc = {bb, inBlock, *cit, afterInstruction};
+            assert(resultInterval->associatedValue);
+
+            intervalMap.insert({binaryRMInPlace->result.get(), resultInterval});
+            collected.push_back(compound);
+            _addPenalty(intervalMap.at(originalPrimary)->compound, compound, blockWeight);
+            break;
+        }
+        case arch_instruction_kinds::call: {
+            auto call = static_cast<CallInstruction *>(*cit);
+            _callsOfBlock[bb->ordinal()].push_back(call);
+            _needsFrame[bb->ordinal()] = true;
             std::array<int, 6> operandRegs{0x80, 0x40, 0x04, 0x02, 0x0100, 0x0200};
             std::array<int, 2> resultRegs{0x01, 0x04};
             std::array<int, 9> clobberRegs{0x80, 0x40, 0x04, 0x02, 0x0100, 0x0200,
@@ -588,28 +1163,28 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             // Add a PseudoMove instruction for the operands.
             auto pseudoMove = bb->insertInstruction(cit,
-                    std::make_unique<PseudoMoveMultipleInstruction>(call->numOperands()));
+                    _fn->create<PseudoMoveMultipleInstruction>(call->numOperands()));
             for (size_t i = 0; i < call->numOperands(); ++i) {
                 auto originalOperand = call->operand(i).get();
                 pseudoMove->operand(i) = originalOperand;
-                auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(originalOperand));
+                auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(_fn, originalOperand));
                 call->operand(i) = pseudoMoveResult;
 
-                auto copyCompound = new LiveCompound;
+                auto copyCompound = _arena.create<LiveCompound>();
                 if (i < operandRegs.size())
                     copyCompound->possibleRegisters = operandRegs[i];
                 else
                     assert(!"TODO: Implement correct ABI for arbitrary arguments");
 
-                auto copyInterval = new LiveInterval;
+                auto copyInterval = _arena.create<LiveInterval>();
                 copyCompound->intervals.push_back(copyInterval);
                 copyInterval->associatedValue = pseudoMoveResult;
                 copyInterval->compound = copyCompound;
                 copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
                 copyInterval->finalPc = ProgramCounter{bb, inBlock, *cit, beforeInstruction};
 
-                _restrictedQueue.push(copyCompound);
-                _penalties.push_back(Penalty{{intervalMap.at(originalOperand)->compound, copyCompound}});
+                _restrictedCompounds.push_back(copyCompound);
+                _addPenalty(intervalMap.at(originalOperand)->compound, copyCompound, blockWeight);
             }
 
             // Add LiveIntervals for result registers.
@@ -617,17 +1192,17 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
                 auto nit = it;
                 ++nit;
                 auto pseudoMoveRetval = bb->insertInstruction(nit,
-                        std::make_unique<PseudoMoveSingleInstruction>());
+                        _fn->create<PseudoMoveSingleInstruction>());
                 auto pseudoMoveRetvalResult
-                        = pseudoMoveRetval->result.set(cloneModeValue(call->result(i).get()));
+                        = pseudoMoveRetval->result.set(cloneModeValue(_fn, call->result(i).get()));
                 call->result(i).get()->replaceAllUses(pseudoMoveRetvalResult);
                 pseudoMoveRetval->operand = call->result(i).get();
 
                 // Add LiveIntervals for the results.
-                auto resultCompound = new LiveCompound;
+                auto resultCompound = _arena.create<LiveCompound>();
                 resultCompound->possibleRegisters = 0x1;
 
-                auto resultInterval = new LiveInterval;
+                auto resultInterval = _arena.create<LiveInterval>();
                 resultCompound->intervals.push_back(resultInterval);
                 resultInterval->associatedValue = call->result(i).get();
                 resultInterval->compound = resultCompound;
@@ -637,10 +1212,11 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
                 assert(resultInterval->associatedValue);
 
                 // Add a LiveInterval for a copy of the result.
-                auto retvalCopyCompound = new LiveCompound;
+                auto retvalCopyCompound = _arena.create<LiveCompound>();
                 retvalCopyCompound->possibleRegisters = gprMask;
+                retvalCopyCompound->spillable = true;
 
-                auto retvalCopyInterval = new LiveInterval;
+                auto retvalCopyInterval = _arena.create<LiveInterval>();
                 retvalCopyCompound->intervals.push_back(retvalCopyInterval);
                 retvalCopyInterval->associatedValue = pseudoMoveRetvalResult;
                 retvalCopyInterval->compound = retvalCopyCompound;
@@ -648,9 +1224,9 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
                      pseudoMoveRetval, afterInstruction};
 
                 intervalMap.insert({pseudoMoveRetvalResult, retvalCopyInterval});
-                _restrictedQueue.push(resultCompound);
+                _restrictedCompounds.push_back(resultCompound);
                 collected.push_back(retvalCopyCompound);
-                _penalties.push_back(Penalty{{resultCompound, retvalCopyCompound}});
+                _addPenalty(resultCompound, retvalCopyCompound, blockWeight);
 
                 // Skip the PseudoMove instruction.
                 ++it;
@@ -659,18 +1235,20 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
             // Add LiveIntervals for other clobbers.
             for (size_t i = 0; i < clobberRegs.size(); ++i) {
-                auto clobberCompound = new LiveCompound;
+                auto clobberCompound = _arena.create<LiveCompound>();
                 clobberCompound->possibleRegisters = clobberRegs[i];
 
-                auto clobberInterval = new LiveInterval;
+                auto clobberInterval = _arena.create<LiveInterval>();
                 clobberCompound->intervals.push_back(clobberInterval);
                 clobberInterval->compound = clobberCompound;
                 clobberInterval->originPc = ProgramCounter{bb, inBlock, *cit, atInstruction};
                 clobberInterval->finalPc = ProgramCounter{bb, inBlock, *cit, atInstruction};
 
-                _restrictedQueue.push(clobberCompound);
+                _restrictedCompounds.push_back(clobberCompound);
             }
-        } else {
+            break;
+        }
+        default:
             std::cout << "lewis: Unknown instruction kind " << (*it)->kind << std::endl;
             assert(!"Unexpected IR instruction");
         }
@@ -684,16 +1262,16 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
     if (!edges.empty()) {
         auto pseudoMove = bb->insertInstruction(
-                std::make_unique<PseudoMoveMultipleInstruction>(edges.size()));
+                _fn->create<PseudoMoveMultipleInstruction>(edges.size()));
         for (size_t i = 0; i < edges.size(); i++) {
             auto originalAlias = edges[i]->alias.get();
             pseudoMove->operand(i) = originalAlias;
-            auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(originalAlias));
+            auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(_fn, originalAlias));
             edges[i]->alias = pseudoMoveResult;
 
             // Add an interval to the PhiNode's compound.
             auto nodeCompound = _phiCompounds.at(edges[i]->sink()->phiNode());
-            auto sourceInterval = new LiveInterval;
+            auto sourceInterval = _arena.create<LiveInterval>();
             nodeCompound->intervals.push_back(sourceInterval);
             sourceInterval->equivalencePointer = intervalMap.at(originalAlias)->equivalencePointer;
             sourceInterval->associatedValue = pseudoMoveResult;
@@ -702,27 +1280,56 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
             sourceInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
             sourceInterval->finalPc = ProgramCounter{bb, afterBlock, nullptr, afterInstruction};
 
-            _penalties.push_back(Penalty{{intervalMap.at(originalAlias)->compound, nodeCompound}});
+            _addPenalty(intervalMap.at(originalAlias)->compound, nodeCompound, blockWeight);
         }
     }
 
     // Generate a PseudoMove instruction to function returns.
     if (auto ret = hierarchy_cast<RetBranch *>(bb->branch()); ret) {
         auto pseudoMove = bb->insertInstruction(
-                std::make_unique<PseudoMoveMultipleInstruction>(ret->numOperands()));
+                _fn->create<PseudoMoveMultipleInstruction>(ret->numOperands()));
         for (size_t i = 0; i < ret->numOperands(); ++i) {
             auto originalOperand = ret->operand(i).get();
             pseudoMove->operand(i) = originalOperand;
-            auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(originalOperand));
+            auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(_fn, originalOperand));
             ret->operand(i) = pseudoMoveResult;
 
-            auto copyCompound = new LiveCompound;
+            auto copyCompound = _arena.create<LiveCompound>();
             switch (i) {
             case 0: copyCompound->possibleRegisters = 0x01; break;
             default: assert(!"TODO: Implement correct ABI for arbitrary return values");
             }
 
-            auto copyInterval = new LiveInterval;
+            auto copyInterval = _arena.create<LiveInterval>();
+            copyCompound->intervals.push_back(copyInterval);
+            copyInterval->equivalencePointer = intervalMap.at(originalOperand)->equivalencePointer;
+            copyInterval->associatedValue = pseudoMoveResult;
+            copyInterval->compound = copyCompound;
+            copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
+            copyInterval->finalPc = ProgramCounter{bb, afterBlock, nullptr, afterInstruction};
+
+            _restrictedCompounds.push_back(copyCompound);
+            _addPenalty(intervalMap.at(originalOperand)->compound, copyCompound, blockWeight);
+        }
+    } else if (auto tailCall = hierarchy_cast<TailCallBranch *>(bb->branch()); tailCall) {
+        // Same as for calls, but the arguments stay live until the end of the block
+        // (i.e., across the epilogue). Clobbers do not matter as we never return here.
+        std::array<int, 6> operandRegs{0x80, 0x40, 0x04, 0x02, 0x0100, 0x0200};
+
+        auto pseudoMove = bb->insertInstruction(
+                _fn->create<PseudoMoveMultipleInstruction>(tailCall->numOperands()));
+        for (size_t i = 0; i < tailCall->numOperands(); ++i) {
+            auto originalOperand = tailCall->operand(i).get();
+            pseudoMove->operand(i) = originalOperand;
+            auto pseudoMoveResult = pseudoMove->result(i).set(cloneModeValue(_fn, originalOperand));
+            tailCall->operand(i) = pseudoMoveResult;
+
+            // LowerCodePass only emits tail calls that pass all arguments in registers.
+            assert(i < operandRegs.size());
+            auto copyCompound = _arena.create<LiveCompound>();
+            copyCompound->possibleRegisters = operandRegs[i];
+
+            auto copyInterval = _arena.create<LiveInterval>();
             copyCompound->intervals.push_back(copyInterval);
             copyInterval->equivalencePointer = intervalMap.at(originalOperand)->equivalencePointer;
             copyInterval->associatedValue = pseudoMoveResult;
@@ -730,20 +1337,20 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
             copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
             copyInterval->finalPc = ProgramCounter{bb, afterBlock, nullptr, afterInstruction};
 
-            _restrictedQueue.push(copyCompound);
-            _penalties.push_back(Penalty{{intervalMap.at(originalOperand)->compound, copyCompound}});
+            _restrictedCompounds.push_back(copyCompound);
+            _addPenalty(intervalMap.at(originalOperand)->compound, copyCompound, blockWeight);
         }
     } else if (auto jnz = hierarchy_cast<JnzBranch *>(bb->branch()); jnz) {
         auto originalOperand = jnz->operand.get();
         auto pseudoMove = bb->insertNewInstruction<PseudoMoveSingleInstruction>();
         pseudoMove->operand = originalOperand;
-        auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(originalOperand));
+        auto pseudoMoveResult = pseudoMove->result.set(cloneModeValue(_fn, originalOperand));
         jnz->operand = pseudoMoveResult;
 
-        auto copyCompound = new LiveCompound;
+        auto copyCompound = _arena.create<LiveCompound>();
         copyCompound->possibleRegisters = gprMask;
 
-        auto copyInterval = new LiveInterval;
+        auto copyInterval = _arena.create<LiveInterval>();
         copyCompound->intervals.push_back(copyInterval);
         copyInterval->equivalencePointer = intervalMap.at(originalOperand)->equivalencePointer;
         copyInterval->associatedValue = pseudoMoveResult;
@@ -751,8 +1358,8 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
         copyInterval->originPc = ProgramCounter{bb, inBlock, pseudoMove, afterInstruction};
         copyInterval->finalPc = ProgramCounter{bb, afterBlock, nullptr, afterInstruction};
 
-        _unrestrictedQueue.push(copyCompound);
-        _penalties.push_back(Penalty{{intervalMap.at(originalOperand)->compound, copyCompound}});
+        _unrestrictedCompounds.push_back(copyCompound);
+        _addPenalty(intervalMap.at(originalOperand)->compound, copyCompound, blockWeight);
     }
 
     // Post-process the generated intervals.
@@ -766,41 +1373,129 @@ void AllocateRegistersImpl::_collectBlockIntervals(BasicBlock *bb) {
 
         // TODO: This popcount is ugly. Find a better solution.
         assert(__builtin_popcountl(compound->possibleRegisters) > 1);
-        _unrestrictedQueue.push(compound);
+        _unrestrictedCompounds.push_back(compound);
     }
 }
 
 std::optional<ProgramCounter> AllocateRegistersImpl::_determineFinalPc(BasicBlock *bb, Value *v) {
     Instruction *finalInst = nullptr;
-    size_t finalIndex;
     for (auto use : v->uses()) {
         // We should never see uses in DataFlowEdges, as they should all originate from the
         // PseudoMove instruction generated in _collectBlockIntervals().
         // This function is never called on those values.
         assert(use->instruction());
         auto useInst = use->instruction();
-        auto useIndex = bb->indexOfInstruction(useInst);
-        if (!finalInst || useIndex > finalIndex) {
+        assert(useInst->basicBlock() == bb);
+        if (!finalInst || useInst->sequenceNumber() > finalInst->sequenceNumber())
             finalInst = useInst;
-            finalIndex = useIndex;
-        }
     }
     if(finalInst)
         return ProgramCounter{bb, inBlock, finalInst, beforeInstruction};
     return std::nullopt;
 }
 
+// Called after allocation. Determines where the prologue and the epilogue are placed.
+// Once a path reaches a block that needs the frame, it stays inside the frame until the function
+// returns. Hence, the frame is established on edges into the closure of those blocks and torn
+// down at the returns inside it. Paths that avoid them (e.g., early exits) skip the
+// save and restore traffic entirely.
+void AllocateRegistersImpl::_placeFrame() {
+    auto numBlocks = _blockWeights.size();
+    std::vector<BasicBlock *> blocks;
+    std::vector<std::vector<BasicBlock *>> successors(numBlocks);
+    for (auto bb : _fn->blocks()) {
+        blocks.push_back(bb);
+        auto &out = successors[bb->ordinal()];
+        if (auto jmp = hierarchy_cast<JmpBranch *>(bb->branch()); jmp) {
+            out.push_back(jmp->target);
+        } else if (auto jnz = hierarchy_cast<JnzBranch *>(bb->branch()); jnz) {
+            out.push_back(jnz->ifTarget);
+            out.push_back(jnz->elseTarget);
+        } else {
+            assert(hierarchy_cast<RetBranch *>(bb->branch())
+                    || hierarchy_cast<TailCallBranch *>(bb->branch()));
+        }
+    }
+
+    // Values that reach a block in a register are written by its predecessors, hence this
+    // also covers callee-saved registers that are live on entry to a block.
+    for (auto bb : blocks) {
+        for (auto interval : _allocatedIntervals[bb->ordinal()]) {
+            if (calleeSavedRegisters & (1 << interval->compound->allocatedRegister))
+                _needsFrame[bb->ordinal()] = true;
+        }
+    }
+
+    _inFrame.assign(numBlocks, false);
+    std::vector<BasicBlock *> worklist;
+    for (auto bb : blocks) {
+        if (!_needsFrame[bb->ordinal()])
+            continue;
+        _inFrame[bb->ordinal()] = true;
+        worklist.push_back(bb);
+    }
+    while (!worklist.empty()) {
+        auto bb = worklist.back();
+        worklist.pop_back();
+        for (auto successor : successors[bb->ordinal()]) {
+            if (_inFrame[successor->ordinal()])
+                continue;
+            _inFrame[successor->ordinal()] = true;
+            worklist.push_back(successor);
+        }
+    }
+
+    // The prologue is placed at the start of each block that is entered from outside of the
+    // frame. This is only correct if the block is never entered from inside of the frame;
+    // otherwise, we fall back to establishing the frame on entry.
+    _savesFrame.assign(numBlocks, false);
+    auto entry = blocks.front();
+    bool saveOnEntry = _inFrame[entry->ordinal()];
+    if (!saveOnEntry) {
+        std::vector<int> numPredecessorsInFrame(numBlocks, 0);
+        std::vector<int> numPredecessorsOutsideFrame(numBlocks, 0);
+        for (auto bb : blocks) {
+            for (auto successor : successors[bb->ordinal()]) {
+                if (_inFrame[bb->ordinal()]) {
+                    numPredecessorsInFrame[successor->ordinal()]++;
+                } else {
+                    numPredecessorsOutsideFrame[successor->ordinal()]++;
+                }
+            }
+        }
+        for (auto bb : blocks) {
+            if (!_inFrame[bb->ordinal()] || !numPredecessorsOutsideFrame[bb->ordinal()])
+                continue;
+            if (numPredecessorsInFrame[bb->ordinal()]) {
+                saveOnEntry = true;
+                break;
+            }
+            _savesFrame[bb->ordinal()] = true;
+        }
+    }
+    if (saveOnEntry) {
+        _inFrame.assign(numBlocks, true);
+        _savesFrame.assign(numBlocks, false);
+        _savesFrame[entry->ordinal()] = true;
+    }
+
+    if (verbose) {
+        std::cout << "Frame is established in blocks:";
+        for (auto bb : blocks)
+            if (_savesFrame[bb->ordinal()])
+                std::cout << " " << bb->ordinal();
+        std::cout << std::endl;
+    }
+}
+
 // This is called *after* the actual allocation is done. It "implements" the allocation by
 // fixing registers in the IR and generating necessary move instructions.
 void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
-    // Callee-saved registers (i.e. owned by the caller).
-    const uint64_t callerRegs = 0xF028;
-
     // Mask of registers that need to be saved.
-    auto saveMask = callerRegs & _usedRegisters;
+    auto saveMask = calleeSavedRegisters & _usedRegisters;
 
     // Stack space required by this function.
-    size_t frameSpace = 0;
+    size_t frameSpace = 8 * _numSpillSlots;
     auto saveSpace = __builtin_popcountl(saveMask) * 8;
 
     // Make sure that the stack is aligned according to the ABI.
@@ -810,16 +1505,16 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
 
     // Generate the function prologue.
     auto instructionsBegin = bb->instructions().begin();
-    if (bb == *_fn->blocks().begin()) {
+    if (_savesFrame[bb->ordinal()]) {
         for (int i = 0; i < 16; i++) {
             if (!(saveMask & (1 << i)))
                 continue;
             bb->insertInstruction(instructionsBegin,
-                    std::make_unique<PushSaveInstruction>(i));
+                    _fn->create<PushSaveInstruction>(i));
         }
         if (frameSpace)
             bb->insertInstruction(instructionsBegin,
-                    std::make_unique<DecrementStackInstruction>(frameSpace));
+                    _fn->create<DecrementStackInstruction>(frameSpace));
     }
 
     std::unordered_map<Value *, LiveInterval *> liveMap;
@@ -827,17 +1522,37 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
     if (verbose)
         std::cout << "Fixing basic block " << bb << std::endl;
 
+    // The liveMap and the resultMap are filled by a single sweep over the intervals of the
+    // block in order of their originPc. Lowering moves only moves the PCs of the current
+    // instruction's operand and result intervals to inserted instructions before it;
+    // this never reorders them relative to intervals that the sweep did not reach yet.
+    auto &intervals = _allocatedIntervals[bb->ordinal()];
+    std::stable_sort(intervals.begin(), intervals.end(),
+            [] (LiveInterval *a, LiveInterval *b) {
+        return a->originPc < b->originPc;
+    });
+    size_t numEntered = 0;
+    std::vector<LiveInterval *> activeIntervals;
+
     for (auto it = bb->instructions().begin(); it != bb->instructions().end(); ) {
         if (verbose)
             std::cout << "    Fixing instruction " << bb->indexOfInstruction(*it) << ", kind "
                     << (*it)->kind << std::endl;
         // Fill the liveMap and the resultMap.
-        _allocated.for_overlaps([&] (LiveInterval *interval) {
-            if (interval->originPc < ProgramCounter{bb, inBlock, *it, beforeInstruction})
-                liveMap.insert({interval->associatedValue, interval});
-            else if (interval->originPc == ProgramCounter{bb, inBlock, *it, afterInstruction})
-                resultMap.insert({interval->associatedValue, interval});
-        }, {bb, inBlock, *it, beforeInstruction}, {bb, inBlock, *it, afterInstruction});
+        ProgramCounter beforePc{bb, inBlock, *it, beforeInstruction};
+        ProgramCounter afterPc{bb, inBlock, *it, afterInstruction};
+        while (numEntered < intervals.size() && intervals[numEntered]->originPc < beforePc)
+            activeIntervals.push_back(intervals[numEntered++]);
+        std::erase_if(activeIntervals, [&] (LiveInterval *interval) {
+            return interval->finalPc < beforePc;
+        });
+        for (auto interval : activeIntervals)
+            liveMap.insert({interval->associatedValue, interval});
+        for (auto i = numEntered; i < intervals.size()
+                && intervals[i]->originPc <= afterPc; i++) {
+            if (intervals[i]->originPc == afterPc)
+                resultMap.insert({intervals[i]->associatedValue, intervals[i]});
+        }
 
         // Determine the current register allocation.
         // TODO: This does not take clobbers into account.
@@ -858,13 +1573,17 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
         }
 
         // Fixes the originPc and finalPc of existing intervals when a move is lowered.
+        // Either interval can be null if the corresponding Value is a spill slot.
         auto fixMoveIntervals = [&] (LiveInterval *operandInterval, LiveInterval *resultInterval,
                 Instruction *lowerInstruction) {
 
             auto beforeLower = ProgramCounter{bb, inBlock, lowerInstruction, beforeInstruction};
-            if (operandInterval->finalPc == ProgramCounter{bb, inBlock, *it, beforeInstruction})
+            if (operandInterval && operandInterval->finalPc
+                    == ProgramCounter{bb, inBlock, *it, beforeInstruction})
                 operandInterval->finalPc = beforeLower;
 
+            if (!resultInterval)
+                return;
             auto afterLower = ProgramCounter{bb, inBlock, lowerInstruction, afterInstruction};
             assert(resultInterval->originPc
                     == (ProgramCounter{bb, inBlock, *it, afterInstruction}));
@@ -875,6 +1594,36 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 resultInterval->originPc = afterLower;
         };
 
+        // Spilled Values are replaced by BaseDispMemoryModes in pseudo moves.
+        auto isSpillSlot = [] (Value *value) {
+            return hierarchy_cast<BaseDispMemoryMode *>(value) != nullptr;
+        };
+
+        // Lowers a move from or to a spill slot.
+        auto lowerSlotMove = [&] (ValueUse &operand, ValueOrigin &result) {
+            auto operandValue = operand.get();
+            auto resultValue = result.reset();
+            operand = nullptr;
+            if (isSpillSlot(operandValue) && isSpillSlot(resultValue)) {
+                // There is no memory-to-memory mov; go through the stack instead.
+                bb->insertInstruction(it, _fn->create<PushMInstruction>(operandValue));
+                auto pop = bb->insertInstruction(it, _fn->create<PopMInstruction>());
+                pop->result.set(resultValue);
+            } else if (isSpillSlot(operandValue)) {
+                auto load = bb->insertInstruction(it,
+                        _fn->create<MovRMInstruction>(operandValue));
+                load->result.set(resultValue);
+                fixMoveIntervals(nullptr, resultMap.at(resultValue), load);
+            } else {
+                assert(isSpillSlot(resultValue));
+                auto store = bb->insertInstruction(it,
+                        _fn->create<MovMRInstruction>(operandValue));
+                store->result.set(resultValue);
+                fixMoveIntervals(liveMap.at(operandValue), nullptr, store);
+            }
+            _numSpillMoves++;
+        };
+
         // Helper function to rewrite the associatedValue of a result interval (from resultMap).
         auto reassociateResult = [&] (LiveInterval *interval, Value *newValue) {
             // Update the associatedValue.
@@ -889,29 +1638,36 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
         // Rewrite pseudo instructions to real instructions.
         bool rewroteInstruction = false;
         if (auto pseudoMoveSingle = hierarchy_cast<PseudoMoveSingleInstruction *>(*it);
-                pseudoMoveSingle) {
+                pseudoMoveSingle && (isSpillSlot(pseudoMoveSingle->operand.get())
+                        || isSpillSlot(pseudoMoveSingle->result.get()))) {
+            if (verbose)
+                std::cout << "        Rewriting pseudoMoveSingle (spill slot)" << std::endl;
+            lowerSlotMove(pseudoMoveSingle->operand, pseudoMoveSingle->result);
+            rewroteInstruction = true;
+        } else if (pseudoMoveSingle) {
             auto operandInterval = liveMap.at(pseudoMoveSingle->operand.get());
             auto resultInterval = resultMap.at(pseudoMoveSingle->result.get());
             if (operandInterval->compound->allocatedRegister
                     == resultInterval->compound->allocatedRegister) {
                 if (verbose)
                     std::cout << "        Rewriting pseudoMoveSingle (fuse)" << std::endl;
-                auto nop = std::make_unique<NopInstruction>();
+                auto nop = _fn->create<NopInstruction>();
 
                 pseudoMoveSingle->result.get()->replaceAllUses(pseudoMoveSingle->operand.get());
-                fixMoveIntervals(operandInterval, resultInterval, nop.get());
+                fixMoveIntervals(operandInterval, resultInterval, nop);
                 reassociateResult(resultInterval, operandInterval->associatedValue);
-                bb->insertInstruction(it, std::move(nop));
+                bb->insertInstruction(it, nop);
+                _numFusedMoves++;
             }else{
                 if (verbose)
                     std::cout << "        Rewriting pseudoMoveSingle (reassociate)" << std::endl;
-                auto move = std::make_unique<MovMRInstruction>(pseudoMoveSingle->operand.get());
+                auto move = _fn->create<MovMRInstruction>(pseudoMoveSingle->operand.get());
                 auto moveResult = pseudoMoveSingle->result.reset();
                 pseudoMoveSingle->operand = nullptr;
-                move->result.set(std::move(moveResult));
+                move->result.set(moveResult);
 
-                fixMoveIntervals(operandInterval, resultInterval, move.get());
-                bb->insertInstruction(it, std::move(move));
+                fixMoveIntervals(operandInterval, resultInterval, move);
+                bb->insertInstruction(it, move);
                 _numRegisterMoves++;
             }
 
@@ -937,8 +1693,24 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 return chain - chains;
             };
 
+            // Moves from or to spill slots do not take part in the MoveChains.
+            // Stores are emitted first (before their source registers are overwritten)
+            // and loads are emitted last (after their target registers are read).
+            std::vector<size_t> slotLoads;
+
             // Build the MoveChains from the PseudoMoveMultiple instruction.
             for (size_t i = 0; i < pseudoMoveMultiple->arity(); ++i) {
+                if (isSpillSlot(pseudoMoveMultiple->operand(i).get())
+                        && !isSpillSlot(pseudoMoveMultiple->result(i).get())) {
+                    slotLoads.push_back(i);
+                    continue;
+                }
+                if (isSpillSlot(pseudoMoveMultiple->operand(i).get())
+                        || isSpillSlot(pseudoMoveMultiple->result(i).get())) {
+                    lowerSlotMove(pseudoMoveMultiple->operand(i), pseudoMoveMultiple->result(i));
+                    continue;
+                }
+
                 auto operandInterval = liveMap.at(pseudoMoveMultiple->operand(i).get());
                 auto resultInterval = resultMap.at(pseudoMoveMultiple->result(i).get());
 
@@ -948,12 +1720,13 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 assert(operandRegister >= 0);
                 assert(resultRegister >= 0);
                 if (operandRegister == resultRegister) {
-                    auto nop = std::make_unique<NopInstruction>();
+                    auto nop = _fn->create<NopInstruction>();
 
                     pseudoMoveMultiple->result(i).get()->replaceAllUses(pseudoMoveMultiple->operand(i).get());
-                    fixMoveIntervals(operandInterval, resultInterval, nop.get());
+                    fixMoveIntervals(operandInterval, resultInterval, nop);
                     reassociateResult(resultInterval, operandInterval->associatedValue);
-                    bb->insertInstruction(it, std::move(nop));
+                    bb->insertInstruction(it, nop);
+                    _numFusedMoves++;
                     continue;
                 }
 
@@ -986,9 +1759,23 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 if (verbose)
                     std::cout << "        There are " << targetChain->indicesOfTarget.size()
                             << " moves to target register " << chainRegister(targetChain) << std::endl;
+                assert(!targetChain->didMoveToThisTarget);
+                if (targetChain->throughStack) {
+                    // Pop in the reverse order of the pushes.
+                    for (auto rit = targetChain->indicesOfTarget.rbegin();
+                            rit != targetChain->indicesOfTarget.rend(); ++rit) {
+                        auto resultInterval = resultMap.at(pseudoMoveMultiple->result(*rit).get());
+                        auto pop = _fn->create<PopMInstruction>();
+                        pop->result.set(pseudoMoveMultiple->result(*rit).reset());
+
+                        fixMoveIntervals(nullptr, resultInterval, pop);
+                        bb->insertInstruction(it, pop);
+                    }
+                    targetChain->didMoveToThisTarget = true;
+                    return;
+                }
                 for (int index : targetChain->indicesOfTarget) {
                     auto srcChain = targetChain->uniqueSource;
-                    assert(!targetChain->didMoveToThisTarget);
                     assert(srcChain->pendingMovesFromThisSource > 0);
 
                     auto operandInterval = liveMap.at(pseudoMoveMultiple->operand(index).get());
@@ -997,14 +1784,14 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                     assert(resultInterval->compound->allocatedRegister == chainRegister(targetChain));
 
                     // Emit the new move instruction.
-                    auto move = std::make_unique<MovMRInstruction>(
+                    auto move = _fn->create<MovMRInstruction>(
                             pseudoMoveMultiple->operand(index).get());
                     auto moveResult = pseudoMoveMultiple->result(index).reset();
                     pseudoMoveMultiple->operand(index) = nullptr;
-                    move->result.set(std::move(moveResult));
+                    move->result.set(moveResult);
 
-                    fixMoveIntervals(operandInterval, resultInterval, move.get());
-                    bb->insertInstruction(it, std::move(move));
+                    fixMoveIntervals(operandInterval, resultInterval, move);
+                    bb->insertInstruction(it, move);
                     _numRegisterMoves++;
 
                     // Update the MoveChain structs.
@@ -1046,11 +1833,16 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                             assert(it != stack.rend());
                             (*it)->cyclePointer = current;
 
-                            // Accumulate the moves out of the cycle. Note that exactly one of the
-                            // moves from pendingMovesFromThisSource is inside the cycle.
-                            assert((*it)->pendingMovesFromThisSource > 0);
+                            // Accumulate the moves out of the cycle. The moves that stay inside
+                            // the cycle target the chain that was traversed before *it
+                            // (or the last chain on the stack for current itself). As the
+                            // PseudoMoveMultiple can contain the same move multiple times,
+                            // there can be more than one such move.
+                            auto innerTarget = (*it == current) ? stack.back() : *std::next(it);
+                            auto innerMoves = static_cast<int>(innerTarget->indicesOfTarget.size());
+                            assert((*it)->pendingMovesFromThisSource >= innerMoves);
                             current->pendingMovesFromThisCycle
-                                    += (*it)->pendingMovesFromThisSource - 1;
+                                    += (*it)->pendingMovesFromThisSource - innerMoves;
                         } while(*(it++) != current);
                         break;
                     }
@@ -1066,6 +1858,12 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 stack.clear();
             }
 
+            // Cycles without moves out of the cycle can be resolved immediately.
+            for (int i = 0; i < 16; i++) {
+                if (chains[i].cyclePointer == &chains[i] && !chains[i].pendingMovesFromThisCycle)
+                    activeCycles.push_back(&chains[i]);
+            }
+
             // First, handle all tails.
             while (!activeTails.empty()) {
                 auto tailRegister = activeTails.back();
@@ -1075,9 +1873,33 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
 
             // Now, handle all cycles.
             while (!activeCycles.empty()) {
-                assert (!"Implement move cycles");
+                auto cycleChain = activeCycles.back();
+                activeCycles.pop_back();
+
+                // Break the cycle by saving the representative's value on the stack:
+                // the chain that reads from the representative later pops it instead.
+                // The stack is not otherwise accessed until the pop, as stores to spill
+                // slots are already emitted and loads are only emitted afterwards.
                 // TODO: For cycles of length 2, use xchg.
-                //       Otherwise, allocate a new temporary register.
+                auto stackedChain = cycleChain;
+                while (stackedChain->uniqueSource != cycleChain)
+                    stackedChain = stackedChain->uniqueSource;
+                for (int index : stackedChain->indicesOfTarget) {
+                    auto operandInterval = liveMap.at(pseudoMoveMultiple->operand(index).get());
+                    auto push = _fn->create<PushMInstruction>(
+                            pseudoMoveMultiple->operand(index).get());
+                    pseudoMoveMultiple->operand(index) = nullptr;
+
+                    fixMoveIntervals(operandInterval, nullptr, push);
+                    bb->insertInstruction(it, push);
+                    _numRegisterMoves++;
+
+                    assert(cycleChain->pendingMovesFromThisSource > 0);
+                    cycleChain->pendingMovesFromThisSource--;
+                }
+                stackedChain->throughStack = true;
+                assert(cycleChain->isTail());
+                activeTails.push_back(cycleChain);
 
                 // Resolving the cycle always results in a tail.
                 while (!activeTails.empty()) {
@@ -1087,6 +1909,9 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
                 }
             }
 
+            for (auto index : slotLoads)
+                lowerSlotMove(pseudoMoveMultiple->operand(index), pseudoMoveMultiple->result(index));
+
             rewroteInstruction = true;
         }
 
@@ -1100,20 +1925,23 @@ void AllocateRegistersImpl::_establishAllocation(BasicBlock *bb) {
         resultMap.clear();
     }
 
-    // Generate the function epilogue.
-    if (auto ret = hierarchy_cast<RetBranch *>(bb->branch()); ret) {
+    // Generate the function epilogue (which precedes the JMP of tail calls).
+    auto branch = bb->branch();
+    if (_inFrame[bb->ordinal()] && (hierarchy_cast<RetBranch *>(branch)
+            || hierarchy_cast<TailCallBranch *>(branch))) {
         if (frameSpace)
-            bb->insertInstruction(std::make_unique<IncrementStackInstruction>(frameSpace));
+            bb->insertInstruction(_fn->create<IncrementStackInstruction>(frameSpace));
         for (int i = 15; i >= 0; i--) {
             if (!(saveMask & (1 << i)))
                 continue;
-            bb->insertInstruction(std::make_unique<PopRestoreInstruction>(i));
+            bb->insertInstruction(_fn->create<PopRestoreInstruction>(i));
         }
     }
 }
 
-std::unique_ptr<AllocateRegistersPass> AllocateRegistersPass::create(Function *fn) {
-    return std::make_unique<AllocateRegistersImpl>(fn);
+std::unique_ptr<AllocateRegistersPass> AllocateRegistersPass::create(Function *fn,
+        AllocationOptions options) {
+    return std::make_unique<AllocateRegistersImpl>(fn, options);
 }
 
 } // namespace lewis::targets::x86_64
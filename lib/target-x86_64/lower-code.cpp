@@ -3,11 +3,68 @@
 
 #include <cassert>
 #include <iostream>
+#include <optional>
+#include <unordered_map>
 #include <lewis/target-x86_64/arch-ir.hpp>
 #include <lewis/target-x86_64/arch-passes.hpp>
 
 namespace lewis::targets::x86_64 {
 
+namespace {
+    // Number of arguments that the SysV ABI passes in registers.
+    constexpr size_t maxRegisterArguments = 6;
+
+    bool hasSingleUse(Value *value) {
+        auto uses = value->uses();
+        auto it = uses.begin();
+        if (it == uses.end())
+            return false;
+        ++it;
+        return it == uses.end();
+    }
+
+    // Returns the MovMCInstruction in bb that defines a value if its constant can be encoded
+    // as a (sign-extended) imm32 of the given operand size. Constants from other blocks
+    // are not folded, as we could not drop their MovMCInstruction afterwards.
+    MovMCInstruction *foldableConstant(BasicBlock *bb, Value *value, OperandSize operandSize) {
+        if (!value->origin())
+            return nullptr;
+        auto movMC = hierarchy_cast<MovMCInstruction *>(value->origin()->instruction());
+        if (!movMC || movMC->basicBlock() != bb)
+            return nullptr;
+        // dword instructions only consider the lower 32 bits of the immediate.
+        if (operandSize == OperandSize::dword)
+            return movMC;
+        auto signedValue = static_cast<int64_t>(movMC->value);
+        if (signedValue < INT32_MIN || signedValue > INT32_MAX)
+            return nullptr;
+        return movMC;
+    }
+
+    // Returns the call at the end of the block if its results are only used to be returned
+    // (in the same order), such that it can become a tail call. Calls that pass arguments
+    // on the stack are not turned into tail calls, as the arguments would have to be
+    // placed in the caller's incoming argument area.
+    CallInstruction *tailCallOf(BasicBlock *bb, FunctionReturnBranch *functionReturn) {
+        Instruction *last = nullptr;
+        for (auto inst : bb->instructions())
+            last = inst;
+        if (!last)
+            return nullptr;
+        auto call = hierarchy_cast<CallInstruction *>(last);
+        if (!call || call->numResults() != functionReturn->numOperands())
+            return nullptr;
+        if (call->numOperands() > maxRegisterArguments)
+            return nullptr;
+        for (size_t i = 0; i < call->numResults(); ++i) {
+            auto result = call->result(i).get();
+            if (functionReturn->operand(i).get() != result || !hasSingleUse(result))
+                return nullptr;
+        }
+        return call;
+    }
+};
+
 struct LowerCodeImpl : LowerCodePass {
     LowerCodeImpl(BasicBlock *bb)
     : _bb{bb} { }
@@ -19,10 +76,13 @@ private:
 };
 
 void LowerCodeImpl::run() {
-    auto lowerValue = [] (Value *value) {
+    auto fn = _bb->function();
+    assert(fn);
+
+    auto lowerValue = [&] (Value *value) {
         auto localValue = hierarchy_cast<LocalValue *>(value);
         assert(localValue);
-        auto lower = std::make_unique<RegisterMode>();
+        auto lower = fn->create<RegisterMode>();
         if (localValue->getType()->typeKind == type_kinds::pointer) {
             lower->operandSize = OperandSize::qword;
         } else if (localValue->getType()->typeKind == type_kinds::int32) {
@@ -35,10 +95,10 @@ void LowerCodeImpl::run() {
         return lower;
     };
 
-    auto lowerValueWithOffset = [] (Value *value, ptrdiff_t offset) {
+    auto lowerValueWithOffset = [&] (Value *value, ptrdiff_t offset) {
         auto localValue = hierarchy_cast<LocalValue *>(value);
         assert(localValue);
-        auto lower = std::make_unique<BaseDispMemoryMode>();
+        auto lower = fn->create<BaseDispMemoryMode>();
         if (localValue->getType()->typeKind == type_kinds::pointer) {
             lower->operandSize = OperandSize::qword;
         } else if (localValue->getType()->typeKind == type_kinds::int32) {
@@ -54,37 +114,52 @@ void LowerCodeImpl::run() {
 
     for (auto it = _bb->phis().begin(); it != _bb->phis().end(); ++it) {
         auto lowerPhi = lowerValue((*it)->value.get());
-        (*it)->value.get()->replaceAllUses(lowerPhi.get());
-        (*it)->value.set(std::move(lowerPhi));
+        (*it)->value.get()->replaceAllUses(lowerPhi);
+        (*it)->value.set(lowerPhi);
     }
 
+    // Loads that were lowered to MovRMInstructions in this block. Maps each load to the
+    // number of calls that preceded it; loads can only be folded into instructions that
+    // are not separated from the load by a call.
+    std::unordered_map<MovRMInstruction *, size_t> loadEpochs;
+    size_t callEpoch = 0;
+
     for (auto it = _bb->instructions().begin(); it != _bb->instructions().end(); ++it) {
-        if (auto loadConst = hierarchy_cast<LoadConstInstruction *>(*it); loadConst) {
-            auto lower = std::make_unique<MovMCInstruction>();
+        switch ((*it)->kind) {
+        case instruction_kinds::loadConst: {
+            auto loadConst = static_cast<LoadConstInstruction *>(*it);
+            auto lower = fn->create<MovMCInstruction>();
             auto lowerResult = lower->result.set(lowerValue(loadConst->result.get()));
             lower->value = loadConst->value;
             loadConst->result.get()->replaceAllUses(lowerResult);
 
-            it = _bb->replaceInstruction(it, std::move(lower));
-        } else if (auto loadOffset = hierarchy_cast<LoadOffsetInstruction *>(*it); loadOffset) {
-            auto lowerOffset = std::make_unique<DefineOffsetInstruction>(loadOffset->operand.get());
+            it = _bb->replaceInstruction(it, lower);
+            break;
+        }
+        case instruction_kinds::loadOffset: {
+            auto loadOffset = static_cast<LoadOffsetInstruction *>(*it);
+            auto lowerOffset = fn->create<DefineOffsetInstruction>(loadOffset->operand.get());
             auto offsetValue = lowerOffset->result.set(lowerValueWithOffset(
                     loadOffset->result.get(), loadOffset->offset));
 
-            auto lowerMov = std::make_unique<MovRMInstruction>(offsetValue);
+            auto lowerMov = fn->create<MovRMInstruction>(offsetValue);
             auto resultValue = lowerMov->result.set(lowerValue(loadOffset->result.get()));
             loadOffset->result.get()->replaceAllUses(resultValue);
 
             loadOffset->operand = nullptr;
-            it = _bb->replaceInstruction(it, std::move(lowerOffset));
+            it = _bb->replaceInstruction(it, lowerOffset);
             auto nit = it;
             ++nit;
-            _bb->insertInstruction(nit, std::move(lowerMov));
+            _bb->insertInstruction(nit, lowerMov);
+            loadEpochs.insert({lowerMov, callEpoch});
             ++it;
-        } else if (auto unaryMath = hierarchy_cast<UnaryMathInstruction *>(*it); unaryMath) {
-            std::unique_ptr<UnaryMInPlaceInstruction> lower;
+            break;
+        }
+        case instruction_kinds::unaryMath: {
+            auto unaryMath = static_cast<UnaryMathInstruction *>(*it);
+            UnaryMInPlaceInstruction *lower = nullptr;
             if (unaryMath->opcode == UnaryMathOpcode::negate) {
-                lower = std::make_unique<NegMInstruction>();
+                lower = fn->create<NegMInstruction>();
             } else {
                 assert(!"Unexpected unary math opcode");
             }
@@ -93,26 +168,104 @@ void LowerCodeImpl::run() {
             unaryMath->result.get()->replaceAllUses(lowerResult);
 
             unaryMath->operand = nullptr;
-            it = _bb->replaceInstruction(it, std::move(lower));
-        } else if (auto binaryMath = hierarchy_cast<BinaryMathInstruction *>(*it); binaryMath) {
-            std::unique_ptr<BinaryMRInPlaceInstruction> lower;
-            if (binaryMath->opcode == BinaryMathOpcode::add) {
-                lower = std::make_unique<AddMRInstruction>();
-            } else if (binaryMath->opcode == BinaryMathOpcode::bitwiseAnd) {
-                lower = std::make_unique<AndMRInstruction>();
+            it = _bb->replaceInstruction(it, lower);
+            break;
+        }
+        case instruction_kinds::binaryMath: {
+            auto binaryMath = static_cast<BinaryMathInstruction *>(*it);
+            auto lowerResultValue = lowerValue(binaryMath->result.get());
+            auto left = binaryMath->left.get();
+            auto right = binaryMath->right.get();
+
+            // Both supported opcodes are commutative, hence we can fold either operand.
+            auto constant = foldableConstant(_bb, right, lowerResultValue->operandSize);
+            auto primary = left;
+            if (!constant) {
+                constant = foldableConstant(_bb, left, lowerResultValue->operandSize);
+                primary = right;
+            }
+
+            // Loads are only folded if nothing in between writes to memory.
+            auto foldableLoad = [&] (Value *value) -> MovRMInstruction * {
+                if (!value->origin() || !hasSingleUse(value))
+                    return nullptr;
+                auto movRM = hierarchy_cast<MovRMInstruction *>(value->origin()->instruction());
+                if (!movRM)
+                    return nullptr;
+                auto epochIt = loadEpochs.find(movRM);
+                if (epochIt == loadEpochs.end() || epochIt->second != callEpoch)
+                    return nullptr;
+                return movRM;
+            };
+            MovRMInstruction *load = nullptr;
+            if (!constant) {
+                load = foldableLoad(right);
+                primary = left;
+                if (!load) {
+                    load = foldableLoad(left);
+                    primary = right;
+                }
+            }
+
+            Instruction *lower = nullptr;
+            if (constant) {
+                BinaryMCInPlaceInstruction *lowerMC = nullptr;
+                if (binaryMath->opcode == BinaryMathOpcode::add) {
+                    lowerMC = fn->create<AddMCInstruction>();
+                } else if (binaryMath->opcode == BinaryMathOpcode::bitwiseAnd) {
+                    lowerMC = fn->create<AndMCInstruction>();
+                } else {
+                    assert(!"Unexpected binary math opcode");
+                }
+                lowerMC->result.set(lowerResultValue);
+                lowerMC->primary = primary;
+                lowerMC->value = static_cast<int32_t>(static_cast<uint32_t>(constant->value));
+                lower = lowerMC;
+            } else if (load) {
+                BinaryRMInPlaceInstruction *lowerRM = nullptr;
+                if (binaryMath->opcode == BinaryMathOpcode::add) {
+                    lowerRM = fn->create<AddRMInstruction>();
+                } else if (binaryMath->opcode == BinaryMathOpcode::bitwiseAnd) {
+                    lowerRM = fn->create<AndRMInstruction>();
+                } else {
+                    assert(!"Unexpected binary math opcode");
+                }
+                lowerRM->result.set(lowerResultValue);
+                lowerRM->primary = primary;
+                lowerRM->secondary = load->operand.get();
+                lower = lowerRM;
             } else {
-                assert(!"Unexpected binary math opcode");
+                BinaryMRInPlaceInstruction *lowerMR = nullptr;
+                if (binaryMath->opcode == BinaryMathOpcode::add) {
+                    lowerMR = fn->create<AddMRInstruction>();
+                } else if (binaryMath->opcode == BinaryMathOpcode::bitwiseAnd) {
+                    lowerMR = fn->create<AndMRInstruction>();
+                } else {
+                    assert(!"Unexpected binary math opcode");
+                }
+                lowerMR->result.set(lowerResultValue);
+                lowerMR->primary = left;
+                lowerMR->secondary = right;
+                lower = lowerMR;
             }
-            auto lowerResult = lower->result.set(lowerValue(binaryMath->result.get()));
-            lower->primary = binaryMath->left.get();
-            lower->secondary = binaryMath->right.get();
-            binaryMath->result.get()->replaceAllUses(lowerResult);
+            binaryMath->result.get()->replaceAllUses(lowerResultValue);
 
             binaryMath->left = nullptr;
             binaryMath->right = nullptr;
-            it = _bb->replaceInstruction(it, std::move(lower));
-        } else if (auto invoke = hierarchy_cast<InvokeInstruction *>(*it); invoke) {
-            auto lower = std::make_unique<CallInstruction>(invoke->numOperands(),
+            it = _bb->replaceInstruction(it, lower);
+
+            // The folded load has no uses anymore; its DefineOffset is now used directly.
+            if (load) {
+                load->operand = nullptr;
+                load->result.reset();
+                loadEpochs.erase(load);
+                _bb->eraseInstruction(_bb->iteratorTo(load));
+            }
+            break;
+        }
+        case instruction_kinds::invoke: {
+            auto invoke = static_cast<InvokeInstruction *>(*it);
+            auto lower = fn->create<CallInstruction>(invoke->numOperands(),
                     invoke->numResults());
             lower->function = invoke->function;
 
@@ -127,35 +280,84 @@ void LowerCodeImpl::run() {
                 invoke->result(i) = nullptr;
             }
 
-            it = _bb->replaceInstruction(it, std::move(lower));
-        } else {
+            it = _bb->replaceInstruction(it, lower);
+            ++callEpoch;
+            break;
+        }
+        default:
             assert(!"Unexpected generic IR instruction");
         }
     }
 
     auto branch = _bb->branch();
-    if (auto functionReturn = hierarchy_cast<FunctionReturnBranch *>(branch); functionReturn) {
-        auto lower = std::make_unique<RetBranch>(functionReturn->numOperands());
+    auto functionReturn = hierarchy_cast<FunctionReturnBranch *>(branch);
+    CallInstruction *call = nullptr;
+    if (functionReturn)
+        call = tailCallOf(_bb, functionReturn);
+
+    if (call) {
+        // The results of the call are returned as-is; jump to the callee instead.
+        auto lower = fn->create<TailCallBranch>(call->numOperands());
+        lower->function = call->function;
+
+        for (size_t i = 0; i < call->numOperands(); ++i) {
+            lower->operand(i) = call->operand(i).get();
+            call->operand(i) = nullptr;
+        }
+        for (size_t i = 0; i < functionReturn->numOperands(); ++i)
+            functionReturn->operand(i) = nullptr;
+        for (size_t i = 0; i < call->numResults(); ++i)
+            call->result(i).reset();
+
+        _bb->eraseInstruction(_bb->iteratorTo(call));
+        _bb->setBranch(lower);
+    } else if (functionReturn) {
+        auto lower = fn->create<RetBranch>(functionReturn->numOperands());
 
         for (size_t i = 0; i < functionReturn->numOperands(); ++i) {
             lower->operand(i) = functionReturn->operand(i).get();
             functionReturn->operand(i) = nullptr;
         }
 
-        _bb->setBranch(std::move(lower));
+        _bb->setBranch(lower);
     }else if (auto unconditional = hierarchy_cast<UnconditionalBranch *>(branch); unconditional) {
-        auto lower = std::make_unique<JmpBranch>(unconditional->target);
-        _bb->setBranch(std::move(lower));
+        auto lower = fn->create<JmpBranch>(unconditional->target);
+        _bb->setBranch(lower);
     }else if (auto conditional = hierarchy_cast<ConditionalBranch *>(branch); conditional) {
-        auto lower = std::make_unique<JnzBranch>(conditional->ifTarget, conditional->elseTarget);
+        auto lower = fn->create<JnzBranch>(conditional->ifTarget, conditional->elseTarget);
 
-        lower->operand = conditional->operand.get();
+        // Fold a preceding AND with an immediate into the branch's TEST.
+        auto operand = conditional->operand.get();
+        AndMCInstruction *andMC = nullptr;
+        if (hasSingleUse(operand) && operand->origin())
+            andMC = hierarchy_cast<AndMCInstruction *>(operand->origin()->instruction());
         conditional->operand = nullptr;
+        if (andMC && andMC->basicBlock() == _bb) {
+            lower->operand = andMC->primary.get();
+            lower->testMask = andMC->value;
+            andMC->primary = nullptr;
+            andMC->result.reset();
+            _bb->eraseInstruction(_bb->iteratorTo(andMC));
+        } else {
+            lower->operand = operand;
+        }
 
-        _bb->setBranch(std::move(lower));
+        _bb->setBranch(lower);
     } else {
         assert(!"Unexpected generic IR branch");
     }
+
+    // Constants that were folded into all of their users are not needed anymore.
+    for (auto it = _bb->instructions().begin(); it != _bb->instructions().end(); ) {
+        auto movMC = hierarchy_cast<MovMCInstruction *>(*it);
+        auto nit = it;
+        ++nit;
+        if (movMC && movMC->result.get()->uses().begin() == movMC->result.get()->uses().end()) {
+            movMC->result.reset();
+            _bb->eraseInstruction(it);
+        }
+        it = nit;
+    }
 }
 
 std::unique_ptr<LowerCodePass> LowerCodePass::create(BasicBlock *bb) {
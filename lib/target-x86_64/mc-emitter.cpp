@@ -1,15 +1,23 @@
 // Copyright the lewis authors (AUTHORS.md) 2018
 // SPDX-License-Identifier: MIT
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <elf.h>
 #include <lewis/target-x86_64/mc-emitter.hpp>
 
 namespace lewis::targets::x86_64 {
 
+// Architectural upper bound on the length of a single x86 instruction.
+constexpr size_t maxInstructionLength = 15;
+
+// Alignment of function entry points, as recommended by the optimization manuals.
+constexpr size_t functionAlignment = 16;
+
 MachineCodeEmitter::MachineCodeEmitter(Function *fn, elf::Object *elf)
-: _fn{fn}, _elf{elf} { }
+: MachineCodeEmitter{fn, elf, nullptr} { }
 
 OperandSize getOperandSize(Value *v) {
     if (auto registerMode = hierarchy_cast<RegisterMode *>(v); registerMode) {
@@ -29,7 +37,7 @@ int getRegister(Value *v) {
     }
 }
 
-void encodeRawRex(util::ByteEncoder &enc, OperandSize os, int r, int x, int b) {
+void encodeRawRex(util::UncheckedEncoder &enc, OperandSize os, int r, int x, int b) {
     assert(r <= 1 && x <= 1 && b <= 1);
     int w = 0;
     if (os == OperandSize::qword)
@@ -41,7 +49,7 @@ void encodeRawRex(util::ByteEncoder &enc, OperandSize os, int r, int x, int b) {
 // mod: Value of the 'mod' field.
 // m: Value of the 'M' field.
 // x: Value of the 'R' field (also used as extra bit for the opcode).
-void encodeRawModRm(util::ByteEncoder &enc, int mod, int m, int x) {
+void encodeRawModRm(util::UncheckedEncoder &enc, int mod, int m, int x) {
     assert(mod <= 3 && x <= 7 && m <= 7);
     encode8(enc, (mod << 6) | (x << 3) | m);
 }
@@ -49,11 +57,28 @@ void encodeRawModRm(util::ByteEncoder &enc, int mod, int m, int x) {
 // b: Value of the 'base' field.
 // i: Value of the 'index' field.
 // s: Value of the 'SS' field.
-void encodeRawSib(util::ByteEncoder &enc, int b, int i, int s) {
+void encodeRawSib(util::UncheckedEncoder &enc, int b, int i, int s) {
     assert(s <= 3 && i <= 7 && b <= 7);
     encode8(enc, (s << 6) | (i << 3) | b);
 }
 
+// Emits ADD (xop = 0) or SUB (xop = 5) of an immediate to RSP.
+void encodeStackAdjust(util::UncheckedEncoder &enc, int xop, ptrdiff_t value) {
+    assert(value >= 0);
+    if (value > INT32_MAX)
+        throw std::runtime_error("Stack frame is too large to be encoded");
+    encodeRawRex(enc, OperandSize::qword, 0, 0, 0);
+    if (value <= 127) {
+        encode8(enc, 0x83);
+        encodeRawModRm(enc, 3, 4, xop);
+        encode8(enc, value);
+    } else {
+        encode8(enc, 0x81);
+        encodeRawModRm(enc, 3, 4, xop);
+        encode32(enc, value);
+    }
+}
+
 struct ModRmEncoding {
     ModRmEncoding(Value *mv, Value *rv)
     : _mv{mv}, _rv{rv}, _xop{-1} { }
@@ -63,11 +88,15 @@ struct ModRmEncoding {
         assert(xop <= 7);
     }
 
-    void encodeRex(util::ByteEncoder &enc) {
+    void encodeRex(util::UncheckedEncoder &enc) {
         auto os = getOperandSize(_mv);
         if (_rv)
             assert(os == getOperandSize(_rv));
+        encodeRex(enc, os);
+    }
 
+    // Overrides the operand size (e.g., for instructions that default to qwords).
+    void encodeRex(util::UncheckedEncoder &enc, OperandSize os) {
         int b;
         if (auto registerMode = hierarchy_cast<RegisterMode *>(_mv); registerMode) {
             assert(registerMode->modeRegister >= 0);
@@ -83,21 +112,32 @@ struct ModRmEncoding {
         encodeRawRex(enc, os, _x() >= 8, 0, b);
     }
 
-    void encodeModRmSib(util::ByteEncoder &enc) {
+    void encodeModRmSib(util::UncheckedEncoder &enc) {
         if (auto registerMode = hierarchy_cast<RegisterMode *>(_mv); registerMode) {
             assert(registerMode->modeRegister >= 0);
             encodeRawModRm(enc, 3, registerMode->modeRegister & 7, _x() & 7);
         } else if (auto baseDisp = hierarchy_cast<BaseDispMemoryMode *>(_mv); baseDisp) {
             assert(baseDisp->baseRegister >= 0);
-            assert((baseDisp->baseRegister & 7) != 4
-                    && "RSP/R12 need an SIB-byte to encode BaseDispMemoryMode");
+            // RSP/R12 can only be encoded as base register through an SIB-byte.
+            bool needSib = (baseDisp->baseRegister & 7) == 4;
+            int mod;
             if (baseDisp->disp >= -128 && baseDisp->disp <= 127) {
                 // Encode the displacement in 8 bits.
-                encodeRawModRm(enc, 1, baseDisp->baseRegister & 7, _x() & 7);
-                encode8(enc, baseDisp->disp);
+                mod = 1;
             } else {
                 // Encode the displacement in 32 bits.
-                encodeRawModRm(enc, 2, baseDisp->baseRegister & 7, _x() & 7);
+                mod = 2;
+            }
+            if (needSib) {
+                encodeRawModRm(enc, mod, 4, _x() & 7);
+                // Index 4 means "no index".
+                encodeRawSib(enc, baseDisp->baseRegister & 7, 4, 0);
+            } else {
+                encodeRawModRm(enc, mod, baseDisp->baseRegister & 7, _x() & 7);
+            }
+            if (mod == 1) {
+                encode8(enc, baseDisp->disp);
+            } else {
                 encode32(enc, baseDisp->disp);
             }
         } else {
@@ -127,36 +167,50 @@ private:
     int _xop;
 };
 
-void MachineCodeEmitter::run() {
-    auto textString = _elf->addString(std::make_unique<elf::String>(".text"));
-    auto gotString = _elf->addString(std::make_unique<elf::String>(".got"));
-    auto pltString = _elf->addString(std::make_unique<elf::String>(".plt"));
-    auto symbolString = _elf->addString(std::make_unique<elf::String>(_fn->name));
+MachineCodeEmitter::MachineCodeEmitter(Function *fn, elf::Object *elf,
+        elf::ByteSection *textSection)
+: _fn{fn}, _elf{elf}, _textSection{textSection} { }
 
-    auto textSection = _elf->insertFragment(std::make_unique<elf::ByteSection>());
-    textSection->name = textString;
+elf::ByteSection *MachineCodeEmitter::createTextSection(elf::Object *elf) {
+    auto textSection = elf->insertFragment(std::make_unique<elf::ByteSection>());
+    textSection->name = elf->internString(".text");
     textSection->type = SHT_PROGBITS;
     textSection->flags = SHF_ALLOC | SHF_EXECINSTR;
+    textSection->alignment = functionAlignment;
+    return textSection;
+}
 
-    auto symbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
-    symbol->name = symbolString;
-    symbol->section = textSection;
+elf::ByteSection *MachineCodeEmitter::createCounterSection(elf::Object *elf) {
+    auto counterSection = elf->insertFragment(std::make_unique<elf::ByteSection>());
+    counterSection->name = elf->internString(".lewis.counters");
+    counterSection->type = SHT_PROGBITS;
+    counterSection->flags = SHF_ALLOC | SHF_WRITE;
+    return counterSection;
+}
 
-    _gotSection = _elf->insertFragment(std::make_unique<elf::ByteSection>());
-    _gotSection->name = gotString;
-    _gotSection->type = SHT_PROGBITS;
-    _gotSection->flags = SHF_ALLOC;
+void MachineCodeEmitter::run() {
+    if (!_textSection)
+        _textSection = createTextSection(_elf);
+    auto textSection = _textSection;
+
+    // Align the function's entry point. Pad with INT3 such that stray jumps trap.
+    {
+        util::ByteEncoder text{&textSection->buffer};
+        while (text.offset() & (functionAlignment - 1))
+            encode8(text, 0xCC);
+    }
 
-    _pltSection = _elf->insertFragment(std::make_unique<elf::ByteSection>());
-    _pltSection->name = pltString;
-    _pltSection->type = SHT_PROGBITS;
-    _pltSection->flags = SHF_ALLOC | SHF_EXECINSTR;
+    // Interning the symbol allows calls to this function to be resolved internally.
+    auto symbol = _elf->internSymbol(_fn->name);
+    assert(!symbol->section && "Function is already defined in this object");
+    symbol->section = textSection;
+    symbol->value = textSection->buffer.size();
 
     // Generate a symbol for each basic block.
     size_t i = 0;
     for (auto bb : _fn->blocks()) {
-        auto bbString = _elf->addString(std::make_unique<elf::String>(_fn->name
-                + ".bb" + std::to_string(i)));
+        auto bbString = _elf->addString(std::make_unique<elf::String>(
+                blockSymbolName(_fn->name, i)));
         auto bbSymbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
         bbSymbol->name = bbString;
         bbSymbol->section = textSection;
@@ -164,24 +218,265 @@ void MachineCodeEmitter::run() {
         i++;
     }
 
-    for (auto bb : _fn->blocks()) {
-        auto bbSymbol = _bbSymbols.at(bb);
-        bbSymbol->value = textSection->buffer.size();
-        _emitBlock(bb, textSection);
+    // Allocate the counters (which are zero-initialized).
+    if (_counterSection) {
+        util::ByteEncoder counters{&_counterSection->buffer};
+        for (auto bb : _fn->blocks()) {
+            auto counterSymbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
+            counterSymbol->name = _elf->addString(std::make_unique<elf::String>(
+                    _bbSymbols.at(bb)->name->buffer + ".count"));
+            counterSymbol->section = _counterSection;
+            counterSymbol->value = counters.offset();
+            counterSymbol->size = 8;
+            encode64(counters, 0);
+            _counterSymbols.insert({bb, counterSymbol});
+        }
     }
-}
 
-void MachineCodeEmitter::_emitBlock(BasicBlock *bb, elf::ByteSection *textSection) {
+    _placeBlocks();
+    for (size_t k = 0; k < _blocks.size(); k++)
+        _lowerBranch(k);
+    for (auto &block : _blocks)
+        _emitBody(block);
+    _relaxBranches();
+
+    // All offsets are known now; write the final code.
     util::ByteEncoder text{&textSection->buffer};
-    util::ByteEncoder got{&_gotSection->buffer};
-    util::ByteEncoder plt{&_pltSection->buffer};
+    for (auto &block : _blocks) {
+        assert(text.offset() == symbol->value + block.offset);
+        _bbSymbols.at(block.bb)->value = text.offset();
+        for (auto relocation : block.relocations)
+            relocation->offset += text.offset();
+        encodeBytes(text, block.code);
+
+        auto encodeJump = [&] (size_t target, bool isLong, uint8_t shortOpcode,
+                std::initializer_list<uint8_t> longOpcode) {
+            auto end = text.offset() + (isLong ? longOpcode.size() + 4 : 2);
+            auto disp = static_cast<ptrdiff_t>(symbol->value + _blocks[target].offset)
+                    - static_cast<ptrdiff_t>(end);
+            if (isLong) {
+                for (auto opcode : longOpcode)
+                    encode8(text, opcode);
+                encode32(text, disp);
+            } else {
+                assert(disp >= -128 && disp <= 127);
+                encode8(text, shortOpcode);
+                encode8(text, disp);
+            }
+        };
+
+        if (block.conditionCode >= 0)
+            encodeJump(block.condTarget, block.longCond, 0x70 | block.conditionCode,
+                    {0x0F, static_cast<uint8_t>(0x80 | block.conditionCode)});
+        if (block.jumpTarget != noBlock)
+            encodeJump(block.jumpTarget, block.longJump, 0xEB, {0xE9});
+        if (block.ret)
+            encode8(text, 0xC3);
+        if (block.tailCall) {
+            // Same as for CallInstructions, the relocation is turned into a direct JMP
+            // (if the callee is defined in this object) or a JMP to a PLT stub.
+            auto jumpToPlt = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
+            jumpToPlt->type = R_X86_64_PLT32;
+            jumpToPlt->section = _textSection;
+            jumpToPlt->offset = text.offset() + 1;
+            jumpToPlt->symbol = _elf->internSymbol(block.tailCall->function);
+            jumpToPlt->addend = -4;
 
-    for (auto inst : bb->instructions()) {
-        if (auto nop = hierarchy_cast<NopInstruction *>(inst); nop) {
-            // Do not emit any code.
-        }else if (hierarchy_cast<DefineOffsetInstruction *>(inst)) {
+            encode8(text, 0xE9);
+            encode32(text, 0); // Relocation points here.
+        }
+    }
+
+    symbol->size = text.offset() - symbol->value;
+}
+
+// Orders blocks such that as many branches as possible can fall through: we greedily
+// follow the successors of each block until we reach a block that is already placed.
+// If a profile is available, chains start at the hottest remaining block and follow
+// the hottest successor, but never continue from executed blocks into cold ones.
+// The entry block is always placed first.
+void MachineCodeEmitter::_placeBlocks() {
+    std::vector<uint64_t> counts;
+    if (_profile)
+        counts = _profile->countsOf(_fn);
+    auto countOf = [&] (BasicBlock *bb) -> uint64_t {
+        if (counts.empty())
+            return 0;
+        return counts[bb->ordinal()];
+    };
+
+    std::vector<BasicBlock *> seeds;
+    for (auto bb : _fn->blocks())
+        seeds.push_back(bb);
+    if (!counts.empty() && seeds.size() > 1)
+        std::stable_sort(seeds.begin() + 1, seeds.end(), [&] (BasicBlock *a, BasicBlock *b) {
+            return countOf(a) > countOf(b);
+        });
+
+    for (auto bb : seeds) {
+        auto current = bb;
+        while (current && !_blockIndices.count(current)) {
+            _blockIndices.insert({current, _blocks.size()});
+            _blocks.push_back(EmittedBlock{current});
+
+            BasicBlock *successor = nullptr;
+            auto branch = current->branch();
+            if (auto jmp = hierarchy_cast<JmpBranch *>(branch); jmp) {
+                successor = jmp->target;
+            } else if (auto jnz = hierarchy_cast<JnzBranch *>(branch); jnz) {
+                // Prefer to fall through into the else target; otherwise, we invert the branch.
+                if (_blockIndices.count(jnz->elseTarget)) {
+                    successor = jnz->ifTarget;
+                } else if (_blockIndices.count(jnz->ifTarget)) {
+                    successor = jnz->elseTarget;
+                } else {
+                    successor = countOf(jnz->ifTarget) > countOf(jnz->elseTarget)
+                            ? jnz->ifTarget : jnz->elseTarget;
+                }
+            }
+
+            if (successor && countOf(current) && !countOf(successor))
+                successor = nullptr;
+            current = successor;
+        }
+    }
+}
+
+void MachineCodeEmitter::_lowerBranch(size_t index) {
+    auto &block = _blocks[index];
+    auto next = index + 1;
+
+    auto branch = block.bb->branch();
+    if (hierarchy_cast<RetBranch *>(branch)) {
+        block.ret = true;
+    } else if (auto tailCall = hierarchy_cast<TailCallBranch *>(branch); tailCall) {
+        block.tailCall = tailCall;
+    } else if (auto jmp = hierarchy_cast<JmpBranch *>(branch); jmp) {
+        auto target = _blockIndices.at(jmp->target);
+        if (target != next)
+            block.jumpTarget = target;
+    } else if (auto jnz = hierarchy_cast<JnzBranch *>(branch); jnz) {
+        auto ifTarget = _blockIndices.at(jnz->ifTarget);
+        auto elseTarget = _blockIndices.at(jnz->elseTarget);
+        if (ifTarget == elseTarget) {
+            if (ifTarget != next)
+                block.jumpTarget = ifTarget;
+        } else if (elseTarget == next) {
+            block.conditionCode = 0x5; // JNZ.
+            block.condTarget = ifTarget;
+        } else if (ifTarget == next) {
+            block.conditionCode = 0x4; // JZ.
+            block.condTarget = elseTarget;
+        } else {
+            block.conditionCode = 0x5; // JNZ.
+            block.condTarget = ifTarget;
+            block.jumpTarget = elseTarget;
+        }
+    } else {
+        assert(!"Unexpected x86_64 IR branch");
+    }
+}
+
+size_t MachineCodeEmitter::_branchSize(EmittedBlock &block) {
+    size_t size = 0;
+    if (block.conditionCode >= 0)
+        size += block.longCond ? 6 : 2;
+    if (block.jumpTarget != noBlock)
+        size += block.longJump ? 5 : 2;
+    if (block.ret)
+        size += 1;
+    if (block.tailCall)
+        size += 5;
+    return size;
+}
+
+// Start with rel8 jumps everywhere and only grow the jumps whose displacement does not fit.
+// Growing a jump never shrinks any displacement, hence this terminates.
+void MachineCodeEmitter::_relaxBranches() {
+    auto fitsRel8 = [] (ptrdiff_t disp) {
+        return disp >= -128 && disp <= 127;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        size_t offset = 0;
+        for (auto &block : _blocks) {
+            block.offset = offset;
+            offset += block.code.size() + _branchSize(block);
+        }
+
+        for (auto &block : _blocks) {
+            auto end = static_cast<ptrdiff_t>(block.offset + block.code.size());
+            if (block.conditionCode >= 0) {
+                end += block.longCond ? 6 : 2;
+                auto disp = static_cast<ptrdiff_t>(_blocks[block.condTarget].offset) - end;
+                if (!block.longCond && !fitsRel8(disp)) {
+                    block.longCond = true;
+                    changed = true;
+                }
+            }
+            if (block.jumpTarget != noBlock) {
+                end += block.longJump ? 5 : 2;
+                auto disp = static_cast<ptrdiff_t>(_blocks[block.jumpTarget].offset) - end;
+                if (!block.longJump && !fitsRel8(disp)) {
+                    block.longJump = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// --------------------------------------------------------------------------------------
+// ModuleEmitter class
+// --------------------------------------------------------------------------------------
+
+ModuleEmitter::ModuleEmitter(elf::Object *elf)
+: _elf{elf} { }
+
+void ModuleEmitter::emit(Function *fn) {
+    if (!_textSection)
+        _textSection = MachineCodeEmitter::createTextSection(_elf);
+    MachineCodeEmitter mce{fn, _elf, _textSection};
+    mce.run();
+}
+
+void MachineCodeEmitter::_emitCounter(EmittedBlock &block) {
+    util::ByteEncoder buffer{&block.code};
+    util::UncheckedEncoder text{buffer, maxInstructionLength};
+
+    auto increment = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
+    increment->type = R_X86_64_PC32;
+    increment->section = _textSection;
+    increment->offset = text.offset() + 3;
+    increment->symbol = _counterSymbols.at(block.bb);
+    increment->addend = -4;
+    block.relocations.push_back(increment);
+
+    // INC qword [RIP + disp32]. Does not need a register, hence it can be placed anywhere.
+    encodeRawRex(text, OperandSize::qword, 0, 0, 0);
+    encode8(text, 0xFF);
+    encodeRawModRm(text, 0, 5, 0);
+    encode32(text, 0); // Relocation points here.
+}
+
+void MachineCodeEmitter::_emitBody(EmittedBlock &block) {
+    if (_counterSection)
+        _emitCounter(block);
+
+    util::ByteEncoder buffer{&block.code};
+
+    for (auto inst : block.bb->instructions()) {
+        util::UncheckedEncoder text{buffer, maxInstructionLength};
+        switch (inst->kind) {
+        case arch_instruction_kinds::nop:
+        case arch_instruction_kinds::defineOffset:
             // Do not emit any code.
-        } else if (auto pushSave = hierarchy_cast<PushSaveInstruction *>(inst); pushSave) {
+            break;
+        case arch_instruction_kinds::pushSave: {
+            auto pushSave = static_cast<PushSaveInstruction *>(inst);
             assert(pushSave->operandRegister >= 0);
             if (pushSave->operandRegister < 8) {
                 encode8(text, 0x50 + pushSave->operandRegister);
@@ -190,7 +485,10 @@ void MachineCodeEmitter::_emitBlock(BasicBlock *bb, elf::ByteSection *textSectio
                 encode8(text, 0xFF);
                 encodeRawModRm(text, 3, pushSave->operandRegister & 7, 6);
             }
-        } else if (auto popRestore = hierarchy_cast<PopRestoreInstruction *>(inst); popRestore) {
+            break;
+        }
+        case arch_instruction_kinds::popRestore: {
+            auto popRestore = static_cast<PopRestoreInstruction *>(inst);
             assert(popRestore->operandRegister >= 0);
             if (popRestore->operandRegister < 8) {
                 encode8(text, 0x58 + popRestore->operandRegister);
@@ -199,154 +497,195 @@ void MachineCodeEmitter::_emitBlock(BasicBlock *bb, elf::ByteSection *textSectio
                 encode8(text, 0x8F);
                 encodeRawModRm(text, 3, popRestore->operandRegister & 7, 0);
             }
-        } else if (auto decrementStack = hierarchy_cast<DecrementStackInstruction *>(inst);
-                decrementStack) {
-            assert(decrementStack->value >= 0 && decrementStack->value <= 127);
-            encodeRawRex(text, OperandSize::qword, 0, 0, 0);
-            encode8(text, 0x83);
-            encodeRawModRm(text, 3, 4, 5);
-            encode8(text, decrementStack->value);
-        } else if (auto incrementStack = hierarchy_cast<IncrementStackInstruction *>(inst);
-                incrementStack) {
-            assert(incrementStack->value >= 0 && incrementStack->value <= 127);
-            encodeRawRex(text, OperandSize::qword, 0, 0, 0);
-            encode8(text, 0x83);
-            encodeRawModRm(text, 3, 4, 0);
-            encode8(text, incrementStack->value);
-        } else if (auto movMC = hierarchy_cast<MovMCInstruction *>(inst); movMC) {
+            break;
+        }
+        case arch_instruction_kinds::decrementStack: {
+            auto decrementStack = static_cast<DecrementStackInstruction *>(inst);
+            encodeStackAdjust(text, 5, decrementStack->value);
+            break;
+        }
+        case arch_instruction_kinds::incrementStack: {
+            auto incrementStack = static_cast<IncrementStackInstruction *>(inst);
+            encodeStackAdjust(text, 0, incrementStack->value);
+            break;
+        }
+        case arch_instruction_kinds::movMC: {
+            auto movMC = static_cast<MovMCInstruction *>(inst);
             auto rr = getRegister(movMC->result.get());
             assert(rr >= 0);
-            if (rr < 8) {
-                encode8(text, 0xB8 + rr);
-            } else {
+            auto os = getOperandSize(movMC->result.get());
+            // dword moves only consider the lower 32 bits (and zero-extend to 64 bits).
+            uint64_t value = movMC->value;
+            if (os == OperandSize::dword)
+                value &= 0xFFFFFFFF;
+            auto signedValue = static_cast<int64_t>(value);
+            if (!value) {
+                // XOR r32, r32. Zero-extends to the full register. We can clobber the flags
+                // here, as the only flag consumer (JnzBranch) emits its TEST after the body.
+                encodeRawRex(text, OperandSize::dword, rr >= 8, 0, rr >= 8);
+                encode8(text, 0x31);
+                encodeRawModRm(text, 3, rr & 7, rr & 7);
+            } else if (value <= 0xFFFFFFFF) {
+                // MOV r32, imm32. Zero-extends to the full register.
+                encodeRawRex(text, OperandSize::dword, 0, 0, rr >= 8);
+                encode8(text, 0xB8 + (rr & 7));
+                encode32(text, value);
+            } else if (signedValue >= INT32_MIN && signedValue <= INT32_MAX) {
+                // MOV r/m64, imm32. Sign-extends to the full register.
                 ModRmEncoding modRm{movMC->result.get(), 0};
                 modRm.encodeRex(text);
                 encode8(text, 0xC7);
                 modRm.encodeModRmSib(text);
+                encode32(text, value);
+            } else {
+                // MOV r64, imm64 (aka MOVABS).
+                encodeRawRex(text, OperandSize::qword, 0, 0, rr >= 8);
+                encode8(text, 0xB8 + (rr & 7));
+                encode64(text, value);
             }
-            encode32(text, movMC->value);
-        } else if (auto movMR = hierarchy_cast<MovMRInstruction *>(inst); movMR) {
+            break;
+        }
+        case arch_instruction_kinds::movMR: {
+            auto movMR = static_cast<MovMRInstruction *>(inst);
             ModRmEncoding modRm{movMR->result.get(), movMR->operand.get()};
             modRm.encodeRex(text);
             encode8(text, 0x89);
             modRm.encodeModRmSib(text);
-        } else if (auto movRM = hierarchy_cast<MovRMInstruction *>(inst); movRM) {
+            break;
+        }
+        case arch_instruction_kinds::movRM: {
+            auto movRM = static_cast<MovRMInstruction *>(inst);
             ModRmEncoding modRm{movRM->operand.get(), movRM->result.get()};
             modRm.encodeRex(text);
             encode8(text, 0x8B);
             modRm.encodeModRmSib(text);
-        } else if (auto xchgMR = hierarchy_cast<XchgMRInstruction *>(inst); xchgMR) {
+            break;
+        }
+        case arch_instruction_kinds::xchgMR: {
+            auto xchgMR = static_cast<XchgMRInstruction *>(inst);
             ModRmEncoding modRm{xchgMR->firstResult.get(), xchgMR->secondResult.get()};
             modRm.encodeRex(text);
             encode8(text, 0x87);
             modRm.encodeModRmSib(text);
-        } else if (auto negM = hierarchy_cast<NegMInstruction *>(inst); negM) {
+            break;
+        }
+        case arch_instruction_kinds::negM: {
+            auto negM = static_cast<NegMInstruction *>(inst);
             ModRmEncoding modRm{negM->result.get(), 3};
             modRm.encodeRex(text);
             encode8(text, 0xF7);
             modRm.encodeModRmSib(text);
-        } else if (auto addMR = hierarchy_cast<AddMRInstruction *>(inst); addMR) {
+            break;
+        }
+        case arch_instruction_kinds::addMR: {
+            auto addMR = static_cast<AddMRInstruction *>(inst);
             ModRmEncoding modRm{addMR->result.get(), addMR->secondary.get()};
             modRm.encodeRex(text);
             encode8(text, 0x01);
             modRm.encodeModRmSib(text);
-        } else if (auto andMR = hierarchy_cast<AndMRInstruction *>(inst); andMR) {
+            break;
+        }
+        case arch_instruction_kinds::andMR: {
+            auto andMR = static_cast<AndMRInstruction *>(inst);
             ModRmEncoding modRm{andMR->result.get(), andMR->secondary.get()};
             modRm.encodeRex(text);
             encode8(text, 0x21);
             modRm.encodeModRmSib(text);
-        }else if (auto call = hierarchy_cast<CallInstruction *>(inst); call) {
-            auto string = _elf->addString(std::make_unique<elf::String>(call->function));
-            auto symbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
-            symbol->name = string;
-
-            // Add a GOT entry for the function.
-            // TODO: Create the "special" GOT entries.
-            // TODO: Move GOT creation into the InternalLinkPass.
-            auto gotString = _elf->addString(std::make_unique<elf::String>(call->function + "@got"));
-            auto gotSymbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
-            gotSymbol->name = gotString;
-            gotSymbol->section = _gotSection;
-            gotSymbol->value = got.offset();
-
-            auto jumpSlot = _elf->addRelocation(std::make_unique<elf::Relocation>());
-            jumpSlot->section = _gotSection;
-            jumpSlot->offset = got.offset();
-            jumpSlot->symbol = symbol;
-            encode64(got, 0);
-
-            // Add a PLT stub for the entry.
-            // TODO: Create the PLT header (and correct entries) for dynamic binding.
-            // TODO: Properly align PLT entries as in the ABI supplement.
-            // TODO: Move PLT creation into the InternalLinkPass.
-            auto pltString = _elf->addString(std::make_unique<elf::String>(call->function + "@plt"));
-            auto pltSymbol = _elf->addSymbol(std::make_unique<elf::Symbol>());
-            pltSymbol->name = pltString;
-            pltSymbol->section = _pltSection;
-            pltSymbol->value = plt.offset();
-
-            auto jumpThroughGot = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
-            jumpThroughGot->section = _pltSection;
-            jumpThroughGot->offset = plt.offset() + 2;
-            jumpThroughGot->symbol = gotSymbol;
-            jumpThroughGot->addend = -4;
-
-            encode8(plt, 0xFF);
-            encode8(plt, 0x25); // TODO: Use encodeRawModRm().
-            encode32(plt, 0);
-
-            // Add the actual jump to the .text section.
+            break;
+        }
+        case arch_instruction_kinds::addMC:
+        case arch_instruction_kinds::andMC: {
+            auto binaryMC = static_cast<BinaryMCInPlaceInstruction *>(inst);
+            // ADD is encoded as /0, AND as /4.
+            int xop = inst->kind == arch_instruction_kinds::addMC ? 0 : 4;
+            ModRmEncoding modRm{binaryMC->result.get(), xop};
+            modRm.encodeRex(text);
+            if (binaryMC->value >= -128 && binaryMC->value <= 127) {
+                encode8(text, 0x83);
+                modRm.encodeModRmSib(text);
+                encode8(text, binaryMC->value);
+            } else {
+                encode8(text, 0x81);
+                modRm.encodeModRmSib(text);
+                encode32(text, binaryMC->value);
+            }
+            break;
+        }
+        case arch_instruction_kinds::addRM: {
+            auto addRM = static_cast<AddRMInstruction *>(inst);
+            ModRmEncoding modRm{addRM->secondary.get(), addRM->result.get()};
+            modRm.encodeRex(text);
+            encode8(text, 0x03);
+            modRm.encodeModRmSib(text);
+            break;
+        }
+        case arch_instruction_kinds::andRM: {
+            auto andRM = static_cast<AndRMInstruction *>(inst);
+            ModRmEncoding modRm{andRM->secondary.get(), andRM->result.get()};
+            modRm.encodeRex(text);
+            encode8(text, 0x23);
+            modRm.encodeModRmSib(text);
+            break;
+        }
+        case arch_instruction_kinds::pushM: {
+            auto pushM = static_cast<PushMInstruction *>(inst);
+            // PUSH always operates on qwords; it does not need REX.W.
+            ModRmEncoding modRm{pushM->operand.get(), 6};
+            modRm.encodeRex(text, OperandSize::dword);
+            encode8(text, 0xFF);
+            modRm.encodeModRmSib(text);
+            break;
+        }
+        case arch_instruction_kinds::popM: {
+            auto popM = static_cast<PopMInstruction *>(inst);
+            // POP always operates on qwords; it does not need REX.W.
+            ModRmEncoding modRm{popM->result.get(), 0};
+            modRm.encodeRex(text, OperandSize::dword);
+            encode8(text, 0x8F);
+            modRm.encodeModRmSib(text);
+            break;
+        }
+        case arch_instruction_kinds::call: {
+            auto call = static_cast<CallInstruction *>(inst);
+            // Calls always go through R_X86_64_PLT32 relocations. CreatePltPass creates
+            // a single GOT entry and PLT stub per undefined function; calls to functions
+            // that are defined in this object are linked directly by InternalLinkPass.
+            auto symbol = _elf->internSymbol(call->function);
+
             auto jumpToPlt = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
-            jumpToPlt->section = textSection;
+            jumpToPlt->type = R_X86_64_PLT32;
+            jumpToPlt->section = _textSection;
             jumpToPlt->offset = text.offset() + 1;
-            jumpToPlt->symbol = pltSymbol;
+            jumpToPlt->symbol = symbol;
             jumpToPlt->addend = -4;
+            block.relocations.push_back(jumpToPlt);
 
             encode8(text, 0xE8);
             encode32(text, 0); // Relocation points here.
-        } else {
+            break;
+        }
+        default:
             assert(!"Unexpected x86_64 IR instruction");
         }
     }
 
-    auto branch = bb->branch();
-    if (auto ret = hierarchy_cast<RetBranch *>(branch); ret) {
-        encode8(text, 0xC3);
-    } else if (auto jmp = hierarchy_cast<JmpBranch *>(branch); jmp) {
-        auto jump = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
-        jump->section = textSection;
-        jump->offset = text.offset() + 1;
-        jump->symbol = _bbSymbols.at(jmp->target);
-        jump->addend = -4;
-
-        encode8(text, 0xE9);
-        encode32(text, 0);
-    } else if (auto jnz = hierarchy_cast<JnzBranch *>(branch); jnz) {
-        ModRmEncoding modRm{jnz->operand.get(), jnz->operand.get()};
-        modRm.encodeRex(text);
-        encode8(text, 0x85);
-        modRm.encodeModRmSib(text);
-
-        auto ifJump = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
-        ifJump->section = textSection;
-        ifJump->offset = text.offset() + 2;
-        ifJump->symbol = _bbSymbols.at(jnz->ifTarget);
-        ifJump->addend = -4;
-
-        encode8(text, 0x0F);
-        encode8(text, 0x85);
-        encode32(text, 0);
-
-        auto elseJump = _elf->addInternalRelocation(std::make_unique<elf::Relocation>());
-        elseJump->section = textSection;
-        elseJump->offset = text.offset() + 1;
-        elseJump->symbol = _bbSymbols.at(jnz->elseTarget);
-        elseJump->addend = -4;
-
-        encode8(text, 0xE9);
-        encode32(text, 0);
-    } else {
-        assert(!"Unexpected x86_64 IR branch");
+    // The jumps themselves are emitted once the block layout is fixed.
+    if (block.conditionCode >= 0) {
+        auto jnz = hierarchy_cast<JnzBranch *>(block.bb->branch());
+        assert(jnz);
+        util::UncheckedEncoder text{buffer, maxInstructionLength};
+        if (jnz->testMask) {
+            ModRmEncoding modRm{jnz->operand.get(), 0};
+            modRm.encodeRex(text);
+            encode8(text, 0xF7);
+            modRm.encodeModRmSib(text);
+            encode32(text, *jnz->testMask);
+        } else {
+            ModRmEncoding modRm{jnz->operand.get(), jnz->operand.get()};
+            modRm.encodeRex(text);
+            encode8(text, 0x85);
+            modRm.encodeModRmSib(text);
+        }
     }
 }
 
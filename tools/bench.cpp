@@ -0,0 +1,342 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+// Measures compile throughput on synthetic IR of increasing size.
+// For each size, the bench reports the time spent in each pass, throughput figures
+// and the number of heap allocations. At the end, it estimates how each pass scales
+// with the input size; anything clearly above linear is flagged.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <lewis/driver/pass-manager.hpp>
+#include "ir-generator.hpp"
+
+namespace {
+    std::atomic<size_t> numAllocations{0};
+    std::atomic<size_t> allocatedBytes{0};
+
+    // All replaceable forms of operator new and delete are routed through these functions,
+    // such that every allocation is counted and released by the matching function.
+    [[gnu::noinline]] void *countedAllocate(size_t size, size_t alignment) {
+        numAllocations.fetch_add(1, std::memory_order_relaxed);
+        allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+        if (!size)
+            size = 1;
+        void *p;
+        if (alignment <= alignof(std::max_align_t)) {
+            p = malloc(size);
+        } else {
+            // aligned_alloc() requires the size to be a multiple of the alignment.
+            p = aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+        }
+        return p;
+    }
+
+    [[gnu::noinline]] void countedFree(void *p) noexcept {
+        free(p);
+    }
+
+    void *countedAllocateOrThrow(size_t size, size_t alignment) {
+        if (auto p = countedAllocate(size, alignment); p)
+            return p;
+        throw std::bad_alloc{};
+    }
+}
+
+// The replacements are not inlined; otherwise, GCC pairs the inlined free() with the
+// (non-inlined) allocation in the standard library and warns about a mismatch.
+[[gnu::noinline]] void *operator new(size_t size) {
+    return countedAllocateOrThrow(size, 0);
+}
+
+[[gnu::noinline]] void *operator new[](size_t size) {
+    return countedAllocateOrThrow(size, 0);
+}
+
+[[gnu::noinline]] void *operator new(size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, 0);
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, 0);
+}
+
+[[gnu::noinline]] void *operator new(size_t size, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept {
+    return countedAllocate(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void *operator new[](size_t size, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept {
+    return countedAllocate(size, static_cast<size_t>(alignment));
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, size_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::align_val_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t,
+        const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::align_val_t,
+        const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+
+namespace {
+
+struct PassTotals {
+    double seconds = 0;
+    size_t instructions = 0;
+    size_t bytes = 0;
+};
+
+struct SizeResult {
+    size_t numInstructions = 0;
+    std::map<std::string, PassTotals> passes;
+    std::vector<std::string> passOrder;
+    double totalSeconds = 0;
+    size_t numAllocations = 0;
+    size_t allocatedBytes = 0;
+    long peakRssKiB = 0;
+};
+
+// Compiles one generated function; returns the fastest of several repetitions.
+SizeResult runSize(lewis::tools::GeneratorParams params, size_t numInstructions,
+        size_t blockSize) {
+    if (numInstructions < blockSize) {
+        params.numBlocks = 1;
+        params.instructionsPerBlock = numInstructions;
+    } else {
+        params.numBlocks = numInstructions / blockSize;
+        params.instructionsPerBlock = blockSize;
+    }
+
+    // Repeat small inputs to get stable measurements.
+    size_t repetitions = std::clamp<size_t>(20000 / std::max<size_t>(numInstructions, 1), 1, 50);
+
+    SizeResult best;
+    for (size_t r = 0; r < repetitions; ++r) {
+        lewis::Function fn;
+        fn.name = "bench";
+        lewis::tools::generateFunction(&fn, params);
+
+        SizeResult result;
+        for (auto bb : fn.blocks())
+            result.numInstructions += bb->indexOfInstruction(nullptr);
+
+        auto allocationsBefore = numAllocations.load();
+        auto bytesBefore = allocatedBytes.load();
+        {
+            lewis::elf::Object elf;
+            auto pm = lewis::driver::PassManager::create(&elf);
+            pm->compileFunction(&fn);
+            pm->emitFile();
+
+            for (auto &report : pm->reports()) {
+                auto [it, inserted] = result.passes.insert({report.pass, PassTotals{}});
+                if (inserted)
+                    result.passOrder.push_back(report.pass);
+                auto &totals = it->second;
+                totals.seconds += std::chrono::duration<double>(report.wallTime).count();
+                totals.instructions += report.sizeBefore;
+                for (auto &[name, value] : report.counters) {
+                    if (name == "bytes")
+                        totals.bytes += value;
+                }
+                result.totalSeconds += std::chrono::duration<double>(report.wallTime).count();
+            }
+        }
+        result.numAllocations = numAllocations.load() - allocationsBefore;
+        result.allocatedBytes = allocatedBytes.load() - bytesBefore;
+
+        if (!r || result.totalSeconds < best.totalSeconds)
+            best = std::move(result);
+    }
+
+    // ru_maxrss is the peak of the whole process. As sizes are run in increasing order,
+    // it is dominated by the current size.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    best.peakRssKiB = usage.ru_maxrss;
+    return best;
+}
+
+std::vector<size_t> parseSizes(const char *s) {
+    std::vector<size_t> sizes;
+    while (*s) {
+        char *end;
+        sizes.push_back(strtoull(s, &end, 10));
+        if (end == s)
+            throw std::runtime_error("Invalid --sizes argument");
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return sizes;
+}
+
+void usage() {
+    fprintf(stderr, "usage: bench [--sizes=N,N,...] [--block-size=N] [--seed=N] [--calls=PERCENT]\n"
+            "             [--phis=N] [--pressure=N] [--json]\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    lewis::tools::GeneratorParams params;
+    std::vector<size_t> sizes{10, 100, 1000, 10000, 100000};
+    size_t blockSize = 32;
+    bool json = false;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = argv[i];
+        auto option = [&] (const char *name) -> const char * {
+            auto n = strlen(name);
+            if (strncmp(arg, name, n) || arg[n] != '=')
+                return nullptr;
+            return arg + n + 1;
+        };
+        if (auto v = option("--sizes"); v) {
+            sizes = parseSizes(v);
+        } else if (auto v = option("--block-size"); v) {
+            blockSize = std::max(1, atoi(v));
+        } else if (auto v = option("--seed"); v) {
+            params.seed = atoi(v);
+        } else if (auto v = option("--calls"); v) {
+            params.callDensity = atoi(v);
+        } else if (auto v = option("--phis"); v) {
+            params.phiWidth = atoi(v);
+        } else if (auto v = option("--pressure"); v) {
+            params.pressure = atoi(v);
+        } else if (!strcmp(arg, "--json")) {
+            json = true;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    std::sort(sizes.begin(), sizes.end());
+
+    std::vector<SizeResult> results;
+    for (auto size : sizes) {
+        results.push_back(runSize(params, size, blockSize));
+        auto &result = results.back();
+        if (json)
+            continue;
+
+        printf("%zu instructions: %.3f ms total, %.0f instructions/s,"
+                " %zu allocations (%zu KiB), peak RSS %ld KiB\n",
+                result.numInstructions, result.totalSeconds * 1e3,
+                result.numInstructions / result.totalSeconds,
+                result.numAllocations, result.allocatedBytes / 1024, result.peakRssKiB);
+        for (auto &pass : result.passOrder) {
+            auto &totals = result.passes.at(pass);
+            printf("    %-20s %10.3f ms %12.0f units/s", pass.c_str(), totals.seconds * 1e3,
+                    totals.instructions / totals.seconds);
+            if (totals.bytes)
+                printf(" %12.0f bytes/s", totals.bytes / totals.seconds);
+            printf("\n");
+        }
+    }
+
+    // Estimate the exponent k in time ~ size^k between consecutive sizes.
+    auto exponent = [&] (size_t i, double a, double b) {
+        auto ratio = static_cast<double>(results[i].numInstructions)
+                / results[i - 1].numInstructions;
+        return std::log(b / a) / std::log(ratio);
+    };
+
+    if (json) {
+        printf("{\"sizes\":[");
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto &result = results[i];
+            printf("%s{\"instructions\":%zu,\"seconds\":%.9f,\"allocations\":%zu,"
+                    "\"allocatedBytes\":%zu,\"peakRssKiB\":%ld,\"passes\":{",
+                    i ? "," : "", result.numInstructions, result.totalSeconds,
+                    result.numAllocations, result.allocatedBytes, result.peakRssKiB);
+            for (size_t j = 0; j < result.passOrder.size(); ++j) {
+                auto &totals = result.passes.at(result.passOrder[j]);
+                printf("%s\"%s\":{\"seconds\":%.9f,\"units\":%zu,\"bytes\":%zu}",
+                        j ? "," : "", result.passOrder[j].c_str(), totals.seconds,
+                        totals.instructions, totals.bytes);
+            }
+            printf("}}");
+        }
+        printf("]}\n");
+        return 0;
+    }
+
+    if (results.size() < 2)
+        return 0;
+    printf("Scaling exponents (1.0 = linear):\n");
+    for (auto &pass : results.back().passOrder) {
+        printf("    %-20s", pass.c_str());
+        bool superlinear = false;
+        for (size_t i = 1; i < results.size(); ++i) {
+            auto k = exponent(i, results[i - 1].passes.at(pass).seconds,
+                    results[i].passes.at(pass).seconds);
+            // Tiny inputs are dominated by constant overhead; only judge larger ones.
+            if (results[i - 1].numInstructions >= 1000 && k > 1.3)
+                superlinear = true;
+            printf(" %6.2f", k);
+        }
+        printf("%s\n", superlinear ? "  <- superlinear" : "");
+    }
+}
@@ -0,0 +1,153 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include <lewis/ir.hpp>
+
+namespace lewis::tools {
+
+// Parameters of the synthetic IR that generateFunction() produces.
+struct GeneratorParams {
+    uint32_t seed = 1;
+    size_t numBlocks = 4;
+    size_t instructionsPerBlock = 16;
+    // Probability (in percent) that an instruction is a call to the callee.
+    unsigned int callDensity = 5;
+    // Number of int32 values that are passed to each successor through DataFlowPhis.
+    size_t phiWidth = 2;
+    // Operands are chosen among the last 'pressure' values of a block. Higher values keep
+    // more values alive at the same time.
+    size_t pressure = 4;
+    // Name of the function that is called. It takes two int32 arguments and returns one.
+    std::string callee = "lewis_bench_callee";
+};
+
+// Fills fn with random IR. The function takes a single pointer argument, loads int32 values
+// from it (at offsets below 64), and returns an int32. The CFG is acyclic, such that the code
+// can be executed. The result only depends on the parameters (including the seed).
+inline void generateFunction(Function *fn, const GeneratorParams &params) {
+    std::mt19937 rng{params.seed};
+    auto choose = [&] (size_t n) -> size_t {
+        return rng() % n;
+    };
+
+    auto define = [&] (auto *inst, Type *type) {
+        auto value = inst->result.set(fn->create<LocalValue>());
+        value->setType(type);
+        return value;
+    };
+
+    auto numBlocks = std::max(params.numBlocks, size_t{1});
+    auto pressure = std::max(params.pressure, size_t{1});
+
+    // Create all blocks and their PhiNodes first, as branches need to refer to them.
+    struct BlockState {
+        BasicBlock *bb;
+        Value *pointer;
+        std::vector<DataFlowPhi *> phis;
+        std::vector<Value *> pool;
+    };
+    std::vector<BlockState> blocks;
+    for (size_t i = 0; i < numBlocks; ++i) {
+        BlockState state;
+        state.bb = fn->addNewBlock();
+        if (!i) {
+            auto argument = state.bb->attachNewPhi<ArgumentPhi>();
+            state.pointer = argument->value.set(fn->create<LocalValue>());
+            state.pointer->setType(globalPointerType());
+        } else {
+            auto phi = state.bb->attachNewPhi<DataFlowPhi>();
+            state.pointer = phi->value.set(fn->create<LocalValue>());
+            state.pointer->setType(globalPointerType());
+            state.phis.push_back(phi);
+            for (size_t j = 0; j < params.phiWidth; ++j) {
+                auto phi = state.bb->attachNewPhi<DataFlowPhi>();
+                auto value = phi->value.set(fn->create<LocalValue>());
+                value->setType(globalInt32Type());
+                state.phis.push_back(phi);
+                state.pool.push_back(value);
+            }
+        }
+        blocks.push_back(std::move(state));
+    }
+
+    for (size_t i = 0; i < numBlocks; ++i) {
+        auto &state = blocks[i];
+        auto bb = state.bb;
+        auto &pool = state.pool;
+
+        auto pickOperand = [&] () -> Value * {
+            auto window = std::min(pool.size(), pressure);
+            return pool[pool.size() - 1 - choose(window)];
+        };
+
+        if (pool.empty())
+            pool.push_back(define(bb->insertNewInstruction<LoadOffsetInstruction>(
+                    state.pointer, 0), globalInt32Type()));
+
+        for (size_t k = 0; k < params.instructionsPerBlock; ++k) {
+            auto roll = choose(100);
+            if (roll < params.callDensity) {
+                auto call = bb->insertNewInstruction<InvokeInstruction>(params.callee, 2, 1);
+                call->operand(0) = pickOperand();
+                call->operand(1) = pickOperand();
+                auto result = call->result(0).set(fn->create<LocalValue>());
+                result->setType(globalInt32Type());
+                pool.push_back(result);
+                continue;
+            }
+
+            roll = choose(100);
+            if (roll < 10) {
+                pool.push_back(define(bb->insertNewInstruction<LoadConstInstruction>(
+                        choose(1000)), globalInt32Type()));
+            } else if (roll < 25) {
+                pool.push_back(define(bb->insertNewInstruction<LoadOffsetInstruction>(
+                        state.pointer, 4 * choose(16)), globalInt32Type()));
+            } else if (roll < 35) {
+                pool.push_back(define(bb->insertNewInstruction<UnaryMathInstruction>(
+                        UnaryMathOpcode::negate, pickOperand()), globalInt32Type()));
+            } else {
+                auto opcode = roll < 75 ? BinaryMathOpcode::add : BinaryMathOpcode::bitwiseAnd;
+                auto left = pickOperand();
+                auto right = pickOperand();
+                pool.push_back(define(bb->insertNewInstruction<BinaryMathInstruction>(
+                        opcode, left, right), globalInt32Type()));
+            }
+        }
+
+        auto passValues = [&] (BlockState &successor) {
+            auto edge = DataFlowEdge::attach(fn->create<DataFlowEdge>(),
+                    bb->source, successor.phis[0]->sink);
+            edge->alias = state.pointer;
+            for (size_t j = 1; j < successor.phis.size(); ++j) {
+                auto edge = DataFlowEdge::attach(fn->create<DataFlowEdge>(),
+                        bb->source, successor.phis[j]->sink);
+                edge->alias = pickOperand();
+            }
+        };
+
+        if (i + 1 == numBlocks) {
+            auto ret = bb->setNewBranch<FunctionReturnBranch>(1);
+            ret->operand(0) = pool.back();
+        } else if (i + 2 < numBlocks && choose(2)) {
+            auto target = i + 2 + choose(numBlocks - i - 2);
+            auto branch = bb->setNewBranch<ConditionalBranch>(blocks[target].bb,
+                    blocks[i + 1].bb);
+            branch->operand = pickOperand();
+            passValues(blocks[target]);
+            passValues(blocks[i + 1]);
+        } else {
+            bb->setNewBranch<UnconditionalBranch>(blocks[i + 1].bb);
+            passValues(blocks[i + 1]);
+        }
+    }
+}
+
+} // namespace lewis::tools
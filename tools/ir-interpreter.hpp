@@ -0,0 +1,124 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <lewis/ir.hpp>
+
+namespace lewis::tools {
+
+// Called for each InvokeInstruction with the callee's name and the two int32 operands.
+using InterpreterCallee = std::function<int32_t(const std::string &name, int32_t, int32_t)>;
+
+// Evaluates the IR that generateFunction() produces (before any pass ran on it).
+// The result is used as a reference for the compiled code.
+inline int32_t interpretFunction(Function *fn, const void *argument,
+        const InterpreterCallee &callee) {
+    std::unordered_map<Value *, uint64_t> values;
+    auto get = [&] (Value *v) -> uint64_t {
+        auto it = values.find(v);
+        if (it == values.end())
+            throw std::runtime_error("Interpreter: Value is used before it is defined");
+        return it->second;
+    };
+
+    auto bb = *fn->blocks().begin();
+    for (auto phi : bb->phis()) {
+        if (!hierarchy_cast<ArgumentPhi *>(phi))
+            throw std::runtime_error("Interpreter: Entry block must only have ArgumentPhis");
+        values[phi->value.get()] = reinterpret_cast<uintptr_t>(argument);
+    }
+
+    auto load = [&] (uint64_t pointer, int64_t offset) -> uint64_t {
+        int32_t word;
+        memcpy(&word, reinterpret_cast<const char *>(pointer) + offset, sizeof(int32_t));
+        return static_cast<uint32_t>(word);
+    };
+
+    while (true) {
+        for (auto inst : bb->instructions()) {
+            if (auto loadConst = hierarchy_cast<LoadConstInstruction *>(inst); loadConst) {
+                values[loadConst->result.get()] = loadConst->value;
+            } else if (auto loadOffset = hierarchy_cast<LoadOffsetInstruction *>(inst);
+                    loadOffset) {
+                values[loadOffset->result.get()] = load(get(loadOffset->operand.get()),
+                        loadOffset->offset);
+            } else if (auto unaryMath = hierarchy_cast<UnaryMathInstruction *>(inst);
+                    unaryMath) {
+                assert(unaryMath->opcode == UnaryMathOpcode::negate);
+                values[unaryMath->result.get()] = static_cast<uint32_t>(
+                        -static_cast<uint32_t>(get(unaryMath->operand.get())));
+            } else if (auto binaryMath = hierarchy_cast<BinaryMathInstruction *>(inst);
+                    binaryMath) {
+                auto left = static_cast<uint32_t>(get(binaryMath->left.get()));
+                auto right = static_cast<uint32_t>(get(binaryMath->right.get()));
+                uint32_t result;
+                if (binaryMath->opcode == BinaryMathOpcode::add) {
+                    result = left + right;
+                } else {
+                    assert(binaryMath->opcode == BinaryMathOpcode::bitwiseAnd);
+                    result = left & right;
+                }
+                values[binaryMath->result.get()] = result;
+            } else if (auto invoke = hierarchy_cast<InvokeInstruction *>(inst); invoke) {
+                assert(invoke->numOperands() == 2 && invoke->numResults() == 1);
+                auto result = callee(invoke->function,
+                        static_cast<int32_t>(get(invoke->operand(0).get())),
+                        static_cast<int32_t>(get(invoke->operand(1).get())));
+                values[invoke->result(0).get()] = static_cast<uint32_t>(result);
+            } else {
+                throw std::runtime_error("Interpreter: Unexpected instruction");
+            }
+        }
+
+        auto branchTo = [&] (BasicBlock *target) {
+            // Read all aliases before any PhiNode is written.
+            std::vector<std::pair<Value *, uint64_t>> incoming;
+            for (auto phi : target->phis()) {
+                auto dataFlowPhi = hierarchy_cast<DataFlowPhi *>(phi);
+                assert(dataFlowPhi);
+                bool found = false;
+                for (auto edge : dataFlowPhi->sink.edges()) {
+                    if (edge->source()->block() != bb)
+                        continue;
+                    incoming.push_back({phi->value.get(), get(edge->alias.get())});
+                    found = true;
+                    break;
+                }
+                if (!found)
+                    throw std::runtime_error("Interpreter: Missing DataFlowEdge");
+            }
+            for (auto [value, word] : incoming)
+                values[value] = word;
+            bb = target;
+        };
+
+        auto branch = bb->branch();
+        if (auto ret = hierarchy_cast<FunctionReturnBranch *>(branch); ret) {
+            assert(ret->numOperands() == 1);
+            return static_cast<int32_t>(get(ret->operand(0).get()));
+        } else if (auto unconditional = hierarchy_cast<UnconditionalBranch *>(branch);
+                unconditional) {
+            branchTo(unconditional->target);
+        } else if (auto conditional = hierarchy_cast<ConditionalBranch *>(branch);
+                conditional) {
+            if (static_cast<uint32_t>(get(conditional->operand.get())))
+                branchTo(conditional->ifTarget);
+            else
+                branchTo(conditional->elseTarget);
+        } else {
+            throw std::runtime_error("Interpreter: Unexpected branch");
+        }
+    }
+}
+
+} // namespace lewis::tools
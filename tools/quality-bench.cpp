@@ -0,0 +1,304 @@
+// Copyright the lewis authors (AUTHORS.md) 2018
+// SPDX-License-Identifier: MIT
+
+// Measures the quality of the generated code on a fixed corpus of synthetic functions.
+// For each function, the bench records the allocator's statistics, the code size and
+// the number of PLT/GOT entries. It also runs the code (checking its result against
+// the IR interpreter) and measures the cycles per call. Results can be written to
+// and compared against a baseline file; a regression makes the bench fail.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+#include <lewis/driver/pass-manager.hpp>
+#include <lewis/jit/loader.hpp>
+#include "ir-generator.hpp"
+#include "ir-interpreter.hpp"
+
+// Keep this out of line such that calls measure the generated code and not the callee.
+// Computed in uint32_t such that overflows wrap around instead of being undefined.
+extern "C" [[gnu::noinline]] int32_t lewis_bench_callee(int32_t a, int32_t b) {
+    return static_cast<int32_t>(static_cast<uint32_t>(a) * 31u + static_cast<uint32_t>(b ^ 7));
+}
+
+namespace {
+
+struct CorpusEntry {
+    std::string name;
+    lewis::tools::GeneratorParams params;
+};
+
+// The corpus covers straight-line code, calls, control flow, wide PhiNodes and
+// code that needs to spill. Changing it invalidates existing baselines.
+std::vector<CorpusEntry> makeCorpus() {
+    struct Family {
+        const char *name;
+        size_t numBlocks;
+        size_t instructionsPerBlock;
+        unsigned int callDensity;
+        size_t phiWidth;
+        size_t pressure;
+    };
+
+    const Family families[] = {
+        {"straight", 1, 48, 0, 0, 4},
+        {"calls", 1, 48, 20, 0, 4},
+        {"branchy", 12, 6, 0, 2, 4},
+        {"wide-phis", 6, 8, 0, 8, 8},
+        {"pressure", 2, 64, 0, 0, 16},
+        {"mixed", 8, 16, 10, 4, 8}
+    };
+
+    std::vector<CorpusEntry> corpus;
+    for (auto &family : families) {
+        for (uint32_t seed = 1; seed <= 4; ++seed) {
+            CorpusEntry entry;
+            entry.name = std::string{family.name} + "-" + std::to_string(seed);
+            entry.params.seed = seed;
+            entry.params.numBlocks = family.numBlocks;
+            entry.params.instructionsPerBlock = family.instructionsPerBlock;
+            entry.params.callDensity = family.callDensity;
+            entry.params.phiWidth = family.phiWidth;
+            entry.params.pressure = family.pressure;
+            corpus.push_back(std::move(entry));
+        }
+    }
+    return corpus;
+}
+
+// Metrics of a single function, in a fixed order.
+using Metrics = std::vector<std::pair<std::string, double>>;
+
+// Larger values are worse for all metrics, except for informational ones: the number
+// of fused moves also decreases when there are fewer moves to begin with.
+bool isInformational(const std::string &metric) {
+    return metric == "fused-moves";
+}
+
+// Metrics that depend on the machine (and not only on the compiler) are only compared
+// up to a tolerance.
+bool isTimingMetric(const std::string &metric) {
+    return metric == "cycles";
+}
+
+int64_t counterOf(const lewis::driver::PassReport &report, const char *name) {
+    for (auto &[counter, value] : report.counters) {
+        if (counter == name)
+            return value;
+    }
+    throw std::runtime_error(std::string{"Pass "} + report.pass + " has no counter " + name);
+}
+
+Metrics measure(const CorpusEntry &entry, bool measureCycles) {
+    lewis::Function fn;
+    fn.name = entry.name;
+    lewis::tools::generateFunction(&fn, entry.params);
+
+    int32_t data[16];
+    for (int i = 0; i < 16; ++i)
+        data[i] = static_cast<int32_t>(entry.params.seed * 2654435761u) ^ (i * 977);
+
+    // The passes modify the IR; compute the expected result first.
+    auto expected = lewis::tools::interpretFunction(&fn, data,
+            [] (const std::string &, int32_t a, int32_t b) {
+        return lewis_bench_callee(a, b);
+    });
+
+    lewis::elf::Object elf;
+    auto pm = lewis::driver::PassManager::create(&elf);
+    pm->compileFunction(&fn);
+    pm->linkObject();
+
+    Metrics metrics;
+    for (auto &report : pm->reports()) {
+        if (report.pass == "allocate-registers") {
+            metrics.push_back({"cost", counterOf(report, "cost")});
+            metrics.push_back({"register-moves", counterOf(report, "register-moves")});
+            metrics.push_back({"fused-moves", counterOf(report, "fused-moves")});
+            metrics.push_back({"spilled-compounds", counterOf(report, "spilled-compounds")});
+            metrics.push_back({"spill-moves", counterOf(report, "spill-moves")});
+        } else if (report.pass == "emit-machine-code") {
+            metrics.push_back({"text-bytes", counterOf(report, "bytes")});
+        } else if (report.pass == "create-plt") {
+            metrics.push_back({"plt-entries", counterOf(report, "plt-entries")});
+        }
+    }
+    size_t gotEntries = 0;
+    for (auto fragment : elf.fragments()) {
+        auto section = lewis::hierarchy_cast<lewis::elf::ByteSection *>(fragment);
+        if (section && section->name && section->name->buffer == ".got")
+            gotEntries += section->buffer.size() / sizeof(uint64_t);
+    }
+    metrics.push_back({"got-entries", gotEntries});
+
+    auto object = lewis::jit::LoadedObject::create(&elf, [] (const std::string &name) -> void * {
+        if (name == "lewis_bench_callee")
+            return reinterpret_cast<void *>(&lewis_bench_callee);
+        return nullptr;
+    });
+    auto code = object->lookupFunction<int32_t (const int32_t *)>(entry.name);
+    if (!code)
+        throw std::runtime_error("Could not find function " + entry.name);
+
+    auto result = code(data);
+    if (result != expected)
+        throw std::runtime_error("Function " + entry.name + " returned "
+                + std::to_string(result) + " instead of " + std::to_string(expected));
+
+    if (measureCycles) {
+        // Take the fastest of several rounds to filter out interrupts.
+        constexpr int callsPerRound = 1000;
+        double best = 0;
+        for (int round = 0; round < 8; ++round) {
+            auto start = __rdtsc();
+            for (int i = 0; i < callsPerRound; ++i) {
+                auto result = code(data);
+                asm volatile ("" : : "r" (result));
+            }
+            double cycles = static_cast<double>(__rdtsc() - start) / callsPerRound;
+            if (!round || cycles < best)
+                best = cycles;
+        }
+        metrics.push_back({"cycles", best});
+    }
+    return metrics;
+}
+
+// Baselines are text files with one "<function> <metric> <value>" line per metric.
+using Baseline = std::map<std::string, std::map<std::string, double>>;
+
+Baseline readBaseline(const std::string &path) {
+    std::ifstream in{path};
+    if (!in)
+        throw std::runtime_error("Could not open baseline " + path);
+
+    Baseline baseline;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields{line};
+        std::string function, metric;
+        double value;
+        if (!(fields >> function >> metric >> value))
+            throw std::runtime_error("Malformed line in baseline: " + line);
+        baseline[function][metric] = value;
+    }
+    return baseline;
+}
+
+void writeBaseline(const std::string &path,
+        const std::vector<std::pair<std::string, Metrics>> &results) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+        throw std::runtime_error("Could not open baseline " + path);
+    fprintf(out, "# Baseline of tools/quality-bench. Regenerate with --write-baseline.\n");
+    for (auto &[function, metrics] : results) {
+        for (auto &[metric, value] : metrics)
+            fprintf(out, "%s %s %.6g\n", function.c_str(), metric.c_str(), value);
+    }
+    fclose(out);
+}
+
+void usage() {
+    fprintf(stderr, "usage: quality-bench [--baseline=FILE] [--write-baseline=FILE]"
+            " [--no-cycles] [--cycles-tolerance=PERCENT]\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    std::string baselinePath;
+    std::string writePath;
+    bool measureCycles = true;
+    double cyclesTolerance = 20;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = argv[i];
+        auto option = [&] (const char *name) -> const char * {
+            auto n = strlen(name);
+            if (strncmp(arg, name, n) || arg[n] != '=')
+                return nullptr;
+            return arg + n + 1;
+        };
+        if (auto v = option("--baseline"); v) {
+            baselinePath = v;
+        } else if (auto v = option("--write-baseline"); v) {
+            writePath = v;
+        } else if (auto v = option("--cycles-tolerance"); v) {
+            cyclesTolerance = atof(v);
+        } else if (!strcmp(arg, "--no-cycles")) {
+            measureCycles = false;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, Metrics>> results;
+    for (auto &entry : makeCorpus())
+        results.push_back({entry.name, measure(entry, measureCycles)});
+
+    // Print a table of all functions and metrics.
+    printf("%-14s", "function");
+    for (auto &[metric, value] : results.front().second)
+        printf(" %*s", std::max<int>(metric.size(), 6), metric.c_str());
+    printf("\n");
+    std::map<std::string, double> totals;
+    for (auto &[function, metrics] : results) {
+        printf("%-14s", function.c_str());
+        for (auto &[metric, value] : metrics) {
+            printf(" %*.6g", std::max<int>(metric.size(), 6), value);
+            totals[metric] += value;
+        }
+        printf("\n");
+    }
+    printf("%-14s", "total");
+    for (auto &[metric, value] : results.front().second)
+        printf(" %*.6g", std::max<int>(metric.size(), 6), totals[metric]);
+    printf("\n");
+
+    if (!writePath.empty())
+        writeBaseline(writePath, results);
+    if (baselinePath.empty())
+        return 0;
+
+    // Compare against the baseline. Deterministic metrics must not get worse at all.
+    auto baseline = readBaseline(baselinePath);
+    int regressions = 0;
+    int improvements = 0;
+    for (auto &[function, metrics] : results) {
+        auto it = baseline.find(function);
+        if (it == baseline.end()) {
+            printf("%s: not in baseline\n", function.c_str());
+            continue;
+        }
+        for (auto &[metric, value] : metrics) {
+            auto jt = it->second.find(metric);
+            if (jt == it->second.end() || isInformational(metric))
+                continue;
+            auto limit = jt->second;
+            if (isTimingMetric(metric))
+                limit *= 1 + cyclesTolerance / 100;
+            if (value > limit) {
+                printf("%s: %s regressed from %g to %g\n", function.c_str(), metric.c_str(),
+                        jt->second, value);
+                regressions++;
+            } else if (value < jt->second && !isTimingMetric(metric)) {
+                printf("%s: %s improved from %g to %g\n", function.c_str(), metric.c_str(),
+                        jt->second, value);
+                improvements++;
+            }
+        }
+    }
+    printf("%d regressions, %d improvements\n", regressions, improvements);
+    return regressions ? 1 : 0;
+}
@@ -11,63 +11,63 @@
 int main() {
     lewis::Function f0;
     f0.name = "automate_irq";
-    auto b0 = f0.addBlock(std::make_unique<lewis::BasicBlock>());
-    auto arg0 = b0->attachPhi(std::make_unique<lewis::ArgumentPhi>());
-    auto pv0 = arg0->value.setNew<lewis::LocalValue>();
+    auto b0 = f0.addNewBlock();
+    auto arg0 = b0->attachNewPhi<lewis::ArgumentPhi>();
+    auto pv0 = arg0->value.set(f0.create<lewis::LocalValue>());
     pv0->setType(lewis::globalPointerType());
 
-    auto b1 = f0.addBlock(std::make_unique<lewis::BasicBlock>());
-    auto b2 = f0.addBlock(std::make_unique<lewis::BasicBlock>());
+    auto b1 = f0.addNewBlock();
+    auto b2 = f0.addNewBlock();
 
     auto i1 = b0->insertNewInstruction<lewis::LoadOffsetInstruction>(pv0, 0);
-    auto v1 = i1->result.setNew<lewis::LocalValue>();
+    auto v1 = i1->result.set(f0.create<lewis::LocalValue>());
     v1->setType(lewis::globalPointerType());
 
     auto i2 = b0->insertNewInstruction<lewis::LoadOffsetInstruction>(pv0, 8);
-    auto v2 = i2->result.setNew<lewis::LocalValue>();
+    auto v2 = i2->result.set(f0.create<lewis::LocalValue>());
     v2->setType(lewis::globalInt32Type());
 
     auto i3 = b0->insertNewInstruction<lewis::LoadConstInstruction>(4);
-    auto v3 = i3->result.setNew<lewis::LocalValue>();
+    auto v3 = i3->result.set(f0.create<lewis::LocalValue>());
     v3->setType(lewis::globalInt32Type());
 
     auto i4 = b0->insertNewInstruction<lewis::BinaryMathInstruction>(
             lewis::BinaryMathOpcode::add, v2, v3);
-    auto v4 = i4->result.setNew<lewis::LocalValue>();
+    auto v4 = i4->result.set(f0.create<lewis::LocalValue>());
     v4->setType(lewis::globalInt32Type());
 
     auto i5 = b0->insertNewInstruction<lewis::InvokeInstruction>("__mmio_read32", 2, 1);
     i5->operand(0) = v1;
     i5->operand(1) = v4;
-    auto v5 = i5->result(0).setNew<lewis::LocalValue>();
+    auto v5 = i5->result(0).set(f0.create<lewis::LocalValue>());
     v5->setType(lewis::globalInt32Type());
 
     auto i6 = b0->insertNewInstruction<lewis::LoadConstInstruction>(23);
-    auto v6 = i6->result.setNew<lewis::LocalValue>();
+    auto v6 = i6->result.set(f0.create<lewis::LocalValue>());
     v6->setType(lewis::globalInt32Type());
 
     auto i7 = b0->insertNewInstruction<lewis::BinaryMathInstruction>(
             lewis::BinaryMathOpcode::bitwiseAnd, v5, v6);
-    auto v7 = i7->result.setNew<lewis::LocalValue>();
+    auto v7 = i7->result.set(f0.create<lewis::LocalValue>());
     v7->setType(lewis::globalInt32Type());
 
-    auto br0 = b0->setBranch(std::make_unique<lewis::ConditionalBranch>(b1, b2));
+    auto br0 = b0->setNewBranch<lewis::ConditionalBranch>(b1, b2);
     br0->operand = v7;
 
     // ----
 
-    auto df0 = b1->attachPhi(std::make_unique<lewis::DataFlowPhi>());
-    auto edge0 = lewis::DataFlowEdge::attach(std::make_unique<lewis::DataFlowEdge>(),
+    auto df0 = b1->attachNewPhi<lewis::DataFlowPhi>();
+    auto edge0 = lewis::DataFlowEdge::attach(f0.create<lewis::DataFlowEdge>(),
         b0->source, df0->sink);
     edge0->alias = v1;
-    auto pv1 = df0->value.setNew<lewis::LocalValue>();
+    auto pv1 = df0->value.set(f0.create<lewis::LocalValue>());
     pv1->setType(lewis::globalPointerType());
 
-    auto df1 = b1->attachPhi(std::make_unique<lewis::DataFlowPhi>());
-    auto edge1 = lewis::DataFlowEdge::attach(std::make_unique<lewis::DataFlowEdge>(),
+    auto df1 = b1->attachNewPhi<lewis::DataFlowPhi>();
+    auto edge1 = lewis::DataFlowEdge::attach(f0.create<lewis::DataFlowEdge>(),
         b0->source, df1->sink);
     edge1->alias = v7;
-    auto pv2 = df1->value.setNew<lewis::LocalValue>();
+    auto pv2 = df1->value.set(f0.create<lewis::LocalValue>());
     pv2->setType(lewis::globalInt32Type());
 
     auto i10 = b1->insertNewInstruction<lewis::InvokeInstruction>("__trigger_event", 2, 0);
@@ -75,19 +75,19 @@ int main() {
     i10->operand(1) = pv2;
 
     auto i8 = b1->insertNewInstruction<lewis::LoadConstInstruction>(1);
-    auto v8 = i8->result.setNew<lewis::LocalValue>();
+    auto v8 = i8->result.set(f0.create<lewis::LocalValue>());
     v8->setType(lewis::globalInt32Type());
 
-    auto br1 = b1->setBranch(std::make_unique<lewis::FunctionReturnBranch>(1));
+    auto br1 = b1->setNewBranch<lewis::FunctionReturnBranch>(1);
     br1->operand(0) = v8;
 
     // ----
 
     auto i9 = b2->insertNewInstruction<lewis::LoadConstInstruction>(-1);
-    auto v9 = i9->result.setNew<lewis::LocalValue>();
+    auto v9 = i9->result.set(f0.create<lewis::LocalValue>());
     v9->setType(lewis::globalInt32Type());
 
-    auto br2 = b2->setBranch(std::make_unique<lewis::FunctionReturnBranch>(1));
+    auto br2 = b2->setNewBranch<lewis::FunctionReturnBranch>(1);
     br2->operand(0) = v9;
 
     for (auto bb : f0.blocks()) {
@@ -102,25 +102,22 @@ int main() {
     mce.run();
 
     // Create headers and layout the file.
+    auto plt_pass = lewis::elf::CreatePltPass::create(&elf);
     auto headers_pass = lewis::elf::CreateHeadersPass::create(&elf);
     auto layout_pass = lewis::elf::LayoutPass::create(&elf);
     auto link_pass = lewis::elf::InternalLinkPass::create(&elf);
+    plt_pass->run();
     headers_pass->run();
     layout_pass->run();
     link_pass->run();
 
-    // Compose the output file.
-    auto file_emitter = lewis::elf::FileEmitter::create(&elf);
-    file_emitter->run();
-
-    // Write the output file.
+    // Compose the output file and stream it to disk.
     FILE *stream;
     if(!(stream = fopen("a.out", "wb")))
         throw std::runtime_error("Could not open output file");
-    auto written = fwrite(file_emitter->buffer.data(), sizeof(uint8_t),
-        file_emitter->buffer.size(), stream);
-    if(written != file_emitter->buffer.size())
-        throw std::runtime_error("Could not write buffer to FILE");
+    auto sink = lewis::elf::FileSink::createForFd(fileno(stream));
+    auto file_emitter = lewis::elf::FileEmitter::create(&elf, sink.get());
+    file_emitter->run();
 
     fclose(stream);
 }